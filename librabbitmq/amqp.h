@@ -267,6 +267,41 @@ typedef enum {
   AMQP_FIELD_KIND_BYTES = 'x'
 } amqp_field_value_kind_t;
 
+/**
+ * Heap allocation hooks
+ *
+ * Every heap allocation the library makes on behalf of a connection, its
+ * pools and its socket goes through one of these. malloc_func, realloc_func
+ * and free_func must either all be set or all be NULL, in which case the C
+ * library is used. calloc_func may be left NULL, malloc_func followed by
+ * memset is used then. user_data is passed through to every hook.
+ */
+typedef struct amqp_allocator_t_ {
+  void *(*malloc_func)(void *user_data, size_t size);
+  void *(*calloc_func)(void *user_data, size_t count, size_t size);
+  void *(*realloc_func)(void *user_data, void *ptr, size_t size);
+  void (*free_func)(void *user_data, void *ptr);
+  void *user_data;
+} amqp_allocator_t;
+
+/**
+ * Memory accounting for a pool or a connection
+ *
+ * A connection's figures add up those of its channel pools.
+ */
+typedef struct amqp_memory_stats_t_ {
+  size_t bytes_reserved;      /**< held in pool pages and large blocks */
+  size_t bytes_in_use;        /**< handed out and not yet recycled */
+  size_t peak_bytes_in_use;   /**< highest bytes_in_use seen */
+  size_t queued_frame_bytes;  /**< header and body payload of queued frames
+                                   that live in pinned receive buffers, always
+                                   0 for a pool */
+  size_t pinned_buffer_bytes; /**< receive buffers held by frames decoded in
+                                   place, always 0 for a pool */
+  size_t retained_bytes;      /**< kept only for reuse: recycled large blocks
+                                   and a spare receive buffer */
+} amqp_memory_stats_t;
+
 typedef struct amqp_pool_blocklist_t_ {
   int num_blocks;
   void **blocklist;
@@ -281,6 +316,14 @@ typedef struct amqp_pool_t_ {
   int next_page;
   char *alloc_block;
   size_t alloc_used;
+
+  amqp_pool_blocklist_t free_large_blocks;
+
+  amqp_allocator_t allocator;
+
+  amqp_memory_stats_t stats;
+  /* also kept up to date if not NULL, used for a connection's channel pools */
+  amqp_memory_stats_t *parent_stats;
 } amqp_pool_t;
 
 typedef struct amqp_method_t_ {
@@ -350,6 +393,7 @@ typedef enum amqp_status_enum_
   AMQP_STATUS_TIMER_FAILURE =             -0x000E,
   AMQP_STATUS_HEARTBEAT_TIMEOUT =         -0x000F,
   AMQP_STATUS_UNEXPECTED_STATE =          -0x0010,
+  AMQP_STATUS_MEMORY_LIMIT =              -0x0011,
 
   AMQP_STATUS_TCP_ERROR =                 -0x0100,
   AMQP_STATUS_TCP_SOCKETLIB_INIT_ERROR =  -0x0101,
@@ -421,6 +465,91 @@ AMQP_PUBLIC_FUNCTION
 amqp_connection_state_t
 AMQP_CALL amqp_new_connection(void);
 
+/**
+ * Allocates a new connection object that makes its heap allocations through
+ * allocator
+ *
+ * The connection object itself, its channel pools, receive and send buffers
+ * and the socket created for it are all allocated with allocator. Messages
+ * and envelopes read from the connection keep using it after the connection
+ * is destroyed, so the hooks must outlive them.
+ *
+ * \param [in] allocator the hooks to use, copied into the connection. NULL
+ *             selects the process-wide default.
+ * \returns a new connection object, or NULL if allocator is incomplete or
+ *          memory could not be allocated
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_connection_state_t
+AMQP_CALL amqp_new_connection_with_allocator(amqp_allocator_t const *allocator);
+
+/**
+ * Sets the process-wide default allocator
+ *
+ * The default is used by amqp_new_connection(), init_amqp_pool() and the
+ * amqp_bytes_malloc() family. It is not thread-safe: set it before any
+ * connections are created and leave it alone while memory allocated with the
+ * previous default is still around.
+ *
+ * \param [in] allocator the hooks to use, copied. NULL restores the C library.
+ * \returns AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if
+ *          allocator is incomplete
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_set_default_allocator(amqp_allocator_t const *allocator);
+
+/**
+ * Gets the memory accounting of a connection
+ *
+ * \param [in] state the connection object
+ * \param [out] stats filled in with the connection's current figures
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_get_memory_stats(amqp_connection_state_t state, amqp_memory_stats_t *stats);
+
+/**
+ * Sets a ceiling on the memory a connection holds for received frames
+ *
+ * Once bytes_in_use plus pinned_buffer_bytes plus retained_bytes goes past
+ * limit, functions that would read more from the socket fail with
+ * AMQP_STATUS_MEMORY_LIMIT instead, frames that have already been received
+ * are still returned. Memory that is only retained is freed before giving up.
+ * Reading resumes once frames have been consumed and their buffers released,
+ * e.g. with amqp_maybe_release_buffers(). Frames are copied out of the
+ * receive buffer rather than pinning another one when that would go past the
+ * limit.
+ *
+ * \param [in] state the connection object
+ * \param [in] limit the ceiling in bytes, 0 for no limit (the default)
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_set_memory_limit(amqp_connection_state_t state, size_t limit);
+
+/**
+ * Leaves the headers table of received messages to be decoded on demand
+ *
+ * Decoding the headers table is most of the work of decoding a content
+ * header. With lazy properties the content headers of basic class messages
+ * returned as frames (by amqp_simple_wait_frame(), amqp_poll_frame(), ...) are
+ * decoded without it: AMQP_BASIC_HEADERS_FLAG is still set if the message
+ * has headers, but the headers table is empty until decoded from
+ * payload.properties.raw with amqp_decode_basic_properties(), and isn't
+ * needed at all to forward the message with amqp_basic_publish_raw().
+ *
+ * Messages read with amqp_read_message() and the like still have their
+ * headers decoded.
+ *
+ * \param [in] state the connection object
+ * \param [in] lazy true to leave headers undecoded, false to decode them
+ *             (the default)
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_set_lazy_properties(amqp_connection_state_t state, amqp_boolean_t lazy);
+
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_get_sockfd(amqp_connection_state_t state);
@@ -513,6 +642,233 @@ AMQP_CALL amqp_send_method(amqp_connection_state_t state,
                            amqp_method_number_t id,
                            void *decoded);
 
+/** Socket readiness, as used by amqp_get_io_events() and amqp_handle_io() */
+typedef enum amqp_io_event_enum_ {
+  AMQP_IO_READABLE = 0x1,
+  AMQP_IO_WRITABLE = 0x2
+} amqp_io_event_enum;
+
+/**
+ * Switches a connection in or out of non-blocking mode
+ *
+ * In non-blocking mode the connection is driven by the caller's event loop:
+ * the socket (see amqp_get_sockfd()) is watched for the events returned by
+ * amqp_get_io_events(), readiness is reported with amqp_handle_io(), and
+ * received frames are collected with amqp_poll_frame(). Functions that send
+ * frames never block: whatever the socket won't take is kept by the
+ * connection and written out as the socket becomes writable. Functions that
+ * wait for a reply (amqp_login(), amqp_simple_rpc() and the API methods built
+ * on it, amqp_consume_message(), ...) should not be used in this mode.
+ *
+ * Leaving non-blocking mode writes out any pending output, blocking if needed.
+ *
+ * \param [in] state the connection object, which must have an open socket
+ * \param [in] nonblocking true to enter non-blocking mode, false to leave it
+ * \returns AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if the
+ *          socket type doesn't support non-blocking mode (currently only TCP
+ *          sockets do), another amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_set_nonblocking(amqp_connection_state_t state, amqp_boolean_t nonblocking);
+
+/**
+ * Gets the socket events a non-blocking connection is waiting for
+ *
+ * AMQP_IO_WRITABLE is included while there is output pending.
+ * AMQP_IO_READABLE is included unless the connection's memory limit has been
+ * reached (see amqp_set_memory_limit()), in which case reading resumes once
+ * enough received frames have been released.
+ *
+ * \param [in] state the connection object
+ * \returns a combination of amqp_io_event_enum flags, 0 if the connection has
+ *          no socket
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_get_io_events(amqp_connection_state_t state);
+
+/**
+ * Handles socket readiness on a non-blocking connection
+ *
+ * Writes out pending output if the socket is writable and reads whatever is
+ * available if it is readable, decoding the frames received so they can be
+ * collected with amqp_poll_frame(). Heartbeats are sent and checked on every
+ * call, so this should also be called when the deadline returned by
+ * amqp_get_next_timeout() passes, with events set to 0.
+ *
+ * \param [in] state the connection object
+ * \param [in] events the amqp_io_event_enum flags reported for the socket
+ * \returns AMQP_STATUS_OK on success, AMQP_STATUS_HEARTBEAT_TIMEOUT if the
+ *          broker stopped sending heartbeats (the socket is closed), another
+ *          amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_handle_io(amqp_connection_state_t state, int events);
+
+/**
+ * Gets the next received frame without blocking
+ *
+ * Frames are handed out in the order they were received, heartbeats are
+ * skipped. As with amqp_simple_wait_frame() the frame's memory belongs to its
+ * channel's pool until amqp_maybe_release_buffers_on_channel() is called.
+ *
+ * \param [in] state the connection object
+ * \param [out] decoded_frame the frame, frame_type is 0 if there was none
+ * \returns AMQP_STATUS_OK on success, an amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_poll_frame(amqp_connection_state_t state, amqp_frame_t *decoded_frame);
+
+/**
+ * Gets the time until amqp_handle_io() must next be called
+ *
+ * \param [in] state the connection object
+ * \param [out] timeout the time left, zero if the deadline has already passed
+ * \returns true if there is a deadline, false if heartbeats are disabled
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_boolean_t
+AMQP_CALL amqp_get_next_timeout(amqp_connection_state_t state, struct timeval *timeout);
+
+/** A set of timers run from the caller's event loop */
+typedef struct amqp_timer_wheel_t_ amqp_timer_wheel_t;
+
+/** Called when a timer on a timer wheel expires */
+typedef void (*amqp_timer_fn)(void *user_data);
+
+/**
+ * A timer on a timer wheel
+ *
+ * The memory is provided by the caller and must be zeroed before the timer is
+ * first scheduled. The fields are private.
+ */
+typedef struct amqp_wheel_timer_t_ {
+  struct amqp_wheel_timer_t_ *next;
+  struct amqp_wheel_timer_t_ **pprev;
+  uint64_t expires;
+  amqp_timer_fn fn;
+  void *user_data;
+} amqp_wheel_timer_t;
+
+/**
+ * Creates a timer wheel
+ *
+ * A timer wheel keeps track of any number of timers, including the heartbeat
+ * deadlines of connections in non-blocking mode, at a constant cost per timer
+ * whatever their number, so an event loop can wait on all of them with
+ * amqp_timer_wheel_next_timeout() and amqp_timer_wheel_run(). Timers are
+ * accurate to a few milliseconds. A timer wheel is not thread-safe.
+ *
+ * \returns the timer wheel, or NULL if out of memory
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_timer_wheel_t *
+AMQP_CALL amqp_timer_wheel_new(void);
+
+/**
+ * Destroys a timer wheel
+ *
+ * Timers still scheduled are dropped. No connection may still be on it.
+ *
+ * \param [in] wheel the timer wheel
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_timer_wheel_destroy(amqp_timer_wheel_t *wheel);
+
+/**
+ * Schedules a timer, or reschedules it if it is already scheduled
+ *
+ * \param [in] wheel the timer wheel
+ * \param [in] timer the timer, which must stay valid until it expires or is
+ *             cancelled
+ * \param [in] delay the time after which fn is called
+ * \param [in] fn called from amqp_timer_wheel_run() once the timer expires
+ * \param [in] user_data passed to fn
+ * \returns AMQP_STATUS_OK on success, an amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_timer_wheel_schedule(amqp_timer_wheel_t *wheel,
+                                    amqp_wheel_timer_t *timer,
+                                    struct timeval const *delay,
+                                    amqp_timer_fn fn, void *user_data);
+
+/**
+ * Cancels a timer, if it is scheduled
+ *
+ * \param [in] wheel the timer wheel
+ * \param [in] timer the timer
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_timer_wheel_cancel(amqp_timer_wheel_t *wheel,
+                                  amqp_wheel_timer_t *timer);
+
+/**
+ * Tracks a connection's heartbeats on a timer wheel
+ *
+ * fn is called whenever a heartbeat is due to be sent or the broker's is
+ * overdue, and should then call amqp_handle_io() with events set to 0. This
+ * replaces watching amqp_get_next_timeout() for each connection. Nothing is
+ * tracked if heartbeats are disabled, so this should be called after logging
+ * in. fn is called again on every tick until the heartbeat has been dealt
+ * with, so a connection that has failed should be taken off the wheel, which
+ * also happens when it is destroyed.
+ *
+ * \param [in] wheel the timer wheel
+ * \param [in] state the connection object, in non-blocking mode
+ * \param [in] fn called from amqp_timer_wheel_run()
+ * \param [in] user_data passed to fn
+ * \returns AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if the
+ *          connection is already on a timer wheel, another amqp_status_enum
+ *          value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_timer_wheel_add_connection(amqp_timer_wheel_t *wheel,
+                                          amqp_connection_state_t state,
+                                          amqp_timer_fn fn, void *user_data);
+
+/**
+ * Stops tracking a connection's heartbeats on a timer wheel
+ *
+ * \param [in] wheel the timer wheel
+ * \param [in] state the connection object
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_timer_wheel_remove_connection(amqp_timer_wheel_t *wheel,
+                                             amqp_connection_state_t state);
+
+/**
+ * Gets the time until amqp_timer_wheel_run() must next be called
+ *
+ * \param [in] wheel the timer wheel
+ * \param [out] timeout the time left, zero if a timer has already expired
+ * \returns true if a timer is scheduled, false otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_boolean_t
+AMQP_CALL amqp_timer_wheel_next_timeout(amqp_timer_wheel_t *wheel,
+                                        struct timeval *timeout);
+
+/**
+ * Calls the functions of the timers that have expired
+ *
+ * Functions may schedule and cancel timers, and add and remove connections.
+ *
+ * \param [in] wheel the timer wheel
+ * \returns AMQP_STATUS_OK on success, AMQP_STATUS_TIMER_FAILURE if the clock
+ *          couldn't be read
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_timer_wheel_run(amqp_timer_wheel_t *wheel);
+
 AMQP_PUBLIC_FUNCTION
 amqp_rpc_reply_t
 AMQP_CALL amqp_simple_rpc(amqp_connection_state_t state,
@@ -568,6 +924,251 @@ AMQP_CALL amqp_basic_publish(amqp_connection_state_t state, amqp_channel_t chann
                              struct amqp_basic_properties_t_ const *properties,
                              amqp_bytes_t body);
 
+/**
+ * Publishes a message with properties that are already encoded
+ *
+ * Like amqp_basic_publish(), but the content header carries raw_properties
+ * verbatim. Passing payload.properties.raw of a received content header
+ * forwards a message's properties unchanged without decoding them.
+ *
+ * \param [in] raw_properties basic class properties as encoded on the wire,
+ *             starting with the property flags
+ * \returns AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if
+ *          raw_properties is too short to hold the property flags, another
+ *          amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_basic_publish_raw(amqp_connection_state_t state, amqp_channel_t channel,
+                                 amqp_bytes_t exchange, amqp_bytes_t routing_key,
+                                 amqp_boolean_t mandatory, amqp_boolean_t immediate,
+                                 amqp_bytes_t raw_properties, amqp_bytes_t body);
+
+/**
+ * A basic.publish method and content header encoded ahead of time
+ *
+ * For publishing many messages with the same exchange, routing key and
+ * properties. Made with amqp_publish_template_new(), used with
+ * amqp_basic_publish_template().
+ */
+typedef struct amqp_publish_template_t_ amqp_publish_template_t;
+
+/**
+ * Encodes a publish template
+ *
+ * The arguments are those of amqp_basic_publish(). They are encoded right
+ * away, so nothing they refer to has to outlive the call. The template can
+ * be used on state and on any other connection whose frame_max is at least
+ * that of state.
+ *
+ * \param [in] state the connection object, whose allocator and frame_max
+ *             are used
+ * \param [in] exchange the exchange on the broker to publish to
+ * \param [in] routing_key the routing key to use when publishing the message
+ * \param [in] mandatory indicate to the broker that the message MUST be routed
+ *              to a queue. If the broker cannot do this it should respond with
+ *              a basic.return method.
+ * \param [in] immediate indicate to the broker that the message MUST be delivered
+ *              to a consumer immediately. If the broker cannot do this it should
+ *              respond with a basic.return method.
+ * \param [in] properties the properties associated with the message, or NULL
+ *             for none
+ * \param [out] publish_template receives the template, to be freed with
+ *              amqp_publish_template_destroy()
+ * \returns AMQP_STATUS_OK on success, an amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_publish_template_new(amqp_connection_state_t state,
+                                    amqp_bytes_t exchange, amqp_bytes_t routing_key,
+                                    amqp_boolean_t mandatory, amqp_boolean_t immediate,
+                                    struct amqp_basic_properties_t_ const *properties,
+                                    amqp_publish_template_t **publish_template);
+
+/**
+ * Frees a publish template
+ *
+ * \param [in] publish_template the template, may be NULL
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_publish_template_destroy(amqp_publish_template_t *publish_template);
+
+/**
+ * Changes the timestamp property of the messages published with a template
+ *
+ * Fields of a fixed size can be patched in place, the timestamp is the one
+ * that usually differs between messages.
+ *
+ * \param [in] publish_template the template
+ * \param [in] timestamp the new timestamp
+ * \returns AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if the
+ *          template was made without AMQP_BASIC_TIMESTAMP_FLAG
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_publish_template_set_timestamp(amqp_publish_template_t *publish_template,
+                                              uint64_t timestamp);
+
+/**
+ * Publishes a message using a template
+ *
+ * Like amqp_basic_publish() with the arguments the template was made with,
+ * except that only the channel and body size are filled in: the frames go
+ * out without being encoded again. Outside of a publish batch they are
+ * written straight from the template along with the body, with one writev.
+ *
+ * A template is modified while publishing, so it must not be used by two
+ * threads at once.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel identifier
+ * \param [in] publish_template the template
+ * \param [in] body the message body
+ * \returns AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if the
+ *          template's frames are larger than the connection's frame_max,
+ *          another amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_basic_publish_template(amqp_connection_state_t state,
+                                      amqp_channel_t channel,
+                                      amqp_publish_template_t *publish_template,
+                                      amqp_bytes_t body);
+
+/**
+ * Decodes some of a message's basic properties
+ *
+ * Used with connections that leave properties to be decoded on demand (see
+ * amqp_set_lazy_properties()). The _flags field of properties is set to the
+ * properties present, of those only the ones in fields are decoded; the others
+ * are left untouched. Strings point into raw, only the headers table takes
+ * memory from pool.
+ *
+ * \param [in] raw payload.properties.raw of a basic class content header
+ * \param [in] fields the AMQP_BASIC_*_FLAG values of the properties wanted
+ * \param [in] pool where the headers table is decoded, only used if
+ *             AMQP_BASIC_HEADERS_FLAG is in fields
+ * \param [in,out] properties receives the properties
+ * \returns AMQP_STATUS_OK on success, an amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_decode_basic_properties(amqp_bytes_t raw, amqp_flags_t fields,
+                                       amqp_pool_t *pool,
+                                       struct amqp_basic_properties_t_ *properties);
+
+/**
+ * Starts batching published messages
+ *
+ * Until amqp_publish_batch_flush() is called, amqp_basic_publish() encodes
+ * messages into a connection-owned buffer instead of writing each of them to
+ * the socket. The buffer is written out in one go when it fills up, when the
+ * batch is flushed, or before any other frame is sent on the connection so
+ * that frames are never reordered. Message bodies that don't fit in the
+ * buffer are written directly along with whatever is pending.
+ *
+ * \param [in] state the connection object
+ * \param [in] buffer_size the size of the batch buffer in bytes. Pass 0 for
+ *             the default. The buffer is never smaller than frame_max.
+ * \returns AMQP_STATUS_OK on success, an amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_publish_batch_begin(amqp_connection_state_t state, size_t buffer_size);
+
+/**
+ * Writes out the messages batched since amqp_publish_batch_begin()
+ *
+ * Ends the batch; subsequent calls to amqp_basic_publish() write to the socket
+ * immediately again.
+ *
+ * \param [in] state the connection object
+ * \returns AMQP_STATUS_OK on success, an amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_publish_batch_flush(amqp_connection_state_t state);
+
+/**
+ * A range of publishes the broker has confirmed or rejected
+ *
+ * All messages published on channel with sequence numbers from first to last
+ * (inclusive) were acked by the broker, or nacked if nacked is true.
+ */
+typedef struct amqp_confirm_event_t_ {
+  amqp_channel_t channel;     /**< channel the messages were published on */
+  uint64_t first;             /**< first sequence number in the range */
+  uint64_t last;              /**< last sequence number in the range */
+  amqp_boolean_t nacked;      /**< true if the broker rejected the messages */
+} amqp_confirm_event_t;
+
+/**
+ * Starts tracking publisher confirms on a channel
+ *
+ * Call this after amqp_confirm_select() has put the channel into confirm mode
+ * and before publishing on it. From then on every amqp_basic_publish() on the
+ * channel is assigned a sequence number, starting at 1, matching the delivery
+ * tag the broker uses to confirm it. basic.ack and basic.nack methods
+ * received on the channel are consumed by the library and reported through
+ * amqp_confirm_poll() instead of being returned by amqp_simple_wait_frame().
+ * A caller feeding amqp_handle_input() itself does get them, valid only until
+ * the next one is decoded.
+ *
+ * Calling this on a channel that is already tracked resets the sequence
+ * number, as needed after the channel has been closed and reopened.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel
+ * \returns AMQP_STATUS_OK on success, an amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_confirm_track(amqp_connection_state_t state, amqp_channel_t channel);
+
+/**
+ * Gets the sequence number the next message published on a channel gets
+ *
+ * \param [in] state the connection object
+ * \param [in] channel a channel tracked with amqp_confirm_track()
+ * \returns the next sequence number, or 0 if the channel isn't tracked
+ */
+AMQP_PUBLIC_FUNCTION
+uint64_t
+AMQP_CALL amqp_confirm_next_seqno(amqp_connection_state_t state, amqp_channel_t channel);
+
+/**
+ * Gets the number of messages published on a channel the broker has yet to
+ * confirm
+ *
+ * \param [in] state the connection object
+ * \param [in] channel a channel tracked with amqp_confirm_track()
+ * \returns the number of outstanding publishes, 0 if the channel isn't tracked
+ */
+AMQP_PUBLIC_FUNCTION
+uint64_t
+AMQP_CALL amqp_confirm_outstanding(amqp_connection_state_t state, amqp_channel_t channel);
+
+/**
+ * Retrieves the next confirm event without blocking
+ *
+ * If no event is pending, whatever data is available on the socket is read
+ * and processed first; this function never waits for data to arrive. Frames
+ * other than confirms that are read are queued, as amqp_simple_wait_frame()
+ * would return them next. Adjacent ranges on the same channel are merged, so
+ * a single event may cover many confirms. If there is no memory to record the
+ * events of a confirm, AMQP_STATUS_NO_MEMORY is returned and whatever it
+ * covered that wasn't recorded stays outstanding.
+ *
+ * \param [in] state the connection object
+ * \param [out] event the next event
+ * \returns AMQP_STATUS_OK if an event was returned, AMQP_STATUS_TIMEOUT if none
+ *          is available, an amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_confirm_poll(amqp_connection_state_t state, amqp_confirm_event_t *event);
+
 AMQP_PUBLIC_FUNCTION
 amqp_rpc_reply_t
 AMQP_CALL amqp_channel_close(amqp_connection_state_t state, amqp_channel_t channel,
@@ -638,12 +1239,89 @@ AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_table_clone(amqp_table_t *original, amqp_table_t *clone, amqp_pool_t *pool);
 
+/**
+ * A key to look up in tables, with its hash worked out once
+ *
+ * Make one with amqp_table_key() for each key that is looked up repeatedly.
+ */
+typedef struct amqp_table_key_t_ {
+  amqp_bytes_t name;    /**< the key, must outlive the amqp_table_key_t */
+  uint32_t hash;        /**< hash of name */
+} amqp_table_key_t;
+
+/**
+ * Index of a table's entries by key
+ *
+ * Made with amqp_table_index_new() for lookups with amqp_table_index_lookup().
+ */
+typedef struct amqp_table_index_t_ amqp_table_index_t;
+
+/**
+ * Prepares a key for lookups
+ *
+ * \param [in] name the key, amqp_cstring_bytes("x-match") for instance. It is
+ *             referred to, not copied.
+ * \returns the key
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_table_key_t
+AMQP_CALL amqp_table_key(amqp_bytes_t name);
+
+/**
+ * Makes an index for looking up keys in a table
+ *
+ * Nothing is indexed until the first lookup. Small tables are scanned, larger
+ * ones hashed. The table must not change while the index is in use.
+ *
+ * \param [in] table the table, usually a decoded one such as the headers of
+ *             a message
+ * \param [in] pool where the index is allocated, usually the pool the table
+ *             lives in. The index is freed with the pool.
+ * \returns the index, or NULL if out of memory
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_table_index_t *
+AMQP_CALL amqp_table_index_new(amqp_table_t const *table, amqp_pool_t *pool);
+
+/**
+ * Looks up a key in an indexed table
+ *
+ * If the table has the key more than once, the first entry is returned.
+ *
+ * \param [in] index the index from amqp_table_index_new()
+ * \param [in] key the key from amqp_table_key()
+ * \returns the table entry, or NULL if the table doesn't have the key
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_table_entry_t *
+AMQP_CALL amqp_table_index_lookup(amqp_table_index_t *index,
+                                  amqp_table_key_t const *key);
+
 typedef struct amqp_message_t_ {
   amqp_basic_properties_t properties;
   amqp_bytes_t body;
   amqp_pool_t pool;
+  amqp_boolean_t pooled;   /**< true if body and properties live in pool, see AMQP_MESSAGE_POOLED */
 } amqp_message_t;
 
+/**
+ * Flag for amqp_read_message() and amqp_consume_message(): allocate the
+ * message (and the envelope's strings) from the message's own pool, which is
+ * kept and recycled by every subsequent call with the same object.
+ *
+ * The pool's pages are frame_max bytes. Once they have grown to fit the
+ * messages being received, reading into the same object again doesn't
+ * allocate; only bodies larger than a page get a block of their own. The
+ * object must be zeroed before its first use, and each read invalidates the
+ * previous contents. Release it with amqp_destroy_message() or
+ * amqp_destroy_envelope() as usual.
+ *
+ * Reads without the flag don't look at the object's previous contents, so
+ * they overwrite, and leak, the pool of an object used with the flag. Call
+ * amqp_destroy_message() or amqp_destroy_envelope() before doing so.
+ */
+#define AMQP_MESSAGE_POOLED 0x1
+
 /**
  * Reads the next message on a channel
  *
@@ -657,7 +1335,7 @@ typedef struct amqp_message_t_ {
  *                 call amqp_message_destroy() when it is done using the
  *                 fields in the message object.  The caller is responsible for
  *                 allocating/destroying the amqp_message_t object itself.
- * \param [in] flags pass in 0. Currently unused.
+ * \param [in] flags 0 or AMQP_MESSAGE_POOLED
  * \returns a amqp_rpc_reply_t object. ret.reply_type == AMQP_RESPONSE_NORMAL on success.
  */
 AMQP_PUBLIC_FUNCTION
@@ -675,6 +1353,106 @@ AMQP_PUBLIC_FUNCTION
 void
 AMQP_CALL amqp_destroy_message(amqp_message_t *message);
 
+/**
+ * A message whose contents are left in the connection's buffers
+ *
+ * The body is not copied into a contiguous allocation: fragments refers to
+ * the payload of each body frame in turn, where the library received it.
+ * When the body arrived in a single frame, body refers to it as well;
+ * otherwise body.bytes is NULL and body.len is the total size.
+ */
+typedef struct amqp_message_ref_t_ {
+  amqp_channel_t channel;                 /**< the channel the message was read on */
+  amqp_basic_properties_t *properties;    /**< the message properties */
+  amqp_bytes_t body;                      /**< the body if it is in one piece */
+  amqp_bytes_t *fragments;                /**< the body, one entry per body frame */
+  int num_fragments;                      /**< number of entries in fragments */
+} amqp_message_ref_t;
+
+/**
+ * Reads the next message on a channel without copying it
+ *
+ * Like amqp_read_message(), but the properties and body are returned as
+ * references into memory owned by the connection instead of being copied.
+ * They remain valid until amqp_release_message_ref() is called, or the
+ * channel's buffers are otherwise released with amqp_maybe_release_buffers()
+ * or amqp_maybe_release_buffers_on_channel().
+ *
+ * \param [in,out] state the connection object
+ * \param [in] channel the channel on which to read the message from
+ * \param [in,out] message a pointer to a amqp_message_ref_t object, filled in
+ *                 on success
+ * \param [in] flags pass in 0. Currently unused.
+ * \returns a amqp_rpc_reply_t object. ret.reply_type == AMQP_RESPONSE_NORMAL on success.
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_rpc_reply_t
+AMQP_CALL amqp_read_message_ref(amqp_connection_state_t state,
+                                amqp_channel_t channel,
+                                amqp_message_ref_t *message, int flags);
+
+/**
+ * Releases a message read with amqp_read_message_ref()
+ *
+ * Releases the buffers of the message's channel if nothing else on it is
+ * pending, after which the message must no longer be used.
+ *
+ * \param [in,out] state the connection object
+ * \param [in] message the message
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_release_message_ref(amqp_connection_state_t state,
+                                   amqp_message_ref_t *message);
+
+/**
+ * Callbacks through which amqp_read_message_stream() delivers a message
+ *
+ * Each callback returns AMQP_STATUS_OK to continue reading, anything else
+ * stops reading the message. Any callback may be NULL.
+ */
+typedef struct amqp_message_handler_t_ {
+  /** Called first with the message properties and the size of the body */
+  int (*properties)(void *user_data, amqp_channel_t channel,
+                    amqp_basic_properties_t const *properties,
+                    uint64_t body_size);
+  /** Called with each piece of the body, in order, as it is received */
+  int (*fragment)(void *user_data, amqp_channel_t channel,
+                  amqp_bytes_t fragment);
+  /** Called once the whole body has been delivered */
+  int (*end)(void *user_data, amqp_channel_t channel);
+} amqp_message_handler_t;
+
+/**
+ * Reads the next message on a channel, streaming the body
+ *
+ * Like amqp_read_message(), but rather than collecting the body in one
+ * allocation, hands each body fragment to the handler as soon as it has been
+ * received. The memory holding the properties and each fragment is only valid
+ * for the duration of the callback; the channel's buffers are released after
+ * every fragment so that reading a message takes a bounded amount of memory
+ * however large it is. Frames previously returned on the channel, such as
+ * the basic.deliver method, are invalidated by this as well.
+ *
+ * If a callback returns something other than AMQP_STATUS_OK, reading stops
+ * and ret.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION with
+ * ret.library_error set to the returned value. The rest of the message is
+ * then left unread on the channel.
+ *
+ * \param [in,out] state the connection object
+ * \param [in] channel the channel on which to read the message from
+ * \param [in] handler the callbacks
+ * \param [in] user_data passed to the callbacks
+ * \param [in] flags pass in 0. Currently unused.
+ * \returns a amqp_rpc_reply_t object. ret.reply_type == AMQP_RESPONSE_NORMAL on success.
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_rpc_reply_t
+AMQP_CALL amqp_read_message_stream(amqp_connection_state_t state,
+                                   amqp_channel_t channel,
+                                   const amqp_message_handler_t *handler,
+                                   void *user_data, int flags);
+
 typedef struct amqp_envelope_t_ {
   amqp_channel_t channel;
   amqp_bytes_t consumer_tag;
@@ -705,7 +1483,7 @@ typedef struct amqp_envelope_t_ {
  *                 for allocating/destroying the amqp_envelope_t object itself.
  * \param [in] timeout a timeout to wait for a message delivery. Passing in
  *             NULL will result in blocking behavior.
- * \param [in] flags pass in 0. Currently unused.
+ * \param [in] flags 0 or AMQP_MESSAGE_POOLED
  * \returns a amqp_rpc_reply_t object.  ret.reply_type == AMQP_RESPONSE_NORMAL
  *          on success. If ret.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION, and
  *          ret.library_error == AMQP_STATUS_UNEXPECTED_FRAME, a frame other
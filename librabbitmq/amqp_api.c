@@ -72,7 +72,9 @@ static const char *base_error_strings[] = {
   "unexpected method received",         /* AMQP_STATUS_WRONG_METHOD             -0x000C */
   "request timed out",                  /* AMQP_STATUS_TIMEOUT                  -0x000D */
   "system timer has failed",            /* AMQP_STATUS_TIMER_FAILED             -0x000E */
-  "heartbeat timeout, connection closed"/* AMQP_STATUS_HEARTBEAT_TIMEOUT        -0x000F */
+  "heartbeat timeout, connection closed",/* AMQP_STATUS_HEARTBEAT_TIMEOUT        -0x000F */
+  "unexpected protocol state",          /* AMQP_STATUS_UNEXPECTED_STATE         -0x0010 */
+  "connection memory limit reached"     /* AMQP_STATUS_MEMORY_LIMIT             -0x0011 */
 };
 
 static const char *tcp_error_strings[] = {
@@ -164,31 +166,14 @@ const amqp_array_t amqp_empty_array = { 0, NULL };
    ? (replytype *) state->most_recent_api_result.reply.decoded\
    : NULL)
 
-int amqp_basic_publish(amqp_connection_state_t state,
-                       amqp_channel_t channel,
-                       amqp_bytes_t exchange,
-                       amqp_bytes_t routing_key,
-                       amqp_boolean_t mandatory,
-                       amqp_boolean_t immediate,
-                       amqp_basic_properties_t const *properties,
-                       amqp_bytes_t body)
+/* What every publish does before its frames are encoded: noticing a missed
+   heartbeat and making room to track the message for publisher confirms */
+static int publish_begin(amqp_connection_state_t state, amqp_channel_t channel)
 {
-  amqp_frame_t f;
-  size_t body_offset;
-  size_t usable_body_payload_size = state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
   int res;
 
-  amqp_basic_publish_t m;
-  amqp_basic_properties_t default_properties;
-
-  m.exchange = exchange;
-  m.routing_key = routing_key;
-  m.mandatory = mandatory;
-  m.immediate = immediate;
-  m.ticket = 0;
-
   if (amqp_heartbeat_enabled(state)) {
-    uint64_t current_timestamp = amqp_get_monotonic_timestamp();
+    uint64_t current_timestamp = amqp_heartbeat_clock(state);
     if (0 == current_timestamp) {
       return AMQP_STATUS_TIMER_FAILURE;
     }
@@ -197,18 +182,122 @@ int amqp_basic_publish(amqp_connection_state_t state,
       res = amqp_try_recv(state, current_timestamp);
       if (AMQP_STATUS_TIMEOUT == res) {
         return AMQP_STATUS_HEARTBEAT_TIMEOUT;
-      } else if (AMQP_STATUS_OK != res) {
+      } else if (AMQP_STATUS_OK != res && AMQP_STATUS_MEMORY_LIMIT != res) {
+        /* hitting the memory limit only holds back reading, not publishing */
         return res;
       }
     }
   }
 
-  res = amqp_send_method(state, channel, AMQP_BASIC_PUBLISH_METHOD, &m);
+  return amqp_confirm_reserve(state, channel);
+}
+
+/* Sends body after the method and content header frames pending in the
+   outbound buffer, or adds it to the batch */
+static int publish_body(amqp_connection_state_t state, amqp_channel_t channel,
+                        amqp_bytes_t body)
+{
+  amqp_frame_t f;
+  amqp_bytes_t pending;
+  int res;
+
+  if (state->publish_batch_active) {
+    size_t usable_body_payload_size = state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
+    size_t body_frames = (body.len + usable_body_payload_size - 1) / usable_body_payload_size;
+    size_t body_frames_size = body.len + body_frames * (HEADER_SIZE + FOOTER_SIZE);
+
+    /* Small bodies are copied into the batch; a body that doesn't fit is
+       sent along with everything pending straight from the caller's memory */
+    if (body_frames_size <= state->outbound_buffer.len - state->outbound_offset) {
+      size_t body_offset = 0;
+
+      f.frame_type = AMQP_FRAME_BODY;
+      f.channel = channel;
+
+      while (body_offset < body.len) {
+        f.payload.body_fragment.bytes = amqp_offset(body.bytes, body_offset);
+        f.payload.body_fragment.len = body.len - body_offset;
+        if (f.payload.body_fragment.len > usable_body_payload_size) {
+          f.payload.body_fragment.len = usable_body_payload_size;
+        }
+
+        res = amqp_append_frame(state, &f);
+        if (res < 0) {
+          return res;
+        }
+
+        body_offset += f.payload.body_fragment.len;
+      }
+
+      return AMQP_STATUS_OK;
+    }
+  }
+
+  /* The method, content header and body frames are coalesced so the whole
+     message goes out with a single writev */
+  pending.bytes = state->outbound_buffer.bytes;
+  pending.len = state->outbound_offset;
+  state->outbound_offset = 0;
+
+  return amqp_send_content(state, pending, channel, body);
+}
+
+/* Sends the body once the method and content header frames are encoded,
+   the message only gets a confirm sequence number if nothing failed */
+static int publish_end(amqp_connection_state_t state, amqp_channel_t channel,
+                       amqp_bytes_t body)
+{
+  int res;
+
+  amqp_confirm_published(state, channel);
+
+  res = publish_body(state, channel, body);
+  if (AMQP_STATUS_OK != res) {
+    amqp_confirm_unpublished(state, channel);
+  }
+  return res;
+}
+
+/* Publishes with either decoded properties or, if raw_properties isn't
+   NULL, properties that are already encoded */
+static int basic_publish(amqp_connection_state_t state,
+                         amqp_channel_t channel,
+                         amqp_bytes_t exchange,
+                         amqp_bytes_t routing_key,
+                         amqp_boolean_t mandatory,
+                         amqp_boolean_t immediate,
+                         amqp_basic_properties_t const *properties,
+                         amqp_bytes_t const *raw_properties,
+                         amqp_bytes_t body)
+{
+  amqp_frame_t f;
+  int res;
+
+  amqp_basic_publish_t m;
+  amqp_basic_properties_t default_properties;
+
+  m.exchange = exchange;
+  m.routing_key = routing_key;
+  m.mandatory = mandatory;
+  m.immediate = immediate;
+  m.ticket = 0;
+
+  res = publish_begin(state, channel);
   if (res < 0) {
     return res;
   }
 
-  if (properties == NULL) {
+  f.frame_type = AMQP_FRAME_METHOD;
+  f.channel = channel;
+  f.payload.method.id = AMQP_BASIC_PUBLISH_METHOD;
+  f.payload.method.decoded = &m;
+
+  res = amqp_append_frame(state, &f);
+  if (res < 0) {
+    return res;
+  }
+
+  if (properties == NULL && raw_properties == NULL) {
     memset(&default_properties, 0, sizeof(default_properties));
     properties = &default_properties;
   }
@@ -217,40 +306,239 @@ int amqp_basic_publish(amqp_connection_state_t state,
   f.channel = channel;
   f.payload.properties.class_id = AMQP_BASIC_CLASS;
   f.payload.properties.body_size = body.len;
-  f.payload.properties.decoded = (void *) properties;
+  if (raw_properties != NULL) {
+    f.payload.properties.raw = *raw_properties;
+    f.payload.properties.decoded = NULL;
+  } else {
+    f.payload.properties.decoded = (void *) properties;
+  }
 
-  res = amqp_send_frame(state, &f);
+  res = amqp_append_frame(state, &f);
   if (res < 0) {
     return res;
   }
 
-  body_offset = 0;
-  while (body_offset < body.len) {
-    size_t remaining = body.len - body_offset;
+  return publish_end(state, channel, body);
+}
 
-    if (remaining == 0) {
-      break;
-    }
+int amqp_basic_publish(amqp_connection_state_t state,
+                       amqp_channel_t channel,
+                       amqp_bytes_t exchange,
+                       amqp_bytes_t routing_key,
+                       amqp_boolean_t mandatory,
+                       amqp_boolean_t immediate,
+                       amqp_basic_properties_t const *properties,
+                       amqp_bytes_t body)
+{
+  return basic_publish(state, channel, exchange, routing_key, mandatory,
+                       immediate, properties, NULL, body);
+}
 
-    f.frame_type = AMQP_FRAME_BODY;
-    f.channel = channel;
-    f.payload.body_fragment.bytes = amqp_offset(body.bytes, body_offset);
-    if (remaining >= usable_body_payload_size) {
-      f.payload.body_fragment.len = usable_body_payload_size;
-    } else {
-      f.payload.body_fragment.len = remaining;
-    }
+int amqp_basic_publish_raw(amqp_connection_state_t state,
+                           amqp_channel_t channel,
+                           amqp_bytes_t exchange,
+                           amqp_bytes_t routing_key,
+                           amqp_boolean_t mandatory,
+                           amqp_boolean_t immediate,
+                           amqp_bytes_t raw_properties,
+                           amqp_bytes_t body)
+{
+  /* at least the property flags */
+  if (raw_properties.len < 2) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  return basic_publish(state, channel, exchange, routing_key, mandatory,
+                       immediate, NULL, &raw_properties, body);
+}
+
+struct amqp_publish_template_t_ {
+  amqp_allocator_t allocator;
+  /* the basic.publish frame followed by the content header frame */
+  amqp_bytes_t encoded;
+  size_t header_offset;
+  /* the largest of the two frames */
+  size_t frame_size;
+  /* where the timestamp property is, 0 if there is none */
+  size_t timestamp_offset;
+};
+
+int amqp_publish_template_new(amqp_connection_state_t state,
+                              amqp_bytes_t exchange,
+                              amqp_bytes_t routing_key,
+                              amqp_boolean_t mandatory,
+                              amqp_boolean_t immediate,
+                              amqp_basic_properties_t const *properties,
+                              amqp_publish_template_t **publish_template)
+{
+  amqp_publish_template_t *t;
+  amqp_basic_publish_t m;
+  amqp_basic_properties_t default_properties;
+  amqp_frame_t f;
+  amqp_bytes_t window;
+  amqp_bytes_t encoded;
+  size_t frame_max = (size_t)state->frame_max;
+  void *shrunk;
+  int res;
+
+  m.exchange = exchange;
+  m.routing_key = routing_key;
+  m.mandatory = mandatory;
+  m.immediate = immediate;
+  m.ticket = 0;
 
-    body_offset += f.payload.body_fragment.len;
-    res = amqp_send_frame(state, &f);
-    if (res < 0) {
-      return res;
+  if (properties == NULL) {
+    memset(&default_properties, 0, sizeof(default_properties));
+    properties = &default_properties;
+  }
+
+  t = amqp_calloc(&state->allocator, 1, sizeof(amqp_publish_template_t));
+  if (NULL == t) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  t->allocator = state->allocator;
+
+  /* Room for two frames of up to frame_max, trimmed once they're encoded */
+  t->encoded.bytes = amqp_malloc(&t->allocator, 2 * frame_max);
+  if (NULL == t->encoded.bytes) {
+    res = AMQP_STATUS_NO_MEMORY;
+    goto error_out;
+  }
+
+  /* The channel and body size are filled in for each message */
+  f.frame_type = AMQP_FRAME_METHOD;
+  f.channel = 0;
+  f.payload.method.id = AMQP_BASIC_PUBLISH_METHOD;
+  f.payload.method.decoded = &m;
+
+  window.bytes = t->encoded.bytes;
+  window.len = frame_max;
+  res = amqp_frame_to_bytes(&f, window, &encoded);
+  if (res < 0) {
+    goto error_out;
+  }
+  t->header_offset = encoded.len;
+  t->frame_size = encoded.len;
+
+  f.frame_type = AMQP_FRAME_HEADER;
+  f.payload.properties.class_id = AMQP_BASIC_CLASS;
+  f.payload.properties.body_size = 0;
+  f.payload.properties.decoded = (void *) properties;
+
+  window.bytes = amqp_offset(t->encoded.bytes, t->header_offset);
+  res = amqp_frame_to_bytes(&f, window, &encoded);
+  if (res < 0) {
+    goto error_out;
+  }
+  t->encoded.len = t->header_offset + encoded.len;
+  if (encoded.len > t->frame_size) {
+    t->frame_size = encoded.len;
+  }
+
+  if (properties->_flags & AMQP_BASIC_TIMESTAMP_FLAG) {
+    /* Only short strings follow the timestamp, so it's found by counting
+       back from the end of the properties */
+    size_t offset = t->encoded.len - FOOTER_SIZE - 8;
+
+    if (properties->_flags & AMQP_BASIC_TYPE_FLAG) {
+      offset -= 1 + properties->type.len;
+    }
+    if (properties->_flags & AMQP_BASIC_USER_ID_FLAG) {
+      offset -= 1 + properties->user_id.len;
+    }
+    if (properties->_flags & AMQP_BASIC_APP_ID_FLAG) {
+      offset -= 1 + properties->app_id.len;
+    }
+    if (properties->_flags & AMQP_BASIC_CLUSTER_ID_FLAG) {
+      offset -= 1 + properties->cluster_id.len;
     }
+    t->timestamp_offset = offset;
+  }
+
+  shrunk = amqp_realloc(&t->allocator, t->encoded.bytes, t->encoded.len);
+  if (NULL != shrunk) {
+    t->encoded.bytes = shrunk;
+  }
+
+  *publish_template = t;
+  return AMQP_STATUS_OK;
+
+error_out:
+  amqp_free(&t->allocator, t->encoded.bytes);
+  amqp_free(&t->allocator, t);
+  return res;
+}
+
+void amqp_publish_template_destroy(amqp_publish_template_t *publish_template)
+{
+  amqp_allocator_t allocator;
+
+  if (NULL == publish_template) {
+    return;
+  }
+
+  allocator = publish_template->allocator;
+  amqp_free(&allocator, publish_template->encoded.bytes);
+  amqp_free(&allocator, publish_template);
+}
+
+int amqp_publish_template_set_timestamp(amqp_publish_template_t *publish_template,
+                                        uint64_t timestamp)
+{
+  if (0 == publish_template->timestamp_offset) {
+    return AMQP_STATUS_INVALID_PARAMETER;
   }
 
+  amqp_e64(publish_template->encoded.bytes, publish_template->timestamp_offset,
+           timestamp);
   return AMQP_STATUS_OK;
 }
 
+int amqp_basic_publish_template(amqp_connection_state_t state,
+                                amqp_channel_t channel,
+                                amqp_publish_template_t *publish_template,
+                                amqp_bytes_t body)
+{
+  amqp_bytes_t encoded = publish_template->encoded;
+  int res;
+
+  if (publish_template->frame_size > (size_t)state->frame_max) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  res = publish_begin(state, channel);
+  if (res < 0) {
+    return res;
+  }
+
+  amqp_e16(encoded.bytes, 1, channel);
+  amqp_e16(encoded.bytes, publish_template->header_offset + 1, channel);
+  amqp_e64(encoded.bytes, publish_template->header_offset + HEADER_SIZE + 4,
+           body.len);
+
+  if (state->publish_batch_active &&
+      encoded.len <= state->outbound_buffer.len - state->outbound_offset) {
+    memcpy(amqp_offset(state->outbound_buffer.bytes, state->outbound_offset),
+           encoded.bytes, encoded.len);
+    state->outbound_offset += encoded.len;
+    return publish_end(state, channel, body);
+  }
+
+  /* Otherwise the frames are written straight from the template */
+  res = amqp_flush_outbound(state);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  amqp_confirm_published(state, channel);
+
+  res = amqp_send_content(state, encoded, channel, body);
+  if (AMQP_STATUS_OK != res) {
+    amqp_confirm_unpublished(state, channel);
+  }
+  return res;
+}
+
 amqp_rpc_reply_t amqp_channel_close(amqp_connection_state_t state,
                                     amqp_channel_t channel,
                                     int code)
@@ -0,0 +1,447 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "amqp_timer.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Publisher confirm tracking.
+ *
+ * Each tracked channel keeps a window [base, next) of sequence numbers.
+ * Everything below base has been confirmed, next is the sequence number the
+ * next publish gets. Within the window, a set bit in a ring bitmap marks a
+ * publish that is still outstanding: sequence number s lives at bit
+ * s & (capacity - 1). Bits outside the window are always clear.
+ *
+ * Acks with multiple set clear whole words at a time, and base only ever
+ * moves forward, so the cost of a confirm is amortized constant no matter how
+ * many publishes it covers.
+ */
+
+#define WORD_BITS 64
+#define INITIAL_TRACKER_CAPACITY 1024
+#define INITIAL_EVENT_CAPACITY 16
+
+struct amqp_confirm_tracker_t_ {
+  uint64_t base;
+  uint64_t next;
+  uint64_t outstanding;
+  uint64_t *bits;
+  uint64_t capacity; /* in bits, a power of 2 and a multiple of WORD_BITS */
+};
+
+#if defined(__GNUC__)
+# define count_trailing_zeros(x) ((unsigned)__builtin_ctzll(x))
+#else
+static unsigned count_trailing_zeros(uint64_t x)
+{
+  unsigned n = 0;
+  while (0 == (x & 1)) {
+    x >>= 1;
+    ++n;
+  }
+  return n;
+}
+#endif
+
+/* Mask of bits [lo, hi) of a word, 0 <= lo < hi <= WORD_BITS */
+static uint64_t word_mask(unsigned lo, unsigned hi)
+{
+  uint64_t mask = (WORD_BITS == hi) ? ~(uint64_t)0 : (((uint64_t)1 << hi) - 1);
+  return mask & ~(((uint64_t)1 << lo) - 1);
+}
+
+static uint64_t *word_of(amqp_confirm_tracker_t *tracker, uint64_t seqno)
+{
+  return &tracker->bits[(seqno & (tracker->capacity - 1)) / WORD_BITS];
+}
+
+/* Returns the first sequence number in [from, to) whose bit is set (or clear
+   when set is false), or to if there is none */
+static uint64_t find_bit(amqp_confirm_tracker_t *tracker, uint64_t from,
+                         uint64_t to, int set)
+{
+  while (from < to) {
+    unsigned lo = (unsigned)(from % WORD_BITS);
+    uint64_t span = WORD_BITS - lo;
+    uint64_t word;
+
+    if (span > to - from) {
+      span = to - from;
+    }
+
+    word = *word_of(tracker, from);
+    if (!set) {
+      word = ~word;
+    }
+    word &= word_mask(lo, lo + (unsigned)span);
+
+    if (0 != word) {
+      return from + (count_trailing_zeros(word) - lo);
+    }
+    from += span;
+  }
+  return to;
+}
+
+static void clear_bits(amqp_confirm_tracker_t *tracker, uint64_t from,
+                       uint64_t to)
+{
+  while (from < to) {
+    unsigned lo = (unsigned)(from % WORD_BITS);
+    uint64_t span = WORD_BITS - lo;
+
+    if (span > to - from) {
+      span = to - from;
+    }
+
+    *word_of(tracker, from) &= ~word_mask(lo, lo + (unsigned)span);
+    from += span;
+  }
+}
+
+static int grow_tracker(amqp_connection_state_t state,
+                        amqp_confirm_tracker_t *tracker)
+{
+  uint64_t new_capacity = tracker->capacity * 2;
+  uint64_t *new_bits = amqp_calloc(&state->allocator,
+                                   (size_t)(new_capacity / WORD_BITS),
+                                   sizeof(uint64_t));
+  uint64_t seqno;
+
+  if (NULL == new_bits) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  /* The window is full when this is called, so the word holding base may also
+     hold the newest bits: only move the bits inside the window */
+  seqno = tracker->base;
+  while (seqno < tracker->next) {
+    unsigned lo = (unsigned)(seqno % WORD_BITS);
+    uint64_t span = WORD_BITS - lo;
+
+    if (span > tracker->next - seqno) {
+      span = tracker->next - seqno;
+    }
+
+    new_bits[(seqno & (new_capacity - 1)) / WORD_BITS] |=
+      *word_of(tracker, seqno) & word_mask(lo, lo + (unsigned)span);
+    seqno += span;
+  }
+
+  amqp_free(&state->allocator, tracker->bits);
+  tracker->bits = new_bits;
+  tracker->capacity = new_capacity;
+  return AMQP_STATUS_OK;
+}
+
+static int push_event(amqp_connection_state_t state, amqp_channel_t channel,
+                      uint64_t first, uint64_t last, amqp_boolean_t nacked)
+{
+  amqp_confirm_event_t *event;
+
+  if (state->confirm_events_count > 0) {
+    size_t tail = (state->confirm_events_head + state->confirm_events_count - 1)
+                  % state->confirm_events_capacity;
+    event = &state->confirm_events[tail];
+
+    if (event->channel == channel && event->nacked == nacked &&
+        event->last + 1 == first) {
+      event->last = last;
+      return AMQP_STATUS_OK;
+    }
+  }
+
+  if (state->confirm_events_count == state->confirm_events_capacity) {
+    size_t new_capacity = state->confirm_events_capacity ?
+                          state->confirm_events_capacity * 2 :
+                          INITIAL_EVENT_CAPACITY;
+    amqp_confirm_event_t *new_events =
+      amqp_malloc(&state->allocator, new_capacity * sizeof(amqp_confirm_event_t));
+    size_t i;
+
+    if (NULL == new_events) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+
+    for (i = 0; i < state->confirm_events_count; ++i) {
+      new_events[i] = state->confirm_events[(state->confirm_events_head + i)
+                                            % state->confirm_events_capacity];
+    }
+
+    amqp_free(&state->allocator, state->confirm_events);
+    state->confirm_events = new_events;
+    state->confirm_events_head = 0;
+    state->confirm_events_capacity = new_capacity;
+  }
+
+  event = &state->confirm_events[(state->confirm_events_head +
+                                  state->confirm_events_count)
+                                 % state->confirm_events_capacity];
+  event->channel = channel;
+  event->first = first;
+  event->last = last;
+  event->nacked = nacked;
+  state->confirm_events_count++;
+
+  return AMQP_STATUS_OK;
+}
+
+static amqp_confirm_tracker_t *get_tracker(amqp_connection_state_t state,
+                                           amqp_channel_t channel)
+{
+  amqp_pool_table_entry_t *entry = amqp_get_channel_entry(state, channel);
+  if (NULL == entry) {
+    return NULL;
+  }
+  return entry->confirms;
+}
+
+int amqp_confirm_track(amqp_connection_state_t state, amqp_channel_t channel)
+{
+  amqp_pool_table_entry_t *entry;
+  amqp_confirm_tracker_t *tracker;
+
+  entry = amqp_get_or_create_channel_entry(state, channel);
+  if (NULL == entry) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  tracker = entry->confirms;
+  if (NULL == tracker) {
+    tracker = amqp_malloc(&state->allocator, sizeof(amqp_confirm_tracker_t));
+    if (NULL == tracker) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+
+    tracker->capacity = INITIAL_TRACKER_CAPACITY;
+    tracker->bits = amqp_malloc(&state->allocator,
+                                (size_t)(tracker->capacity / WORD_BITS) * sizeof(uint64_t));
+    if (NULL == tracker->bits) {
+      amqp_free(&state->allocator, tracker);
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    entry->confirms = tracker;
+  }
+
+  /* Delivery tags for confirms start at 1 */
+  memset(tracker->bits, 0, (size_t)(tracker->capacity / WORD_BITS) * sizeof(uint64_t));
+  tracker->base = 1;
+  tracker->next = 1;
+  tracker->outstanding = 0;
+
+  return AMQP_STATUS_OK;
+}
+
+void amqp_confirm_tracker_free(amqp_connection_state_t state,
+                               amqp_confirm_tracker_t *tracker)
+{
+  if (tracker) {
+    amqp_free(&state->allocator, tracker->bits);
+    amqp_free(&state->allocator, tracker);
+  }
+}
+
+uint64_t amqp_confirm_next_seqno(amqp_connection_state_t state,
+                                 amqp_channel_t channel)
+{
+  amqp_confirm_tracker_t *tracker = get_tracker(state, channel);
+  return tracker ? tracker->next : 0;
+}
+
+uint64_t amqp_confirm_outstanding(amqp_connection_state_t state,
+                                  amqp_channel_t channel)
+{
+  amqp_confirm_tracker_t *tracker = get_tracker(state, channel);
+  return tracker ? tracker->outstanding : 0;
+}
+
+int amqp_confirm_reserve(amqp_connection_state_t state, amqp_channel_t channel)
+{
+  amqp_confirm_tracker_t *tracker = get_tracker(state, channel);
+
+  if (NULL != tracker && tracker->next - tracker->base == tracker->capacity) {
+    return grow_tracker(state, tracker);
+  }
+  return AMQP_STATUS_OK;
+}
+
+void amqp_confirm_published(amqp_connection_state_t state, amqp_channel_t channel)
+{
+  amqp_confirm_tracker_t *tracker = get_tracker(state, channel);
+
+  if (NULL == tracker) {
+    return;
+  }
+
+  *word_of(tracker, tracker->next) |= (uint64_t)1 << (tracker->next % WORD_BITS);
+  tracker->next++;
+  tracker->outstanding++;
+}
+
+void amqp_confirm_unpublished(amqp_connection_state_t state, amqp_channel_t channel)
+{
+  amqp_confirm_tracker_t *tracker = get_tracker(state, channel);
+  uint64_t seqno;
+
+  if (NULL == tracker || tracker->next == tracker->base) {
+    return;
+  }
+
+  /* If the broker already confirmed it, the publish did go out */
+  seqno = tracker->next - 1;
+  if (0 == (*word_of(tracker, seqno) & ((uint64_t)1 << (seqno % WORD_BITS)))) {
+    return;
+  }
+
+  clear_bits(tracker, seqno, seqno + 1);
+  tracker->next = seqno;
+  tracker->outstanding--;
+}
+
+int amqp_confirm_handle_frame(amqp_connection_state_t state, amqp_frame_t *frame)
+{
+  amqp_confirm_tracker_t *tracker;
+  uint64_t delivery_tag;
+  amqp_boolean_t multiple;
+  amqp_boolean_t nacked;
+  int res = AMQP_STATUS_OK;
+
+  tracker = get_tracker(state, frame->channel);
+  if (NULL == tracker) {
+    return AMQP_STATUS_OK;
+  }
+
+  if (AMQP_BASIC_ACK_METHOD == frame->payload.method.id) {
+    amqp_basic_ack_t *ack = frame->payload.method.decoded;
+    delivery_tag = ack->delivery_tag;
+    multiple = ack->multiple;
+    nacked = 0;
+  } else if (AMQP_BASIC_NACK_METHOD == frame->payload.method.id) {
+    amqp_basic_nack_t *nack = frame->payload.method.decoded;
+    delivery_tag = nack->delivery_tag;
+    multiple = nack->multiple;
+    nacked = 1;
+  } else {
+    return AMQP_STATUS_OK;
+  }
+
+  frame->frame_type = 0;
+
+  if (multiple) {
+    /* A delivery tag of 0 with multiple set covers everything outstanding */
+    uint64_t to = (0 == delivery_tag || delivery_tag >= tracker->next) ?
+                  tracker->next : delivery_tag + 1;
+    uint64_t from = tracker->base;
+
+    while (from < to) {
+      uint64_t first = find_bit(tracker, from, to, 1);
+      uint64_t end;
+
+      if (first == to) {
+        break;
+      }
+      end = find_bit(tracker, first, to, 0);
+
+      /* Only what has been reported stops being outstanding, so running out
+         of memory part way loses nothing */
+      res = push_event(state, frame->channel, first, end - 1, nacked);
+      if (AMQP_STATUS_OK != res) {
+        break;
+      }
+      clear_bits(tracker, first, end);
+      tracker->outstanding -= end - first;
+      from = end;
+    }
+  } else if (delivery_tag >= tracker->base && delivery_tag < tracker->next &&
+             (*word_of(tracker, delivery_tag) &
+              ((uint64_t)1 << (delivery_tag % WORD_BITS)))) {
+    res = push_event(state, frame->channel, delivery_tag, delivery_tag, nacked);
+    if (AMQP_STATUS_OK == res) {
+      clear_bits(tracker, delivery_tag, delivery_tag + 1);
+      tracker->outstanding--;
+    }
+  }
+
+  tracker->base = find_bit(tracker, tracker->base, tracker->next, 1);
+
+  return res;
+}
+
+int amqp_confirm_poll(amqp_connection_state_t state, amqp_confirm_event_t *event)
+{
+  int res;
+
+  if (0 == state->confirm_events_count) {
+    /* Process whatever has already been read, then whatever is waiting on
+       the socket, without blocking */
+    res = amqp_queue_buffered_frames(state);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
+    if (0 == state->confirm_events_count) {
+      uint64_t current_timestamp = amqp_get_coarse_timestamp();
+      if (0 == current_timestamp) {
+        return AMQP_STATUS_TIMER_FAILURE;
+      }
+
+      res = amqp_try_recv(state, current_timestamp);
+      if (AMQP_STATUS_TIMEOUT == res) {
+        return AMQP_STATUS_TIMEOUT;
+      } else if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+
+      res = amqp_queue_buffered_frames(state);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+
+    if (0 == state->confirm_events_count) {
+      return AMQP_STATUS_TIMEOUT;
+    }
+  }
+
+  *event = state->confirm_events[state->confirm_events_head];
+  state->confirm_events_head = (state->confirm_events_head + 1)
+                               % state->confirm_events_capacity;
+  state->confirm_events_count--;
+
+  return AMQP_STATUS_OK;
+}
@@ -51,6 +51,8 @@
 #define INITIAL_FRAME_POOL_PAGE_SIZE 65536
 #define INITIAL_DECODING_POOL_PAGE_SIZE 131072
 #define INITIAL_INBOUND_SOCK_BUFFER_SIZE 131072
+#define CONFIRM_POOL_PAGE_SIZE 256
+#define DEFAULT_PUBLISH_BATCH_SIZE 262144
 
 #define ENFORCE_STATE(statevec, statenum)                                                 \
   {                                                                                       \
@@ -63,14 +65,30 @@
   }
 
 amqp_connection_state_t amqp_new_connection(void)
+{
+  return amqp_new_connection_with_allocator(NULL);
+}
+
+amqp_connection_state_t amqp_new_connection_with_allocator(amqp_allocator_t const *allocator)
 {
   int res;
-  amqp_connection_state_t state =
-    (amqp_connection_state_t) calloc(1, sizeof(struct amqp_connection_state_t_));
+  amqp_connection_state_t state;
+
+  if (NULL == allocator) {
+    allocator = amqp_get_default_allocator();
+  } else if (!amqp_allocator_valid(allocator)) {
+    return NULL;
+  }
 
+  state = (amqp_connection_state_t) amqp_calloc(allocator, 1, sizeof(struct amqp_connection_state_t_));
   if (state == NULL) {
     return NULL;
   }
+  state->allocator = *allocator;
+
+  init_amqp_pool_with_allocator(&state->confirm_pool, CONFIRM_POOL_PAGE_SIZE,
+                                &state->allocator);
+  state->confirm_pool.parent_stats = &state->memory_stats;
 
   res = amqp_tune_connection(state, 0, INITIAL_FRAME_POOL_PAGE_SIZE, 0);
   if (0 != res) {
@@ -85,20 +103,69 @@ amqp_connection_state_t amqp_new_connection(void)
      is also the minimum frame size */
   state->target_size = 8;
 
-  state->sock_inbound_buffer.len = INITIAL_INBOUND_SOCK_BUFFER_SIZE;
-  state->sock_inbound_buffer.bytes = malloc(INITIAL_INBOUND_SOCK_BUFFER_SIZE);
-  if (state->sock_inbound_buffer.bytes == NULL) {
+  state->sock_inbound_block =
+    amqp_malloc(&state->allocator, sizeof(amqp_recv_buffer_t) + INITIAL_INBOUND_SOCK_BUFFER_SIZE);
+  if (state->sock_inbound_block == NULL) {
     goto out_nomem;
   }
+  state->sock_inbound_block->pins = 0;
+  state->sock_inbound_block->len = INITIAL_INBOUND_SOCK_BUFFER_SIZE;
+  state->sock_inbound_buffer.len = INITIAL_INBOUND_SOCK_BUFFER_SIZE;
+  state->sock_inbound_buffer.bytes = amqp_recv_buffer_data(state->sock_inbound_block);
 
   return state;
 
 out_nomem:
-  free(state->sock_inbound_buffer.bytes);
-  free(state);
+  amqp_free(&state->allocator, state->sock_inbound_block);
+  amqp_free(&state->allocator, state->outbound_buffer.bytes);
+  amqp_free(allocator, state);
   return NULL;
 }
 
+void amqp_get_memory_stats(amqp_connection_state_t state, amqp_memory_stats_t *stats)
+{
+  *stats = state->memory_stats;
+}
+
+void amqp_set_memory_limit(amqp_connection_state_t state, size_t limit)
+{
+  state->memory_limit = limit;
+}
+
+static size_t memory_held(amqp_connection_state_t state)
+{
+  return state->memory_stats.bytes_in_use +
+         state->memory_stats.pinned_buffer_bytes +
+         state->memory_stats.retained_bytes;
+}
+
+amqp_boolean_t amqp_memory_limit_exceeded(amqp_connection_state_t state,
+                                          size_t extra)
+{
+  amqp_pool_table_entry_t *entry;
+
+  if (0 == state->memory_limit ||
+      memory_held(state) + extra <= state->memory_limit) {
+    return 0;
+  }
+
+  if (NULL != state->spare_inbound_block) {
+    state->memory_stats.retained_bytes -= state->spare_inbound_block->len;
+    amqp_free(&state->allocator, state->spare_inbound_block);
+    state->spare_inbound_block = NULL;
+  }
+  for (entry = state->channel_entries; NULL != entry; entry = entry->next) {
+    amqp_pool_free_retained(&entry->pool);
+  }
+
+  return (memory_held(state) + extra > state->memory_limit);
+}
+
+void amqp_set_lazy_properties(amqp_connection_state_t state, amqp_boolean_t lazy)
+{
+  state->lazy_properties = lazy;
+}
+
 int amqp_get_sockfd(amqp_connection_state_t state)
 {
   return state->socket ? amqp_socket_get_sockfd(state->socket) : -1;
@@ -140,7 +207,7 @@ int amqp_tune_connection(amqp_connection_state_t state,
   state->heartbeat = heartbeat;
 
   if (amqp_heartbeat_enabled(state)) {
-    uint64_t current_time = amqp_get_monotonic_timestamp();
+    uint64_t current_time = amqp_heartbeat_clock(state);
     if (0 == current_time) {
       return AMQP_STATUS_TIMER_FAILURE;
     }
@@ -149,7 +216,7 @@ int amqp_tune_connection(amqp_connection_state_t state,
   }
 
   state->outbound_buffer.len = frame_max;
-  newbuf = realloc(state->outbound_buffer.bytes, frame_max);
+  newbuf = amqp_realloc(&state->allocator, state->outbound_buffer.bytes, frame_max);
   if (newbuf == NULL) {
     return AMQP_STATUS_NO_MEMORY;
   }
@@ -163,25 +230,67 @@ int amqp_get_channel_max(amqp_connection_state_t state)
   return state->channel_max;
 }
 
+static void unpin_recv_buffer(amqp_connection_state_t state,
+                              amqp_recv_buffer_t *buffer)
+{
+  if (0 != --buffer->pins) {
+    return;
+  }
+
+  state->memory_stats.pinned_buffer_bytes -= buffer->len;
+  if (buffer == state->sock_inbound_block) {
+    return;
+  }
+
+  /* Keep one spare around so a connection whose frames are held across
+     reads doesn't hit malloc on every read */
+  if (NULL == state->spare_inbound_block) {
+    state->spare_inbound_block = buffer;
+    state->memory_stats.retained_bytes += buffer->len;
+  } else {
+    amqp_free(&state->allocator, buffer);
+  }
+}
+
+static void unpin_channel_buffers(amqp_connection_state_t state,
+                                  amqp_pool_table_entry_t *entry)
+{
+  amqp_link_t *link;
+
+  for (link = entry->pinned_buffers; NULL != link; link = link->next) {
+    unpin_recv_buffer(state, link->data);
+  }
+
+  entry->pinned_buffers = NULL;
+  entry->last_pinned = NULL;
+}
+
 int amqp_destroy_connection(amqp_connection_state_t state)
 {
   int status = AMQP_STATUS_OK;
   if (state) {
-    int i;
-    for (i = 0; i < POOL_TABLE_SIZE; ++i) {
-      amqp_pool_table_entry_t *entry = state->pool_table[i];
-      while (NULL != entry) {
-        amqp_pool_table_entry_t *todelete = entry;
-        empty_amqp_pool(&entry->pool);
-        entry = entry->next;
-        free(todelete);
-      }
+    amqp_pool_table_entry_t *entry = state->channel_entries;
+    if (state->timer_wheel != NULL) {
+      amqp_timer_wheel_remove_connection(state->timer_wheel, state);
+    }
+    while (NULL != entry) {
+      amqp_pool_table_entry_t *todelete = entry;
+      unpin_channel_buffers(state, entry);
+      empty_amqp_pool(&entry->pool);
+      amqp_confirm_tracker_free(state, entry->confirms);
+      entry = entry->next;
+      amqp_free(&state->allocator, todelete);
     }
 
-    free(state->outbound_buffer.bytes);
-    free(state->sock_inbound_buffer.bytes);
+    empty_amqp_pool(&state->confirm_pool);
+    amqp_free(&state->allocator, state->channel_table);
+    amqp_free(&state->allocator, state->outbound_buffer.bytes);
+    amqp_free(&state->allocator, state->pending_output.bytes);
+    amqp_free(&state->allocator, state->sock_inbound_block);
+    amqp_free(&state->allocator, state->spare_inbound_block);
+    amqp_free(&state->allocator, state->confirm_events);
     amqp_socket_delete(state->socket);
-    free(state);
+    amqp_free(&state->allocator, state);
   }
   return status;
 }
@@ -213,6 +322,155 @@ static size_t consume_data(amqp_connection_state_t state,
   return bytes_consumed;
 }
 
+/* Decodes a complete frame of frame_size bytes at raw_frame. The decoded
+   frame refers to raw_frame, anything else it needs comes from pool. */
+static int decode_frame(amqp_connection_state_t state,
+                        void *raw_frame, size_t frame_size, amqp_pool_t *pool,
+                        amqp_frame_t *decoded_frame)
+{
+  amqp_bytes_t encoded;
+  int res;
+
+  /* Check frame end marker (footer) */
+  if (amqp_d8(raw_frame, frame_size - 1) != AMQP_FRAME_END) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+
+  decoded_frame->frame_type = amqp_d8(raw_frame, 0);
+  decoded_frame->channel = amqp_d16(raw_frame, 1);
+
+  switch (decoded_frame->frame_type) {
+  case AMQP_FRAME_METHOD:
+    decoded_frame->payload.method.id = amqp_d32(raw_frame, HEADER_SIZE);
+    encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 4);
+    encoded.len = frame_size - HEADER_SIZE - 4 - FOOTER_SIZE;
+
+    res = amqp_decode_method(decoded_frame->payload.method.id,
+                             pool, encoded,
+                             &decoded_frame->payload.method.decoded);
+    if (res < 0) {
+      return res;
+    }
+
+    break;
+
+  case AMQP_FRAME_HEADER:
+    decoded_frame->payload.properties.class_id
+      = amqp_d16(raw_frame, HEADER_SIZE);
+    /* unused 2-byte weight field goes here */
+    decoded_frame->payload.properties.body_size
+      = amqp_d64(raw_frame, HEADER_SIZE + 4);
+    encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 12);
+    encoded.len = frame_size - HEADER_SIZE - 12 - FOOTER_SIZE;
+    decoded_frame->payload.properties.raw = encoded;
+
+    if (state->lazy_properties &&
+        AMQP_BASIC_CLASS == decoded_frame->payload.properties.class_id) {
+      /* Everything but the headers table, which stays empty until asked for */
+      amqp_basic_properties_t *properties =
+        amqp_pool_alloc(pool, sizeof(amqp_basic_properties_t));
+      if (NULL == properties) {
+        return AMQP_STATUS_NO_MEMORY;
+      }
+      properties->headers = amqp_empty_table;
+      decoded_frame->payload.properties.decoded = properties;
+
+      res = amqp_decode_basic_properties(encoded, ~AMQP_BASIC_HEADERS_FLAG,
+                                         NULL, properties);
+    } else {
+      res = amqp_decode_properties(decoded_frame->payload.properties.class_id,
+                                   pool, encoded,
+                                   &decoded_frame->payload.properties.decoded);
+    }
+    if (res < 0) {
+      return res;
+    }
+
+    break;
+
+  case AMQP_FRAME_BODY:
+    decoded_frame->payload.body_fragment.len
+      = frame_size - HEADER_SIZE - FOOTER_SIZE;
+    decoded_frame->payload.body_fragment.bytes
+      = amqp_offset(raw_frame, HEADER_SIZE);
+    break;
+
+  case AMQP_FRAME_HEARTBEAT:
+    break;
+
+  default:
+    /* Ignore the frame */
+    decoded_frame->frame_type = 0;
+    break;
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+/* Whether raw_frame is a basic.ack or basic.nack the confirm tracker of its
+   channel is going to consume */
+static amqp_boolean_t is_tracked_confirm(amqp_pool_table_entry_t *entry,
+                                         void *raw_frame, size_t frame_size)
+{
+  amqp_method_number_t id;
+
+  if (NULL == entry->confirms ||
+      AMQP_FRAME_METHOD != amqp_d8(raw_frame, 0) ||
+      frame_size < HEADER_SIZE + 4 + FOOTER_SIZE) {
+    return 0;
+  }
+
+  id = amqp_d32(raw_frame, HEADER_SIZE);
+  return (AMQP_BASIC_ACK_METHOD == id || AMQP_BASIC_NACK_METHOD == id);
+}
+
+/* The pool a frame is decoded into, see confirm_pool */
+static amqp_pool_t *frame_pool(amqp_connection_state_t state,
+                               amqp_pool_table_entry_t *entry,
+                               void *raw_frame, size_t frame_size)
+{
+  if (is_tracked_confirm(entry, raw_frame, frame_size)) {
+    recycle_amqp_pool(&state->confirm_pool);
+    return &state->confirm_pool;
+  }
+  return &entry->pool;
+}
+
+/* Decodes the frame that has been assembled in inbound_buffer */
+static int complete_frame(amqp_connection_state_t state,
+                          amqp_frame_t *decoded_frame)
+{
+  amqp_pool_table_entry_t *entry;
+  amqp_pool_t *pool;
+  void *raw_frame = state->inbound_buffer.bytes;
+  int res;
+
+  entry = amqp_get_or_create_channel_entry(state, amqp_d16(raw_frame, 1));
+  if (NULL == entry) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  pool = frame_pool(state, entry, raw_frame, state->target_size);
+  if (pool == &entry->pool && raw_frame == state->confirm_frame_buffer) {
+    /* Not a confirm after all, and what it decodes to may refer to the
+       frame: move it where it can stay */
+    raw_frame = amqp_pool_alloc_uninit(pool, state->target_size);
+    if (NULL == raw_frame) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    memcpy(raw_frame, state->confirm_frame_buffer, state->target_size);
+  }
+
+  res = decode_frame(state, raw_frame, state->target_size, pool,
+                     decoded_frame);
+  if (res < 0) {
+    return res;
+  }
+
+  return_to_idle(state);
+  return AMQP_STATUS_OK;
+}
+
 int amqp_handle_input(amqp_connection_state_t state,
                       amqp_bytes_t received_data,
                       amqp_frame_t *decoded_frame)
@@ -267,23 +525,35 @@ int amqp_handle_input(amqp_connection_state_t state,
 
   case CONNECTION_STATE_HEADER: {
     amqp_channel_t channel;
-    amqp_pool_t *channel_pool;
+    amqp_pool_table_entry_t *entry;
     /* frame length is 3 bytes in */
     channel = amqp_d16(raw_frame, 1);
 
-    channel_pool = amqp_get_or_create_channel_pool(state, channel);
-    if (NULL == channel_pool) {
+    entry = amqp_get_or_create_channel_entry(state, channel);
+    if (NULL == entry) {
       return AMQP_STATUS_NO_MEMORY;
     }
 
     state->target_size
       = amqp_d32(raw_frame, 3) + HEADER_SIZE + FOOTER_SIZE;
 
-    amqp_pool_alloc_bytes(channel_pool, state->target_size, &state->inbound_buffer);
-    if (NULL == state->inbound_buffer.bytes) {
-      return AMQP_STATUS_NO_MEMORY;
+    if (NULL != entry->confirms && AMQP_FRAME_METHOD == amqp_d8(raw_frame, 0) &&
+        state->target_size <= sizeof(state->confirm_frame_buffer)) {
+      /* Possibly a confirm, which shouldn't take up room in the channel
+         pool: complete_frame() moves it there if it isn't one */
+      state->inbound_buffer.bytes = state->confirm_frame_buffer;
+      state->inbound_buffer.len = state->target_size;
+    } else {
+      amqp_pool_alloc_bytes_uninit(&entry->pool, state->target_size,
+                                   &state->inbound_buffer);
+      if (NULL == state->inbound_buffer.bytes) {
+        return AMQP_STATUS_NO_MEMORY;
+      }
     }
-    memcpy(state->inbound_buffer.bytes, state->header_buffer, HEADER_SIZE);
+    /* coming from CONNECTION_STATE_INITIAL the first payload byte has been
+       read into header_buffer as well */
+    memcpy(state->inbound_buffer.bytes, state->header_buffer,
+           state->inbound_offset);
     raw_frame = state->inbound_buffer.bytes;
 
     state->state = CONNECTION_STATE_BODY;
@@ -300,81 +570,146 @@ int amqp_handle_input(amqp_connection_state_t state,
     /* fall through to process body */
 
   case CONNECTION_STATE_BODY: {
-    amqp_bytes_t encoded;
-    int res;
-    amqp_pool_t *channel_pool;
-
-    /* Check frame end marker (footer) */
-    if (amqp_d8(raw_frame, state->target_size - 1) != AMQP_FRAME_END) {
-      return AMQP_STATUS_BAD_AMQP_DATA;
+    int res = complete_frame(state, decoded_frame);
+    if (res < 0) {
+      return res;
     }
 
-    decoded_frame->frame_type = amqp_d8(raw_frame, 0);
-    decoded_frame->channel = amqp_d16(raw_frame, 1);
+    return bytes_consumed;
+  }
 
-    channel_pool = amqp_get_or_create_channel_pool(state, decoded_frame->channel);
-    if (NULL == channel_pool) {
+  default:
+    amqp_abort("Internal error: invalid amqp_connection_state_t->state %d", state->state);
+    return bytes_consumed;
+  }
+}
+
+int amqp_prepare_recv_buffer(amqp_connection_state_t state)
+{
+  amqp_recv_buffer_t *buffer = state->sock_inbound_block;
+
+  if (0 == buffer->pins) {
+    return AMQP_STATUS_OK;
+  }
+
+  /* Frames decoded from the current buffer are still in use: leave it to
+     the channels holding them and read into another one */
+  if (NULL != state->spare_inbound_block) {
+    buffer = state->spare_inbound_block;
+    state->spare_inbound_block = NULL;
+    state->memory_stats.retained_bytes -= buffer->len;
+  } else {
+    buffer = amqp_malloc(&state->allocator,
+                         sizeof(amqp_recv_buffer_t) + state->sock_inbound_buffer.len);
+    if (NULL == buffer) {
       return AMQP_STATUS_NO_MEMORY;
     }
+    buffer->pins = 0;
+    buffer->len = state->sock_inbound_buffer.len;
+  }
 
-    switch (decoded_frame->frame_type) {
-    case AMQP_FRAME_METHOD:
-      decoded_frame->payload.method.id = amqp_d32(raw_frame, HEADER_SIZE);
-      encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 4);
-      encoded.len = state->target_size - HEADER_SIZE - 4 - FOOTER_SIZE;
+  state->sock_inbound_block = buffer;
+  state->sock_inbound_buffer.bytes = amqp_recv_buffer_data(buffer);
+  state->sock_inbound_buffer.len = buffer->len;
+  state->sock_inbound_offset = 0;
+  state->sock_inbound_limit = 0;
 
-      res = amqp_decode_method(decoded_frame->payload.method.id,
-                               channel_pool, encoded,
-                               &decoded_frame->payload.method.decoded);
-      if (res < 0) {
-        return res;
-      }
+  return AMQP_STATUS_OK;
+}
 
-      break;
+amqp_boolean_t amqp_frame_remainder(amqp_connection_state_t state,
+                                    amqp_bytes_t *remainder)
+{
+  if (CONNECTION_STATE_BODY != state->state ||
+      state->target_size - state->inbound_offset < AMQP_DIRECT_RECV_THRESHOLD) {
+    return 0;
+  }
 
-    case AMQP_FRAME_HEADER:
-      decoded_frame->payload.properties.class_id
-        = amqp_d16(raw_frame, HEADER_SIZE);
-      /* unused 2-byte weight field goes here */
-      decoded_frame->payload.properties.body_size
-        = amqp_d64(raw_frame, HEADER_SIZE + 4);
-      encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 12);
-      encoded.len = state->target_size - HEADER_SIZE - 12 - FOOTER_SIZE;
-      decoded_frame->payload.properties.raw = encoded;
+  remainder->bytes = amqp_offset(state->inbound_buffer.bytes, state->inbound_offset);
+  remainder->len = state->target_size - state->inbound_offset;
+  return 1;
+}
 
-      res = amqp_decode_properties(decoded_frame->payload.properties.class_id,
-                                   channel_pool, encoded,
-                                   &decoded_frame->payload.properties.decoded);
-      if (res < 0) {
-        return res;
+void amqp_frame_remainder_received(amqp_connection_state_t state, size_t len)
+{
+  state->inbound_offset += len;
+}
+
+amqp_boolean_t amqp_frame_ready(amqp_connection_state_t state)
+{
+  return (CONNECTION_STATE_BODY == state->state &&
+          state->inbound_offset == state->target_size);
+}
+
+int amqp_handle_buffered_input(amqp_connection_state_t state,
+                               amqp_frame_t *decoded_frame)
+{
+  amqp_bytes_t received_data;
+
+  /* The rest of the frame was received directly into its buffer */
+  if (amqp_frame_ready(state)) {
+    decoded_frame->frame_type = 0;
+    return complete_frame(state, decoded_frame);
+  }
+
+  received_data.len = state->sock_inbound_limit - state->sock_inbound_offset;
+  received_data.bytes = amqp_offset(state->sock_inbound_buffer.bytes,
+                                    state->sock_inbound_offset);
+
+  /* Fast path: the whole frame is in the socket buffer, decode it where it
+     is instead of copying it into the channel pool first. Unless pinning the
+     buffer would go past the memory limit. */
+  if (CONNECTION_STATE_IDLE == state->state &&
+      received_data.len >= HEADER_SIZE) {
+    void *raw_frame = received_data.bytes;
+    size_t frame_size = (size_t)amqp_d32(raw_frame, 3) + HEADER_SIZE + FOOTER_SIZE;
+
+    if (frame_size <= received_data.len) {
+      amqp_pool_table_entry_t *entry;
+      amqp_pool_t *pool;
+      int res;
+
+      entry = amqp_get_or_create_channel_entry(state, amqp_d16(raw_frame, 1));
+      if (NULL == entry) {
+        return AMQP_STATUS_NO_MEMORY;
       }
 
-      break;
+      pool = frame_pool(state, entry, raw_frame, frame_size);
+      if (pool == &entry->pool && 0 == state->sock_inbound_block->pins &&
+          0 != state->memory_limit &&
+          amqp_memory_limit_exceeded(state, state->sock_inbound_block->len)) {
+        return amqp_handle_input(state, received_data, decoded_frame);
+      }
 
-    case AMQP_FRAME_BODY:
-      decoded_frame->payload.body_fragment.len
-        = state->target_size - HEADER_SIZE - FOOTER_SIZE;
-      decoded_frame->payload.body_fragment.bytes
-        = amqp_offset(raw_frame, HEADER_SIZE);
-      break;
+      res = decode_frame(state, raw_frame, frame_size, pool, decoded_frame);
+      if (res < 0) {
+        return res;
+      }
 
-    case AMQP_FRAME_HEARTBEAT:
-      break;
+      /* A decoded confirm doesn't refer to the frame */
+      if (pool == &entry->pool &&
+          0 != decoded_frame->frame_type &&
+          AMQP_FRAME_HEARTBEAT != decoded_frame->frame_type &&
+          entry->last_pinned != state->sock_inbound_block) {
+        amqp_link_t *link = amqp_pool_alloc(&entry->pool, sizeof(amqp_link_t));
+        if (NULL == link) {
+          return AMQP_STATUS_NO_MEMORY;
+        }
+
+        link->data = state->sock_inbound_block;
+        link->next = entry->pinned_buffers;
+        entry->pinned_buffers = link;
+        entry->last_pinned = state->sock_inbound_block;
+        if (0 == state->sock_inbound_block->pins++) {
+          state->memory_stats.pinned_buffer_bytes += state->sock_inbound_block->len;
+        }
+      }
 
-    default:
-      /* Ignore the frame */
-      decoded_frame->frame_type = 0;
-      break;
+      return (int)frame_size;
     }
-
-    return_to_idle(state);
-    return bytes_consumed;
   }
 
-  default:
-    amqp_abort("Internal error: invalid amqp_connection_state_t->state %d", state->state);
-    return bytes_consumed;
-  }
+  return amqp_handle_input(state, received_data, decoded_frame);
 }
 
 amqp_boolean_t amqp_release_buffers_ok(amqp_connection_state_t state)
@@ -384,15 +719,11 @@ amqp_boolean_t amqp_release_buffers_ok(amqp_connection_state_t state)
 
 void amqp_release_buffers(amqp_connection_state_t state)
 {
-  int i;
+  amqp_pool_table_entry_t *entry;
   ENFORCE_STATE(state, CONNECTION_STATE_IDLE);
 
-  for (i = 0; i < POOL_TABLE_SIZE; ++i) {
-    amqp_pool_table_entry_t *entry = state->pool_table[i];
-
-    for ( ;NULL != entry; entry = entry->next) {
-      amqp_maybe_release_buffers_on_channel(state, entry->channel);
-    }
+  for (entry = state->channel_entries; NULL != entry; entry = entry->next) {
+    amqp_maybe_release_buffers_on_channel(state, entry->channel);
   }
 }
 
@@ -405,46 +736,344 @@ void amqp_maybe_release_buffers(amqp_connection_state_t state)
 
 void amqp_maybe_release_buffers_on_channel(amqp_connection_state_t state, amqp_channel_t channel)
 {
-  amqp_link_t *queued_link;
-  amqp_pool_t *pool;
+  amqp_pool_table_entry_t *entry;
   if (CONNECTION_STATE_IDLE != state->state) {
     return;
   }
 
-  queued_link = state->first_queued_frame;
+  entry = amqp_get_channel_entry(state, channel);
+
+  if (entry != NULL && NULL == entry->first_queued_frame) {
+    unpin_channel_buffers(state, entry);
+    recycle_amqp_pool(&entry->pool);
+  }
+}
+
+int amqp_frame_to_bytes(const amqp_frame_t *frame, amqp_bytes_t buffer,
+                        amqp_bytes_t *encoded)
+{
+  void *out_frame = buffer.bytes;
+  size_t out_frame_len;
+  int res;
 
-  while (NULL != queued_link) {
-    amqp_frame_t *frame = queued_link->data;
-    if (channel == frame->channel) {
-      return;
+  if (buffer.len < HEADER_SIZE + FOOTER_SIZE) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+
+  amqp_e8(out_frame, 0, frame->frame_type);
+  amqp_e16(out_frame, 1, frame->channel);
+
+  switch (frame->frame_type) {
+  case AMQP_FRAME_METHOD: {
+    amqp_bytes_t method_encoded;
+
+    if (buffer.len < HEADER_SIZE + 4 + FOOTER_SIZE) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+
+    amqp_e32(out_frame, HEADER_SIZE, frame->payload.method.id);
+
+    method_encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 4);
+    method_encoded.len = buffer.len - HEADER_SIZE - 4 - FOOTER_SIZE;
+
+    res = amqp_encode_method(frame->payload.method.id,
+                             frame->payload.method.decoded, method_encoded);
+    if (res < 0) {
+      return res;
+    }
+
+    out_frame_len = res + 4;
+    break;
+  }
+
+  case AMQP_FRAME_HEADER: {
+    amqp_bytes_t properties_encoded;
+
+    if (buffer.len < HEADER_SIZE + 12 + FOOTER_SIZE) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+
+    amqp_e16(out_frame, HEADER_SIZE, frame->payload.properties.class_id);
+    amqp_e16(out_frame, HEADER_SIZE+2, 0); /* "weight" */
+    amqp_e64(out_frame, HEADER_SIZE+4, frame->payload.properties.body_size);
+
+    properties_encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 12);
+    properties_encoded.len = buffer.len - HEADER_SIZE - 12 - FOOTER_SIZE;
+
+    if (NULL == frame->payload.properties.decoded) {
+      /* Already encoded properties are sent as they are */
+      const amqp_bytes_t *raw = &frame->payload.properties.raw;
+
+      if (properties_encoded.len < raw->len) {
+        return AMQP_STATUS_BAD_AMQP_DATA;
+      }
+      memcpy(properties_encoded.bytes, raw->bytes, raw->len);
+      res = (int)raw->len;
+    } else {
+      res = amqp_encode_properties(frame->payload.properties.class_id,
+                                   frame->payload.properties.decoded,
+                                   properties_encoded);
+      if (res < 0) {
+        return res;
+      }
+    }
+
+    out_frame_len = res + 12;
+    break;
+  }
+
+  case AMQP_FRAME_BODY: {
+    const amqp_bytes_t *body = &frame->payload.body_fragment;
+
+    if (buffer.len - HEADER_SIZE - FOOTER_SIZE < body->len) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+
+    memcpy(amqp_offset(out_frame, HEADER_SIZE), body->bytes, body->len);
+
+    out_frame_len = body->len;
+    break;
+  }
+
+  case AMQP_FRAME_HEARTBEAT:
+    out_frame_len = 0;
+    break;
+
+  default:
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  amqp_e32(out_frame, 3, out_frame_len);
+  amqp_e8(out_frame, out_frame_len + HEADER_SIZE, AMQP_FRAME_END);
+
+  encoded->bytes = out_frame;
+  encoded->len = out_frame_len + HEADER_SIZE + FOOTER_SIZE;
+  return AMQP_STATUS_OK;
+}
+
+static int update_send_heartbeat(amqp_connection_state_t state)
+{
+  if (state->heartbeat > 0) {
+    state->next_send_heartbeat =
+      amqp_calc_next_send_heartbeat(state, state->heartbeat_timestamp);
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Makes room for len more bytes at the end of the pending output */
+static int reserve_pending_output(amqp_connection_state_t state, size_t len)
+{
+  size_t capacity;
+  void *newbuf;
+
+  if (state->pending_output_offset > 0) {
+    state->pending_output_len -= state->pending_output_offset;
+    memmove(state->pending_output.bytes,
+            amqp_offset(state->pending_output.bytes, state->pending_output_offset),
+            state->pending_output_len);
+    state->pending_output_offset = 0;
+  }
+
+  if (state->pending_output_len + len <= state->pending_output.len) {
+    return AMQP_STATUS_OK;
+  }
+
+  capacity = state->pending_output.len * 2;
+  if (capacity < state->pending_output_len + len) {
+    capacity = state->pending_output_len + len;
+  }
+
+  newbuf = amqp_realloc(&state->allocator, state->pending_output.bytes, capacity);
+  if (NULL == newbuf) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  state->pending_output.bytes = newbuf;
+  state->pending_output.len = capacity;
+  return AMQP_STATUS_OK;
+}
+
+int amqp_write_iov(amqp_connection_state_t state, struct iovec *iov, int iovcnt)
+{
+  size_t written = 0;
+  size_t total = 0;
+  int res;
+  int i;
+
+  if (!state->nonblocking) {
+    if (1 == iovcnt) {
+      return amqp_socket_send(state->socket, iov[0].iov_base, iov[0].iov_len);
     }
+    return amqp_socket_writev(state->socket, iov, iovcnt);
+  }
 
-    queued_link = queued_link->next;
+  /* Nothing may overtake output that is already waiting */
+  if (!amqp_output_pending(state)) {
+    ssize_t sent = amqp_socket_try_writev(state->socket, iov, iovcnt);
+    if (sent < 0) {
+      return (int)sent;
+    }
+    written = sent;
   }
 
-  pool = amqp_get_channel_pool(state, channel);
+  for (i = 0; i < iovcnt; ++i) {
+    total += iov[i].iov_len;
+  }
+  if (written == total) {
+    return AMQP_STATUS_OK;
+  }
+
+  res = reserve_pending_output(state, total - written);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
 
-  if (pool != NULL) {
-    recycle_amqp_pool(pool);
+  for (i = 0; i < iovcnt; ++i) {
+    size_t len = iov[i].iov_len;
+    char *bytes = iov[i].iov_base;
+
+    if (written >= len) {
+      written -= len;
+      continue;
+    }
+    bytes += written;
+    len -= written;
+    written = 0;
+
+    memcpy(amqp_offset(state->pending_output.bytes, state->pending_output_len),
+           bytes, len);
+    state->pending_output_len += len;
   }
+
+  return AMQP_STATUS_OK;
+}
+
+int amqp_flush_pending_output(amqp_connection_state_t state)
+{
+  while (amqp_output_pending(state)) {
+    struct iovec iov;
+    ssize_t sent;
+
+    iov.iov_base = amqp_offset(state->pending_output.bytes, state->pending_output_offset);
+    iov.iov_len = state->pending_output_len - state->pending_output_offset;
+
+    sent = amqp_socket_try_writev(state->socket, &iov, 1);
+    if (sent < 0) {
+      return (int)sent;
+    }
+    if (0 == sent) {
+      break;
+    }
+    state->pending_output_offset += sent;
+  }
+
+  if (!amqp_output_pending(state)) {
+    state->pending_output_offset = 0;
+    state->pending_output_len = 0;
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+int amqp_flush_outbound(amqp_connection_state_t state)
+{
+  struct iovec iov;
+  int res;
+
+  if (0 == state->outbound_offset) {
+    return AMQP_STATUS_OK;
+  }
+
+  iov.iov_base = state->outbound_buffer.bytes;
+  iov.iov_len = state->outbound_offset;
+  res = amqp_write_iov(state, &iov, 1);
+  state->outbound_offset = 0;
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  return update_send_heartbeat(state);
+}
+
+int amqp_append_frame(amqp_connection_state_t state, const amqp_frame_t *frame)
+{
+  amqp_bytes_t window;
+  amqp_bytes_t encoded;
+  int res;
+
+  while (1) {
+    /* frames are bounded by frame_max, even if the batch buffer is larger */
+    window.bytes = amqp_offset(state->outbound_buffer.bytes, state->outbound_offset);
+    window.len = state->outbound_buffer.len - state->outbound_offset;
+    if (window.len > (size_t)state->frame_max) {
+      window.len = state->frame_max;
+    }
+
+    res = amqp_frame_to_bytes(frame, window, &encoded);
+    if (AMQP_STATUS_OK == res) {
+      state->outbound_offset += encoded.len;
+      return AMQP_STATUS_OK;
+    }
+
+    if (0 == state->outbound_offset) {
+      return res;
+    }
+
+    /* No room left behind the pending frames, send them and retry */
+    res = amqp_flush_outbound(state);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+}
+
+int amqp_publish_batch_begin(amqp_connection_state_t state, size_t buffer_size)
+{
+  if (0 == buffer_size) {
+    buffer_size = DEFAULT_PUBLISH_BATCH_SIZE;
+  }
+
+  if (buffer_size > state->outbound_buffer.len) {
+    void *newbuf = amqp_realloc(&state->allocator, state->outbound_buffer.bytes,
+                                buffer_size);
+    if (NULL == newbuf) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    state->outbound_buffer.bytes = newbuf;
+    state->outbound_buffer.len = buffer_size;
+  }
+
+  state->publish_batch_active = 1;
+  return AMQP_STATUS_OK;
+}
+
+int amqp_publish_batch_flush(amqp_connection_state_t state)
+{
+  state->publish_batch_active = 0;
+  return amqp_flush_outbound(state);
 }
 
 int amqp_send_frame(amqp_connection_state_t state,
                     const amqp_frame_t *frame)
 {
-  void *out_frame = state->outbound_buffer.bytes;
   int res;
 
-  amqp_e8(out_frame, 0, frame->frame_type);
-  amqp_e16(out_frame, 1, frame->channel);
+  /* Anything still sitting in a publish batch goes out first so frames
+     stay in order */
+  res = amqp_flush_outbound(state);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
 
   if (frame->frame_type == AMQP_FRAME_BODY) {
     /* For a body frame, rather than copying data around, we use
        writev to compose the frame */
+    void *out_frame = state->outbound_buffer.bytes;
     struct iovec iov[3];
     uint8_t frame_end_byte = AMQP_FRAME_END;
     const amqp_bytes_t *body = &frame->payload.body_fragment;
 
+    amqp_e8(out_frame, 0, frame->frame_type);
+    amqp_e16(out_frame, 1, frame->channel);
     amqp_e32(out_frame, 3, body->len);
 
     iov[0].iov_base = out_frame;
@@ -454,65 +1083,110 @@ int amqp_send_frame(amqp_connection_state_t state,
     iov[2].iov_base = &frame_end_byte;
     iov[2].iov_len = FOOTER_SIZE;
 
-    res = amqp_socket_writev(state->socket, iov, 3);
+    res = amqp_write_iov(state, iov, 3);
   } else {
-    size_t out_frame_len;
     amqp_bytes_t encoded;
+    struct iovec iov;
 
-    switch (frame->frame_type) {
-    case AMQP_FRAME_METHOD:
-      amqp_e32(out_frame, HEADER_SIZE, frame->payload.method.id);
+    res = amqp_frame_to_bytes(frame, state->outbound_buffer, &encoded);
+    if (res < 0) {
+      return res;
+    }
 
-      encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 4);
-      encoded.len = state->outbound_buffer.len - HEADER_SIZE - 4 - FOOTER_SIZE;
+    iov.iov_base = encoded.bytes;
+    iov.iov_len = encoded.len;
+    res = amqp_write_iov(state, &iov, 1);
+  }
 
-      res = amqp_encode_method(frame->payload.method.id,
-                               frame->payload.method.decoded, encoded);
-      if (res < 0) {
-        return res;
-      }
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
 
-      out_frame_len = res + 4;
-      break;
+  return update_send_heartbeat(state);
+}
 
-    case AMQP_FRAME_HEADER:
-      amqp_e16(out_frame, HEADER_SIZE, frame->payload.properties.class_id);
-      amqp_e16(out_frame, HEADER_SIZE+2, 0); /* "weight" */
-      amqp_e64(out_frame, HEADER_SIZE+4, frame->payload.properties.body_size);
+/* Appends a run of bytes living in the outbound buffer to the vector,
+   growing the previous entry when the two are adjacent */
+static void append_scratch_iov(struct iovec *iov, int *iovcnt,
+                               void *bytes, size_t len)
+{
+  if (*iovcnt > 0
+      && (char *)iov[*iovcnt - 1].iov_base + iov[*iovcnt - 1].iov_len == bytes) {
+    iov[*iovcnt - 1].iov_len += len;
+  } else {
+    iov[*iovcnt].iov_base = bytes;
+    iov[*iovcnt].iov_len = len;
+    (*iovcnt)++;
+  }
+}
 
-      encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 12);
-      encoded.len = state->outbound_buffer.len - HEADER_SIZE - 12 - FOOTER_SIZE;
+int amqp_send_content(amqp_connection_state_t state, amqp_bytes_t encoded,
+                      amqp_channel_t channel, amqp_bytes_t body)
+{
+  struct iovec iov[AMQP_SEND_CONTENT_IOVECS];
+  int iovcnt = 0;
+  char *scratch = state->outbound_buffer.bytes;
+  size_t scratch_used = 0;
+  size_t usable_body_payload_size = state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
+  size_t body_offset = 0;
+  int res;
 
-      res = amqp_encode_properties(frame->payload.properties.class_id,
-                                   frame->payload.properties.decoded, encoded);
-      if (res < 0) {
+  /* Frame headers and footers for the body frames are written to the
+     outbound buffer, following the already encoded frames if they live
+     there too */
+  if (encoded.bytes == state->outbound_buffer.bytes) {
+    scratch_used = encoded.len;
+  }
+
+  if (encoded.len > 0) {
+    iov[0].iov_base = encoded.bytes;
+    iov[0].iov_len = encoded.len;
+    iovcnt = 1;
+  }
+
+  while (body_offset < body.len) {
+    size_t fragment_len = body.len - body_offset;
+    void *frame_header;
+
+    if (fragment_len > usable_body_payload_size) {
+      fragment_len = usable_body_payload_size;
+    }
+
+    /* a body frame takes at most three vector entries */
+    if (iovcnt + 3 > AMQP_SEND_CONTENT_IOVECS
+        || scratch_used + HEADER_SIZE + FOOTER_SIZE > state->outbound_buffer.len) {
+      res = amqp_write_iov(state, iov, iovcnt);
+      if (AMQP_STATUS_OK != res) {
         return res;
       }
+      iovcnt = 0;
+      scratch_used = 0;
+    }
 
-      out_frame_len = res + 12;
-      break;
+    frame_header = scratch + scratch_used;
+    amqp_e8(frame_header, 0, AMQP_FRAME_BODY);
+    amqp_e16(frame_header, 1, channel);
+    amqp_e32(frame_header, 3, fragment_len);
+    append_scratch_iov(iov, &iovcnt, frame_header, HEADER_SIZE);
+    scratch_used += HEADER_SIZE;
 
-    case AMQP_FRAME_HEARTBEAT:
-      out_frame_len = 0;
-      break;
+    iov[iovcnt].iov_base = amqp_offset(body.bytes, body_offset);
+    iov[iovcnt].iov_len = fragment_len;
+    iovcnt++;
 
-    default:
-      return AMQP_STATUS_INVALID_PARAMETER;
-    }
+    amqp_e8(scratch, scratch_used, AMQP_FRAME_END);
+    append_scratch_iov(iov, &iovcnt, scratch + scratch_used, FOOTER_SIZE);
+    scratch_used += FOOTER_SIZE;
 
-    amqp_e32(out_frame, 3, out_frame_len);
-    amqp_e8(out_frame, out_frame_len + HEADER_SIZE, AMQP_FRAME_END);
-    res = amqp_socket_send(state->socket, out_frame,
-                           out_frame_len + HEADER_SIZE + FOOTER_SIZE);
+    body_offset += fragment_len;
   }
 
-  if (state->heartbeat > 0) {
-    uint64_t current_time = amqp_get_monotonic_timestamp();
-    if (0 == current_time) {
-      return AMQP_STATUS_TIMER_FAILURE;
+  if (iovcnt > 0) {
+    res = amqp_write_iov(state, iov, iovcnt);
+    if (AMQP_STATUS_OK != res) {
+      return res;
     }
-    state->next_send_heartbeat = amqp_calc_next_send_heartbeat(state, current_time);
   }
 
-  return res;
+  return update_send_heartbeat(state);
 }
@@ -0,0 +1,458 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_connection_pool.h"
+#include "amqp_private.h"
+#include "amqp_tcp_socket.h"
+#include "amqp_timer.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* amqp_connection_pool_publish() has a channel of its own on every
+   connection, amqp_connection_pool_acquire() hands out the ones after it */
+#define PUBLISH_CHANNEL 1
+
+typedef struct amqp_pool_shard_t_ {
+  pthread_mutex_t mutex;
+  /* NULL until first used, and after failing */
+  amqp_connection_state_t state;
+  /* which channels have been opened on state, indexed by channel - 1 */
+  amqp_boolean_t *open_channels;
+} amqp_pool_shard_t;
+
+struct amqp_connection_pool_t_ {
+  amqp_allocator_t allocator;
+  char *host;
+  int port;
+  char *vhost;
+  char *user;
+  char *password;
+  int frame_max;
+  int heartbeat;
+
+  /* handed out by amqp_connection_pool_acquire() */
+  int channels;
+  int shard_count;
+  amqp_pool_shard_t *shards;
+  /* where amqp_connection_pool_publish() starts looking, only accessed
+     atomically */
+  unsigned int next_shard;
+};
+
+static char *copy_string(amqp_allocator_t const *allocator, char const *s)
+{
+  size_t len = strlen(s) + 1;
+  char *copy = amqp_malloc(allocator, len);
+  if (copy != NULL) {
+    memcpy(copy, s, len);
+  }
+  return copy;
+}
+
+static int reply_status(amqp_rpc_reply_t reply)
+{
+  switch (reply.reply_type) {
+  case AMQP_RESPONSE_NORMAL:
+    return AMQP_STATUS_OK;
+  case AMQP_RESPONSE_LIBRARY_EXCEPTION:
+    return reply.library_error;
+  default:
+    /* the broker closed the channel or connection */
+    return AMQP_STATUS_CONNECTION_CLOSED;
+  }
+}
+
+/* Errors caused by the message rather than the connection, which would fail
+   the same way on every connection */
+static int is_message_error(int status)
+{
+  return AMQP_STATUS_TABLE_TOO_BIG == status ||
+         AMQP_STATUS_INVALID_PARAMETER == status ||
+         AMQP_STATUS_BAD_AMQP_DATA == status;
+}
+
+static int open_connection(amqp_connection_pool_t *pool,
+                           amqp_pool_shard_t *shard)
+{
+  amqp_connection_state_t state;
+  amqp_socket_t *socket;
+  int status;
+
+  state = amqp_new_connection_with_allocator(&pool->allocator);
+  if (NULL == state) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  socket = amqp_tcp_socket_new(state);
+  if (NULL == socket) {
+    status = AMQP_STATUS_NO_MEMORY;
+    goto error;
+  }
+
+  status = amqp_socket_open(socket, pool->host, pool->port);
+  if (AMQP_STATUS_OK != status) {
+    goto error;
+  }
+
+  status = reply_status(amqp_login(state, pool->vhost, 0, pool->frame_max,
+                                   pool->heartbeat, AMQP_SASL_METHOD_PLAIN,
+                                   pool->user, pool->password));
+  if (AMQP_STATUS_OK != status) {
+    goto error;
+  }
+
+  shard->state = state;
+  memset(shard->open_channels, 0,
+         (pool->channels + 1) * sizeof(*shard->open_channels));
+  return AMQP_STATUS_OK;
+
+error:
+  amqp_destroy_connection(state);
+  return status;
+}
+
+/* A failed connection is dropped without the closing handshake, which could
+   block on a broken socket */
+static void drop_connection(amqp_pool_shard_t *shard)
+{
+  if (shard->state != NULL) {
+    amqp_destroy_connection(shard->state);
+    shard->state = NULL;
+  }
+}
+
+/* Called with the shard locked: makes sure it has a connection, with channel
+   open. A connection that has been idle may have died unnoticed, so if opening
+   the channel on it fails it is replaced once. */
+static int prepare_channel(amqp_connection_pool_t *pool,
+                           amqp_pool_shard_t *shard,
+                           amqp_channel_t channel)
+{
+  amqp_boolean_t reconnected = 0;
+  int status;
+
+  for (;;) {
+    if (NULL == shard->state) {
+      status = open_connection(pool, shard);
+      if (AMQP_STATUS_OK != status) {
+        return status;
+      }
+      reconnected = 1;
+    }
+
+    if (shard->open_channels[channel - 1]) {
+      return AMQP_STATUS_OK;
+    }
+
+    if (amqp_channel_open(shard->state, channel) != NULL) {
+      shard->open_channels[channel - 1] = 1;
+      return AMQP_STATUS_OK;
+    }
+
+    status = reply_status(amqp_get_rpc_reply(shard->state));
+    drop_connection(shard);
+    if (reconnected) {
+      return status;
+    }
+  }
+}
+
+/* Takes the next frame queued for channel without reading the socket */
+static amqp_boolean_t take_queued_frame(amqp_connection_state_t state,
+                                        amqp_channel_t channel,
+                                        amqp_frame_t *frame)
+{
+  amqp_pool_table_entry_t *entry = amqp_get_channel_entry(state, channel);
+
+  if (NULL == entry || NULL == entry->first_queued_frame) {
+    return 0;
+  }
+  return AMQP_STATUS_OK == amqp_simple_wait_frame_on_channel(state, channel,
+                                                             frame);
+}
+
+/* Called with the shard locked: handles, without blocking, what the broker
+   has sent on the connection and on the publish channel, which nobody else
+   reads. If the broker closed the publish channel the close is answered and
+   the channel reopened the next time it is used. If it closed the
+   connection, or reading failed, the connection is dropped. */
+static int check_publish_channel(amqp_pool_shard_t *shard)
+{
+  amqp_connection_state_t state = shard->state;
+  uint64_t current_timestamp = amqp_get_coarse_timestamp();
+  amqp_frame_t frame;
+  int status = AMQP_STATUS_OK;
+  int res;
+
+  if (0 == current_timestamp) {
+    return AMQP_STATUS_TIMER_FAILURE;
+  }
+
+  res = amqp_try_recv(state, current_timestamp);
+  if (AMQP_STATUS_TIMEOUT == res || AMQP_STATUS_MEMORY_LIMIT == res) {
+    res = AMQP_STATUS_OK;
+  }
+  if (AMQP_STATUS_OK == res) {
+    res = amqp_queue_buffered_frames(state);
+  }
+  if (AMQP_STATUS_OK != res) {
+    drop_connection(shard);
+    return res;
+  }
+
+  while (take_queued_frame(state, 0, &frame)) {
+    if (AMQP_FRAME_METHOD == frame.frame_type &&
+        AMQP_CONNECTION_CLOSE_METHOD == frame.payload.method.id) {
+      amqp_connection_close_ok_t close_ok;
+      amqp_send_method(state, 0, AMQP_CONNECTION_CLOSE_OK_METHOD, &close_ok);
+      drop_connection(shard);
+      return AMQP_STATUS_CONNECTION_CLOSED;
+    }
+  }
+  amqp_maybe_release_buffers_on_channel(state, 0);
+
+  /* Anything else on the publish channel, such as returned messages, is
+     dropped */
+  while (take_queued_frame(state, PUBLISH_CHANNEL, &frame)) {
+    if (AMQP_FRAME_METHOD == frame.frame_type &&
+        AMQP_CHANNEL_CLOSE_METHOD == frame.payload.method.id) {
+      amqp_channel_close_ok_t close_ok;
+      res = amqp_send_method(state, PUBLISH_CHANNEL,
+                             AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok);
+      if (AMQP_STATUS_OK != res) {
+        drop_connection(shard);
+        return res;
+      }
+      shard->open_channels[PUBLISH_CHANNEL - 1] = 0;
+      status = AMQP_STATUS_CONNECTION_CLOSED;
+    }
+  }
+  amqp_maybe_release_buffers_on_channel(state, PUBLISH_CHANNEL);
+
+  return status;
+}
+
+amqp_connection_pool_t *amqp_connection_pool_new(
+    struct amqp_connection_info const *info, int connections, int channels,
+    int frame_max, int heartbeat)
+{
+  amqp_connection_pool_t *pool;
+  amqp_allocator_t const *allocator = amqp_get_default_allocator();
+
+  if (info->ssl || channels <= 0 || channels >= UINT16_MAX ||
+      connections < 0) {
+    return NULL;
+  }
+
+  if (0 == connections) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    connections = cpus > 0 ? (int)cpus : 1;
+  }
+
+  pool = amqp_calloc(allocator, 1, sizeof(*pool));
+  if (NULL == pool) {
+    return NULL;
+  }
+  pool->allocator = *allocator;
+  pool->port = info->port;
+  pool->frame_max = frame_max;
+  pool->heartbeat = heartbeat;
+  pool->channels = channels;
+
+  pool->host = copy_string(allocator, info->host);
+  pool->vhost = copy_string(allocator, info->vhost);
+  pool->user = copy_string(allocator, info->user);
+  pool->password = copy_string(allocator, info->password);
+  pool->shards = amqp_calloc(allocator, connections, sizeof(*pool->shards));
+  if (NULL == pool->host || NULL == pool->vhost || NULL == pool->user ||
+      NULL == pool->password || NULL == pool->shards) {
+    goto error;
+  }
+
+  for (; pool->shard_count < connections; pool->shard_count++) {
+    amqp_pool_shard_t *shard = &pool->shards[pool->shard_count];
+
+    shard->open_channels = amqp_calloc(allocator, channels + 1,
+                                       sizeof(*shard->open_channels));
+    if (NULL == shard->open_channels) {
+      goto error;
+    }
+    if (pthread_mutex_init(&shard->mutex, NULL)) {
+      amqp_free(allocator, shard->open_channels);
+      goto error;
+    }
+  }
+
+  return pool;
+
+error:
+  amqp_connection_pool_destroy(pool);
+  return NULL;
+}
+
+void amqp_connection_pool_destroy(amqp_connection_pool_t *pool)
+{
+  int i;
+
+  if (NULL == pool) {
+    return;
+  }
+
+  for (i = 0; i < pool->shard_count; i++) {
+    amqp_pool_shard_t *shard = &pool->shards[i];
+
+    if (shard->state != NULL) {
+      amqp_connection_close(shard->state, AMQP_REPLY_SUCCESS);
+      drop_connection(shard);
+    }
+    pthread_mutex_destroy(&shard->mutex);
+    amqp_free(&pool->allocator, shard->open_channels);
+  }
+
+  amqp_free(&pool->allocator, pool->shards);
+  amqp_free(&pool->allocator, pool->host);
+  amqp_free(&pool->allocator, pool->vhost);
+  amqp_free(&pool->allocator, pool->user);
+  amqp_free(&pool->allocator, pool->password);
+  amqp_free(&pool->allocator, pool);
+}
+
+int amqp_connection_pool_size(amqp_connection_pool_t const *pool)
+{
+  return pool->shard_count;
+}
+
+int amqp_connection_pool_acquire(amqp_connection_pool_t *pool,
+                                 unsigned int affinity,
+                                 amqp_pooled_channel_t *channel)
+{
+  int shard_index = (int)(affinity % (unsigned int)pool->shard_count);
+  amqp_pool_shard_t *shard = &pool->shards[shard_index];
+  amqp_channel_t channel_number = PUBLISH_CHANNEL + 1 +
+      (affinity / pool->shard_count) % (unsigned int)pool->channels;
+  int status;
+
+  pthread_mutex_lock(&shard->mutex);
+
+  status = prepare_channel(pool, shard, channel_number);
+  if (AMQP_STATUS_OK != status) {
+    pthread_mutex_unlock(&shard->mutex);
+    return status;
+  }
+
+  channel->state = shard->state;
+  channel->channel = channel_number;
+  channel->shard = shard_index;
+  return AMQP_STATUS_OK;
+}
+
+void amqp_connection_pool_release(amqp_connection_pool_t *pool,
+                                  amqp_pooled_channel_t *channel,
+                                  amqp_boolean_t failed)
+{
+  amqp_pool_shard_t *shard = &pool->shards[channel->shard];
+
+  if (failed) {
+    drop_connection(shard);
+  }
+  channel->state = NULL;
+
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+int amqp_connection_pool_publish(amqp_connection_pool_t *pool,
+                                 amqp_bytes_t exchange,
+                                 amqp_bytes_t routing_key,
+                                 amqp_boolean_t mandatory,
+                                 amqp_boolean_t immediate,
+                                 amqp_basic_properties_t const *properties,
+                                 amqp_bytes_t body)
+{
+  unsigned int start = __atomic_fetch_add(&pool->next_shard, 1,
+                                          __ATOMIC_RELAXED);
+  int failures = 0;
+  int status = AMQP_STATUS_OK;
+  amqp_boolean_t channel_closed;
+  int i;
+
+  /* First try the connections nobody else is using, then wait for them in
+     turn */
+  for (i = 0; i < 2 * pool->shard_count; i++) {
+    amqp_pool_shard_t *shard =
+        &pool->shards[(start + i) % (unsigned int)pool->shard_count];
+
+    if (i < pool->shard_count) {
+      if (pthread_mutex_trylock(&shard->mutex)) {
+        continue;
+      }
+    } else {
+      pthread_mutex_lock(&shard->mutex);
+    }
+
+    /* A channel or connection the broker has closed since the last publish
+       is replaced rather than published to */
+    if (NULL != shard->state) {
+      check_publish_channel(shard);
+    }
+
+    status = prepare_channel(pool, shard, PUBLISH_CHANNEL);
+    if (AMQP_STATUS_OK == status) {
+      status = amqp_basic_publish(shard->state, PUBLISH_CHANNEL, exchange,
+                                  routing_key, mandatory, immediate,
+                                  properties, body);
+      if (AMQP_STATUS_OK == status) {
+        status = check_publish_channel(shard);
+      } else {
+        drop_connection(shard);
+      }
+    }
+
+    /* The broker closing just the publish channel may well be down to this
+       message, so it isn't tried again elsewhere */
+    channel_closed = (AMQP_STATUS_CONNECTION_CLOSED == status &&
+                      NULL != shard->state);
+
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (AMQP_STATUS_OK == status || is_message_error(status) ||
+        channel_closed || ++failures == pool->shard_count) {
+      break;
+    }
+  }
+
+  return status;
+}
@@ -0,0 +1,181 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+/**
+ * A pool of connections to one broker shared between threads.
+ */
+
+#ifndef AMQP_CONNECTION_POOL_H
+#define AMQP_CONNECTION_POOL_H
+
+#include <amqp.h>
+
+AMQP_BEGIN_DECLS
+
+typedef struct amqp_connection_pool_t_ amqp_connection_pool_t;
+
+/**
+ * A channel on one of a pool's connections, handed out by
+ * amqp_connection_pool_acquire()
+ */
+typedef struct amqp_pooled_channel_t_ {
+  amqp_connection_state_t state; /**< the connection, owned by the pool */
+  amqp_channel_t channel;        /**< an open channel on state */
+  int shard;                     /**< private to the pool */
+} amqp_pooled_channel_t;
+
+/**
+ * Creates a pool of connections
+ *
+ * Each connection is a shard of the pool with its own lock, so threads using
+ * different connections never contend. Connections are opened, logged in to
+ * with the PLAIN mechanism, and have their channels opened lazily, on first
+ * use; one that fails is closed and replaced the next time it is used.
+ *
+ * Pooled connections are only read from while in use, so heartbeats should
+ * be left disabled or set well above the time a connection may sit idle.
+ *
+ * \param [in] info the broker to connect to, copied. SSL isn't supported.
+ * \param [in] connections the number of connections, 0 to open one per
+ *             online processor
+ * \param [in] channels the number of channels handed out on each
+ *             connection, numbered from 2. Channel 1 is kept for
+ *             amqp_connection_pool_publish().
+ * \param [in] frame_max the maximum frame size, see amqp_login()
+ * \param [in] heartbeat the heartbeat interval, see amqp_login()
+ * \returns the pool, or NULL on failure
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_connection_pool_t *
+AMQP_CALL amqp_connection_pool_new(struct amqp_connection_info const *info,
+                                   int connections, int channels,
+                                   int frame_max, int heartbeat);
+
+/**
+ * Closes all the pool's connections and frees it
+ *
+ * No channel may still be acquired.
+ *
+ * \param [in] pool the pool
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_connection_pool_destroy(amqp_connection_pool_t *pool);
+
+/**
+ * Returns the number of connections in a pool
+ *
+ * \param [in] pool the pool
+ * \returns the number of connections
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_connection_pool_size(amqp_connection_pool_t const *pool);
+
+/**
+ * Acquires a channel for the exclusive use of the calling thread
+ *
+ * Callers passing the same affinity always get the same connection and
+ * channel, so their messages stay in order; spreading it, for instance by
+ * passing the processor or thread number, spreads them over the pool.
+ *
+ * The connection is locked exclusively while the channel is held, until
+ * amqp_connection_pool_release(): other callers whose affinity maps to it
+ * block, even for a different channel, and amqp_connection_pool_publish()
+ * doesn't use it. Hold channels only briefly.
+ *
+ * A connection that has failed is replaced first. Anything done on the channel
+ * (consumers, QoS, confirm mode, ...) is lost when that happens.
+ *
+ * \param [in] pool the pool
+ * \param [in] affinity chooses the connection and channel
+ * \param [out] channel the acquired channel
+ * \returns AMQP_STATUS_OK on success, an amqp_status_enum value if the
+ *          connection couldn't be opened
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_connection_pool_acquire(amqp_connection_pool_t *pool,
+                                       unsigned int affinity,
+                                       amqp_pooled_channel_t *channel);
+
+/**
+ * Gives back a channel acquired with amqp_connection_pool_acquire()
+ *
+ * \param [in] pool the pool
+ * \param [in] channel the channel
+ * \param [in] failed true if something failed on the connection. It is then
+ *             closed and replaced the next time it is used.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_connection_pool_release(amqp_connection_pool_t *pool,
+                                       amqp_pooled_channel_t *channel,
+                                       amqp_boolean_t failed);
+
+/**
+ * Publishes a message on whichever connection is free
+ *
+ * Connections are tried round robin, skipping those in use by other threads
+ * and waiting only if all of them are. The message is published on channel 1
+ * of the connection, which amqp_connection_pool_acquire() never hands out.
+ * If publishing fails the connection is replaced and the next one tried,
+ * until every connection has failed.
+ *
+ * Before and after publishing, whatever the broker has already sent on the
+ * connection is read without blocking. If the broker closed channel 1, for
+ * instance because a message went to an exchange that doesn't exist, the
+ * close is answered, the channel is reopened on next use and
+ * AMQP_STATUS_CONNECTION_CLOSED returned without trying other connections.
+ * A connection the broker closed is replaced.
+ *
+ * As with amqp_basic_publish(), success only means the message was handed
+ * to the socket: messages sent shortly before the broker closes the channel
+ * or the connection can still be lost. Messages published this way may be
+ * reordered.
+ *
+ * See amqp_basic_publish() for the meaning of the message parameters.
+ *
+ * \param [in] pool the pool
+ * \returns AMQP_STATUS_OK on success, the last error otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_connection_pool_publish(amqp_connection_pool_t *pool,
+                                       amqp_bytes_t exchange,
+                                       amqp_bytes_t routing_key,
+                                       amqp_boolean_t mandatory,
+                                       amqp_boolean_t immediate,
+                                       struct amqp_basic_properties_t_ const *properties,
+                                       amqp_bytes_t body);
+
+AMQP_END_DECLS
+
+#endif /* AMQP_CONNECTION_POOL_H */
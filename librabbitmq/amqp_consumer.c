@@ -31,10 +31,165 @@
 #include "amqp_private.h"
 #include "amqp_socket.h"
 
+#include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
-static
+/* Initial size of the fragment list of amqp_read_message_ref() */
+#define INITIAL_FRAGMENTS_CAPACITY 4
+
+enum basic_property_type {
+  BASIC_PROPERTY_SHORTSTR,
+  BASIC_PROPERTY_TABLE,
+  BASIC_PROPERTY_OCTET,
+  BASIC_PROPERTY_TIMESTAMP
+};
+
+/* The basic class properties in the order they are encoded */
+static const struct {
+  amqp_flags_t flag;
+  enum basic_property_type type;
+  size_t offset;
+} basic_properties[] = {
+#define BASIC_PROPERTY(flag, type, field) \
+  { flag, type, offsetof(amqp_basic_properties_t, field) }
+  BASIC_PROPERTY(AMQP_BASIC_CONTENT_TYPE_FLAG, BASIC_PROPERTY_SHORTSTR, content_type),
+  BASIC_PROPERTY(AMQP_BASIC_CONTENT_ENCODING_FLAG, BASIC_PROPERTY_SHORTSTR, content_encoding),
+  BASIC_PROPERTY(AMQP_BASIC_HEADERS_FLAG, BASIC_PROPERTY_TABLE, headers),
+  BASIC_PROPERTY(AMQP_BASIC_DELIVERY_MODE_FLAG, BASIC_PROPERTY_OCTET, delivery_mode),
+  BASIC_PROPERTY(AMQP_BASIC_PRIORITY_FLAG, BASIC_PROPERTY_OCTET, priority),
+  BASIC_PROPERTY(AMQP_BASIC_CORRELATION_ID_FLAG, BASIC_PROPERTY_SHORTSTR, correlation_id),
+  BASIC_PROPERTY(AMQP_BASIC_REPLY_TO_FLAG, BASIC_PROPERTY_SHORTSTR, reply_to),
+  BASIC_PROPERTY(AMQP_BASIC_EXPIRATION_FLAG, BASIC_PROPERTY_SHORTSTR, expiration),
+  BASIC_PROPERTY(AMQP_BASIC_MESSAGE_ID_FLAG, BASIC_PROPERTY_SHORTSTR, message_id),
+  BASIC_PROPERTY(AMQP_BASIC_TIMESTAMP_FLAG, BASIC_PROPERTY_TIMESTAMP, timestamp),
+  BASIC_PROPERTY(AMQP_BASIC_TYPE_FLAG, BASIC_PROPERTY_SHORTSTR, type),
+  BASIC_PROPERTY(AMQP_BASIC_USER_ID_FLAG, BASIC_PROPERTY_SHORTSTR, user_id),
+  BASIC_PROPERTY(AMQP_BASIC_APP_ID_FLAG, BASIC_PROPERTY_SHORTSTR, app_id),
+  BASIC_PROPERTY(AMQP_BASIC_CLUSTER_ID_FLAG, BASIC_PROPERTY_SHORTSTR, cluster_id)
+#undef BASIC_PROPERTY
+};
+
+int amqp_decode_basic_properties(amqp_bytes_t raw, amqp_flags_t fields,
+                                 amqp_pool_t *pool,
+                                 amqp_basic_properties_t *properties)
+{
+  size_t offset = 0;
+  amqp_flags_t flags = 0;
+  amqp_flags_t remaining;
+  int flagword_index = 0;
+  uint16_t partial_flags;
+  size_t i;
+
+  do {
+    if (!amqp_decode_16(raw, &offset, &partial_flags)) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+    flags |= (partial_flags << (flagword_index * 16));
+    flagword_index++;
+  } while (partial_flags & 1);
+
+  properties->_flags = flags;
+
+  remaining = flags & fields;
+  if ((remaining & AMQP_BASIC_HEADERS_FLAG) && NULL == pool) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  /* Fields before the last one wanted are skipped, those after it aren't
+     looked at */
+  for (i = 0; 0 != remaining &&
+       i < sizeof(basic_properties) / sizeof(basic_properties[0]); i++) {
+    void *field = (char *)properties + basic_properties[i].offset;
+    amqp_boolean_t wanted = 0 != (remaining & basic_properties[i].flag);
+
+    if (!(flags & basic_properties[i].flag)) {
+      continue;
+    }
+    remaining &= ~basic_properties[i].flag;
+
+    switch (basic_properties[i].type) {
+    case BASIC_PROPERTY_SHORTSTR: {
+      uint8_t len;
+      amqp_bytes_t value;
+      if (!amqp_decode_8(raw, &offset, &len)
+          || !amqp_decode_bytes(raw, &offset, &value, len)) {
+        return AMQP_STATUS_BAD_AMQP_DATA;
+      }
+      if (wanted) {
+        *(amqp_bytes_t *)field = value;
+      }
+      break;
+    }
+
+    case BASIC_PROPERTY_TABLE:
+      if (wanted) {
+        int res = amqp_decode_table(raw, pool, (amqp_table_t *)field, &offset);
+        if (res < 0) {
+          return res;
+        }
+      } else {
+        uint32_t len;
+        amqp_bytes_t value;
+        if (!amqp_decode_32(raw, &offset, &len)
+            || !amqp_decode_bytes(raw, &offset, &value, len)) {
+          return AMQP_STATUS_BAD_AMQP_DATA;
+        }
+      }
+      break;
+
+    case BASIC_PROPERTY_OCTET: {
+      uint8_t value;
+      if (!amqp_decode_8(raw, &offset, &value)) {
+        return AMQP_STATUS_BAD_AMQP_DATA;
+      }
+      if (wanted) {
+        *(uint8_t *)field = value;
+      }
+      break;
+    }
+
+    case BASIC_PROPERTY_TIMESTAMP: {
+      uint64_t value;
+      if (!amqp_decode_64(raw, &offset, &value)) {
+        return AMQP_STATUS_BAD_AMQP_DATA;
+      }
+      if (wanted) {
+        *(uint64_t *)field = value;
+      }
+      break;
+    }
+    }
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+/* Decodes the headers table a connection with lazy properties left out of a
+   basic content header, into the pool of the frame's channel */
+static int decode_lazy_headers(amqp_connection_state_t state,
+                               amqp_frame_t *frame)
+{
+  amqp_basic_properties_t *properties = frame->payload.properties.decoded;
+  amqp_pool_t *channel_pool;
+
+  if (AMQP_BASIC_CLASS != frame->payload.properties.class_id ||
+      !(properties->_flags & AMQP_BASIC_HEADERS_FLAG) ||
+      0 != properties->headers.num_entries) {
+    return AMQP_STATUS_OK;
+  }
+
+  channel_pool = amqp_get_channel_pool(state, frame->channel);
+  if (NULL == channel_pool) {
+    return AMQP_STATUS_UNEXPECTED_STATE;
+  }
+
+  return amqp_decode_basic_properties(frame->payload.properties.raw,
+                                      AMQP_BASIC_HEADERS_FLAG, channel_pool,
+                                      properties);
+}
+
 int amqp_basic_properties_clone(amqp_basic_properties_t *original,
                                 amqp_basic_properties_t *clone,
                                 amqp_pool_t *pool)
@@ -46,7 +201,7 @@ int amqp_basic_properties_clone(amqp_basic_properties_t *original,
   if (0 == original.len) {                              \
     clone = amqp_empty_bytes;                           \
   } else {                                              \
-    amqp_pool_alloc_bytes(pool, original.len, &clone);  \
+    amqp_pool_alloc_bytes_uninit(pool, original.len, &clone); \
     if (NULL == clone.bytes) {                          \
       return AMQP_STATUS_NO_MEMORY;                     \
     }                                                   \
@@ -120,29 +275,94 @@ int amqp_basic_properties_clone(amqp_basic_properties_t *original,
 void amqp_destroy_message(amqp_message_t *message)
 {
   empty_amqp_pool(&message->pool);
-  amqp_bytes_free(message->body);
+  if (!message->pooled) {
+    amqp_free(&message->pool.allocator, message->body.bytes);
+  }
+  message->pooled = 0;
 }
 
 void amqp_destroy_envelope(amqp_envelope_t *envelope)
 {
+  if (!envelope->message.pooled) {
+    /* allocated with the same allocator as the message */
+    amqp_allocator_t const *allocator = &envelope->message.pool.allocator;
+    amqp_free(allocator, envelope->routing_key.bytes);
+    amqp_free(allocator, envelope->exchange.bytes);
+    amqp_free(allocator, envelope->consumer_tag.bytes);
+  }
   amqp_destroy_message(&envelope->message);
-  amqp_bytes_free(envelope->routing_key);
-  amqp_bytes_free(envelope->exchange);
-  amqp_bytes_free(envelope->consumer_tag);
 }
 
+/* Readies a message for AMQP_MESSAGE_POOLED reads: the first time its pool
+   is set up, after that whatever the previous message used is recycled */
+static void prepare_pooled_message(amqp_connection_state_t state,
+                                   amqp_message_t *message)
+{
+  if (message->pooled) {
+    recycle_amqp_pool(&message->pool);
+  } else {
+    /* Pages of frame_max bytes fit most messages in one page */
+    init_amqp_pool_with_allocator(&message->pool, state->frame_max,
+                                  &state->allocator);
+    message->pooled = 1;
+  }
+}
+
+static amqp_bytes_t envelope_bytes_dup(amqp_connection_state_t state,
+                                       amqp_bytes_t src, amqp_pool_t *pool)
+{
+  amqp_bytes_t result;
+
+  if (NULL == pool) {
+    result.len = src.len;
+    result.bytes = amqp_malloc(&state->allocator, src.len);
+    if (NULL != result.bytes) {
+      memcpy(result.bytes, src.bytes, src.len);
+    }
+    return result;
+  }
+
+  if (0 == src.len) {
+    /* amqp_empty_bytes has a NULL pointer, which would read as failure */
+    result.len = 0;
+    result.bytes = (void *)"";
+    return result;
+  }
+
+  amqp_pool_alloc_bytes_uninit(pool, src.len, &result);
+  if (NULL != result.bytes) {
+    memcpy(result.bytes, src.bytes, src.len);
+  }
+  return result;
+}
+
+static amqp_rpc_reply_t read_message(amqp_connection_state_t state,
+                                     amqp_channel_t channel,
+                                     amqp_message_t *message);
+
 
 amqp_rpc_reply_t
 amqp_consume_message(amqp_connection_state_t state, amqp_envelope_t *envelope,
-                     struct timeval *timeout, AMQP_UNUSED int flags)
+                     struct timeval *timeout, int flags)
 {
   int res;
   amqp_frame_t frame;
   amqp_basic_deliver_t *delivery_method;
   amqp_rpc_reply_t ret;
+  amqp_pool_t *pool = NULL;
 
   memset(&ret, 0, sizeof(amqp_rpc_reply_t));
-  memset(envelope, 0, sizeof(amqp_envelope_t));
+
+  if (flags & AMQP_MESSAGE_POOLED) {
+    amqp_message_t message = envelope->message;
+    memset(envelope, 0, sizeof(amqp_envelope_t));
+    envelope->message = message;
+
+    prepare_pooled_message(state, &envelope->message);
+    pool = &envelope->message.pool;
+  } else {
+    memset(envelope, 0, sizeof(amqp_envelope_t));
+  }
 
   res = amqp_simple_wait_frame_noblock(state, &frame, timeout);
   if (AMQP_STATUS_OK != res) {
@@ -162,11 +382,11 @@ amqp_consume_message(amqp_connection_state_t state, amqp_envelope_t *envelope,
   delivery_method = frame.payload.method.decoded;
 
   envelope->channel = frame.channel;
-  envelope->consumer_tag = amqp_bytes_malloc_dup(delivery_method->consumer_tag);
+  envelope->consumer_tag = envelope_bytes_dup(state, delivery_method->consumer_tag, pool);
   envelope->delivery_tag = delivery_method->delivery_tag;
   envelope->redelivered = delivery_method->redelivered;
-  envelope->exchange = amqp_bytes_malloc_dup(delivery_method->exchange);
-  envelope->routing_key = amqp_bytes_malloc_dup(delivery_method->routing_key);
+  envelope->exchange = envelope_bytes_dup(state, delivery_method->exchange, pool);
+  envelope->routing_key = envelope_bytes_dup(state, delivery_method->routing_key, pool);
 
   if (NULL == envelope->consumer_tag.bytes ||
       NULL == envelope->exchange.bytes ||
@@ -176,7 +396,11 @@ amqp_consume_message(amqp_connection_state_t state, amqp_envelope_t *envelope,
     goto error_out2;
   }
 
-  ret = amqp_read_message(state, envelope->channel, &envelope->message, 0);
+  if (NULL == pool) {
+    memset(&envelope->message, 0, sizeof(amqp_message_t));
+  }
+
+  ret = read_message(state, envelope->channel, &envelope->message);
   if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
     goto error_out2;
   }
@@ -185,9 +409,11 @@ amqp_consume_message(amqp_connection_state_t state, amqp_envelope_t *envelope,
   return ret;
 
 error_out2:
-  amqp_bytes_free(envelope->routing_key);
-  amqp_bytes_free(envelope->exchange);
-  amqp_bytes_free(envelope->consumer_tag);
+  if (NULL == pool) {
+    amqp_free(&state->allocator, envelope->routing_key.bytes);
+    amqp_free(&state->allocator, envelope->exchange.bytes);
+    amqp_free(&state->allocator, envelope->consumer_tag.bytes);
+  }
 error_out1:
   return ret;
 }
@@ -195,7 +421,24 @@ error_out1:
 amqp_rpc_reply_t amqp_read_message(amqp_connection_state_t state,
                                    amqp_channel_t channel,
                                    amqp_message_t *message,
-                                   AMQP_UNUSED int flags)
+                                   int flags)
+{
+  if (flags & AMQP_MESSAGE_POOLED) {
+    prepare_pooled_message(state, message);
+  } else {
+    /* message may be uninitialized, it's up to the caller to release a pool
+       from earlier AMQP_MESSAGE_POOLED reads */
+    memset(message, 0, sizeof(amqp_message_t));
+  }
+
+  return read_message(state, channel, message);
+}
+
+/* Reads into message, which is either zeroed or has been readied by
+   prepare_pooled_message() */
+static amqp_rpc_reply_t read_message(amqp_connection_state_t state,
+                                     amqp_channel_t channel,
+                                     amqp_message_t *message)
 {
   amqp_frame_t frame;
   amqp_rpc_reply_t ret;
@@ -205,7 +448,6 @@ amqp_rpc_reply_t amqp_read_message(amqp_connection_state_t state,
   int res;
 
   memset(&ret, 0, sizeof(amqp_rpc_reply_t));
-  memset(message, 0, sizeof(amqp_message_t));
 
   res = amqp_simple_wait_frame_on_channel(state, channel, &frame);
   if (AMQP_STATUS_OK != res) {
@@ -232,7 +474,16 @@ amqp_rpc_reply_t amqp_read_message(amqp_connection_state_t state,
     goto error_out1;
   }
 
-  init_amqp_pool(&message->pool, 4096);
+  res = decode_lazy_headers(state, &frame);
+  if (AMQP_STATUS_OK != res) {
+    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    ret.library_error = res;
+    goto error_out1;
+  }
+
+  if (!message->pooled) {
+    init_amqp_pool_with_allocator(&message->pool, 4096, &state->allocator);
+  }
   res = amqp_basic_properties_clone(frame.payload.properties.decoded,
                                     &message->properties, &message->pool);
 
@@ -245,7 +496,15 @@ amqp_rpc_reply_t amqp_read_message(amqp_connection_state_t state,
   if (0 == frame.payload.properties.body_size) {
     message->body = amqp_empty_bytes;
   } else {
-    message->body = amqp_bytes_malloc(frame.payload.properties.body_size);
+    if (message->pooled) {
+      amqp_pool_alloc_bytes_uninit(&message->pool,
+                                   frame.payload.properties.body_size,
+                                   &message->body);
+    } else {
+      message->body.len = frame.payload.properties.body_size;
+      message->body.bytes = amqp_malloc(&message->pool.allocator,
+                                        message->body.len);
+    }
     if (NULL == message->body.bytes) {
       ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
       ret.library_error = AMQP_STATUS_NO_MEMORY;
@@ -293,9 +552,272 @@ amqp_rpc_reply_t amqp_read_message(amqp_connection_state_t state,
   return ret;
 
 error_out2:
-  amqp_bytes_free(message->body);
+  if (!message->pooled) {
+    amqp_free(&message->pool.allocator, message->body.bytes);
+  }
 error_out3:
-  empty_amqp_pool(&message->pool);
+  if (!message->pooled) {
+    empty_amqp_pool(&message->pool);
+  }
 error_out1:
   return ret;
 }
+
+amqp_rpc_reply_t amqp_read_message_ref(amqp_connection_state_t state,
+                                       amqp_channel_t channel,
+                                       amqp_message_ref_t *message,
+                                       AMQP_UNUSED int flags)
+{
+  amqp_frame_t frame;
+  amqp_rpc_reply_t ret;
+  amqp_pool_t *channel_pool;
+
+  uint64_t body_size;
+  uint64_t body_read;
+  int fragments_capacity;
+  int res;
+
+  memset(&ret, 0, sizeof(amqp_rpc_reply_t));
+  memset(message, 0, sizeof(amqp_message_ref_t));
+
+  res = amqp_simple_wait_frame_on_channel(state, channel, &frame);
+  if (AMQP_STATUS_OK != res) {
+    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    ret.library_error = res;
+    return ret;
+  }
+
+  if (AMQP_FRAME_HEADER != frame.frame_type) {
+    if (AMQP_FRAME_METHOD == frame.frame_type &&
+        (AMQP_CHANNEL_CLOSE_METHOD == frame.payload.method.id ||
+         AMQP_CONNECTION_CLOSE_METHOD == frame.payload.method.id)) {
+
+      ret.reply_type = AMQP_RESPONSE_SERVER_EXCEPTION;
+      ret.reply = frame.payload.method;
+
+    } else {
+      ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+      ret.library_error = AMQP_STATUS_UNEXPECTED_STATE;
+
+      amqp_queue_frame(state, &frame);
+    }
+    return ret;
+  }
+
+  channel_pool = amqp_get_channel_pool(state, channel);
+  if (NULL == channel_pool) {
+    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    ret.library_error = AMQP_STATUS_UNEXPECTED_STATE;
+    return ret;
+  }
+
+  res = decode_lazy_headers(state, &frame);
+  if (AMQP_STATUS_OK != res) {
+    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    ret.library_error = res;
+    return ret;
+  }
+
+  message->channel = channel;
+  message->properties = frame.payload.properties.decoded;
+  body_size = frame.payload.properties.body_size;
+  if (body_size > SIZE_MAX) {
+    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    ret.library_error = AMQP_STATUS_BAD_AMQP_DATA;
+    return ret;
+  }
+  message->body.len = (size_t)body_size;
+
+  /* The fragment list starts small and grows as body frames arrive, the
+     announced body size is not trusted for sizing it */
+  fragments_capacity = 0;
+
+  body_read = 0;
+
+  while (body_read < body_size) {
+    res = amqp_simple_wait_frame_on_channel(state, channel, &frame);
+    if (AMQP_STATUS_OK != res) {
+      ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+      ret.library_error = res;
+      return ret;
+    }
+    if (AMQP_FRAME_BODY != frame.frame_type) {
+      if (AMQP_FRAME_METHOD == frame.frame_type &&
+          (AMQP_CHANNEL_CLOSE_METHOD == frame.payload.method.id ||
+           AMQP_CONNECTION_CLOSE_METHOD == frame.payload.method.id)) {
+
+        ret.reply_type = AMQP_RESPONSE_SERVER_EXCEPTION;
+        ret.reply = frame.payload.method;
+      } else {
+        ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+        ret.library_error = AMQP_STATUS_BAD_AMQP_DATA;
+      }
+      return ret;
+    }
+
+    if (body_read + frame.payload.body_fragment.len > body_size) {
+      ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+      ret.library_error = AMQP_STATUS_BAD_AMQP_DATA;
+      return ret;
+    }
+
+    if (message->num_fragments == fragments_capacity) {
+      amqp_bytes_t *fragments;
+
+      if (fragments_capacity > INT_MAX / 2 ||
+          (size_t)fragments_capacity * 2 > SIZE_MAX / sizeof(amqp_bytes_t)) {
+        ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+        ret.library_error = AMQP_STATUS_NO_MEMORY;
+        return ret;
+      }
+      fragments_capacity = 0 == fragments_capacity
+                               ? INITIAL_FRAGMENTS_CAPACITY
+                               : fragments_capacity * 2;
+      fragments = amqp_pool_alloc(channel_pool,
+                                  fragments_capacity * sizeof(amqp_bytes_t));
+      if (NULL == fragments) {
+        ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+        ret.library_error = AMQP_STATUS_NO_MEMORY;
+        return ret;
+      }
+      if (message->num_fragments > 0) {
+        memcpy(fragments, message->fragments,
+               message->num_fragments * sizeof(amqp_bytes_t));
+      }
+      message->fragments = fragments;
+    }
+
+    message->fragments[message->num_fragments++] = frame.payload.body_fragment;
+    body_read += frame.payload.body_fragment.len;
+  }
+
+  if (1 == message->num_fragments) {
+    message->body = message->fragments[0];
+  }
+
+  ret.reply_type = AMQP_RESPONSE_NORMAL;
+  return ret;
+}
+
+void amqp_release_message_ref(amqp_connection_state_t state,
+                              amqp_message_ref_t *message)
+{
+  amqp_maybe_release_buffers_on_channel(state, message->channel);
+  memset(message, 0, sizeof(amqp_message_ref_t));
+}
+
+amqp_rpc_reply_t amqp_read_message_stream(amqp_connection_state_t state,
+                                          amqp_channel_t channel,
+                                          const amqp_message_handler_t *handler,
+                                          void *user_data,
+                                          AMQP_UNUSED int flags)
+{
+  amqp_frame_t frame;
+  amqp_rpc_reply_t ret;
+
+  uint64_t body_size;
+  uint64_t body_read;
+  int res;
+
+  memset(&ret, 0, sizeof(amqp_rpc_reply_t));
+
+  res = amqp_simple_wait_frame_on_channel(state, channel, &frame);
+  if (AMQP_STATUS_OK != res) {
+    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    ret.library_error = res;
+    return ret;
+  }
+
+  if (AMQP_FRAME_HEADER != frame.frame_type) {
+    if (AMQP_FRAME_METHOD == frame.frame_type &&
+        (AMQP_CHANNEL_CLOSE_METHOD == frame.payload.method.id ||
+         AMQP_CONNECTION_CLOSE_METHOD == frame.payload.method.id)) {
+
+      ret.reply_type = AMQP_RESPONSE_SERVER_EXCEPTION;
+      ret.reply = frame.payload.method;
+
+    } else {
+      ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+      ret.library_error = AMQP_STATUS_UNEXPECTED_STATE;
+
+      amqp_queue_frame(state, &frame);
+    }
+    return ret;
+  }
+
+  body_size = frame.payload.properties.body_size;
+
+  if (handler->properties) {
+    res = decode_lazy_headers(state, &frame);
+    if (AMQP_STATUS_OK != res) {
+      ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+      ret.library_error = res;
+      return ret;
+    }
+
+    res = handler->properties(user_data, channel,
+                              frame.payload.properties.decoded, body_size);
+    if (AMQP_STATUS_OK != res) {
+      goto callback_error;
+    }
+  }
+
+  body_read = 0;
+
+  while (body_read < body_size) {
+    /* Whatever the previous frames used can go before reading more */
+    amqp_maybe_release_buffers_on_channel(state, channel);
+
+    res = amqp_simple_wait_frame_on_channel(state, channel, &frame);
+    if (AMQP_STATUS_OK != res) {
+      ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+      ret.library_error = res;
+      return ret;
+    }
+    if (AMQP_FRAME_BODY != frame.frame_type) {
+      if (AMQP_FRAME_METHOD == frame.frame_type &&
+          (AMQP_CHANNEL_CLOSE_METHOD == frame.payload.method.id ||
+           AMQP_CONNECTION_CLOSE_METHOD == frame.payload.method.id)) {
+
+        ret.reply_type = AMQP_RESPONSE_SERVER_EXCEPTION;
+        ret.reply = frame.payload.method;
+      } else {
+        ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+        ret.library_error = AMQP_STATUS_BAD_AMQP_DATA;
+      }
+      return ret;
+    }
+
+    if (body_read + frame.payload.body_fragment.len > body_size) {
+      ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+      ret.library_error = AMQP_STATUS_BAD_AMQP_DATA;
+      return ret;
+    }
+
+    body_read += frame.payload.body_fragment.len;
+
+    if (handler->fragment) {
+      res = handler->fragment(user_data, channel, frame.payload.body_fragment);
+      if (AMQP_STATUS_OK != res) {
+        goto callback_error;
+      }
+    }
+  }
+
+  amqp_maybe_release_buffers_on_channel(state, channel);
+
+  if (handler->end) {
+    res = handler->end(user_data, channel);
+    if (AMQP_STATUS_OK != res) {
+      goto callback_error;
+    }
+  }
+
+  ret.reply_type = AMQP_RESPONSE_NORMAL;
+  return ret;
+
+callback_error:
+  ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+  ret.library_error = res;
+  return ret;
+}
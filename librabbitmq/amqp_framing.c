@@ -183,8 +183,10 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
     case AMQP_CONNECTION_START_METHOD: {
       amqp_connection_start_t *m = (amqp_connection_start_t *) amqp_pool_alloc(pool, sizeof(amqp_connection_start_t));
       if (m == NULL) { return AMQP_STATUS_NO_MEMORY; }
-      if (!amqp_decode_8(encoded, &offset, &m->version_major)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_decode_8(encoded, &offset, &m->version_minor)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 2 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      m->version_major = amqp_d8(encoded.bytes, offset);
+      m->version_minor = amqp_d8(encoded.bytes, offset + 1);
+      offset += 2;
       {
         int res = amqp_decode_table(encoded, pool, &(m->server_properties), &offset);
         if (res < 0) return res;
@@ -259,18 +261,22 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
     case AMQP_CONNECTION_TUNE_METHOD: {
       amqp_connection_tune_t *m = (amqp_connection_tune_t *) amqp_pool_alloc(pool, sizeof(amqp_connection_tune_t));
       if (m == NULL) { return AMQP_STATUS_NO_MEMORY; }
-      if (!amqp_decode_16(encoded, &offset, &m->channel_max)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_decode_32(encoded, &offset, &m->frame_max)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_decode_16(encoded, &offset, &m->heartbeat)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 8 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      m->channel_max = amqp_d16(encoded.bytes, offset);
+      m->frame_max = amqp_d32(encoded.bytes, offset + 2);
+      m->heartbeat = amqp_d16(encoded.bytes, offset + 6);
+      offset += 8;
       *decoded = m;
       return 0;
     }
     case AMQP_CONNECTION_TUNE_OK_METHOD: {
       amqp_connection_tune_ok_t *m = (amqp_connection_tune_ok_t *) amqp_pool_alloc(pool, sizeof(amqp_connection_tune_ok_t));
       if (m == NULL) { return AMQP_STATUS_NO_MEMORY; }
-      if (!amqp_decode_16(encoded, &offset, &m->channel_max)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_decode_32(encoded, &offset, &m->frame_max)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_decode_16(encoded, &offset, &m->heartbeat)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 8 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      m->channel_max = amqp_d16(encoded.bytes, offset);
+      m->frame_max = amqp_d32(encoded.bytes, offset + 2);
+      m->heartbeat = amqp_d16(encoded.bytes, offset + 6);
+      offset += 8;
       *decoded = m;
       return 0;
     }
@@ -316,8 +322,10 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
             || !amqp_decode_bytes(encoded, &offset, &m->reply_text, len))
           return AMQP_STATUS_BAD_AMQP_DATA;
       }
-      if (!amqp_decode_16(encoded, &offset, &m->class_id)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_decode_16(encoded, &offset, &m->method_id)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 4 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      m->class_id = amqp_d16(encoded.bytes, offset);
+      m->method_id = amqp_d16(encoded.bytes, offset + 2);
+      offset += 4;
       *decoded = m;
       return 0;
     }
@@ -376,8 +384,10 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
             || !amqp_decode_bytes(encoded, &offset, &m->reply_text, len))
           return AMQP_STATUS_BAD_AMQP_DATA;
       }
-      if (!amqp_decode_16(encoded, &offset, &m->class_id)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_decode_16(encoded, &offset, &m->method_id)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 4 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      m->class_id = amqp_d16(encoded.bytes, offset);
+      m->method_id = amqp_d16(encoded.bytes, offset + 2);
+      offset += 4;
       *decoded = m;
       return 0;
     }
@@ -570,8 +580,10 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
             || !amqp_decode_bytes(encoded, &offset, &m->queue, len))
           return AMQP_STATUS_BAD_AMQP_DATA;
       }
-      if (!amqp_decode_32(encoded, &offset, &m->message_count)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_decode_32(encoded, &offset, &m->consumer_count)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 8 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      m->message_count = amqp_d32(encoded.bytes, offset);
+      m->consumer_count = amqp_d32(encoded.bytes, offset + 4);
+      offset += 8;
       *decoded = m;
       return 0;
     }
@@ -694,10 +706,12 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
     case AMQP_BASIC_QOS_METHOD: {
       amqp_basic_qos_t *m = (amqp_basic_qos_t *) amqp_pool_alloc(pool, sizeof(amqp_basic_qos_t));
       if (m == NULL) { return AMQP_STATUS_NO_MEMORY; }
-      if (!amqp_decode_32(encoded, &offset, &m->prefetch_size)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_decode_16(encoded, &offset, &m->prefetch_count)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 7 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      m->prefetch_size = amqp_d32(encoded.bytes, offset);
+      m->prefetch_count = amqp_d16(encoded.bytes, offset + 4);
+      bit_buffer = amqp_d8(encoded.bytes, offset + 6);
       m->global = (bit_buffer & (1 << 0)) ? 1 : 0;
+      offset += 7;
       *decoded = m;
       return 0;
     }
@@ -828,9 +842,11 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
             || !amqp_decode_bytes(encoded, &offset, &m->consumer_tag, len))
           return AMQP_STATUS_BAD_AMQP_DATA;
       }
-      if (!amqp_decode_64(encoded, &offset, &m->delivery_tag)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 9 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      m->delivery_tag = amqp_d64(encoded.bytes, offset);
+      bit_buffer = amqp_d8(encoded.bytes, offset + 8);
       m->redelivered = (bit_buffer & (1 << 0)) ? 1 : 0;
+      offset += 9;
       {
         uint8_t len;
         if (!amqp_decode_8(encoded, &offset, &len)
@@ -864,9 +880,11 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
     case AMQP_BASIC_GET_OK_METHOD: {
       amqp_basic_get_ok_t *m = (amqp_basic_get_ok_t *) amqp_pool_alloc(pool, sizeof(amqp_basic_get_ok_t));
       if (m == NULL) { return AMQP_STATUS_NO_MEMORY; }
-      if (!amqp_decode_64(encoded, &offset, &m->delivery_tag)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 9 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      m->delivery_tag = amqp_d64(encoded.bytes, offset);
+      bit_buffer = amqp_d8(encoded.bytes, offset + 8);
       m->redelivered = (bit_buffer & (1 << 0)) ? 1 : 0;
+      offset += 9;
       {
         uint8_t len;
         if (!amqp_decode_8(encoded, &offset, &len)
@@ -898,18 +916,22 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
     case AMQP_BASIC_ACK_METHOD: {
       amqp_basic_ack_t *m = (amqp_basic_ack_t *) amqp_pool_alloc(pool, sizeof(amqp_basic_ack_t));
       if (m == NULL) { return AMQP_STATUS_NO_MEMORY; }
-      if (!amqp_decode_64(encoded, &offset, &m->delivery_tag)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 9 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      m->delivery_tag = amqp_d64(encoded.bytes, offset);
+      bit_buffer = amqp_d8(encoded.bytes, offset + 8);
       m->multiple = (bit_buffer & (1 << 0)) ? 1 : 0;
+      offset += 9;
       *decoded = m;
       return 0;
     }
     case AMQP_BASIC_REJECT_METHOD: {
       amqp_basic_reject_t *m = (amqp_basic_reject_t *) amqp_pool_alloc(pool, sizeof(amqp_basic_reject_t));
       if (m == NULL) { return AMQP_STATUS_NO_MEMORY; }
-      if (!amqp_decode_64(encoded, &offset, &m->delivery_tag)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 9 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      m->delivery_tag = amqp_d64(encoded.bytes, offset);
+      bit_buffer = amqp_d8(encoded.bytes, offset + 8);
       m->requeue = (bit_buffer & (1 << 0)) ? 1 : 0;
+      offset += 9;
       *decoded = m;
       return 0;
     }
@@ -937,10 +959,12 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
     case AMQP_BASIC_NACK_METHOD: {
       amqp_basic_nack_t *m = (amqp_basic_nack_t *) amqp_pool_alloc(pool, sizeof(amqp_basic_nack_t));
       if (m == NULL) { return AMQP_STATUS_NO_MEMORY; }
-      if (!amqp_decode_64(encoded, &offset, &m->delivery_tag)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 9 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      m->delivery_tag = amqp_d64(encoded.bytes, offset);
+      bit_buffer = amqp_d8(encoded.bytes, offset + 8);
       m->multiple = (bit_buffer & (1 << 0)) ? 1 : 0;
       m->requeue = (bit_buffer & (1 << 1)) ? 1 : 0;
+      offset += 9;
       *decoded = m;
       return 0;
     }
@@ -1175,8 +1199,10 @@ int amqp_encode_method(amqp_method_number_t methodNumber,
   switch (methodNumber) {
     case AMQP_CONNECTION_START_METHOD: {
       amqp_connection_start_t *m = (amqp_connection_start_t *) decoded;
-      if (!amqp_encode_8(encoded, &offset, m->version_major)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_encode_8(encoded, &offset, m->version_minor)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 2 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e8(encoded.bytes, offset, m->version_major);
+      amqp_e8(encoded.bytes, offset + 1, m->version_minor);
+      offset += 2;
       {
         int res = amqp_encode_table(encoded, &(m->server_properties), &offset);
         if (res < 0) return res;
@@ -1222,16 +1248,20 @@ int amqp_encode_method(amqp_method_number_t methodNumber,
     }
     case AMQP_CONNECTION_TUNE_METHOD: {
       amqp_connection_tune_t *m = (amqp_connection_tune_t *) decoded;
-      if (!amqp_encode_16(encoded, &offset, m->channel_max)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_encode_32(encoded, &offset, m->frame_max)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_encode_16(encoded, &offset, m->heartbeat)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 8 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e16(encoded.bytes, offset, m->channel_max);
+      amqp_e32(encoded.bytes, offset + 2, m->frame_max);
+      amqp_e16(encoded.bytes, offset + 6, m->heartbeat);
+      offset += 8;
       return offset;
     }
     case AMQP_CONNECTION_TUNE_OK_METHOD: {
       amqp_connection_tune_ok_t *m = (amqp_connection_tune_ok_t *) decoded;
-      if (!amqp_encode_16(encoded, &offset, m->channel_max)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_encode_32(encoded, &offset, m->frame_max)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_encode_16(encoded, &offset, m->heartbeat)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 8 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e16(encoded.bytes, offset, m->channel_max);
+      amqp_e32(encoded.bytes, offset + 2, m->frame_max);
+      amqp_e16(encoded.bytes, offset + 6, m->heartbeat);
+      offset += 8;
       return offset;
     }
     case AMQP_CONNECTION_OPEN_METHOD: {
@@ -1260,8 +1290,10 @@ int amqp_encode_method(amqp_method_number_t methodNumber,
       if (!amqp_encode_8(encoded, &offset, m->reply_text.len)
           || !amqp_encode_bytes(encoded, &offset, m->reply_text))
         return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_encode_16(encoded, &offset, m->class_id)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_encode_16(encoded, &offset, m->method_id)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 4 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e16(encoded.bytes, offset, m->class_id);
+      amqp_e16(encoded.bytes, offset + 2, m->method_id);
+      offset += 4;
       return offset;
     }
     case AMQP_CONNECTION_CLOSE_OK_METHOD: {
@@ -1301,8 +1333,10 @@ int amqp_encode_method(amqp_method_number_t methodNumber,
       if (!amqp_encode_8(encoded, &offset, m->reply_text.len)
           || !amqp_encode_bytes(encoded, &offset, m->reply_text))
         return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_encode_16(encoded, &offset, m->class_id)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_encode_16(encoded, &offset, m->method_id)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 4 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e16(encoded.bytes, offset, m->class_id);
+      amqp_e16(encoded.bytes, offset + 2, m->method_id);
+      offset += 4;
       return offset;
     }
     case AMQP_CHANNEL_CLOSE_OK_METHOD: {
@@ -1439,8 +1473,10 @@ int amqp_encode_method(amqp_method_number_t methodNumber,
       if (!amqp_encode_8(encoded, &offset, m->queue.len)
           || !amqp_encode_bytes(encoded, &offset, m->queue))
         return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_encode_32(encoded, &offset, m->message_count)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_encode_32(encoded, &offset, m->consumer_count)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 8 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e32(encoded.bytes, offset, m->message_count);
+      amqp_e32(encoded.bytes, offset + 4, m->consumer_count);
+      offset += 8;
       return offset;
     }
     case AMQP_QUEUE_BIND_METHOD: {
@@ -1524,11 +1560,13 @@ int amqp_encode_method(amqp_method_number_t methodNumber,
     }
     case AMQP_BASIC_QOS_METHOD: {
       amqp_basic_qos_t *m = (amqp_basic_qos_t *) decoded;
-      if (!amqp_encode_32(encoded, &offset, m->prefetch_size)) return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_encode_16(encoded, &offset, m->prefetch_count)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 7 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e32(encoded.bytes, offset, m->prefetch_size);
+      amqp_e16(encoded.bytes, offset + 4, m->prefetch_count);
       bit_buffer = 0;
       if (m->global) bit_buffer |= (1 << 0);
-      if (!amqp_encode_8(encoded, &offset, bit_buffer)) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e8(encoded.bytes, offset + 6, bit_buffer);
+      offset += 7;
       return offset;
     }
     case AMQP_BASIC_QOS_OK_METHOD: {
@@ -1613,10 +1651,12 @@ int amqp_encode_method(amqp_method_number_t methodNumber,
       if (!amqp_encode_8(encoded, &offset, m->consumer_tag.len)
           || !amqp_encode_bytes(encoded, &offset, m->consumer_tag))
         return AMQP_STATUS_BAD_AMQP_DATA;
-      if (!amqp_encode_64(encoded, &offset, m->delivery_tag)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 9 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e64(encoded.bytes, offset, m->delivery_tag);
       bit_buffer = 0;
       if (m->redelivered) bit_buffer |= (1 << 0);
-      if (!amqp_encode_8(encoded, &offset, bit_buffer)) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e8(encoded.bytes, offset + 8, bit_buffer);
+      offset += 9;
       if (!amqp_encode_8(encoded, &offset, m->exchange.len)
           || !amqp_encode_bytes(encoded, &offset, m->exchange))
         return AMQP_STATUS_BAD_AMQP_DATA;
@@ -1638,10 +1678,12 @@ int amqp_encode_method(amqp_method_number_t methodNumber,
     }
     case AMQP_BASIC_GET_OK_METHOD: {
       amqp_basic_get_ok_t *m = (amqp_basic_get_ok_t *) decoded;
-      if (!amqp_encode_64(encoded, &offset, m->delivery_tag)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 9 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e64(encoded.bytes, offset, m->delivery_tag);
       bit_buffer = 0;
       if (m->redelivered) bit_buffer |= (1 << 0);
-      if (!amqp_encode_8(encoded, &offset, bit_buffer)) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e8(encoded.bytes, offset + 8, bit_buffer);
+      offset += 9;
       if (!amqp_encode_8(encoded, &offset, m->exchange.len)
           || !amqp_encode_bytes(encoded, &offset, m->exchange))
         return AMQP_STATUS_BAD_AMQP_DATA;
@@ -1660,18 +1702,22 @@ int amqp_encode_method(amqp_method_number_t methodNumber,
     }
     case AMQP_BASIC_ACK_METHOD: {
       amqp_basic_ack_t *m = (amqp_basic_ack_t *) decoded;
-      if (!amqp_encode_64(encoded, &offset, m->delivery_tag)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 9 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e64(encoded.bytes, offset, m->delivery_tag);
       bit_buffer = 0;
       if (m->multiple) bit_buffer |= (1 << 0);
-      if (!amqp_encode_8(encoded, &offset, bit_buffer)) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e8(encoded.bytes, offset + 8, bit_buffer);
+      offset += 9;
       return offset;
     }
     case AMQP_BASIC_REJECT_METHOD: {
       amqp_basic_reject_t *m = (amqp_basic_reject_t *) decoded;
-      if (!amqp_encode_64(encoded, &offset, m->delivery_tag)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 9 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e64(encoded.bytes, offset, m->delivery_tag);
       bit_buffer = 0;
       if (m->requeue) bit_buffer |= (1 << 0);
-      if (!amqp_encode_8(encoded, &offset, bit_buffer)) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e8(encoded.bytes, offset + 8, bit_buffer);
+      offset += 9;
       return offset;
     }
     case AMQP_BASIC_RECOVER_ASYNC_METHOD: {
@@ -1693,11 +1739,13 @@ int amqp_encode_method(amqp_method_number_t methodNumber,
     }
     case AMQP_BASIC_NACK_METHOD: {
       amqp_basic_nack_t *m = (amqp_basic_nack_t *) decoded;
-      if (!amqp_encode_64(encoded, &offset, m->delivery_tag)) return AMQP_STATUS_BAD_AMQP_DATA;
+      if (offset + 9 > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e64(encoded.bytes, offset, m->delivery_tag);
       bit_buffer = 0;
       if (m->multiple) bit_buffer |= (1 << 0);
       if (m->requeue) bit_buffer |= (1 << 1);
-      if (!amqp_encode_8(encoded, &offset, bit_buffer)) return AMQP_STATUS_BAD_AMQP_DATA;
+      amqp_e8(encoded.bytes, offset + 8, bit_buffer);
+      offset += 9;
       return offset;
     }
     case AMQP_TX_SELECT_METHOD: {
@@ -0,0 +1,684 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_io_thread.h"
+#include "amqp_private.h"
+#include "amqp_timer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Properties are copied into a pool of their own, they are rarely large */
+#define PROPERTIES_POOL_PAGE_SIZE 1024
+/* Messages are held back while more than this is waiting to be sent, or the
+   connection's memory limit if that is lower */
+#define OUTPUT_HIGH_WATER (1024 * 1024)
+
+typedef struct amqp_io_request_t_ {
+  struct amqp_io_request_t_ *next;
+  uint64_t seqno;
+
+  amqp_bytes_t exchange;
+  amqp_bytes_t routing_key;
+  amqp_bytes_t body;
+  /* counted in the I/O thread's queued_bytes until published */
+  size_t size;
+  amqp_boolean_t mandatory;
+  amqp_boolean_t immediate;
+  amqp_boolean_t has_properties;
+  amqp_basic_properties_t properties;
+  amqp_pool_t pool;
+
+  amqp_publish_done_fn done;
+  void *user_data;
+} amqp_io_request_t;
+
+struct amqp_io_thread_t_ {
+  amqp_connection_state_t state;
+  amqp_channel_t channel;
+  amqp_boolean_t confirms;
+  amqp_frame_handler_fn on_frame;
+  void *user_data;
+  amqp_allocator_t allocator;
+  /* the connection's memory limit when the I/O thread started, 0 for none */
+  size_t memory_limit;
+  size_t output_limit;
+
+  pthread_t thread;
+  /* written to wake the I/O thread up, the read end is polled with the
+     socket */
+  int wake_fds[2];
+
+  /* Requests are pushed here by publishing threads and taken all at once by
+     the I/O thread, so it is a stack in reverse order of submission. Holds
+     SUBMITTED_CLOSED once nothing more is taken. Only accessed atomically. */
+  amqp_io_request_t *submitted;
+  /* bytes of the messages submitted and not yet published. Only accessed
+     atomically. */
+  size_t queued_bytes;
+  int stopping;
+  int status;
+  /* when amqp_io_thread_stop() gives up waiting, set before stopping */
+  amqp_boolean_t has_stop_deadline;
+  uint64_t stop_deadline;
+
+  /* requests taken while too much output was pending, in submission order.
+     Only used by the I/O thread. */
+  amqp_io_request_t *first_held;
+  amqp_io_request_t *last_held;
+
+  /* published requests waiting for a confirm, in sequence number order.
+     Only used by the I/O thread. */
+  amqp_io_request_t *first_unconfirmed;
+  amqp_io_request_t *last_unconfirmed;
+};
+
+/* Stands in for the submitted stack once the I/O thread no longer takes
+   requests, so that publishing threads can't push any more */
+static amqp_io_request_t submitted_closed;
+#define SUBMITTED_CLOSED (&submitted_closed)
+
+static void wake(amqp_io_thread_t *thread)
+{
+  char c = 0;
+  ssize_t res;
+
+  /* If the pipe is full the I/O thread is about to wake up anyway */
+  do {
+    res = write(thread->wake_fds[1], &c, 1);
+  } while (res < 0 && EINTR == errno);
+}
+
+static void drain_wakeups(amqp_io_thread_t *thread)
+{
+  char buf[64];
+  ssize_t res;
+
+  do {
+    res = read(thread->wake_fds[0], buf, sizeof(buf));
+  } while (res > 0 || (res < 0 && EINTR == errno));
+}
+
+static int set_pipe_flags(int fd)
+{
+  int flags = fcntl(fd, F_GETFL);
+  if (-1 == flags || -1 == fcntl(fd, F_SETFL, flags | O_NONBLOCK)) {
+    return -1;
+  }
+  flags = fcntl(fd, F_GETFD);
+  if (-1 == flags || -1 == fcntl(fd, F_SETFD, flags | FD_CLOEXEC)) {
+    return -1;
+  }
+  return 0;
+}
+
+static void complete_request(amqp_io_thread_t *thread, amqp_io_request_t *request,
+                             int status, amqp_boolean_t nacked)
+{
+  if (request->done) {
+    request->done(request->user_data, status, nacked);
+  }
+  empty_amqp_pool(&request->pool);
+  amqp_free(&thread->allocator, request);
+}
+
+static void fail_requests(amqp_io_thread_t *thread, amqp_io_request_t *request,
+                          int status)
+{
+  while (request) {
+    amqp_io_request_t *next = request->next;
+    complete_request(thread, request, status, 0);
+    request = next;
+  }
+}
+
+/* Takes everything submitted so far, oldest first. With close set nothing
+   can be submitted afterwards. */
+static amqp_io_request_t *take_submitted(amqp_io_thread_t *thread,
+                                         amqp_boolean_t close)
+{
+  amqp_io_request_t *stack =
+    __atomic_exchange_n(&thread->submitted, close ? SUBMITTED_CLOSED : NULL,
+                        __ATOMIC_ACQ_REL);
+  amqp_io_request_t *queue = NULL;
+
+  if (SUBMITTED_CLOSED == stack) {
+    return NULL;
+  }
+
+  while (stack) {
+    amqp_io_request_t *next = stack->next;
+    stack->next = queue;
+    queue = stack;
+    stack = next;
+  }
+  return queue;
+}
+
+static size_t output_pending_bytes(amqp_connection_state_t state)
+{
+  return state->pending_output_len - state->pending_output_offset;
+}
+
+static int publish_submitted(amqp_io_thread_t *thread, amqp_boolean_t close)
+{
+  amqp_connection_state_t state = thread->state;
+  amqp_io_request_t *request = take_submitted(thread, close);
+  int res;
+
+  if (request) {
+    if (thread->last_held) {
+      thread->last_held->next = request;
+    } else {
+      thread->first_held = request;
+    }
+    while (request->next) {
+      request = request->next;
+    }
+    thread->last_held = request;
+  }
+
+  /* The rest waits for the socket to catch up rather than piling up in the
+     connection's output buffer */
+  if (NULL == thread->first_held ||
+      output_pending_bytes(state) >= thread->output_limit) {
+    return AMQP_STATUS_OK;
+  }
+
+  /* Everything taken goes out in as few writes as possible */
+  res = amqp_publish_batch_begin(state, 0);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  while (thread->first_held &&
+         output_pending_bytes(state) < thread->output_limit) {
+    request = thread->first_held;
+    thread->first_held = request->next;
+    if (NULL == thread->first_held) {
+      thread->last_held = NULL;
+    }
+    request->next = NULL;
+    __atomic_sub_fetch(&thread->queued_bytes, request->size, __ATOMIC_RELAXED);
+
+    if (thread->confirms) {
+      request->seqno = amqp_confirm_next_seqno(state, thread->channel);
+    }
+
+    res = amqp_basic_publish(state, thread->channel, request->exchange,
+                             request->routing_key, request->mandatory,
+                             request->immediate,
+                             request->has_properties ? &request->properties : NULL,
+                             request->body);
+    if (AMQP_STATUS_OK != res) {
+      complete_request(thread, request, res, 0);
+      return res;
+    }
+
+    if (thread->confirms) {
+      if (thread->last_unconfirmed) {
+        thread->last_unconfirmed->next = request;
+      } else {
+        thread->first_unconfirmed = request;
+      }
+      thread->last_unconfirmed = request;
+    } else {
+      /* The connection has its own copy of the message by now */
+      complete_request(thread, request, AMQP_STATUS_OK, 0);
+    }
+  }
+
+  return amqp_publish_batch_flush(state);
+}
+
+static void confirm_requests(amqp_io_thread_t *thread,
+                             const amqp_confirm_event_t *event)
+{
+  amqp_io_request_t *prev = NULL;
+  amqp_io_request_t *request = thread->first_unconfirmed;
+
+  while (request && request->seqno <= event->last) {
+    amqp_io_request_t *next = request->next;
+
+    if (request->seqno >= event->first) {
+      if (prev) {
+        prev->next = next;
+      } else {
+        thread->first_unconfirmed = next;
+      }
+      if (thread->last_unconfirmed == request) {
+        thread->last_unconfirmed = prev;
+      }
+      complete_request(thread, request, AMQP_STATUS_OK, event->nacked);
+    } else {
+      prev = request;
+    }
+
+    request = next;
+  }
+}
+
+static int dispatch_received(amqp_io_thread_t *thread)
+{
+  amqp_connection_state_t state = thread->state;
+  amqp_frame_t frame;
+  int res;
+
+  /* Confirms are picked out while frames are decoded */
+  while (1) {
+    res = amqp_poll_frame(state, &frame);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    if (0 == frame.frame_type) {
+      break;
+    }
+
+    if (thread->on_frame) {
+      thread->on_frame(thread->user_data, &frame);
+    }
+    amqp_maybe_release_buffers_on_channel(state, frame.channel);
+  }
+
+  while (state->confirm_events_count > 0) {
+    amqp_confirm_event_t event;
+
+    res = amqp_confirm_poll(state, &event);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    if (event.channel == thread->channel) {
+      confirm_requests(thread, &event);
+    }
+  }
+  /* Confirms are consumed here rather than handed to on_frame */
+  amqp_maybe_release_buffers_on_channel(state, thread->channel);
+
+  return AMQP_STATUS_OK;
+}
+
+static int wait_for_io(amqp_io_thread_t *thread, uint64_t deadline)
+{
+  amqp_connection_state_t state = thread->state;
+  struct pollfd fds[2];
+  struct timeval tv;
+  int timeout_ms = -1;
+  int wanted;
+  int events = 0;
+  int res;
+
+  wanted = amqp_get_io_events(state);
+  fds[0].fd = amqp_get_sockfd(state);
+  if (-1 == fds[0].fd) {
+    return AMQP_STATUS_CONNECTION_CLOSED;
+  }
+  fds[0].events = ((wanted & AMQP_IO_READABLE) ? POLLIN : 0) |
+                  ((wanted & AMQP_IO_WRITABLE) ? POLLOUT : 0);
+  fds[0].revents = 0;
+  fds[1].fd = thread->wake_fds[0];
+  fds[1].events = POLLIN;
+  fds[1].revents = 0;
+
+  if (amqp_get_next_timeout(state, &tv)) {
+    uint64_t ms = (uint64_t)tv.tv_sec * 1000 + ((uint64_t)tv.tv_usec + 999) / 1000;
+    timeout_ms = ms > INT_MAX ? INT_MAX : (int)ms;
+  }
+  if (deadline) {
+    uint64_t now = amqp_get_monotonic_timestamp();
+    uint64_t ms = (now < deadline ? (deadline - now + 999999) / 1000000 : 0);
+    if (-1 == timeout_ms || ms < (uint64_t)timeout_ms) {
+      timeout_ms = ms > INT_MAX ? INT_MAX : (int)ms;
+    }
+  }
+
+  res = poll(fds, 2, timeout_ms);
+  if (res < 0) {
+    if (EINTR == errno) {
+      return AMQP_STATUS_OK;
+    }
+    return AMQP_STATUS_SOCKET_ERROR;
+  }
+
+  if (fds[1].revents & POLLIN) {
+    drain_wakeups(thread);
+  }
+
+  /* Errors are reported by the read or write they fail */
+  if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+    events |= AMQP_IO_READABLE;
+  }
+  if (fds[0].revents & (POLLOUT | POLLERR)) {
+    events |= AMQP_IO_WRITABLE;
+  }
+
+  /* Called even without events so that heartbeats are kept up */
+  return amqp_handle_io(state, events);
+}
+
+static void *io_thread_main(void *arg)
+{
+  amqp_io_thread_t *thread = arg;
+  int res;
+
+  while (1) {
+    /* Once stopping is seen the submitted stack is closed by the publish
+       below, which takes whatever was submitted before */
+    int stopping = __atomic_load_n(&thread->stopping, __ATOMIC_ACQUIRE);
+    uint64_t deadline = 0;
+
+    res = publish_submitted(thread, stopping);
+    if (AMQP_STATUS_OK != res) {
+      break;
+    }
+
+    res = dispatch_received(thread);
+    if (AMQP_STATUS_OK != res) {
+      break;
+    }
+
+    if (stopping) {
+      if (NULL == thread->first_unconfirmed && NULL == thread->first_held
+          && !amqp_output_pending(thread->state)) {
+        break;
+      }
+      if (thread->has_stop_deadline) {
+        uint64_t now = amqp_get_monotonic_timestamp();
+        if (0 == now || now >= thread->stop_deadline) {
+          res = AMQP_STATUS_TIMEOUT;
+          break;
+        }
+        deadline = thread->stop_deadline;
+      }
+    }
+
+    res = wait_for_io(thread, deadline);
+    if (AMQP_STATUS_OK != res) {
+      break;
+    }
+  }
+
+  if (AMQP_STATUS_OK != res) {
+    /* Publishing threads that don't see the error yet find the submitted
+       stack closed */
+    __atomic_store_n(&thread->status, res, __ATOMIC_RELEASE);
+    fail_requests(thread, thread->first_unconfirmed, res);
+    thread->first_unconfirmed = NULL;
+    thread->last_unconfirmed = NULL;
+    fail_requests(thread, thread->first_held, res);
+    thread->first_held = NULL;
+    thread->last_held = NULL;
+    fail_requests(thread, take_submitted(thread, 1), res);
+  }
+
+  return NULL;
+}
+
+amqp_io_thread_t *amqp_io_thread_start(amqp_connection_state_t state,
+                                       amqp_channel_t channel,
+                                       amqp_frame_handler_fn on_frame,
+                                       void *user_data)
+{
+  amqp_io_thread_t *thread;
+
+  thread = amqp_calloc(&state->allocator, 1, sizeof(*thread));
+  if (NULL == thread) {
+    return NULL;
+  }
+  thread->state = state;
+  thread->channel = channel;
+  thread->confirms = (0 != amqp_confirm_next_seqno(state, channel));
+  thread->on_frame = on_frame;
+  thread->user_data = user_data;
+  thread->allocator = state->allocator;
+  thread->memory_limit = state->memory_limit;
+  thread->output_limit = OUTPUT_HIGH_WATER;
+  if (thread->memory_limit && thread->memory_limit < thread->output_limit) {
+    thread->output_limit = thread->memory_limit;
+  }
+  thread->status = AMQP_STATUS_OK;
+
+  if (pipe(thread->wake_fds)) {
+    goto out_free;
+  }
+  if (set_pipe_flags(thread->wake_fds[0]) || set_pipe_flags(thread->wake_fds[1])) {
+    goto out_close;
+  }
+
+  if (AMQP_STATUS_OK != amqp_set_nonblocking(state, 1)) {
+    goto out_close;
+  }
+
+  if (pthread_create(&thread->thread, NULL, io_thread_main, thread)) {
+    amqp_set_nonblocking(state, 0);
+    goto out_close;
+  }
+
+  return thread;
+
+out_close:
+  close(thread->wake_fds[0]);
+  close(thread->wake_fds[1]);
+out_free:
+  amqp_free(&state->allocator, thread);
+  return NULL;
+}
+
+int amqp_io_thread_publish(amqp_io_thread_t *thread,
+                           amqp_bytes_t exchange,
+                           amqp_bytes_t routing_key,
+                           amqp_boolean_t mandatory,
+                           amqp_boolean_t immediate,
+                           amqp_basic_properties_t const *properties,
+                           amqp_bytes_t body,
+                           amqp_publish_done_fn done,
+                           void *user_data)
+{
+  amqp_io_request_t *request;
+  amqp_io_request_t *head;
+  size_t size = exchange.len + routing_key.len + body.len;
+  size_t queued;
+  char *data;
+  int res;
+
+  res = __atomic_load_n(&thread->status, __ATOMIC_ACQUIRE);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  /* Counted before the request can be taken, so the I/O thread never takes
+     off more than has been added */
+  queued = __atomic_add_fetch(&thread->queued_bytes, size, __ATOMIC_RELAXED);
+  if (thread->memory_limit && queued > thread->memory_limit) {
+    __atomic_sub_fetch(&thread->queued_bytes, size, __ATOMIC_RELAXED);
+    return AMQP_STATUS_MEMORY_LIMIT;
+  }
+
+  /* One allocation holds the request and the bytes it refers to */
+  request = amqp_malloc(&thread->allocator, sizeof(*request) + size);
+  if (NULL == request) {
+    __atomic_sub_fetch(&thread->queued_bytes, size, __ATOMIC_RELAXED);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  data = (char *)(request + 1);
+
+  request->exchange.bytes = data;
+  request->exchange.len = exchange.len;
+  memcpy(data, exchange.bytes, exchange.len);
+  data += exchange.len;
+
+  request->routing_key.bytes = data;
+  request->routing_key.len = routing_key.len;
+  memcpy(data, routing_key.bytes, routing_key.len);
+  data += routing_key.len;
+
+  request->body.bytes = data;
+  request->body.len = body.len;
+  memcpy(data, body.bytes, body.len);
+
+  request->size = size;
+  request->seqno = 0;
+  request->mandatory = mandatory;
+  request->immediate = immediate;
+  request->done = done;
+  request->user_data = user_data;
+
+  init_amqp_pool_with_allocator(&request->pool, PROPERTIES_POOL_PAGE_SIZE,
+                                &thread->allocator);
+  request->has_properties = (NULL != properties);
+  if (properties) {
+    res = amqp_basic_properties_clone((amqp_basic_properties_t *)properties,
+                                      &request->properties, &request->pool);
+    if (AMQP_STATUS_OK != res) {
+      empty_amqp_pool(&request->pool);
+      amqp_free(&thread->allocator, request);
+      __atomic_sub_fetch(&thread->queued_bytes, size, __ATOMIC_RELAXED);
+      return res;
+    }
+  }
+
+  head = __atomic_load_n(&thread->submitted, __ATOMIC_RELAXED);
+  do {
+    if (SUBMITTED_CLOSED == head) {
+      /* The I/O thread stopped after the status was checked */
+      empty_amqp_pool(&request->pool);
+      amqp_free(&thread->allocator, request);
+      __atomic_sub_fetch(&thread->queued_bytes, size, __ATOMIC_RELAXED);
+      res = __atomic_load_n(&thread->status, __ATOMIC_ACQUIRE);
+      return AMQP_STATUS_OK != res ? res : AMQP_STATUS_CONNECTION_CLOSED;
+    }
+    request->next = head;
+  } while (!__atomic_compare_exchange_n(&thread->submitted, &head, request, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  /* The I/O thread takes everything at once, so it only needs waking up for
+     the first request after that */
+  if (NULL == head) {
+    wake(thread);
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+typedef struct publish_wait_t_ {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  amqp_boolean_t done;
+  int status;
+  amqp_boolean_t nacked;
+} publish_wait_t;
+
+static void publish_wait_done(void *user_data, int status, amqp_boolean_t nacked)
+{
+  publish_wait_t *wait = user_data;
+
+  pthread_mutex_lock(&wait->mutex);
+  wait->done = 1;
+  wait->status = status;
+  wait->nacked = nacked;
+  pthread_cond_signal(&wait->cond);
+  pthread_mutex_unlock(&wait->mutex);
+}
+
+int amqp_io_thread_publish_wait(amqp_io_thread_t *thread,
+                                amqp_bytes_t exchange,
+                                amqp_bytes_t routing_key,
+                                amqp_boolean_t mandatory,
+                                amqp_boolean_t immediate,
+                                amqp_basic_properties_t const *properties,
+                                amqp_bytes_t body,
+                                amqp_boolean_t *nacked)
+{
+  publish_wait_t wait;
+  int res;
+
+  pthread_mutex_init(&wait.mutex, NULL);
+  pthread_cond_init(&wait.cond, NULL);
+  wait.done = 0;
+
+  res = amqp_io_thread_publish(thread, exchange, routing_key, mandatory,
+                               immediate, properties, body,
+                               publish_wait_done, &wait);
+  if (AMQP_STATUS_OK == res) {
+    pthread_mutex_lock(&wait.mutex);
+    while (!wait.done) {
+      pthread_cond_wait(&wait.cond, &wait.mutex);
+    }
+    pthread_mutex_unlock(&wait.mutex);
+
+    res = wait.status;
+    if (nacked) {
+      *nacked = wait.nacked;
+    }
+  }
+
+  pthread_cond_destroy(&wait.cond);
+  pthread_mutex_destroy(&wait.mutex);
+  return res;
+}
+
+int amqp_io_thread_stop(amqp_io_thread_t *thread,
+                        struct timeval const *timeout)
+{
+  int res;
+
+  if (timeout) {
+    thread->has_stop_deadline = 1;
+    thread->stop_deadline = amqp_get_monotonic_timestamp() +
+                            (uint64_t)timeout->tv_sec * AMQP_NS_PER_S +
+                            (uint64_t)timeout->tv_usec * AMQP_NS_PER_US;
+  }
+  __atomic_store_n(&thread->stopping, 1, __ATOMIC_RELEASE);
+  wake(thread);
+  pthread_join(thread->thread, NULL);
+
+  /* Giving up on the broker leaves the connection usable */
+  res = thread->status;
+  if (AMQP_STATUS_OK == res || AMQP_STATUS_TIMEOUT == res) {
+    int nonblocking_res = amqp_set_nonblocking(thread->state, 0);
+    if (AMQP_STATUS_OK != nonblocking_res) {
+      res = nonblocking_res;
+    }
+  }
+
+  close(thread->wake_fds[0]);
+  close(thread->wake_fds[1]);
+  amqp_free(&thread->allocator, thread);
+  return res;
+}
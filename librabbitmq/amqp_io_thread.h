@@ -0,0 +1,182 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+/**
+ * A connection shared between threads through a dedicated I/O thread.
+ *
+ * Any thread can publish, on the one channel given to amqp_io_thread_start().
+ * Publish results and received frames are reported on the I/O thread itself:
+ * a thread that needs the result of its own publish uses
+ * amqp_io_thread_publish_wait(), or passes it back from its done callback.
+ * Deliveries are passed on as the raw method, content header and body frames
+ * they arrive in.
+ */
+
+#ifndef AMQP_IO_THREAD_H
+#define AMQP_IO_THREAD_H
+
+#include <amqp.h>
+
+AMQP_BEGIN_DECLS
+
+typedef struct amqp_io_thread_t_ amqp_io_thread_t;
+
+/**
+ * Called on the I/O thread once a message queued with
+ * amqp_io_thread_publish() is done with
+ *
+ * status is AMQP_STATUS_OK if the broker confirmed the message, or if the
+ * channel isn't in confirm mode, once the message was handed to the
+ * connection. nacked is set if the broker rejected it. Otherwise status is
+ * the error that stopped the I/O thread. The callback must not block.
+ */
+typedef void (*amqp_publish_done_fn)(void *user_data, int status,
+                                     amqp_boolean_t nacked);
+
+/**
+ * Called on the I/O thread with each frame received other than heartbeats
+ * and publisher confirms, such as deliveries. The frame is only valid for the
+ * duration of the callback.
+ */
+typedef void (*amqp_frame_handler_fn)(void *user_data,
+                                      amqp_frame_t const *frame);
+
+/**
+ * Hands a connection over to a new I/O thread
+ *
+ * The connection must be logged in, with channel open. If publisher confirms
+ * are tracked on channel (see amqp_confirm_track()) messages are done with
+ * once confirmed. From then on until amqp_io_thread_stop() the connection
+ * belongs to the I/O thread, which drives it in non-blocking mode (see
+ * amqp_set_nonblocking()), and must not be used directly. Any number of
+ * threads can publish through amqp_io_thread_publish() concurrently.
+ *
+ * Messages are copied using the connection's allocator, which must be safe
+ * to call from several threads at once. The C library's is.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel messages are published on
+ * \param [in] on_frame called with received frames, may be NULL
+ * \param [in] user_data passed to on_frame
+ * \returns the I/O thread, or NULL on failure
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_io_thread_t *
+AMQP_CALL amqp_io_thread_start(amqp_connection_state_t state,
+                               amqp_channel_t channel,
+                               amqp_frame_handler_fn on_frame,
+                               void *user_data);
+
+/**
+ * Queues a message to be published by the I/O thread
+ *
+ * Safe to call from any thread. Takes a copy of the message and returns
+ * without waiting for it to be sent; done is called once it has been.
+ *
+ * Messages wait in the I/O thread's queue while the socket is slow to take
+ * what was already published. If the connection had a memory limit when the
+ * I/O thread started (see amqp_set_memory_limit()), messages that would take
+ * the queue past it are refused.
+ *
+ * \param [in] thread the I/O thread
+ * \param [in] exchange the exchange on the broker to publish to
+ * \param [in] routing_key the routing key to use when publishing the message
+ * \param [in] mandatory indicate to the broker that the message MUST be routed
+ *             to a queue
+ * \param [in] immediate indicate to the broker that the message MUST be
+ *             delivered to a consumer immediately
+ * \param [in] properties the properties associated with the message, may be
+ *             NULL
+ * \param [in] body the message body
+ * \param [in] done called once the message is done with, may be NULL
+ * \param [in] user_data passed to done
+ * \returns AMQP_STATUS_OK if the message was queued,
+ *          AMQP_STATUS_MEMORY_LIMIT if the queue is full, an amqp_status_enum
+ *          value otherwise, including the error that stopped the I/O thread
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_io_thread_publish(amqp_io_thread_t *thread,
+                                 amqp_bytes_t exchange,
+                                 amqp_bytes_t routing_key,
+                                 amqp_boolean_t mandatory,
+                                 amqp_boolean_t immediate,
+                                 struct amqp_basic_properties_t_ const *properties,
+                                 amqp_bytes_t body,
+                                 amqp_publish_done_fn done,
+                                 void *user_data);
+
+/**
+ * Publishes a message through the I/O thread and waits until it is done with
+ *
+ * Like amqp_io_thread_publish(), but the result is returned to the calling
+ * thread.
+ *
+ * \param [out] nacked set if the broker rejected the message, may be NULL
+ * \returns AMQP_STATUS_OK if the message was confirmed (or nacked) or, on a
+ *          channel without confirms, sent, an amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_io_thread_publish_wait(amqp_io_thread_t *thread,
+                                      amqp_bytes_t exchange,
+                                      amqp_bytes_t routing_key,
+                                      amqp_boolean_t mandatory,
+                                      amqp_boolean_t immediate,
+                                      struct amqp_basic_properties_t_ const *properties,
+                                      amqp_bytes_t body,
+                                      amqp_boolean_t *nacked);
+
+/**
+ * Stops an I/O thread and hands its connection back
+ *
+ * Messages already queued are published, and the I/O thread waits for the
+ * broker to confirm them, before it exits. Messages still unconfirmed when
+ * timeout runs out are done with AMQP_STATUS_TIMEOUT. Publishing fails with
+ * AMQP_STATUS_CONNECTION_CLOSED once this has been called, and no thread may
+ * publish through thread after it returns. The connection is back in
+ * blocking mode afterwards, unless the I/O thread stopped on an error other
+ * than the timeout.
+ *
+ * \param [in] thread the I/O thread, freed by this call
+ * \param [in] timeout how long to wait for the broker, NULL to wait for as
+ *             long as it takes
+ * \returns AMQP_STATUS_OK on success, AMQP_STATUS_TIMEOUT if the broker
+ *          didn't confirm everything in time, the error that stopped the I/O
+ *          thread otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_io_thread_stop(amqp_io_thread_t *thread,
+                              struct timeval const *timeout);
+
+AMQP_END_DECLS
+
+#endif /* AMQP_IO_THREAD_H */
@@ -51,8 +51,111 @@ char const *amqp_version(void)
   return VERSION; /* defined in config.h */
 }
 
+/* All hooks NULL: the C library */
+static amqp_allocator_t default_allocator;
+
+int amqp_allocator_valid(amqp_allocator_t const *allocator)
+{
+  if (NULL == allocator->malloc_func) {
+    return NULL == allocator->realloc_func && NULL == allocator->free_func &&
+           NULL == allocator->calloc_func;
+  }
+  return NULL != allocator->realloc_func && NULL != allocator->free_func;
+}
+
+int amqp_set_default_allocator(amqp_allocator_t const *allocator)
+{
+  if (NULL == allocator) {
+    memset(&default_allocator, 0, sizeof(default_allocator));
+    return AMQP_STATUS_OK;
+  }
+  if (!amqp_allocator_valid(allocator)) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  default_allocator = *allocator;
+  return AMQP_STATUS_OK;
+}
+
+amqp_allocator_t const *amqp_get_default_allocator(void)
+{
+  return &default_allocator;
+}
+
+void *amqp_malloc(amqp_allocator_t const *allocator, size_t size)
+{
+  if (NULL == allocator->malloc_func) {
+    return malloc(size);
+  }
+  return allocator->malloc_func(allocator->user_data, size);
+}
+
+void *amqp_calloc(amqp_allocator_t const *allocator, size_t count, size_t size)
+{
+  void *result;
+
+  if (NULL != allocator->calloc_func) {
+    return allocator->calloc_func(allocator->user_data, count, size);
+  }
+  if (NULL == allocator->malloc_func) {
+    return calloc(count, size);
+  }
+
+  if (0 != size && count > SIZE_MAX / size) {
+    return NULL;
+  }
+  result = allocator->malloc_func(allocator->user_data, count * size);
+  if (NULL != result) {
+    memset(result, 0, count * size);
+  }
+  return result;
+}
+
+void *amqp_realloc(amqp_allocator_t const *allocator, void *ptr, size_t size)
+{
+  if (NULL == allocator->realloc_func) {
+    return realloc(ptr, size);
+  }
+  return allocator->realloc_func(allocator->user_data, ptr, size);
+}
+
+void amqp_free(amqp_allocator_t const *allocator, void *ptr)
+{
+  if (NULL == ptr) {
+    return;
+  }
+  if (NULL == allocator->free_func) {
+    free(ptr);
+  } else {
+    allocator->free_func(allocator->user_data, ptr);
+  }
+}
+
+/* Blocklists grow geometrically from this many slots */
+#define POOL_BLOCKLIST_INITIAL_SIZE 8
+
+/* Bounds on the large blocks a pool keeps across recycle_amqp_pool() */
+#define POOL_FREE_LARGE_BLOCKS_MAX 8
+#define POOL_FREE_LARGE_BYTES_MAX (4 * 1024 * 1024)
+
+/* Large blocks carry their usable size in front of the data handed out, so
+ * a recycled block can be matched against later requests */
+typedef union amqp_pool_large_block_t_ {
+  size_t size;
+  uint64_t align_;
+  double align_double_;
+} amqp_pool_large_block_t;
+
 void init_amqp_pool(amqp_pool_t *pool, size_t pagesize)
 {
+  init_amqp_pool_with_allocator(pool, pagesize, &default_allocator);
+}
+
+void init_amqp_pool_with_allocator(amqp_pool_t *pool, size_t pagesize,
+                                   amqp_allocator_t const *allocator)
+{
+  pool->allocator = *allocator;
+  memset(&pool->stats, 0, sizeof(pool->stats));
+  pool->parent_stats = NULL;
   pool->pagesize = pagesize ? pagesize : 4096;
 
   pool->pages.num_blocks = 0;
@@ -61,63 +164,216 @@ void init_amqp_pool(amqp_pool_t *pool, size_t pagesize)
   pool->large_blocks.num_blocks = 0;
   pool->large_blocks.blocklist = NULL;
 
+  pool->free_large_blocks.num_blocks = 0;
+  pool->free_large_blocks.blocklist = NULL;
+
   pool->next_page = 0;
   pool->alloc_block = NULL;
   pool->alloc_used = 0;
 }
 
-static void empty_blocklist(amqp_pool_blocklist_t *x)
+static void add_reserved(amqp_pool_t *pool, size_t bytes)
+{
+  pool->stats.bytes_reserved += bytes;
+  if (NULL != pool->parent_stats) {
+    pool->parent_stats->bytes_reserved += bytes;
+  }
+}
+
+static void remove_reserved(amqp_pool_t *pool, size_t bytes)
+{
+  pool->stats.bytes_reserved -= bytes;
+  if (NULL != pool->parent_stats) {
+    pool->parent_stats->bytes_reserved -= bytes;
+  }
+}
+
+static void add_retained(amqp_pool_t *pool, size_t bytes)
+{
+  pool->stats.retained_bytes += bytes;
+  if (NULL != pool->parent_stats) {
+    pool->parent_stats->retained_bytes += bytes;
+  }
+}
+
+static void remove_retained(amqp_pool_t *pool, size_t bytes)
+{
+  pool->stats.retained_bytes -= bytes;
+  if (NULL != pool->parent_stats) {
+    pool->parent_stats->retained_bytes -= bytes;
+  }
+}
+
+static void update_in_use(amqp_memory_stats_t *stats, size_t bytes)
+{
+  stats->bytes_in_use += bytes;
+  if (stats->bytes_in_use > stats->peak_bytes_in_use) {
+    stats->peak_bytes_in_use = stats->bytes_in_use;
+  }
+}
+
+static void add_in_use(amqp_pool_t *pool, size_t bytes)
+{
+  update_in_use(&pool->stats, bytes);
+  if (NULL != pool->parent_stats) {
+    update_in_use(pool->parent_stats, bytes);
+  }
+}
+
+/* Everything handed out by the pool is back */
+static void reset_in_use(amqp_pool_t *pool)
+{
+  if (NULL != pool->parent_stats) {
+    pool->parent_stats->bytes_in_use -= pool->stats.bytes_in_use;
+  }
+  pool->stats.bytes_in_use = 0;
+}
+
+static void empty_blocklist(amqp_pool_t *pool, amqp_pool_blocklist_t *x)
 {
   int i;
 
   for (i = 0; i < x->num_blocks; i++) {
-    free(x->blocklist[i]);
+    amqp_free(&pool->allocator, x->blocklist[i]);
   }
   if (x->blocklist != NULL) {
-    free(x->blocklist);
+    amqp_free(&pool->allocator, x->blocklist);
   }
   x->num_blocks = 0;
   x->blocklist = NULL;
 }
 
+/* Returns 1 on success, 0 on failure */
+static int record_pool_block(amqp_pool_t *pool, amqp_pool_blocklist_t *x,
+                             void *block)
+{
+  /* The list is sized to the next power of two above num_blocks (at least
+   * POOL_BLOCKLIST_INITIAL_SIZE), so it only needs to grow when num_blocks
+   * lands on one of those boundaries */
+  if (x->blocklist == NULL ||
+      (x->num_blocks >= POOL_BLOCKLIST_INITIAL_SIZE &&
+       0 == (x->num_blocks & (x->num_blocks - 1)))) {
+    size_t new_size = x->num_blocks < POOL_BLOCKLIST_INITIAL_SIZE ?
+                      POOL_BLOCKLIST_INITIAL_SIZE : 2 * (size_t)x->num_blocks;
+    void **newbl = amqp_realloc(&pool->allocator, x->blocklist,
+                                sizeof(void *) * new_size);
+    if (newbl == NULL) {
+      return 0;
+    }
+    x->blocklist = newbl;
+  }
+
+  x->blocklist[x->num_blocks] = block;
+  x->num_blocks++;
+  return 1;
+}
+
+static void retain_large_blocks(amqp_pool_t *pool)
+{
+  amqp_pool_blocklist_t *free_blocks = &pool->free_large_blocks;
+  size_t retained = 0;
+  int i;
+
+  for (i = 0; i < free_blocks->num_blocks; i++) {
+    retained += ((amqp_pool_large_block_t *)free_blocks->blocklist[i])->size;
+  }
+
+  for (i = 0; i < pool->large_blocks.num_blocks; i++) {
+    amqp_pool_large_block_t *block = pool->large_blocks.blocklist[i];
+
+    if (free_blocks->num_blocks < POOL_FREE_LARGE_BLOCKS_MAX &&
+        retained + block->size <= POOL_FREE_LARGE_BYTES_MAX &&
+        record_pool_block(pool, free_blocks, block)) {
+      retained += block->size;
+      add_retained(pool, block->size);
+    } else {
+      remove_reserved(pool, block->size);
+      amqp_free(&pool->allocator, block);
+    }
+  }
+
+  /* Keep the list itself around for the next cycle */
+  pool->large_blocks.num_blocks = 0;
+}
+
 void recycle_amqp_pool(amqp_pool_t *pool)
 {
-  empty_blocklist(&pool->large_blocks);
+  retain_large_blocks(pool);
+  reset_in_use(pool);
   pool->next_page = 0;
   pool->alloc_block = NULL;
   pool->alloc_used = 0;
 }
 
+void amqp_pool_free_retained(amqp_pool_t *pool)
+{
+  amqp_pool_blocklist_t *free_blocks = &pool->free_large_blocks;
+  int i;
+
+  for (i = 0; i < free_blocks->num_blocks; i++) {
+    amqp_pool_large_block_t *block = free_blocks->blocklist[i];
+    remove_retained(pool, block->size);
+    remove_reserved(pool, block->size);
+    amqp_free(&pool->allocator, block);
+  }
+  free_blocks->num_blocks = 0;
+}
+
 void empty_amqp_pool(amqp_pool_t *pool)
 {
-  recycle_amqp_pool(pool);
-  empty_blocklist(&pool->pages);
+  amqp_pool_free_retained(pool);
+  empty_blocklist(pool, &pool->large_blocks);
+  empty_blocklist(pool, &pool->free_large_blocks);
+  empty_blocklist(pool, &pool->pages);
+  remove_reserved(pool, pool->stats.bytes_reserved);
+  reset_in_use(pool);
+  pool->next_page = 0;
+  pool->alloc_block = NULL;
+  pool->alloc_used = 0;
 }
 
-/* Returns 1 on success, 0 on failure */
-static int record_pool_block(amqp_pool_blocklist_t *x, void *block)
+static void *alloc_large_block(amqp_pool_t *pool, size_t amount)
 {
-  size_t blocklistlength = sizeof(void *) * (x->num_blocks + 1);
+  amqp_pool_blocklist_t *free_blocks = &pool->free_large_blocks;
+  amqp_pool_large_block_t *block = NULL;
+  int best = -1;
+  int i;
 
-  if (x->blocklist == NULL) {
-    x->blocklist = malloc(blocklistlength);
-    if (x->blocklist == NULL) {
-      return 0;
+  /* Best fit among the blocks kept from earlier cycles */
+  for (i = 0; i < free_blocks->num_blocks; i++) {
+    amqp_pool_large_block_t *candidate = free_blocks->blocklist[i];
+    if (candidate->size >= amount &&
+        (NULL == block || candidate->size < block->size)) {
+      block = candidate;
+      best = i;
     }
+  }
+
+  if (NULL != block) {
+    free_blocks->num_blocks--;
+    free_blocks->blocklist[best] = free_blocks->blocklist[free_blocks->num_blocks];
+    remove_retained(pool, block->size);
   } else {
-    void *newbl = realloc(x->blocklist, blocklistlength);
-    if (newbl == NULL) {
-      return 0;
+    block = amqp_malloc(&pool->allocator,
+                        sizeof(amqp_pool_large_block_t) + amount);
+    if (NULL == block) {
+      return NULL;
     }
-    x->blocklist = newbl;
+    block->size = amount;
+    add_reserved(pool, amount);
   }
 
-  x->blocklist[x->num_blocks] = block;
-  x->num_blocks++;
-  return 1;
+  if (!record_pool_block(pool, &pool->large_blocks, block)) {
+    remove_reserved(pool, block->size);
+    amqp_free(&pool->allocator, block);
+    return NULL;
+  }
+
+  add_in_use(pool, block->size);
+  return block + 1;
 }
 
-void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount)
+void *amqp_pool_alloc_uninit(amqp_pool_t *pool, size_t amount)
 {
   if (amount == 0) {
     return NULL;
@@ -126,14 +382,7 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount)
   amount = (amount + 7) & (~7); /* round up to nearest 8-byte boundary */
 
   if (amount > pool->pagesize) {
-    void *result = calloc(1, amount);
-    if (result == NULL) {
-      return NULL;
-    }
-    if (!record_pool_block(&pool->large_blocks, result)) {
-      return NULL;
-    }
-    return result;
+    return alloc_large_block(pool, amount);
   }
 
   if (pool->alloc_block != NULL) {
@@ -142,18 +391,22 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount)
     if (pool->alloc_used + amount <= pool->pagesize) {
       void *result = pool->alloc_block + pool->alloc_used;
       pool->alloc_used += amount;
+      add_in_use(pool, amount);
       return result;
     }
   }
 
   if (pool->next_page >= pool->pages.num_blocks) {
-    pool->alloc_block = calloc(1, pool->pagesize);
+    pool->alloc_block = amqp_malloc(&pool->allocator, pool->pagesize);
     if (pool->alloc_block == NULL) {
       return NULL;
     }
-    if (!record_pool_block(&pool->pages, pool->alloc_block)) {
+    if (!record_pool_block(pool, &pool->pages, pool->alloc_block)) {
+      amqp_free(&pool->allocator, pool->alloc_block);
+      pool->alloc_block = NULL;
       return NULL;
     }
+    add_reserved(pool, pool->pagesize);
     pool->next_page = pool->pages.num_blocks;
   } else {
     pool->alloc_block = pool->pages.blocklist[pool->next_page];
@@ -161,16 +414,33 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount)
   }
 
   pool->alloc_used = amount;
+  add_in_use(pool, amount);
 
   return pool->alloc_block;
 }
 
+void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount)
+{
+  /* Pages are handed out dirty, so zero just the part the caller gets */
+  void *result = amqp_pool_alloc_uninit(pool, amount);
+  if (result != NULL) {
+    memset(result, 0, amount);
+  }
+  return result;
+}
+
 void amqp_pool_alloc_bytes(amqp_pool_t *pool, size_t amount, amqp_bytes_t *output)
 {
   output->len = amount;
   output->bytes = amqp_pool_alloc(pool, amount);
 }
 
+void amqp_pool_alloc_bytes_uninit(amqp_pool_t *pool, size_t amount, amqp_bytes_t *output)
+{
+  output->len = amount;
+  output->bytes = amqp_pool_alloc_uninit(pool, amount);
+}
+
 amqp_bytes_t amqp_cstring_bytes(char const *cstr)
 {
   amqp_bytes_t result;
@@ -183,7 +453,7 @@ amqp_bytes_t amqp_bytes_malloc_dup(amqp_bytes_t src)
 {
   amqp_bytes_t result;
   result.len = src.len;
-  result.bytes = malloc(src.len);
+  result.bytes = amqp_malloc(&default_allocator, src.len);
   if (result.bytes != NULL) {
     memcpy(result.bytes, src.bytes, src.len);
   }
@@ -194,54 +464,91 @@ amqp_bytes_t amqp_bytes_malloc(size_t amount)
 {
   amqp_bytes_t result;
   result.len = amount;
-  result.bytes = malloc(amount); /* will return NULL if it fails */
+  result.bytes = amqp_malloc(&default_allocator, amount); /* will return NULL if it fails */
   return result;
 }
 
 void amqp_bytes_free(amqp_bytes_t bytes)
 {
-  free(bytes.bytes);
+  amqp_free(&default_allocator, bytes.bytes);
 }
 
-amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t state, amqp_channel_t channel)
+#define INITIAL_CHANNEL_TABLE_SIZE 16
+
+amqp_pool_table_entry_t *amqp_get_or_create_channel_entry(amqp_connection_state_t state, amqp_channel_t channel)
 {
   amqp_pool_table_entry_t *entry;
-  size_t index = channel % POOL_TABLE_SIZE;
 
-  entry = state->pool_table[index];
+  if (channel < state->channel_table_size) {
+    entry = state->channel_table[channel];
+    if (NULL != entry) {
+      return entry;
+    }
+  } else {
+    size_t new_size = state->channel_table_size ?
+                      state->channel_table_size : INITIAL_CHANNEL_TABLE_SIZE;
+    amqp_pool_table_entry_t **new_table;
 
-  for ( ; NULL != entry; entry = entry->next) {
-    if (channel == entry->channel) {
-      return &entry->pool;
+    while (new_size <= channel) {
+      new_size *= 2;
+    }
+
+    new_table = amqp_realloc(&state->allocator, state->channel_table,
+                             new_size * sizeof(amqp_pool_table_entry_t *));
+    if (NULL == new_table) {
+      return NULL;
     }
+    memset(new_table + state->channel_table_size, 0,
+           (new_size - state->channel_table_size) * sizeof(amqp_pool_table_entry_t *));
+
+    state->channel_table = new_table;
+    state->channel_table_size = new_size;
   }
 
-  entry = malloc(sizeof(amqp_pool_table_entry_t));
+  entry = amqp_malloc(&state->allocator, sizeof(amqp_pool_table_entry_t));
   if (NULL == entry) {
     return NULL;
   }
 
   entry->channel = channel;
-  entry->next = state->pool_table[index];
-  state->pool_table[index] = entry;
+  entry->confirms = NULL;
+  entry->first_queued_frame = NULL;
+  entry->last_queued_frame = NULL;
+  entry->pinned_buffers = NULL;
+  entry->last_pinned = NULL;
+  entry->next = state->channel_entries;
+  state->channel_entries = entry;
+  state->channel_table[channel] = entry;
+
+  init_amqp_pool_with_allocator(&entry->pool, state->frame_max,
+                                &state->allocator);
+  entry->pool.parent_stats = &state->memory_stats;
+
+  return entry;
+}
 
-  init_amqp_pool(&entry->pool, state->frame_max);
+amqp_pool_table_entry_t *amqp_get_channel_entry(amqp_connection_state_t state, amqp_channel_t channel)
+{
+  if (channel < state->channel_table_size) {
+    return state->channel_table[channel];
+  }
+  return NULL;
+}
 
+amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t state, amqp_channel_t channel)
+{
+  amqp_pool_table_entry_t *entry = amqp_get_or_create_channel_entry(state, channel);
+  if (NULL == entry) {
+    return NULL;
+  }
   return &entry->pool;
 }
 
 amqp_pool_t *amqp_get_channel_pool(amqp_connection_state_t state, amqp_channel_t channel)
 {
-  amqp_pool_table_entry_t *entry;
-  size_t index = channel % POOL_TABLE_SIZE;
-
-  entry = state->pool_table[index];
-
-  for ( ; NULL != entry; entry = entry->next) {
-    if (channel == entry->channel) {
-      return &entry->pool;
-    }
+  amqp_pool_table_entry_t *entry = amqp_get_channel_entry(state, channel);
+  if (NULL == entry) {
+    return NULL;
   }
-
-  return NULL;
+  return &entry->pool;
 }
@@ -71,6 +71,7 @@ struct amqp_ssl_socket_t {
   size_t length;
   amqp_boolean_t verify;
   int internal_error;
+  amqp_allocator_t allocator;
 };
 
 static ssize_t
@@ -121,7 +122,7 @@ amqp_ssl_socket_writev(void *base,
     bytes += iov[i].iov_len;
   }
   if (self->length < bytes) {
-    self->buffer = realloc(self->buffer, bytes);
+    self->buffer = amqp_realloc(&self->allocator, self->buffer, bytes);
     if (!self->buffer) {
       self->length = 0;
       ret = AMQP_STATUS_NO_MEMORY;
@@ -339,8 +340,8 @@ amqp_ssl_socket_delete(void *base)
     amqp_ssl_socket_close(self);
 
     SSL_CTX_free(self->ctx);
-    free(self->buffer);
-    free(self);
+    amqp_free(&self->allocator, self->buffer);
+    amqp_free(&self->allocator, self);
   }
   destroy_openssl();
 }
@@ -352,18 +353,20 @@ static const struct amqp_socket_class_t amqp_ssl_socket_class = {
   amqp_ssl_socket_open, /* open */
   amqp_ssl_socket_close, /* close */
   amqp_ssl_socket_get_sockfd, /* get_sockfd */
-  amqp_ssl_socket_delete /* delete */
+  amqp_ssl_socket_delete, /* delete */
+  NULL /* try_writev */
 };
 
 amqp_socket_t *
 amqp_ssl_socket_new(amqp_connection_state_t state)
 {
-  struct amqp_ssl_socket_t *self = calloc(1, sizeof(*self));
+  struct amqp_ssl_socket_t *self = amqp_calloc(&state->allocator, 1, sizeof(*self));
   int status;
   if (!self) {
     return NULL;
   }
 
+  self->allocator = state->allocator;
   self->sockfd = -1;
   self->klass = &amqp_ssl_socket_class;
   self->verify = 1;
@@ -43,6 +43,7 @@
 
 #include "amqp.h"
 #include "amqp_framing.h"
+#include <limits.h>
 #include <string.h>
 
 #ifdef _WIN32
@@ -113,6 +114,9 @@ typedef enum amqp_connection_state_enum_ {
 #define HEADER_SIZE 7
 #define FOOTER_SIZE 1
 
+/* Room for a basic.ack or basic.nack frame, see confirm_frame_buffer */
+#define CONFIRM_FRAME_MAX 32
+
 #define AMQP_PSEUDOFRAME_PROTOCOL_HEADER 'A'
 
 typedef struct amqp_link_t_ {
@@ -120,16 +124,61 @@ typedef struct amqp_link_t_ {
   void *data;
 } amqp_link_t;
 
-#define POOL_TABLE_SIZE 16
+/* A frame waiting to be picked up. Queued frames form one list in arrival
+ * order, and each is also on a list of the frames queued for its channel, so
+ * the next frame for a given channel can be found without a scan.
+ */
+typedef struct amqp_queued_frame_t_ {
+  struct amqp_queued_frame_t_ *next;
+  struct amqp_queued_frame_t_ *prev;
+  struct amqp_queued_frame_t_ *channel_next;
+  /* what the frame adds to queued_frame_bytes, 0 if its payload is in the
+     channel pool and so already in bytes_in_use */
+  size_t size;
+  amqp_frame_t frame;
+} amqp_queued_frame_t;
+
+/* Publisher confirm bookkeeping for one channel, see amqp_confirm.c */
+typedef struct amqp_confirm_tracker_t_ amqp_confirm_tracker_t;
+
+/* A socket receive buffer, the data follows the struct. Frames that are
+ * completely contained in it are decoded in place, so the buffer is pinned
+ * by each channel that has been handed such a frame, until that channel's
+ * buffers are released.
+ */
+typedef struct amqp_recv_buffer_t_ {
+  int pins;
+  size_t len;
+} amqp_recv_buffer_t;
 
+#define amqp_recv_buffer_data(b) ((void *)((amqp_recv_buffer_t *)(b) + 1))
+
+/* Per-channel state. Entries are created on first use of a channel and live
+ * as long as the connection.
+ */
 typedef struct amqp_pool_table_entry_t_ {
-  struct amqp_pool_table_entry_t_ *next;
+  struct amqp_pool_table_entry_t_ *next; /* list of all entries */
   amqp_pool_t pool;
   amqp_channel_t channel;
+  amqp_confirm_tracker_t *confirms;
+
+  /* frames queued for this channel, allocated from pool */
+  amqp_queued_frame_t *first_queued_frame;
+  amqp_queued_frame_t *last_queued_frame;
+
+  /* receive buffers pinned by frames on this channel, allocated from pool */
+  amqp_link_t *pinned_buffers;
+  amqp_recv_buffer_t *last_pinned;
 } amqp_pool_table_entry_t;
 
 struct amqp_connection_state_t_ {
-  amqp_pool_table_entry_t *pool_table[POOL_TABLE_SIZE];
+  /* Channel entries, indexed directly by channel number. The table grows to
+   * cover the highest channel used so far; all entries are also linked
+   * through channel_entries for iteration.
+   */
+  amqp_pool_table_entry_t **channel_table;
+  size_t channel_table_size;
+  amqp_pool_table_entry_t *channel_entries;
 
   amqp_connection_state_enum state;
 
@@ -143,34 +192,152 @@ struct amqp_connection_state_t_ {
   char header_buffer[HEADER_SIZE + 1];
   amqp_bytes_t inbound_buffer;
 
+  /* The confirm tracker consumes the basic.ack and basic.nack frames of the
+   * channels it tracks, so nothing ever releases the channel buffers for
+   * them. They are decoded into confirm_pool instead, which only ever holds
+   * the last one, and never pin a receive buffer. Small method frames on
+   * those channels that span reads are assembled in confirm_frame_buffer.
+   */
+  char confirm_frame_buffer[CONFIRM_FRAME_MAX];
+  amqp_pool_t confirm_pool;
+
   size_t inbound_offset;
   size_t target_size;
 
+  /* Frames are encoded into outbound_buffer. While a publish batch is open
+   * encoded frames accumulate in it, outbound_offset being the number of
+   * bytes waiting to be sent. Outside of a batch it is always 0.
+   */
   amqp_bytes_t outbound_buffer;
+  size_t outbound_offset;
+  amqp_boolean_t publish_batch_active;
+
+  /* In non-blocking mode, output the socket didn't take yet. Bytes from
+   * pending_output_offset up to pending_output_len are still to be sent,
+   * pending_output.len is the buffer's capacity.
+   */
+  amqp_boolean_t nonblocking;
+  amqp_bytes_t pending_output;
+  size_t pending_output_offset;
+  size_t pending_output_len;
 
   amqp_socket_t *socket;
 
+  /* sock_inbound_buffer is the data of sock_inbound_block */
+  amqp_recv_buffer_t *sock_inbound_block;
+  amqp_recv_buffer_t *spare_inbound_block;
   amqp_bytes_t sock_inbound_buffer;
   size_t sock_inbound_offset;
   size_t sock_inbound_limit;
 
-  amqp_link_t *first_queued_frame;
-  amqp_link_t *last_queued_frame;
+  amqp_queued_frame_t *first_queued_frame;
+  amqp_queued_frame_t *last_queued_frame;
 
   amqp_rpc_reply_t most_recent_api_result;
 
   uint64_t next_recv_heartbeat;
   uint64_t next_send_heartbeat;
+  /* when the clock was last read for heartbeats, see amqp_heartbeat_clock() */
+  uint64_t heartbeat_timestamp;
+
+  /* set while the heartbeats are tracked on a timer wheel, see
+     amqp_timer_wheel_add_connection() */
+  amqp_timer_wheel_t *timer_wheel;
+  amqp_wheel_timer_t heartbeat_timer;
+  amqp_timer_fn heartbeat_fn;
+  void *heartbeat_user_data;
+
+  /* ring of confirm events not yet handed out by amqp_confirm_poll() */
+  amqp_confirm_event_t *confirm_events;
+  size_t confirm_events_head;
+  size_t confirm_events_count;
+  size_t confirm_events_capacity;
+
+  /* every heap allocation made for this connection goes through here */
+  amqp_allocator_t allocator;
+
+  /* totals over the channel pools, see amqp_set_memory_limit() */
+  amqp_memory_stats_t memory_stats;
+  size_t memory_limit;
+
+  /* leave basic headers tables undecoded, see amqp_set_lazy_properties() */
+  amqp_boolean_t lazy_properties;
 };
 
+amqp_pool_table_entry_t *amqp_get_or_create_channel_entry(amqp_connection_state_t state, amqp_channel_t channel);
+amqp_pool_table_entry_t *amqp_get_channel_entry(amqp_connection_state_t state, amqp_channel_t channel);
 amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t connection, amqp_channel_t channel);
 amqp_pool_t *amqp_get_channel_pool(amqp_connection_state_t state, amqp_channel_t channel);
 
+/* Heap allocation through an allocator's hooks, falling back to the C library
+   when they are not set */
+void *amqp_malloc(amqp_allocator_t const *allocator, size_t size);
+void *amqp_calloc(amqp_allocator_t const *allocator, size_t count, size_t size);
+void *amqp_realloc(amqp_allocator_t const *allocator, void *ptr, size_t size);
+void amqp_free(amqp_allocator_t const *allocator, void *ptr);
+
+/* Returns 1 if allocator sets either all or none of its required hooks */
+int amqp_allocator_valid(amqp_allocator_t const *allocator);
+
+/* The allocator set with amqp_set_default_allocator() */
+amqp_allocator_t const *amqp_get_default_allocator(void);
+
+/* init_amqp_pool() for a pool whose memory comes from allocator */
+void init_amqp_pool_with_allocator(amqp_pool_t *pool, size_t pagesize,
+                                   amqp_allocator_t const *allocator);
+
+/* Frees the large blocks a pool kept from earlier cycles */
+void amqp_pool_free_retained(amqp_pool_t *pool);
+
+/* Like amqp_pool_alloc() and amqp_pool_alloc_bytes(), but the memory is not
+   zeroed. Only for buffers the caller fills completely before reading. */
+void *amqp_pool_alloc_uninit(amqp_pool_t *pool, size_t amount);
+void amqp_pool_alloc_bytes_uninit(amqp_pool_t *pool, size_t amount, amqp_bytes_t *output);
+
+/* Makes sure amqp_confirm_published() has room for one more publish on
+   channel if it is tracking confirms */
+int amqp_confirm_reserve(amqp_connection_state_t state, amqp_channel_t channel);
+
+/* Assigns the next publish sequence number on channel if it is tracking
+   confirms, after amqp_confirm_reserve() */
+void amqp_confirm_published(amqp_connection_state_t state, amqp_channel_t channel);
+
+/* Takes back the sequence number amqp_confirm_published() just assigned, for
+   a publish that failed to go out */
+void amqp_confirm_unpublished(amqp_connection_state_t state, amqp_channel_t channel);
+
+/* Consumes a basic.ack or basic.nack for a channel that is tracking confirms,
+   turning it into confirm events. The frame's type is set to 0 when it has
+   been consumed. */
+int amqp_confirm_handle_frame(amqp_connection_state_t state, amqp_frame_t *frame);
+
+void amqp_confirm_tracker_free(amqp_connection_state_t state,
+                               amqp_confirm_tracker_t *tracker);
+
+/* Whether holding extra more bytes would take the connection past its memory
+   limit, after freeing what is only retained for reuse if need be */
+amqp_boolean_t amqp_memory_limit_exceeded(amqp_connection_state_t state,
+                                          size_t extra);
+
+static inline amqp_boolean_t amqp_memory_limit_reached(amqp_connection_state_t state)
+{
+  return (0 != state->memory_limit && amqp_memory_limit_exceeded(state, 0));
+}
+
 static inline amqp_boolean_t amqp_heartbeat_enabled(amqp_connection_state_t state)
 {
   return (state->heartbeat > 0);
 }
 
+/* Reads the coarse clock for heartbeat bookkeeping. Sending a frame doesn't
+   read the clock, it reuses the time read last: that can only be behind, so
+   at worst the next heartbeat is sent early. */
+static inline uint64_t amqp_heartbeat_clock(amqp_connection_state_t state)
+{
+  state->heartbeat_timestamp = amqp_get_coarse_timestamp();
+  return state->heartbeat_timestamp;
+}
+
 static inline uint64_t amqp_calc_next_send_heartbeat(amqp_connection_state_t state, uint64_t cur)
 {
   return cur + ((uint64_t)state->heartbeat * AMQP_NS_PER_S);
@@ -181,8 +348,84 @@ static inline uint64_t amqp_calc_next_recv_heartbeat(amqp_connection_state_t sta
   return cur + ((uint64_t)state->heartbeat * 2 * AMQP_NS_PER_S);
 }
 
+/* Decodes the next frame from the socket buffer, in place when the whole
+   frame is there. Returns the number of bytes consumed. Frames decoded in
+   place stay valid until the buffers of their channel are released, just
+   like frames copied into the channel pool. */
+int amqp_handle_buffered_input(amqp_connection_state_t state,
+                               amqp_frame_t *decoded_frame);
+
+/* Frames whose remaining payload is at least this large are received
+   directly into the frame buffer, bypassing the socket buffer */
+#define AMQP_DIRECT_RECV_THRESHOLD 16384
+
+/* If a large frame is partially read, sets remainder to the part of the
+   frame buffer still to be filled and returns true */
+amqp_boolean_t amqp_frame_remainder(amqp_connection_state_t state,
+                                    amqp_bytes_t *remainder);
+
+/* Records that len bytes were received into the frame remainder */
+void amqp_frame_remainder_received(amqp_connection_state_t state, size_t len);
+
+/* True when a frame received directly into its buffer is complete and
+   waiting to be decoded */
+amqp_boolean_t amqp_frame_ready(amqp_connection_state_t state);
+
+/* Makes sure the socket buffer can be read into without clobbering frames
+   that are still pinned */
+int amqp_prepare_recv_buffer(amqp_connection_state_t state);
+
+/* Decodes the frames already sitting in the socket buffer and queues them */
+int amqp_queue_buffered_frames(amqp_connection_state_t state);
+
 int amqp_try_recv(amqp_connection_state_t state, uint64_t current_time);
 
+/* Encodes a frame, including the frame header and footer, into buffer.
+   Body frames are copied. On success encoded refers to the frame within
+   buffer. */
+int amqp_frame_to_bytes(const amqp_frame_t *frame, amqp_bytes_t buffer,
+                        amqp_bytes_t *encoded);
+
+/* Maximum number of vector entries handed to the socket in one writev */
+#if defined(IOV_MAX) && IOV_MAX < 256
+# define AMQP_SEND_CONTENT_IOVECS IOV_MAX
+#else
+# define AMQP_SEND_CONTENT_IOVECS 256
+#endif
+
+/* Encodes frame at the end of the bytes pending in the outbound buffer,
+   flushing them first if there isn't room for it */
+int amqp_append_frame(amqp_connection_state_t state, const amqp_frame_t *frame);
+
+/* Copies properties, and everything they refer to, into pool */
+int amqp_basic_properties_clone(amqp_basic_properties_t *original,
+                                amqp_basic_properties_t *clone,
+                                amqp_pool_t *pool);
+
+/* Sends the bytes pending in the outbound buffer */
+int amqp_flush_outbound(amqp_connection_state_t state);
+
+/* Writes iov to the socket. In non-blocking mode whatever the socket doesn't
+   take right away is copied to the pending output. May modify iov. */
+int amqp_write_iov(amqp_connection_state_t state, struct iovec *iov, int iovcnt);
+
+/* Writes as much of the pending output as the socket takes without blocking */
+int amqp_flush_pending_output(amqp_connection_state_t state);
+
+static inline amqp_boolean_t amqp_output_pending(amqp_connection_state_t state)
+{
+  return state->pending_output_offset < state->pending_output_len;
+}
+
+/*
+ * Sends the already encoded frames followed by body, split into body frames
+ * on channel. Everything is composed into a single vector and written with
+ * one writev, unless the body needs more frames than fit in one vector.
+ * encoded may live at the start of the connection's outbound buffer.
+ */
+int amqp_send_content(amqp_connection_state_t state, amqp_bytes_t encoded,
+                      amqp_channel_t channel, amqp_bytes_t body);
+
 static inline void *amqp_offset(void *data, size_t offset)
 {
   return (char *)data + offset;
@@ -270,51 +513,64 @@ static inline void *amqp_offset(void *data, size_t offset)
 /* Don't define anything */
 #endif
 
-#if defined(AMQP_LITTLE_ENDIAN)
+/* Byte swapping, with the compiler's builtins where it has them so that
+   each turns into a single instruction */
+#if defined(__clang__)
+# if __has_builtin(__builtin_bswap16) && __has_builtin(__builtin_bswap32) && \
+     __has_builtin(__builtin_bswap64)
+#  define AMQP_HAVE_BSWAP_BUILTINS
+# endif
+#elif defined(__GNUC__) &&                                                  \
+      (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
+# define AMQP_HAVE_BSWAP_BUILTINS
+#endif
 
-#define DECLARE_XTOXLL(func)                        \
-  static inline uint64_t func##ll(uint64_t val)     \
-  {                                                 \
-    union {                                         \
-      uint64_t whole;                               \
-      uint32_t halves[2];                           \
-    } u;                                            \
-    uint32_t t;                                     \
-    u.whole = val;                                  \
-    t = u.halves[0];                                \
-    u.halves[0] = func##l(u.halves[1]);             \
-    u.halves[1] = func##l(t);                       \
-    return u.whole;                                 \
-  }
+#if defined(AMQP_HAVE_BSWAP_BUILTINS)
+# define amqp_bswap16(val) __builtin_bswap16(val)
+# define amqp_bswap32(val) __builtin_bswap32(val)
+# define amqp_bswap64(val) __builtin_bswap64(val)
+#elif defined(_MSC_VER)
+# include <stdlib.h>
+# define amqp_bswap16(val) _byteswap_ushort(val)
+# define amqp_bswap32(val) _byteswap_ulong(val)
+# define amqp_bswap64(val) _byteswap_uint64(val)
+#else
+static inline uint16_t amqp_bswap16(uint16_t val)
+{
+  return (uint16_t)((val << 8) | (val >> 8));
+}
 
-#elif defined(AMQP_BIG_ENDIAN)
+static inline uint32_t amqp_bswap32(uint32_t val)
+{
+  return ((val & 0x000000FFu) << 24) | ((val & 0x0000FF00u) << 8) |
+         ((val & 0x00FF0000u) >> 8) | ((val & 0xFF000000u) >> 24);
+}
 
-#define DECLARE_XTOXLL(func)                        \
-  static inline uint64_t func##ll(uint64_t val)     \
-  {                                                 \
-    union {                                         \
-      uint64_t whole;                               \
-      uint32_t halves[2];                           \
-    } u;                                            \
-    u.whole = val;                                  \
-    u.halves[0] = func##l(u.halves[0]);             \
-    u.halves[1] = func##l(u.halves[1]);             \
-    return u.whole;                                 \
-  }
+static inline uint64_t amqp_bswap64(uint64_t val)
+{
+  return ((uint64_t)amqp_bswap32((uint32_t)val) << 32) |
+         amqp_bswap32((uint32_t)(val >> 32));
+}
+#endif
 
+/* Conversions between host and network byte order, the same in both
+   directions */
+#if defined(AMQP_LITTLE_ENDIAN)
+# define amqp_hton16(val) amqp_bswap16(val)
+# define amqp_hton32(val) amqp_bswap32(val)
+# define amqp_hton64(val) amqp_bswap64(val)
+#elif defined(AMQP_BIG_ENDIAN)
+# define amqp_hton16(val) (val)
+# define amqp_hton32(val) (val)
+# define amqp_hton64(val) (val)
 #else
 # error Endianness not known
 #endif
 
-#ifndef HAVE_HTONLL
-DECLARE_XTOXLL(hton)
-DECLARE_XTOXLL(ntoh)
-#endif
-
 DECLARE_CODEC_BASE_TYPE(8, (uint8_t), (uint8_t))
-DECLARE_CODEC_BASE_TYPE(16, htons, ntohs)
-DECLARE_CODEC_BASE_TYPE(32, htonl, ntohl)
-DECLARE_CODEC_BASE_TYPE(64, htonll, ntohll)
+DECLARE_CODEC_BASE_TYPE(16, amqp_hton16, amqp_hton16)
+DECLARE_CODEC_BASE_TYPE(32, amqp_hton32, amqp_hton32)
+DECLARE_CODEC_BASE_TYPE(64, amqp_hton64, amqp_hton64)
 
 static inline int amqp_encode_bytes(amqp_bytes_t encoded, size_t *offset,
                                     amqp_bytes_t input)
@@ -42,6 +42,7 @@
 #include "amqp_timer.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -64,6 +65,7 @@
 # include <netdb.h>
 # include <sys/uio.h>
 # include <fcntl.h>
+# include <poll.h>
 # include <unistd.h>
 #endif
 
@@ -186,6 +188,48 @@ amqp_os_socket_close(int sockfd)
 #endif
 }
 
+/* Waits up to timeout (forever if NULL) for sockfd to become readable, or
+ * writable if for_write is set. Errors on the socket count as ready, the next
+ * operation on it reports them. Returns > 0 when ready, 0 on timeout and -1 on
+ * failure, with the reason in amqp_os_socket_error().
+ */
+static int
+amqp_os_socket_wait(int sockfd, amqp_boolean_t for_write,
+                    struct timeval *timeout)
+{
+#ifdef _WIN32
+  fd_set fds;
+  fd_set except_fds;
+
+  FD_ZERO(&fds);
+  FD_SET(sockfd, &fds);
+
+  /* Win32 requires except_fds to be passed to detect connection failure */
+  FD_ZERO(&except_fds);
+  FD_SET(sockfd, &except_fds);
+
+  return select(sockfd + 1, for_write ? NULL : &fds, for_write ? &fds : NULL,
+                &except_fds, timeout);
+#else
+  /* poll() rather than select(): it has no FD_SETSIZE limit on sockfd and
+     its cost doesn't grow with the descriptor number */
+  struct pollfd pfd;
+  int timeout_ms = -1;
+
+  if (timeout) {
+    uint64_t ms = (uint64_t)timeout->tv_sec * 1000 +
+                  ((uint64_t)timeout->tv_usec + 999) / 1000;
+    timeout_ms = ms > INT_MAX ? INT_MAX : (int)ms;
+  }
+
+  pfd.fd = sockfd;
+  pfd.events = for_write ? POLLOUT : POLLIN;
+  pfd.revents = 0;
+
+  return poll(&pfd, 1, timeout_ms);
+#endif
+}
+
 ssize_t
 amqp_socket_writev(amqp_socket_t *self, struct iovec *iov, int iovcnt)
 {
@@ -194,6 +238,14 @@ amqp_socket_writev(amqp_socket_t *self, struct iovec *iov, int iovcnt)
   return self->klass->writev(self, iov, iovcnt);
 }
 
+ssize_t
+amqp_socket_try_writev(amqp_socket_t *self, struct iovec *iov, int iovcnt)
+{
+  assert(self);
+  assert(self->klass->try_writev);
+  return self->klass->try_writev(self, iov, iovcnt);
+}
+
 ssize_t
 amqp_socket_send(amqp_socket_t *self, const void *buf, size_t len)
 {
@@ -349,15 +401,6 @@ int amqp_open_socket_noblock(char const *hostname,
 #endif
 
         while(1) {
-          fd_set write_fd;
-          fd_set except_fd;
-
-          FD_ZERO(&write_fd);
-          FD_SET(sockfd, &write_fd);
-
-          FD_ZERO(&except_fd);
-          FD_SET(sockfd, &except_fd);
-
           timer_error = amqp_timer_update(&timer, timeout);
 
           if (timer_error < 0) {
@@ -365,11 +408,7 @@ int amqp_open_socket_noblock(char const *hostname,
             break;
           }
 
-          /* Win32 requires except_fds to be passed to detect connection
-           * failure. Other platforms only need write_fds, passing except_fds
-           * seems to be harmless otherwise
-           */
-          res = select(sockfd+1, NULL, &write_fd, &except_fd, &timer.tv);
+          res = amqp_os_socket_wait(sockfd, 1, &timer.tv);
 
           if (res > 0) {
             int result;
@@ -452,7 +491,11 @@ int amqp_send_header(amqp_connection_state_t state)
                                      AMQP_PROTOCOL_VERSION_MINOR,
                                      AMQP_PROTOCOL_VERSION_REVISION
                                    };
-  return amqp_socket_send(state->socket, header, sizeof(header));
+  struct iovec iov;
+
+  iov.iov_base = (void *)header;
+  iov.iov_len = sizeof(header);
+  return amqp_write_iov(state, &iov, 1);
 }
 
 static amqp_bytes_t sasl_method_name(amqp_sasl_method_enum method)
@@ -519,36 +562,90 @@ amqp_boolean_t amqp_frames_enqueued(amqp_connection_state_t state)
  */
 amqp_boolean_t amqp_data_in_buffer(amqp_connection_state_t state)
 {
-  return (state->sock_inbound_offset < state->sock_inbound_limit);
+  return (state->sock_inbound_offset < state->sock_inbound_limit ||
+          amqp_frame_ready(state));
 }
 
 static int consume_one_frame(amqp_connection_state_t state, amqp_frame_t *decoded_frame)
 {
   int res;
 
-  amqp_bytes_t buffer;
-  buffer.len = state->sock_inbound_limit - state->sock_inbound_offset;
-  buffer.bytes = ((char *) state->sock_inbound_buffer.bytes) + state->sock_inbound_offset;
-
-  res = amqp_handle_input(state, buffer, decoded_frame);
+  res = amqp_handle_buffered_input(state, decoded_frame);
   if (res < 0) {
     return res;
   }
 
   state->sock_inbound_offset += res;
 
+  if (AMQP_FRAME_METHOD == decoded_frame->frame_type &&
+      (AMQP_BASIC_ACK_METHOD == decoded_frame->payload.method.id ||
+       AMQP_BASIC_NACK_METHOD == decoded_frame->payload.method.id)) {
+    /* Confirms for channels being tracked never reach the caller */
+    return amqp_confirm_handle_frame(state, decoded_frame);
+  }
+
   return AMQP_STATUS_OK;
 }
 
 
+/* Reads whatever the socket has, or blocks until it has something unless the
+   socket is non-blocking */
+static int recv_available(amqp_connection_state_t state)
+{
+  int res;
+  amqp_bytes_t remainder;
+
+  if (amqp_frame_remainder(state, &remainder)) {
+    /* The rest of a large frame goes straight into the frame buffer rather
+       than through the socket buffer */
+    res = amqp_socket_recv(state->socket, remainder.bytes, remainder.len, 0);
+
+    if (res < 0) {
+      return res;
+    }
+
+    amqp_frame_remainder_received(state, res);
+  } else {
+    res = amqp_prepare_recv_buffer(state);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
+    res = amqp_socket_recv(state->socket, state->sock_inbound_buffer.bytes,
+                           state->sock_inbound_buffer.len, 0);
+
+    if (res < 0) {
+      return res;
+    }
+
+    state->sock_inbound_limit = res;
+    state->sock_inbound_offset = 0;
+  }
+
+  if (res > 0 && amqp_heartbeat_enabled(state)) {
+    uint64_t current_time = amqp_heartbeat_clock(state);
+    if (0 == current_time) {
+      return AMQP_STATUS_TIMER_FAILURE;
+    }
+    state->next_recv_heartbeat = amqp_calc_next_recv_heartbeat(state, current_time);
+  }
+
+  return AMQP_STATUS_OK;
+}
+
 static int recv_with_timeout(amqp_connection_state_t state, uint64_t start, struct timeval *timeout)
 {
   int res;
 
-  if (timeout) {
+  /* Leave whatever the broker sends in the socket until the caller has
+     released enough of what was already received */
+  if (amqp_memory_limit_reached(state)) {
+    return AMQP_STATUS_MEMORY_LIMIT;
+  }
+
+  /* A non-blocking socket has to be waited on even without a timeout */
+  if (timeout || state->nonblocking) {
     int fd;
-    fd_set read_fd;
-    fd_set except_fd;
 
     fd = amqp_get_sockfd(state);
     if (-1 == fd) {
@@ -556,13 +653,7 @@ static int recv_with_timeout(amqp_connection_state_t state, uint64_t start, stru
     }
 
     while (1) {
-      FD_ZERO(&read_fd);
-      FD_SET(fd, &read_fd);
-
-      FD_ZERO(&except_fd);
-      FD_SET(fd, &except_fd);
-
-      res = select(fd + 1, &read_fd, NULL, &except_fd, timeout);
+      res = amqp_os_socket_wait(fd, 0, timeout);
 
       if (0 < res) {
         break;
@@ -596,31 +687,11 @@ static int recv_with_timeout(amqp_connection_state_t state, uint64_t start, stru
     }
   }
 
-  res = amqp_socket_recv(state->socket, state->sock_inbound_buffer.bytes,
-                         state->sock_inbound_buffer.len, 0);
-
-  if (res < 0) {
-    return res;
-  }
-
-  state->sock_inbound_limit = res;
-  state->sock_inbound_offset = 0;
-
-  if (amqp_heartbeat_enabled(state)) {
-    uint64_t current_time = amqp_get_monotonic_timestamp();
-    if (0 == current_time) {
-      return AMQP_STATUS_TIMER_FAILURE;
-    }
-    state->next_recv_heartbeat = amqp_calc_next_recv_heartbeat(state, current_time);
-  }
-
-  return AMQP_STATUS_OK;
+  return recv_available(state);
 }
 
-int amqp_try_recv(amqp_connection_state_t state, uint64_t current_time)
+int amqp_queue_buffered_frames(amqp_connection_state_t state)
 {
-  struct timeval tv;
-
   while (amqp_data_in_buffer(state)) {
     amqp_frame_t frame;
     int res = consume_one_frame(state, &frame);
@@ -630,34 +701,24 @@ int amqp_try_recv(amqp_connection_state_t state, uint64_t current_time)
     }
 
     if (frame.frame_type != 0) {
-      amqp_pool_t *channel_pool;
-      amqp_frame_t *frame_copy;
-      amqp_link_t *link;
-
-      channel_pool = amqp_get_or_create_channel_pool(state, frame.channel);
-      if (NULL == channel_pool) {
-        return AMQP_STATUS_NO_MEMORY;
-      }
-
-      frame_copy = amqp_pool_alloc(channel_pool, sizeof(amqp_frame_t));
-      link = amqp_pool_alloc(channel_pool, sizeof(amqp_link_t));
-
-      if (frame_copy == NULL || link == NULL) {
-        return AMQP_STATUS_NO_MEMORY;
+      res = amqp_queue_frame(state, &frame);
+      if (AMQP_STATUS_OK != res) {
+        return res;
       }
+    }
+  }
 
-      *frame_copy = frame;
+  return AMQP_STATUS_OK;
+}
 
-      link->next = NULL;
-      link->data = frame_copy;
+int amqp_try_recv(amqp_connection_state_t state, uint64_t current_time)
+{
+  struct timeval tv;
+  int res;
 
-      if (state->last_queued_frame == NULL) {
-        state->first_queued_frame = link;
-      } else {
-        state->last_queued_frame->next = link;
-      }
-      state->last_queued_frame = link;
-    }
+  res = amqp_queue_buffered_frames(state);
+  if (AMQP_STATUS_OK != res) {
+    return res;
   }
 
   memset(&tv, 0, sizeof(struct timeval));
@@ -667,6 +728,18 @@ int amqp_try_recv(amqp_connection_state_t state, uint64_t current_time)
   return recv_with_timeout(state, current_time, &tv);
 }
 
+/* Timeouts set by the caller are kept to the precise clock, heartbeats alone
+   make do with the coarse one */
+static uint64_t wait_timestamp(amqp_connection_state_t state,
+                               struct timeval *timeout)
+{
+  if (timeout) {
+    state->heartbeat_timestamp = amqp_get_monotonic_timestamp();
+    return state->heartbeat_timestamp;
+  }
+  return amqp_heartbeat_clock(state);
+}
+
 static int wait_frame_inner(amqp_connection_state_t state,
                             amqp_frame_t *decoded_frame,
                             struct timeval *timeout)
@@ -706,7 +779,7 @@ beginrecv:
     if (timeout || amqp_heartbeat_enabled(state)) {
       uint64_t ns_until_next_timeout;
 
-      current_timestamp = amqp_get_monotonic_timestamp();
+      current_timestamp = wait_timestamp(state, timeout);
       if (0 == current_timestamp) {
         return AMQP_STATUS_TIMER_FAILURE;
       }
@@ -721,7 +794,7 @@ beginrecv:
           return res;
         }
 
-        current_timestamp = amqp_get_monotonic_timestamp();
+        current_timestamp = wait_timestamp(state, timeout);
         if (0 == current_timestamp) {
           return AMQP_STATUS_TIMER_FAILURE;
         }
@@ -786,60 +859,118 @@ beginrecv:
   }
 }
 
-int amqp_queue_frame(amqp_connection_state_t state, amqp_frame_t *frame)
+/* Whether data was decoded in place in a receive buffer pinned by the
+   channel of entry, rather than copied into the channel pool */
+static amqp_boolean_t in_pinned_buffer(amqp_pool_table_entry_t *entry,
+                                       void *data)
 {
   amqp_link_t *link;
-  amqp_frame_t *frame_copy;
 
-  amqp_pool_t *channel_pool = amqp_get_or_create_channel_pool(state, frame->channel);
+  for (link = entry->pinned_buffers; NULL != link; link = link->next) {
+    char *start = amqp_recv_buffer_data(link->data);
+    amqp_recv_buffer_t *buffer = link->data;
 
-  if (NULL == channel_pool) {
-    return AMQP_STATUS_NO_MEMORY;
+    if ((char *)data >= start && (char *)data < start + buffer->len) {
+      return 1;
+    }
   }
+  return 0;
+}
+
+int amqp_queue_frame(amqp_connection_state_t state, amqp_frame_t *frame)
+{
+  amqp_queued_frame_t *queued;
+  amqp_pool_table_entry_t *entry;
 
-  link = amqp_pool_alloc(channel_pool, sizeof(amqp_link_t));
-  frame_copy = amqp_pool_alloc(channel_pool, sizeof(amqp_frame_t));
+  entry = amqp_get_or_create_channel_entry(state, frame->channel);
+  if (NULL == entry) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
 
-  if (NULL == link || NULL == frame_copy) {
+  queued = amqp_pool_alloc(&entry->pool, sizeof(amqp_queued_frame_t));
+  if (NULL == queued) {
     return AMQP_STATUS_NO_MEMORY;
   }
 
-  *frame_copy = *frame;
-  link->data = frame_copy;
+  queued->frame = *frame;
+
+  switch (frame->frame_type) {
+  case AMQP_FRAME_BODY:
+    queued->size = frame->payload.body_fragment.len;
+    break;
+  case AMQP_FRAME_HEADER:
+    queued->size = frame->payload.properties.raw.len;
+    break;
+  default:
+    queued->size = 0;
+    break;
+  }
+  if (0 != queued->size &&
+      !in_pinned_buffer(entry, AMQP_FRAME_BODY == frame->frame_type ?
+                               frame->payload.body_fragment.bytes :
+                               frame->payload.properties.raw.bytes)) {
+    queued->size = 0;
+  }
+  state->memory_stats.queued_frame_bytes += queued->size;
 
-  if (NULL == state->first_queued_frame) {
-    state->first_queued_frame = link;
+  queued->next = NULL;
+  queued->prev = state->last_queued_frame;
+  if (NULL == state->last_queued_frame) {
+    state->first_queued_frame = queued;
   } else {
-    state->last_queued_frame->next = link;
+    state->last_queued_frame->next = queued;
   }
+  state->last_queued_frame = queued;
 
-  link->next = NULL;
-  state->last_queued_frame = link;
+  queued->channel_next = NULL;
+  if (NULL == entry->last_queued_frame) {
+    entry->first_queued_frame = queued;
+  } else {
+    entry->last_queued_frame->channel_next = queued;
+  }
+  entry->last_queued_frame = queued;
 
   return AMQP_STATUS_OK;
 }
 
+/* Takes the first frame queued for the channel of entry off both queues */
+static void dequeue_channel_frame(amqp_connection_state_t state,
+                                  amqp_pool_table_entry_t *entry,
+                                  amqp_frame_t *decoded_frame)
+{
+  amqp_queued_frame_t *queued = entry->first_queued_frame;
+
+  entry->first_queued_frame = queued->channel_next;
+  if (NULL == entry->first_queued_frame) {
+    entry->last_queued_frame = NULL;
+  }
+
+  if (NULL == queued->prev) {
+    state->first_queued_frame = queued->next;
+  } else {
+    queued->prev->next = queued->next;
+  }
+  if (NULL == queued->next) {
+    state->last_queued_frame = queued->prev;
+  } else {
+    queued->next->prev = queued->prev;
+  }
+
+  state->memory_stats.queued_frame_bytes -= queued->size;
+  *decoded_frame = queued->frame;
+}
+
 int amqp_simple_wait_frame_on_channel(amqp_connection_state_t state,
                                       amqp_channel_t channel,
                                       amqp_frame_t *decoded_frame)
 {
-  amqp_frame_t *frame_ptr;
-  amqp_link_t *cur;
+  amqp_pool_table_entry_t *entry;
   int res;
 
-  for (cur = state->first_queued_frame; NULL != cur; cur = cur->next) {
-    frame_ptr = cur->data;
-
-    if (channel == frame_ptr->channel) {
-      state->first_queued_frame = cur->next;
-      if (NULL == state->first_queued_frame) {
-        state->last_queued_frame = NULL;
-      }
-
-      *decoded_frame = *frame_ptr;
-
-      return AMQP_STATUS_OK;
-    }
+  entry = amqp_get_channel_entry(state, channel);
+  if (NULL != entry && NULL != entry->first_queued_frame) {
+    dequeue_channel_frame(state, entry, decoded_frame);
+    return AMQP_STATUS_OK;
   }
 
   while (1) {
@@ -871,18 +1002,176 @@ int amqp_simple_wait_frame_noblock(amqp_connection_state_t state,
                                    struct timeval *timeout)
 {
   if (state->first_queued_frame != NULL) {
-    amqp_frame_t *f = (amqp_frame_t *) state->first_queued_frame->data;
-    state->first_queued_frame = state->first_queued_frame->next;
-    if (state->first_queued_frame == NULL) {
-      state->last_queued_frame = NULL;
-    }
-    *decoded_frame = *f;
+    /* The oldest frame overall is also the oldest on its channel */
+    amqp_pool_table_entry_t *entry =
+      amqp_get_channel_entry(state, state->first_queued_frame->frame.channel);
+    dequeue_channel_frame(state, entry, decoded_frame);
     return AMQP_STATUS_OK;
   } else {
     return wait_frame_inner(state, decoded_frame, timeout);
   }
 }
 
+int amqp_set_nonblocking(amqp_connection_state_t state, amqp_boolean_t nonblocking)
+{
+  int fd;
+  int res;
+
+  fd = amqp_get_sockfd(state);
+  if (-1 == fd) {
+    return AMQP_STATUS_CONNECTION_CLOSED;
+  }
+
+  if (nonblocking && NULL == state->socket->klass->try_writev) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  res = amqp_os_socket_setsockblock(fd, !nonblocking);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  state->nonblocking = nonblocking;
+
+  if (!nonblocking && amqp_output_pending(state)) {
+    res = amqp_socket_send(state->socket,
+                           amqp_offset(state->pending_output.bytes,
+                                       state->pending_output_offset),
+                           state->pending_output_len - state->pending_output_offset);
+    state->pending_output_offset = 0;
+    state->pending_output_len = 0;
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+int amqp_get_io_events(amqp_connection_state_t state)
+{
+  int events = 0;
+
+  if (-1 == amqp_get_sockfd(state)) {
+    return 0;
+  }
+
+  if (!amqp_memory_limit_reached(state)) {
+    events |= AMQP_IO_READABLE;
+  }
+  if (amqp_output_pending(state)) {
+    events |= AMQP_IO_WRITABLE;
+  }
+  return events;
+}
+
+int amqp_handle_io(amqp_connection_state_t state, int events)
+{
+  int res;
+
+  if (events & AMQP_IO_WRITABLE) {
+    res = amqp_flush_pending_output(state);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+
+  if ((events & AMQP_IO_READABLE) && !amqp_memory_limit_reached(state)) {
+    /* Frames the caller hasn't polled yet would be overwritten by the read */
+    res = amqp_queue_buffered_frames(state);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
+    res = recv_available(state);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+
+  if (amqp_heartbeat_enabled(state)) {
+    uint64_t current_timestamp = amqp_heartbeat_clock(state);
+    if (0 == current_timestamp) {
+      return AMQP_STATUS_TIMER_FAILURE;
+    }
+
+    /* The coarse clock often lands right on a deadline, which
+       amqp_get_next_timeout() has already reported as reached */
+    if (current_timestamp >= state->next_recv_heartbeat) {
+      amqp_socket_close(state->socket);
+      return AMQP_STATUS_HEARTBEAT_TIMEOUT;
+    }
+
+    if (current_timestamp >= state->next_send_heartbeat) {
+      amqp_frame_t heartbeat;
+      heartbeat.channel = 0;
+      heartbeat.frame_type = AMQP_FRAME_HEARTBEAT;
+
+      res = amqp_send_frame(state, &heartbeat);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+int amqp_poll_frame(amqp_connection_state_t state, amqp_frame_t *decoded_frame)
+{
+  int res;
+
+  /* Heartbeats are skipped, but channel 0 isn't released for them: the
+     caller may still hold frames it received on it */
+  while (state->first_queued_frame != NULL) {
+    amqp_pool_table_entry_t *entry =
+      amqp_get_channel_entry(state, state->first_queued_frame->frame.channel);
+    dequeue_channel_frame(state, entry, decoded_frame);
+
+    if (AMQP_FRAME_HEARTBEAT != decoded_frame->frame_type) {
+      return AMQP_STATUS_OK;
+    }
+  }
+
+  while (amqp_data_in_buffer(state)) {
+    res = consume_one_frame(state, decoded_frame);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
+    if (decoded_frame->frame_type != 0 &&
+        AMQP_FRAME_HEARTBEAT != decoded_frame->frame_type) {
+      return AMQP_STATUS_OK;
+    }
+  }
+
+  decoded_frame->frame_type = 0;
+  return AMQP_STATUS_OK;
+}
+
+amqp_boolean_t amqp_get_next_timeout(amqp_connection_state_t state, struct timeval *timeout)
+{
+  uint64_t current_timestamp;
+  uint64_t next_timestamp;
+  uint64_t ns_left = 0;
+
+  if (!amqp_heartbeat_enabled(state)) {
+    return 0;
+  }
+
+  next_timestamp = (state->next_recv_heartbeat < state->next_send_heartbeat ?
+                    state->next_recv_heartbeat :
+                    state->next_send_heartbeat);
+
+  current_timestamp = amqp_get_coarse_timestamp();
+  if (current_timestamp < next_timestamp) {
+    ns_left = next_timestamp - current_timestamp;
+  }
+
+  timeout->tv_sec = ns_left / AMQP_NS_PER_S;
+  timeout->tv_usec = (ns_left % AMQP_NS_PER_S) / AMQP_NS_PER_US;
+  return 1;
+}
+
 int amqp_simple_wait_method(amqp_connection_state_t state,
                             amqp_channel_t expected_channel,
                             amqp_method_number_t expected_method,
@@ -976,38 +1265,13 @@ retry:
              && (frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD))
           )
          )) {
-      amqp_pool_t *channel_pool;
-      amqp_frame_t *frame_copy;
-      amqp_link_t *link;
-
-      channel_pool = amqp_get_or_create_channel_pool(state, frame.channel);
-      if (NULL == channel_pool) {
+      status = amqp_queue_frame(state, &frame);
+      if (AMQP_STATUS_OK != status) {
         result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-        result.library_error = AMQP_STATUS_NO_MEMORY;
+        result.library_error = status;
         return result;
       }
 
-      frame_copy = amqp_pool_alloc(channel_pool, sizeof(amqp_frame_t));
-      link = amqp_pool_alloc(channel_pool, sizeof(amqp_link_t));
-
-      if (frame_copy == NULL || link == NULL) {
-        result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-        result.library_error = AMQP_STATUS_NO_MEMORY;
-        return result;
-      }
-
-      *frame_copy = frame;
-
-      link->next = NULL;
-      link->data = frame_copy;
-
-      if (state->last_queued_frame == NULL) {
-        state->first_queued_frame = link;
-      } else {
-        state->last_queued_frame->next = link;
-      }
-      state->last_queued_frame = link;
-
       goto retry;
     }
 
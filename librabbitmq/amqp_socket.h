@@ -50,6 +50,7 @@ typedef int (*amqp_socket_open_fn)(void *, const char *, int, struct timeval *);
 typedef int (*amqp_socket_close_fn)(void *);
 typedef int (*amqp_socket_get_sockfd_fn)(void *);
 typedef void (*amqp_socket_delete_fn)(void *);
+typedef ssize_t (*amqp_socket_try_writev_fn)(void *, struct iovec *, int);
 
 /** V-table for amqp_socket_t */
 struct amqp_socket_class_t {
@@ -60,6 +61,8 @@ struct amqp_socket_class_t {
   amqp_socket_close_fn close;
   amqp_socket_get_sockfd_fn get_sockfd;
   amqp_socket_delete_fn delete;
+  /* optional, socket types without it can't be used in non-blocking mode */
+  amqp_socket_try_writev_fn try_writev;
 };
 
 /** Abstract base class for amqp_socket_t */
@@ -108,6 +111,22 @@ amqp_set_socket(amqp_connection_state_t state, amqp_socket_t *socket);
 ssize_t
 amqp_socket_writev(amqp_socket_t *self, struct iovec *iov, int iovcnt);
 
+/**
+ * Write to a socket without blocking.
+ *
+ * Writes as much of the data referred to in iov as the socket takes right
+ * away. Only available if the socket class has a try_writev method.
+ *
+ * \param [in,out] self A socket object.
+ * \param [in] iov One or more data vecors.
+ * \param [in] iovcnt The number of vectors in \e iov.
+ *
+ * \return The number of bytes written, which may be 0, or < 0 on error
+ * (\ref amqp_status_enum)
+ */
+ssize_t
+amqp_socket_try_writev(amqp_socket_t *self, struct iovec *iov, int iovcnt);
+
 /**
  * Send a message from a socket.
  *
@@ -135,7 +154,8 @@ amqp_socket_send(amqp_socket_t *self, const void *buf, size_t len);
  * \param [in] len The number of bytes at \e buf.
  * \param [in] flags Receive flags, implementation specific.
  *
- * \return The number of bytes received, or < 0 on error (\ref amqp_status_enum)
+ * \return The number of bytes received, 0 if a non-blocking socket has
+ * nothing to read, or < 0 on error (\ref amqp_status_enum)
  */
 ssize_t
 amqp_socket_recv(amqp_socket_t *self, void *buf, size_t len, int flags);
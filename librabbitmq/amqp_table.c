@@ -45,9 +45,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define INITIAL_ARRAY_SIZE 16
-#define INITIAL_TABLE_SIZE 16
-
 static int amqp_decode_field_value(amqp_bytes_t encoded,
                                    amqp_pool_t *pool,
                                    amqp_field_value_t *entry,
@@ -59,64 +56,144 @@ static int amqp_encode_field_value(amqp_bytes_t encoded,
 
 /*---------------------------------------------------------------------------*/
 
+/* Moves offset past an encoded field value without decoding it. Returns 0 if
+   the value is malformed or runs past the end of encoded. */
+static int amqp_skip_field_value(amqp_bytes_t encoded, size_t *offset)
+{
+  uint8_t kind;
+  uint32_t len;
+  amqp_bytes_t skipped;
+
+  if (!amqp_decode_8(encoded, offset, &kind)) {
+    return 0;
+  }
+
+  switch (kind) {
+  case AMQP_FIELD_KIND_BOOLEAN:
+  case AMQP_FIELD_KIND_I8:
+  case AMQP_FIELD_KIND_U8:
+    len = 1;
+    break;
+
+  case AMQP_FIELD_KIND_I16:
+  case AMQP_FIELD_KIND_U16:
+    len = 2;
+    break;
+
+  case AMQP_FIELD_KIND_I32:
+  case AMQP_FIELD_KIND_U32:
+  case AMQP_FIELD_KIND_F32:
+    len = 4;
+    break;
+
+  case AMQP_FIELD_KIND_DECIMAL:
+    len = 5;
+    break;
+
+  case AMQP_FIELD_KIND_I64:
+  case AMQP_FIELD_KIND_U64:
+  case AMQP_FIELD_KIND_F64:
+  case AMQP_FIELD_KIND_TIMESTAMP:
+    len = 8;
+    break;
+
+  case AMQP_FIELD_KIND_UTF8:
+  case AMQP_FIELD_KIND_BYTES:
+  case AMQP_FIELD_KIND_ARRAY:
+  case AMQP_FIELD_KIND_TABLE:
+    /* all of these are prefixed with their size */
+    if (!amqp_decode_32(encoded, offset, &len)) {
+      return 0;
+    }
+    break;
+
+  case AMQP_FIELD_KIND_VOID:
+    len = 0;
+    break;
+
+  default:
+    return 0;
+  }
+
+  return amqp_decode_bytes(encoded, offset, &skipped, len);
+}
+
+/* The entries are counted before they are decoded so that exactly enough
+   memory for them can be taken from the pool. Nested arrays and tables are
+   skipped over by the count, and counted when they are decoded in turn. */
+
+static int amqp_count_array_entries(amqp_bytes_t encoded, size_t offset,
+                                    size_t limit, int *num_entries)
+{
+  int count = 0;
+
+  while (offset < limit) {
+    if (!amqp_skip_field_value(encoded, &offset)) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+    count++;
+  }
+
+  *num_entries = count;
+  return AMQP_STATUS_OK;
+}
+
+static int amqp_count_table_entries(amqp_bytes_t encoded, size_t offset,
+                                    size_t limit, int *num_entries)
+{
+  int count = 0;
+
+  while (offset < limit) {
+    uint8_t keylen;
+    amqp_bytes_t key;
+
+    if (!amqp_decode_8(encoded, &offset, &keylen)
+        || !amqp_decode_bytes(encoded, &offset, &key, keylen)
+        || !amqp_skip_field_value(encoded, &offset)) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+    count++;
+  }
+
+  *num_entries = count;
+  return AMQP_STATUS_OK;
+}
+
 static int amqp_decode_array(amqp_bytes_t encoded,
                              amqp_pool_t *pool,
                              amqp_array_t *output,
                              size_t *offset)
 {
   uint32_t arraysize;
-  int num_entries = 0;
-  int allocated_entries = INITIAL_ARRAY_SIZE;
-  amqp_field_value_t *entries;
-  size_t limit;
+  int num_entries;
+  int i;
   int res;
 
   if (!amqp_decode_32(encoded, offset, &arraysize)) {
     return AMQP_STATUS_BAD_AMQP_DATA;
   }
 
-  entries = malloc(allocated_entries * sizeof(amqp_field_value_t));
-  if (entries == NULL) {
-    return AMQP_STATUS_NO_MEMORY;
-  }
-
-  limit = *offset + arraysize;
-  while (*offset < limit) {
-    if (num_entries >= allocated_entries) {
-      void *newentries;
-      allocated_entries = allocated_entries * 2;
-      newentries = realloc(entries, allocated_entries * sizeof(amqp_field_value_t));
-      res = AMQP_STATUS_NO_MEMORY;
-      if (newentries == NULL) {
-        goto out;
-      }
-
-      entries = newentries;
-    }
-
-    res = amqp_decode_field_value(encoded, pool, &entries[num_entries],
-                                  offset);
-    if (res < 0) {
-      goto out;
-    }
-
-    num_entries++;
+  res = amqp_count_array_entries(encoded, *offset, *offset + arraysize,
+                                 &num_entries);
+  if (res < 0) {
+    return res;
   }
 
   output->num_entries = num_entries;
   output->entries = amqp_pool_alloc(pool, num_entries * sizeof(amqp_field_value_t));
-  res = AMQP_STATUS_NO_MEMORY;
   /* NULL is legitimate if we requested a zero-length block. */
   if (output->entries == NULL && num_entries > 0) {
-    goto out;
+    return AMQP_STATUS_NO_MEMORY;
   }
 
-  memcpy(output->entries, entries, num_entries * sizeof(amqp_field_value_t));
-  res = 0;
+  for (i = 0; i < num_entries; i++) {
+    res = amqp_decode_field_value(encoded, pool, &output->entries[i], offset);
+    if (res < 0) {
+      return res;
+    }
+  }
 
-out:
-  free(entries);
-  return res;
+  return AMQP_STATUS_OK;
 }
 
 int amqp_decode_table(amqp_bytes_t encoded,
@@ -125,70 +202,43 @@ int amqp_decode_table(amqp_bytes_t encoded,
                       size_t *offset)
 {
   uint32_t tablesize;
-  int num_entries = 0;
-  amqp_table_entry_t *entries;
-  int allocated_entries = INITIAL_TABLE_SIZE;
-  size_t limit;
+  int num_entries;
+  int i;
   int res;
 
   if (!amqp_decode_32(encoded, offset, &tablesize)) {
     return AMQP_STATUS_BAD_AMQP_DATA;
   }
 
-  entries = malloc(allocated_entries * sizeof(amqp_table_entry_t));
-  if (entries == NULL) {
+  res = amqp_count_table_entries(encoded, *offset, *offset + tablesize,
+                                 &num_entries);
+  if (res < 0) {
+    return res;
+  }
+
+  output->num_entries = num_entries;
+  output->entries = amqp_pool_alloc(pool, num_entries * sizeof(amqp_table_entry_t));
+  /* NULL is legitimate if we requested a zero-length block. */
+  if (output->entries == NULL && num_entries > 0) {
     return AMQP_STATUS_NO_MEMORY;
   }
 
-  limit = *offset + tablesize;
-  while (*offset < limit) {
+  for (i = 0; i < num_entries; i++) {
+    amqp_table_entry_t *entry = &output->entries[i];
     uint8_t keylen;
 
-    res = AMQP_STATUS_BAD_AMQP_DATA;
-    if (!amqp_decode_8(encoded, offset, &keylen)) {
-      goto out;
-    }
-
-    if (num_entries >= allocated_entries) {
-      void *newentries;
-      allocated_entries = allocated_entries * 2;
-      newentries = realloc(entries, allocated_entries * sizeof(amqp_table_entry_t));
-      res = AMQP_STATUS_NO_MEMORY;
-      if (newentries == NULL) {
-        goto out;
-      }
-
-      entries = newentries;
+    if (!amqp_decode_8(encoded, offset, &keylen)
+        || !amqp_decode_bytes(encoded, offset, &entry->key, keylen)) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
     }
 
-    res = AMQP_STATUS_BAD_AMQP_DATA;
-    if (!amqp_decode_bytes(encoded, offset, &entries[num_entries].key, keylen)) {
-      goto out;
-    }
-
-    res = amqp_decode_field_value(encoded, pool, &entries[num_entries].value,
-                                  offset);
+    res = amqp_decode_field_value(encoded, pool, &entry->value, offset);
     if (res < 0) {
-      goto out;
+      return res;
     }
-
-    num_entries++;
   }
 
-  output->num_entries = num_entries;
-  output->entries = amqp_pool_alloc(pool, num_entries * sizeof(amqp_table_entry_t));
-  res = AMQP_STATUS_NO_MEMORY;
-  /* NULL is legitimate if we requested a zero-length block. */
-  if (output->entries == NULL && num_entries > 0) {
-    goto out;
-  }
-
-  memcpy(output->entries, entries, num_entries * sizeof(amqp_table_entry_t));
-  res = AMQP_STATUS_OK;
-
-out:
-  free(entries);
-  return res;
+  return AMQP_STATUS_OK;
 }
 
 static int amqp_decode_field_value(amqp_bytes_t encoded,
@@ -525,7 +575,7 @@ amqp_field_value_clone(amqp_field_value_t *original, amqp_field_value_t *clone,
       if (0 == original->value.bytes.len) {
         clone->value.bytes = amqp_empty_bytes;
       } else {
-        amqp_pool_alloc_bytes(pool, original->value.bytes.len, &clone->value.bytes);
+        amqp_pool_alloc_bytes_uninit(pool, original->value.bytes.len, &clone->value.bytes);
         if (NULL == clone->value.bytes.bytes) {
           return AMQP_STATUS_NO_MEMORY;
         }
@@ -573,7 +623,7 @@ amqp_table_entry_clone(amqp_table_entry_t *original, amqp_table_entry_t *clone,
     return AMQP_STATUS_INVALID_PARAMETER;
   }
 
-  amqp_pool_alloc_bytes(pool, original->key.len, &clone->key);
+  amqp_pool_alloc_bytes_uninit(pool, original->key.len, &clone->key);
   if (NULL == clone->key.bytes) {
     return AMQP_STATUS_NO_MEMORY;
   }
@@ -612,3 +662,135 @@ amqp_table_clone(amqp_table_t *original, amqp_table_t *clone, amqp_pool_t *pool)
 error_out1:
   return res;
 }
+
+/*---------------------------------------------------------------------------*/
+
+/* Tables with up to this many entries are scanned rather than hashed */
+#define TABLE_INDEX_MIN_ENTRIES 8
+
+typedef struct amqp_table_index_slot_t_ {
+  uint32_t hash;
+  int entry;  /* position in the table plus one, 0 for an empty slot */
+} amqp_table_index_slot_t;
+
+struct amqp_table_index_t_ {
+  amqp_table_t const *table;
+  amqp_pool_t *pool;
+  /* open addressing with linear probing, built on the first lookup */
+  amqp_table_index_slot_t *slots;
+  uint32_t mask;
+  amqp_boolean_t built;
+};
+
+/* 32-bit FNV-1a */
+static uint32_t table_key_hash(amqp_bytes_t name)
+{
+  uint32_t hash = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < name.len; ++i) {
+    hash ^= ((uint8_t *)name.bytes)[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static amqp_boolean_t table_key_equal(amqp_bytes_t name,
+                                      amqp_table_key_t const *key)
+{
+  return name.len == key->name.len &&
+         0 == memcmp(name.bytes, key->name.bytes, name.len);
+}
+
+amqp_table_key_t amqp_table_key(amqp_bytes_t name)
+{
+  amqp_table_key_t key;
+  key.name = name;
+  key.hash = table_key_hash(name);
+  return key;
+}
+
+amqp_table_index_t *amqp_table_index_new(amqp_table_t const *table,
+                                         amqp_pool_t *pool)
+{
+  amqp_table_index_t *index = amqp_pool_alloc(pool, sizeof(amqp_table_index_t));
+  if (NULL == index) {
+    return NULL;
+  }
+
+  index->table = table;
+  index->pool = pool;
+  index->slots = NULL;
+  index->mask = 0;
+  index->built = 0;
+  return index;
+}
+
+static void table_index_build(amqp_table_index_t *index)
+{
+  uint32_t size = 16;
+  int i;
+
+  index->built = 1;
+  if (index->table->num_entries <= TABLE_INDEX_MIN_ENTRIES) {
+    return;
+  }
+
+  /* at most half full */
+  while (size < 2 * (uint32_t)index->table->num_entries) {
+    size *= 2;
+  }
+
+  index->slots = amqp_pool_alloc(index->pool,
+                                 size * sizeof(amqp_table_index_slot_t));
+  if (NULL == index->slots) {
+    /* lookups fall back to scanning the table */
+    return;
+  }
+  memset(index->slots, 0, size * sizeof(amqp_table_index_slot_t));
+  index->mask = size - 1;
+
+  /* Entries are inserted in order, so of duplicate keys the first one is
+     found, as with a scan */
+  for (i = 0; i < index->table->num_entries; ++i) {
+    uint32_t hash = table_key_hash(index->table->entries[i].key);
+    uint32_t slot = hash & index->mask;
+
+    while (0 != index->slots[slot].entry) {
+      slot = (slot + 1) & index->mask;
+    }
+    index->slots[slot].hash = hash;
+    index->slots[slot].entry = i + 1;
+  }
+}
+
+amqp_table_entry_t *amqp_table_index_lookup(amqp_table_index_t *index,
+                                            amqp_table_key_t const *key)
+{
+  amqp_table_entry_t *entries = index->table->entries;
+  int i;
+
+  if (!index->built) {
+    table_index_build(index);
+  }
+
+  if (NULL != index->slots) {
+    uint32_t slot = key->hash & index->mask;
+
+    for (; 0 != index->slots[slot].entry; slot = (slot + 1) & index->mask) {
+      amqp_table_entry_t *entry = &entries[index->slots[slot].entry - 1];
+      if (index->slots[slot].hash == key->hash &&
+          table_key_equal(entry->key, key)) {
+        return entry;
+      }
+    }
+    return NULL;
+  }
+
+  for (i = 0; i < index->table->num_entries; ++i) {
+    if (table_key_equal(entries[i].key, key)) {
+      return &entries[i];
+    }
+  }
+  return NULL;
+}
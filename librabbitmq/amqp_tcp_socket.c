@@ -32,12 +32,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef _WIN32
+# define AMQP_TCP_WOULD_BLOCK(err) (WSAEWOULDBLOCK == (err))
+#else
+# define AMQP_TCP_WOULD_BLOCK(err) (EAGAIN == (err) || EWOULDBLOCK == (err))
+#endif
+
 struct amqp_tcp_socket_t {
   const struct amqp_socket_class_t *klass;
   int sockfd;
-  void *buffer;
-  size_t buffer_length;
   int internal_error;
+  amqp_allocator_t allocator;
 };
 
 
@@ -103,23 +108,12 @@ amqp_tcp_socket_writev(void *base, struct iovec *iov, int iovcnt)
   }
   return ret;
 
-#elif defined(MSG_MORE)
-  int i;
-  for (i = 0; i < iovcnt - 1; ++i) {
-    ret = amqp_tcp_socket_send_inner(self, iov[i].iov_base, iov[i].iov_len, MSG_MORE);
-    if (ret != AMQP_STATUS_OK) {
-      goto exit;
-    }
-  }
-  ret = amqp_tcp_socket_send_inner(self, iov[i].iov_base, iov[i].iov_len, 0);
-
-exit:
-  return ret;
-
-#elif defined(SO_NOSIGPIPE) || !defined(MSG_NOSIGNAL)
+#else
   int i;
   ssize_t len_left = 0;
-
+#ifdef MSG_NOSIGNAL
+  struct msghdr msg;
+#endif
 
   struct iovec *iov_left = iov;
   int iovcnt_left = iovcnt;
@@ -129,14 +123,22 @@ exit:
   }
 
 start:
+#ifdef MSG_NOSIGNAL
+  /* sendmsg() puts the whole vector on the wire with one syscall while
+     still letting us suppress SIGPIPE */
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov_left;
+  msg.msg_iovlen = iovcnt_left;
+  ret = sendmsg(self->sockfd, &msg, MSG_NOSIGNAL);
+#else
   ret = writev(self->sockfd, iov_left, iovcnt_left);
+#endif
 
   if (ret < 0) {
     self->internal_error = amqp_os_socket_error();
     if (EINTR == self->internal_error) {
       goto start;
     } else {
-      self->internal_error = amqp_os_socket_error();
       ret = AMQP_STATUS_SOCKET_ERROR;
     }
   } else {
@@ -162,38 +164,54 @@ start:
   }
 
   return ret;
+#endif
+}
 
-#else
-  int i;
-  size_t bytes = 0;
-  void *bufferp;
+static ssize_t
+amqp_tcp_socket_try_writev(void *base, struct iovec *iov, int iovcnt)
+{
+  struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
+  ssize_t ret;
 
-  for (i = 0; i < iovcnt; ++i) {
-    bytes += iov[i].iov_len;
+#if defined(_WIN32)
+  DWORD res;
+  if (WSASend(self->sockfd, (LPWSABUF)iov, iovcnt, &res, 0, NULL, NULL) == 0) {
+    ret = res;
+  } else {
+    ret = -1;
   }
+#else
+# ifdef MSG_NOSIGNAL
+  struct msghdr msg;
 
-  if (self->buffer_length < bytes) {
-    self->buffer = realloc(self->buffer, bytes);
-    if (NULL == self->buffer) {
-      self->buffer_length = 0;
-      self->internal_error = 0;
-      ret = AMQP_STATUS_NO_MEMORY;
-      goto exit;
-    }
-    self->buffer_length = bytes;
-  }
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+# endif
 
-  bufferp = self->buffer;
-  for (i = 0; i < iovcnt; ++i) {
-    memcpy(bufferp, iov[i].iov_base, iov[i].iov_len);
-    bufferp += iov[i].iov_len;
-  }
+start:
+# ifdef MSG_NOSIGNAL
+  ret = sendmsg(self->sockfd, &msg, MSG_NOSIGNAL);
+# else
+  ret = writev(self->sockfd, iov, iovcnt);
+# endif
+#endif
 
-  ret = amqp_tcp_socket_send_inner(self, self->buffer, bytes, 0);
+  if (ret < 0) {
+    self->internal_error = amqp_os_socket_error();
+#ifndef _WIN32
+    if (EINTR == self->internal_error) {
+      goto start;
+    }
+#endif
+    if (AMQP_TCP_WOULD_BLOCK(self->internal_error)) {
+      return 0;
+    }
+    return AMQP_STATUS_SOCKET_ERROR;
+  }
 
-exit:
+  self->internal_error = 0;
   return ret;
-#endif
 }
 
 static ssize_t
@@ -209,6 +227,9 @@ start:
     self->internal_error = amqp_os_socket_error();
     if (EINTR == self->internal_error) {
       goto start;
+    } else if (AMQP_TCP_WOULD_BLOCK(self->internal_error)) {
+      /* nothing to read yet on a non-blocking socket */
+      ret = 0;
     } else {
       ret = AMQP_STATUS_SOCKET_ERROR;
     }
@@ -261,8 +282,7 @@ amqp_tcp_socket_delete(void *base)
 
   if (self) {
     amqp_tcp_socket_close(self);
-    free(self->buffer);
-    free(self);
+    amqp_free(&self->allocator, self);
   }
 }
 
@@ -273,16 +293,18 @@ static const struct amqp_socket_class_t amqp_tcp_socket_class = {
   amqp_tcp_socket_open, /* open */
   amqp_tcp_socket_close, /* close */
   amqp_tcp_socket_get_sockfd, /* get_sockfd */
-  amqp_tcp_socket_delete /* delete */
+  amqp_tcp_socket_delete, /* delete */
+  amqp_tcp_socket_try_writev /* try_writev */
 };
 
 amqp_socket_t *
 amqp_tcp_socket_new(amqp_connection_state_t state)
 {
-  struct amqp_tcp_socket_t *self = calloc(1, sizeof(*self));
+  struct amqp_tcp_socket_t *self = amqp_calloc(&state->allocator, 1, sizeof(*self));
   if (!self) {
     return NULL;
   }
+  self->allocator = state->allocator;
   self->klass = &amqp_tcp_socket_class;
   self->sockfd = -1;
 
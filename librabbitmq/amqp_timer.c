@@ -57,6 +57,12 @@ amqp_get_monotonic_timestamp(void)
 
   return perf_count.QuadPart * NS_PER_COUNT;
 }
+
+uint64_t
+amqp_get_coarse_timestamp(void)
+{
+  return amqp_get_monotonic_timestamp();
+}
 #endif /* AMQP_WIN_TIMER_API */
 
 #ifdef AMQP_MAC_TIMER_API
@@ -82,6 +88,12 @@ amqp_get_monotonic_timestamp(void)
 
   return timestamp;
 }
+
+uint64_t
+amqp_get_coarse_timestamp(void)
+{
+  return amqp_get_monotonic_timestamp();
+}
 #endif /* AMQP_MAC_TIMER_API */
 
 #ifdef AMQP_POSIX_TIMER_API
@@ -97,6 +109,23 @@ amqp_get_monotonic_timestamp(void)
 
   return ((uint64_t)tp.tv_sec * AMQP_NS_PER_S + (uint64_t)tp.tv_nsec);
 }
+
+uint64_t
+amqp_get_coarse_timestamp(void)
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+  /* Returns the time of the last kernel tick, without reading the hardware
+     clock */
+  struct timespec tp;
+  if (-1 == clock_gettime(CLOCK_MONOTONIC_COARSE, &tp)) {
+    return 0;
+  }
+
+  return ((uint64_t)tp.tv_sec * AMQP_NS_PER_S + (uint64_t)tp.tv_nsec);
+#else
+  return amqp_get_monotonic_timestamp();
+#endif
+}
 #endif /* AMQP_POSIX_TIMER_API */
 
 int
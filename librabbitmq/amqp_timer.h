@@ -53,6 +53,11 @@ typedef struct amqp_timer_t_ {
 uint64_t
 amqp_get_monotonic_timestamp(void);
 
+/* Gets a timestamp from the same clock that is only accurate to a few ms but
+   is cheaper to read, for heartbeats which count in seconds */
+uint64_t
+amqp_get_coarse_timestamp(void);
+
 /* Prepare timeout value and modify timer state based on timer state. */
 int
 amqp_timer_update(amqp_timer_t *timer, struct timeval *timeout);
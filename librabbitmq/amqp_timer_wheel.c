@@ -0,0 +1,378 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "amqp_timer.h"
+
+#include <string.h>
+
+/*
+ * A hierarchical timing wheel. Time is counted in ticks of about a
+ * millisecond. Level 0 has a slot for each of the next WHEEL_SLOTS ticks,
+ * each slot of level n covers WHEEL_SLOTS slots of level n - 1. When time
+ * reaches a level n slot its timers are moved down to where they now belong,
+ * so scheduling, cancelling and expiring a timer take constant time.
+ */
+#define TICK_SHIFT 20 /* 2^20 ns per tick */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+/* timers further away than this wait in the last level, and are moved again
+   when it comes round */
+#define WHEEL_MAX_DELTA (((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct amqp_timer_wheel_t_ {
+  amqp_allocator_t allocator;
+  /* the next tick to be run */
+  uint64_t current;
+  /* the time amqp_timer_wheel_run() read the clock, in ns */
+  uint64_t now;
+  size_t count;
+  amqp_wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static uint64_t ns_to_tick(uint64_t ns)
+{
+  /* round up so timers never expire early */
+  return (ns + ((uint64_t)1 << TICK_SHIFT) - 1) >> TICK_SHIFT;
+}
+
+static void link_timer(amqp_timer_wheel_t *wheel, amqp_wheel_timer_t *timer)
+{
+  uint64_t delta;
+  uint64_t expires;
+  amqp_wheel_timer_t **slot;
+  int level;
+
+  if (timer->expires < wheel->current) {
+    timer->expires = wheel->current;
+  }
+
+  delta = timer->expires - wheel->current;
+  expires = timer->expires;
+  if (delta > WHEEL_MAX_DELTA) {
+    delta = WHEEL_MAX_DELTA;
+    expires = wheel->current + WHEEL_MAX_DELTA;
+  }
+
+  for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+    if (delta < (uint64_t)1 << (WHEEL_BITS * (level + 1))) {
+      break;
+    }
+  }
+
+  slot = &wheel->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+  timer->next = *slot;
+  if (timer->next != NULL) {
+    timer->next->pprev = &timer->next;
+  }
+  timer->pprev = slot;
+  *slot = timer;
+}
+
+static void unlink_timer(amqp_wheel_timer_t *timer)
+{
+  *timer->pprev = timer->next;
+  if (timer->next != NULL) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+/* Moves the timers of the higher level slots time has just reached down.
+   Called before the level 0 slot of the current tick is run, so timers are
+   placed relative to that tick and never behind it. */
+static void cascade(amqp_timer_wheel_t *wheel)
+{
+  amqp_wheel_timer_t **due = &wheel->slots[0][wheel->current & WHEEL_MASK];
+  int level;
+
+  for (level = 1; level < WHEEL_LEVELS; level++) {
+    int index = (wheel->current >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    amqp_wheel_timer_t *timer = wheel->slots[level][index];
+
+    wheel->slots[level][index] = NULL;
+    while (timer != NULL) {
+      amqp_wheel_timer_t *next = timer->next;
+
+      if (timer->expires <= wheel->current) {
+        /* Due already, e.g. after a late run: goes out on this tick rather
+           than wherever its own tick falls in level 0 */
+        timer->expires = wheel->current;
+        timer->next = *due;
+        if (timer->next != NULL) {
+          timer->next->pprev = &timer->next;
+        }
+        timer->pprev = due;
+        *due = timer;
+      } else {
+        link_timer(wheel, timer);
+      }
+      timer = next;
+    }
+
+    /* the next level only comes round when this one wraps */
+    if (index != 0) {
+      break;
+    }
+  }
+}
+
+static void schedule_at(amqp_timer_wheel_t *wheel, amqp_wheel_timer_t *timer,
+                        uint64_t expires, amqp_timer_fn fn, void *user_data)
+{
+  if (timer->pprev != NULL) {
+    unlink_timer(timer);
+  } else {
+    wheel->count++;
+  }
+
+  timer->expires = expires;
+  timer->fn = fn;
+  timer->user_data = user_data;
+  link_timer(wheel, timer);
+}
+
+static uint64_t heartbeat_deadline(amqp_connection_state_t state)
+{
+  return (state->next_recv_heartbeat < state->next_send_heartbeat ?
+          state->next_recv_heartbeat :
+          state->next_send_heartbeat);
+}
+
+static void heartbeat_timer_expired(void *user_data)
+{
+  amqp_connection_state_t state = user_data;
+  amqp_timer_wheel_t *wheel = state->timer_wheel;
+  uint64_t deadline = heartbeat_deadline(state);
+
+  /* Deadlines move as frames are sent and received, without the timer being
+     rescheduled every time, so it may go off early */
+  if (deadline > wheel->now) {
+    schedule_at(wheel, &state->heartbeat_timer, ns_to_tick(deadline),
+                heartbeat_timer_expired, state);
+    return;
+  }
+
+  /* Looked at again on the tick after this run, after the caller has dealt
+     with it. A late run walks through every tick it missed, rescheduling at
+     the next of those would call the caller once per tick. Rescheduled first
+     as the connection may be gone after the call. */
+  schedule_at(wheel, &state->heartbeat_timer, (wheel->now >> TICK_SHIFT) + 1,
+              heartbeat_timer_expired, state);
+  state->heartbeat_fn(state->heartbeat_user_data);
+}
+
+amqp_timer_wheel_t *amqp_timer_wheel_new(void)
+{
+  amqp_allocator_t const *allocator = amqp_get_default_allocator();
+  amqp_timer_wheel_t *wheel;
+  uint64_t now;
+
+  now = amqp_get_coarse_timestamp();
+  if (0 == now) {
+    return NULL;
+  }
+
+  wheel = amqp_calloc(allocator, 1, sizeof(*wheel));
+  if (NULL == wheel) {
+    return NULL;
+  }
+
+  wheel->allocator = *allocator;
+  wheel->now = now;
+  wheel->current = now >> TICK_SHIFT;
+  return wheel;
+}
+
+void amqp_timer_wheel_destroy(amqp_timer_wheel_t *wheel)
+{
+  if (NULL == wheel) {
+    return;
+  }
+
+  amqp_free(&wheel->allocator, wheel);
+}
+
+int amqp_timer_wheel_schedule(amqp_timer_wheel_t *wheel,
+                              amqp_wheel_timer_t *timer,
+                              struct timeval const *delay,
+                              amqp_timer_fn fn, void *user_data)
+{
+  uint64_t now;
+
+  if (delay->tv_sec < 0 || delay->tv_usec < 0) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  /* The coarse clock runs up to a few ms behind, counting from it could
+     expire the timer early */
+  now = amqp_get_monotonic_timestamp();
+  if (0 == now) {
+    return AMQP_STATUS_TIMER_FAILURE;
+  }
+
+  schedule_at(wheel, timer,
+              ns_to_tick(now + (uint64_t)delay->tv_sec * AMQP_NS_PER_S +
+                         (uint64_t)delay->tv_usec * AMQP_NS_PER_US),
+              fn, user_data);
+  return AMQP_STATUS_OK;
+}
+
+void amqp_timer_wheel_cancel(amqp_timer_wheel_t *wheel,
+                             amqp_wheel_timer_t *timer)
+{
+  if (timer->pprev != NULL) {
+    unlink_timer(timer);
+    wheel->count--;
+  }
+}
+
+int amqp_timer_wheel_add_connection(amqp_timer_wheel_t *wheel,
+                                    amqp_connection_state_t state,
+                                    amqp_timer_fn fn, void *user_data)
+{
+  if (state->timer_wheel != NULL) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  state->timer_wheel = wheel;
+  state->heartbeat_fn = fn;
+  state->heartbeat_user_data = user_data;
+  memset(&state->heartbeat_timer, 0, sizeof(state->heartbeat_timer));
+
+  if (amqp_heartbeat_enabled(state)) {
+    schedule_at(wheel, &state->heartbeat_timer,
+                ns_to_tick(heartbeat_deadline(state)),
+                heartbeat_timer_expired, state);
+  }
+  return AMQP_STATUS_OK;
+}
+
+void amqp_timer_wheel_remove_connection(amqp_timer_wheel_t *wheel,
+                                        amqp_connection_state_t state)
+{
+  if (state->timer_wheel != wheel) {
+    return;
+  }
+
+  amqp_timer_wheel_cancel(wheel, &state->heartbeat_timer);
+  state->timer_wheel = NULL;
+}
+
+amqp_boolean_t amqp_timer_wheel_next_timeout(amqp_timer_wheel_t *wheel,
+                                             struct timeval *timeout)
+{
+  uint64_t next = 0;
+  uint64_t now;
+  uint64_t ns_left = 0;
+  int level;
+  int i;
+
+  if (0 == wheel->count) {
+    return 0;
+  }
+
+  /* The first tick at which something happens: a level 0 timer expires or a
+     higher level slot is moved down */
+  for (level = 0; level < WHEEL_LEVELS; level++) {
+    int shift = WHEEL_BITS * level;
+    uint64_t position = wheel->current >> shift;
+    /* the current slot of a higher level has been moved down already,
+       unless time is just about to reach it */
+    int first = (0 == (wheel->current & (((uint64_t)1 << shift) - 1)) ? 0 : 1);
+
+    for (i = first; i <= WHEEL_SLOTS; i++) {
+      if (wheel->slots[level][(position + i) & WHEEL_MASK] != NULL) {
+        uint64_t tick = (position + i) << shift;
+        if (0 == next || tick < next) {
+          next = tick;
+        }
+        break;
+      }
+    }
+  }
+
+  now = amqp_get_coarse_timestamp();
+  if ((next << TICK_SHIFT) > now) {
+    ns_left = (next << TICK_SHIFT) - now;
+  }
+
+  timeout->tv_sec = ns_left / AMQP_NS_PER_S;
+  timeout->tv_usec = (ns_left % AMQP_NS_PER_S) / AMQP_NS_PER_US;
+  return 1;
+}
+
+int amqp_timer_wheel_run(amqp_timer_wheel_t *wheel)
+{
+  uint64_t now_tick;
+
+  wheel->now = amqp_get_coarse_timestamp();
+  if (0 == wheel->now) {
+    return AMQP_STATUS_TIMER_FAILURE;
+  }
+  now_tick = wheel->now >> TICK_SHIFT;
+
+  while (wheel->current <= now_tick) {
+    amqp_wheel_timer_t *expired;
+
+    if (0 == wheel->count) {
+      wheel->current = now_tick + 1;
+      break;
+    }
+
+    if (0 == (wheel->current & WHEEL_MASK)) {
+      cascade(wheel);
+    }
+
+    /* Timers scheduled by the functions called go after this tick */
+    expired = wheel->slots[0][wheel->current & WHEEL_MASK];
+    wheel->slots[0][wheel->current & WHEEL_MASK] = NULL;
+    if (expired != NULL) {
+      expired->pprev = &expired;
+    }
+    wheel->current++;
+
+    while (expired != NULL) {
+      amqp_wheel_timer_t *timer = expired;
+      unlink_timer(timer);
+      wheel->count--;
+      timer->fn(timer->user_data);
+    }
+  }
+
+  return AMQP_STATUS_OK;
+}
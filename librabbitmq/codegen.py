@@ -206,6 +206,101 @@ def typeFor(spec, f):
     """Get a representation of the AMQP type of a field."""
     return types[spec.resolveDomain(f.domain)]
 
+def fixedFieldGroups(spec, fields):
+    """Splits fields into runs of consecutive fields of a fixed size and
+    the fields of variable size between them. Yields (fields, size)
+    pairs, size being the encoded size of a run in bytes, or None for a
+    single field of variable size."""
+    group = []
+    size = 0
+    bit = 0
+    for f in fields:
+        t = typeFor(spec, f)
+        if isinstance(t, SimpleType):
+            group.append(f)
+            size += t.bits // 8
+            bit = 0
+        elif isinstance(t, BitType):
+            if bit == 0:
+                size += 1
+            group.append(f)
+            bit = (bit + 1) % 8
+        else:
+            if group:
+                yield (group, size)
+            group = []
+            size = 0
+            bit = 0
+            yield ([f], None)
+    if group:
+        yield (group, size)
+
+def fixedGroupUnits(spec, fields):
+    """The number of loads or stores needed for a run of fixed size fields:
+    one per field, bits sharing an octet sharing one."""
+    units = 0
+    bit = 0
+    for f in fields:
+        if isinstance(typeFor(spec, f), BitType):
+            if bit == 0:
+                units += 1
+            bit = (bit + 1) % 8
+        else:
+            units += 1
+            bit = 0
+    return units
+
+def offsetExpr(position):
+    if position == 0:
+        return "offset"
+    return "offset + %d" % (position,)
+
+def decodeFixedGroup(spec, emitter, fields, size, prefix):
+    """Generate code to decode a run of fixed size fields after checking
+    once that all of it is there."""
+    emitter.emit("if (offset + %d > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;" % (size,))
+    position = 0
+    bit = 0
+    for f in fields:
+        t = typeFor(spec, f)
+        lvalue = prefix + c_ize(f.name)
+        if isinstance(t, BitType):
+            if bit == 0:
+                emitter.emit("bit_buffer = amqp_d8(encoded.bytes, %s);" % (offsetExpr(position),))
+                position += 1
+            emitter.emit("%s = (bit_buffer & (1 << %d)) ? 1 : 0;" % (lvalue, bit))
+            bit = (bit + 1) % 8
+        else:
+            emitter.emit("%s = amqp_d%d(encoded.bytes, %s);" % (lvalue, t.bits, offsetExpr(position)))
+            position += t.bits // 8
+            bit = 0
+    emitter.emit("offset += %d;" % (size,))
+
+def encodeFixedGroup(spec, emitter, fields, size, prefix):
+    """Generate code to encode a run of fixed size fields after checking
+    once that there is room for all of it."""
+    emitter.emit("if (offset + %d > encoded.len) return AMQP_STATUS_BAD_AMQP_DATA;" % (size,))
+    position = 0
+    bit = 0
+    for i, f in enumerate(fields):
+        t = typeFor(spec, f)
+        value = prefix + c_ize(f.name)
+        if isinstance(t, BitType):
+            if bit == 0:
+                emitter.emit("bit_buffer = 0;")
+            emitter.emit("if (%s) bit_buffer |= (1 << %d);" % (value, bit))
+            bit = (bit + 1) % 8
+            last_bit = (i + 1 == len(fields) or
+                        not isinstance(typeFor(spec, fields[i + 1]), BitType))
+            if bit == 0 or last_bit:
+                emitter.emit("amqp_e8(encoded.bytes, %s, bit_buffer);" % (offsetExpr(position),))
+                position += 1
+                bit = 0
+        else:
+            emitter.emit("amqp_e%d(encoded.bytes, %s, %s);" % (t.bits, offsetExpr(position), value))
+            position += t.bits // 8
+    emitter.emit("offset += %d;" % (size,))
+
 def c_ize(s):
     s = s.replace('-', '_')
     s = s.replace(' ', '_')
@@ -285,8 +380,12 @@ def genErl(spec):
             print "      %s *m = NULL; /* no fields */" % (m.structName(),)
 
         emitter = BitDecoder(Emitter("      "))
-        for f in m.arguments:
-            typeFor(spec, f).decode(emitter, "m->"+c_ize(f.name))
+        for (fields, size) in fixedFieldGroups(spec, m.arguments):
+            if size is not None and fixedGroupUnits(spec, fields) > 1:
+                decodeFixedGroup(spec, emitter, fields, size, "m->")
+            else:
+                for f in fields:
+                    typeFor(spec, f).decode(emitter, "m->"+c_ize(f.name))
 
         print "      *decoded = m;"
         print "      return 0;"
@@ -315,8 +414,12 @@ def genErl(spec):
             print "      %s *m = (%s *) decoded;" % (m.structName(), m.structName())
 
         emitter = BitEncoder(Emitter("      "))
-        for f in m.arguments:
-            typeFor(spec, f).encode(emitter, "m->"+c_ize(f.name))
+        for (fields, size) in fixedFieldGroups(spec, m.arguments):
+            if size is not None and fixedGroupUnits(spec, fields) > 1:
+                encodeFixedGroup(spec, emitter, fields, size, "m->")
+            else:
+                for f in fields:
+                    typeFor(spec, f).encode(emitter, "m->"+c_ize(f.name))
         emitter.flush()
 
         print "      return offset;"
@@ -0,0 +1,229 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * Measures how fast methods and basic properties are encoded and decoded.
+ * Not run as a test, timings are only meaningful on a quiet machine with an
+ * optimized build.
+ *
+ * Usage: bench_codec [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+
+#define BUFFER_SIZE 4096
+
+static void die(const char *what, int res)
+{
+  fprintf(stderr, "%s: %s\n", what, amqp_error_string2(res));
+  exit(1);
+}
+
+static double elapsed_ns(clock_t start, long iterations)
+{
+  return (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / iterations;
+}
+
+static void bench_method(const char *name, amqp_method_number_t id,
+                         void *method, long iterations)
+{
+  char buffer[BUFFER_SIZE];
+  amqp_bytes_t encoded;
+  amqp_pool_t pool;
+  void *decoded;
+  clock_t start;
+  double encode_ns, decode_ns;
+  long i;
+  int res = 0;
+
+  encoded.bytes = buffer;
+  encoded.len = sizeof(buffer);
+
+  start = clock();
+  for (i = 0; i < iterations; i++) {
+    res = amqp_encode_method(id, method, encoded);
+    if (res < 0) {
+      die(name, res);
+    }
+  }
+  encode_ns = elapsed_ns(start, iterations);
+  encoded.len = res;
+
+  init_amqp_pool(&pool, BUFFER_SIZE);
+  start = clock();
+  for (i = 0; i < iterations; i++) {
+    res = amqp_decode_method(id, &pool, encoded, &decoded);
+    if (res < 0) {
+      die(name, res);
+    }
+    recycle_amqp_pool(&pool);
+  }
+  decode_ns = elapsed_ns(start, iterations);
+  empty_amqp_pool(&pool);
+
+  printf("%-20s %8.1f ns encode %8.1f ns decode\n", name, encode_ns, decode_ns);
+}
+
+static void bench_properties(const char *name,
+                             amqp_basic_properties_t *properties,
+                             long iterations)
+{
+  char buffer[BUFFER_SIZE];
+  amqp_bytes_t encoded;
+  amqp_pool_t pool;
+  void *decoded;
+  clock_t start;
+  double encode_ns, decode_ns;
+  long i;
+  int res = 0;
+
+  encoded.bytes = buffer;
+  encoded.len = sizeof(buffer);
+
+  start = clock();
+  for (i = 0; i < iterations; i++) {
+    res = amqp_encode_properties(AMQP_BASIC_CLASS, properties, encoded);
+    if (res < 0) {
+      die(name, res);
+    }
+  }
+  encode_ns = elapsed_ns(start, iterations);
+  encoded.len = res;
+
+  init_amqp_pool(&pool, BUFFER_SIZE);
+  start = clock();
+  for (i = 0; i < iterations; i++) {
+    res = amqp_decode_properties(AMQP_BASIC_CLASS, &pool, encoded, &decoded);
+    if (res < 0) {
+      die(name, res);
+    }
+    recycle_amqp_pool(&pool);
+  }
+  decode_ns = elapsed_ns(start, iterations);
+  empty_amqp_pool(&pool);
+
+  printf("%-20s %8.1f ns encode %8.1f ns decode\n", name, encode_ns, decode_ns);
+}
+
+int main(int argc, char **argv)
+{
+  long iterations = 2000000;
+
+  amqp_connection_tune_t tune;
+  amqp_basic_qos_t qos;
+  amqp_basic_ack_t ack;
+  amqp_basic_publish_t publish;
+  amqp_basic_deliver_t deliver;
+  amqp_basic_properties_t properties;
+  amqp_table_entry_t headers[4];
+
+  if (argc > 1) {
+    iterations = atol(argv[1]);
+    if (iterations <= 0) {
+      fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  tune.channel_max = 2047;
+  tune.frame_max = 131072;
+  tune.heartbeat = 60;
+  bench_method("connection.tune", AMQP_CONNECTION_TUNE_METHOD, &tune,
+               iterations);
+
+  qos.prefetch_size = 0;
+  qos.prefetch_count = 100;
+  qos.global = 0;
+  bench_method("basic.qos", AMQP_BASIC_QOS_METHOD, &qos, iterations);
+
+  ack.delivery_tag = 123456789;
+  ack.multiple = 1;
+  bench_method("basic.ack", AMQP_BASIC_ACK_METHOD, &ack, iterations);
+
+  publish.ticket = 0;
+  publish.exchange = amqp_cstring_bytes("amq.direct");
+  publish.routing_key = amqp_cstring_bytes("orders.created");
+  publish.mandatory = 0;
+  publish.immediate = 0;
+  bench_method("basic.publish", AMQP_BASIC_PUBLISH_METHOD, &publish,
+               iterations);
+
+  deliver.consumer_tag = amqp_cstring_bytes("amq.ctag-0123456789abcdef");
+  deliver.delivery_tag = 123456789;
+  deliver.redelivered = 0;
+  deliver.exchange = amqp_cstring_bytes("amq.direct");
+  deliver.routing_key = amqp_cstring_bytes("orders.created");
+  bench_method("basic.deliver", AMQP_BASIC_DELIVER_METHOD, &deliver,
+               iterations);
+
+  memset(&properties, 0, sizeof(properties));
+  properties._flags = AMQP_BASIC_CONTENT_TYPE_FLAG |
+                      AMQP_BASIC_DELIVERY_MODE_FLAG |
+                      AMQP_BASIC_PRIORITY_FLAG |
+                      AMQP_BASIC_MESSAGE_ID_FLAG |
+                      AMQP_BASIC_TIMESTAMP_FLAG;
+  properties.content_type = amqp_cstring_bytes("application/json");
+  properties.delivery_mode = 2;
+  properties.priority = 5;
+  properties.message_id = amqp_cstring_bytes("0f8fad5b-d9cb-469f-a165-70867728950e");
+  properties.timestamp = 1400000000;
+  bench_properties("basic properties", &properties, iterations);
+
+  headers[0].key = amqp_cstring_bytes("x-retries");
+  headers[0].value.kind = AMQP_FIELD_KIND_I32;
+  headers[0].value.value.i32 = 3;
+  headers[1].key = amqp_cstring_bytes("x-origin");
+  headers[1].value.kind = AMQP_FIELD_KIND_UTF8;
+  headers[1].value.value.bytes = amqp_cstring_bytes("billing");
+  headers[2].key = amqp_cstring_bytes("x-created");
+  headers[2].value.kind = AMQP_FIELD_KIND_TIMESTAMP;
+  headers[2].value.value.u64 = 1400000000;
+  headers[3].key = amqp_cstring_bytes("x-weight");
+  headers[3].value.kind = AMQP_FIELD_KIND_F64;
+  headers[3].value.value.f64 = 0.5;
+  properties._flags |= AMQP_BASIC_HEADERS_FLAG;
+  properties.headers.num_entries = 4;
+  properties.headers.entries = headers;
+  bench_properties("... with headers", &properties, iterations);
+
+  return 0;
+}
@@ -0,0 +1,440 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+/* The publisher and a stand-in for the broker talk over a socket pair, the
+   broker side only sends the confirms and never reads the publishes */
+
+static void die(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  abort();
+}
+
+static amqp_connection_state_t new_connection(int sockfd)
+{
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *socket;
+
+  if (NULL == conn) {
+    die("out of memory");
+  }
+  socket = amqp_tcp_socket_new(conn);
+  if (NULL == socket) {
+    die("out of memory");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sockfd);
+  return conn;
+}
+
+static void publish(amqp_connection_state_t conn, amqp_channel_t channel,
+                    int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++) {
+    int res = amqp_basic_publish(conn, channel, amqp_cstring_bytes("exchange"),
+                                 amqp_cstring_bytes("key"), 0, 0, NULL,
+                                 amqp_cstring_bytes("body"));
+    if (AMQP_STATUS_OK != res) {
+      die("publish failed: %s", amqp_error_string2(res));
+    }
+  }
+}
+
+static void send_confirm(amqp_connection_state_t broker, uint64_t delivery_tag,
+                         amqp_boolean_t multiple, amqp_boolean_t nack)
+{
+  int res;
+
+  if (nack) {
+    amqp_basic_nack_t m;
+    m.delivery_tag = delivery_tag;
+    m.multiple = multiple;
+    m.requeue = 0;
+    res = amqp_send_method(broker, 1, AMQP_BASIC_NACK_METHOD, &m);
+  } else {
+    amqp_basic_ack_t m;
+    m.delivery_tag = delivery_tag;
+    m.multiple = multiple;
+    res = amqp_send_method(broker, 1, AMQP_BASIC_ACK_METHOD, &m);
+  }
+
+  if (AMQP_STATUS_OK != res) {
+    die("sending confirm failed: %s", amqp_error_string2(res));
+  }
+}
+
+static void expect_event(amqp_connection_state_t conn, uint64_t first,
+                         uint64_t last, amqp_boolean_t nacked)
+{
+  amqp_confirm_event_t event;
+  int res;
+  int tries = 0;
+
+  while (AMQP_STATUS_TIMEOUT == (res = amqp_confirm_poll(conn, &event))) {
+    if (++tries == 1000) {
+      die("no event for %u-%u", (unsigned)first, (unsigned)last);
+    }
+    usleep(1000);
+  }
+  if (AMQP_STATUS_OK != res) {
+    die("polling failed: %s", amqp_error_string2(res));
+  }
+
+  if (1 != event.channel || first != event.first || last != event.last ||
+      nacked != event.nacked) {
+    die("expected %s %u-%u, got %s %u-%u on channel %u",
+        nacked ? "nack" : "ack", (unsigned)first, (unsigned)last,
+        event.nacked ? "nack" : "ack", (unsigned)event.first,
+        (unsigned)event.last, (unsigned)event.channel);
+  }
+}
+
+static void expect_no_event(amqp_connection_state_t conn)
+{
+  amqp_confirm_event_t event;
+
+  usleep(10000);
+  if (AMQP_STATUS_TIMEOUT != amqp_confirm_poll(conn, &event)) {
+    die("unexpected event %u-%u", (unsigned)event.first, (unsigned)event.last);
+  }
+}
+
+static void expect_counts(amqp_connection_state_t conn, uint64_t next_seqno,
+                          uint64_t outstanding)
+{
+  if (next_seqno != amqp_confirm_next_seqno(conn, 1)) {
+    die("expected next sequence number %u, got %u", (unsigned)next_seqno,
+        (unsigned)amqp_confirm_next_seqno(conn, 1));
+  }
+  if (outstanding != amqp_confirm_outstanding(conn, 1)) {
+    die("expected %u outstanding, got %u", (unsigned)outstanding,
+        (unsigned)amqp_confirm_outstanding(conn, 1));
+  }
+}
+
+static void test_failed_publish(amqp_connection_state_t conn)
+{
+  amqp_basic_properties_t properties;
+  amqp_table_entry_t entry;
+  amqp_bytes_t huge;
+
+  /* A header too large for a frame can't be encoded, so the publish never
+     goes out and must not take a sequence number */
+  huge.len = 1024 * 1024;
+  huge.bytes = calloc(1, huge.len);
+  if (NULL == huge.bytes) {
+    die("out of memory");
+  }
+
+  entry.key = amqp_cstring_bytes("huge");
+  entry.value.kind = AMQP_FIELD_KIND_BYTES;
+  entry.value.value.bytes = huge;
+
+  memset(&properties, 0, sizeof(properties));
+  properties._flags = AMQP_BASIC_HEADERS_FLAG;
+  properties.headers.num_entries = 1;
+  properties.headers.entries = &entry;
+
+  if (AMQP_STATUS_OK == amqp_basic_publish(conn, 1, amqp_cstring_bytes("exchange"),
+                                           amqp_cstring_bytes("key"), 0, 0,
+                                           &properties, amqp_cstring_bytes("body"))) {
+    die("publishing an oversized header succeeded");
+  }
+
+  free(huge.bytes);
+}
+
+static int fail_allocations;
+
+static void *test_malloc(void *user_data, size_t size)
+{
+  (void)user_data;
+  return fail_allocations ? NULL : malloc(size);
+}
+
+static void *test_realloc(void *user_data, void *ptr, size_t size)
+{
+  (void)user_data;
+  return fail_allocations ? NULL : realloc(ptr, size);
+}
+
+static void test_free(void *user_data, void *ptr)
+{
+  (void)user_data;
+  free(ptr);
+}
+
+static void test_out_of_memory(void)
+{
+  amqp_allocator_t allocator;
+  amqp_connection_state_t conn;
+  amqp_connection_state_t broker;
+  amqp_confirm_event_t event;
+  int sv[2];
+  int res;
+  int i;
+
+  memset(&allocator, 0, sizeof(allocator));
+  allocator.malloc_func = test_malloc;
+  allocator.realloc_func = test_realloc;
+  allocator.free_func = test_free;
+
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair failed");
+  }
+  conn = amqp_new_connection_with_allocator(&allocator);
+  if (NULL == conn || NULL == amqp_tcp_socket_new(conn)) {
+    die("out of memory");
+  }
+  amqp_tcp_socket_set_sockfd(amqp_get_socket(conn), sv[0]);
+  broker = new_connection(sv[1]);
+
+  if (AMQP_STATUS_OK != amqp_confirm_track(conn, 1)) {
+    die("tracking confirms failed");
+  }
+  publish(conn, 1, 40);
+
+  /* Leave every other one of the first 36 outstanding */
+  for (i = 1; i < 37; i += 2) {
+    send_confirm(broker, i, 0, 0);
+    expect_event(conn, i, i, 0);
+  }
+  expect_counts(conn, 41, 22);
+
+  /* The multiple ack makes 18 events, there is room for 16 */
+  fail_allocations = 1;
+  send_confirm(broker, 40, 1, 0);
+  while (AMQP_STATUS_TIMEOUT == (res = amqp_confirm_poll(conn, &event))) {
+    usleep(1000);
+  }
+  fail_allocations = 0;
+  if (AMQP_STATUS_NO_MEMORY != res) {
+    die("expected running out of memory, got %s", amqp_error_string2(res));
+  }
+
+  /* What was reported is no longer outstanding, the rest still is */
+  for (i = 2; i < 34; i += 2) {
+    expect_event(conn, i, i, 0);
+  }
+  expect_no_event(conn);
+  expect_counts(conn, 41, 6);
+
+  send_confirm(broker, 40, 1, 0);
+  expect_event(conn, 34, 34, 0);
+  expect_event(conn, 36, 40, 0);
+  expect_counts(conn, 41, 0);
+
+  amqp_destroy_connection(broker);
+  amqp_destroy_connection(conn);
+}
+
+static void test_failed_publish_at_wrap(amqp_connection_state_t conn,
+                                        amqp_connection_state_t broker)
+{
+  uint64_t next = amqp_confirm_next_seqno(conn, 1);
+
+  /* The ring's size is a power of 2 no larger than 4096, so sequence number
+     4096 is at the start of the ring */
+  publish(conn, 1, (int)(4095 - next));
+  test_failed_publish(conn);
+  publish(conn, 1, 3);
+  expect_counts(conn, 4098, 4098 - next);
+
+  send_confirm(broker, 4000, 1, 1);
+  expect_event(conn, next, 4000, 1);
+  send_confirm(broker, 4096, 0, 0);
+  expect_event(conn, 4096, 4096, 0);
+  send_confirm(broker, 4097, 1, 1);
+  expect_event(conn, 4001, 4095, 1);
+  expect_event(conn, 4097, 4097, 1);
+  expect_counts(conn, 4098, 0);
+}
+
+static void send_split_ack(int broker_fd, uint64_t delivery_tag,
+                           amqp_connection_state_t conn)
+{
+  /* basic.ack on channel 1, 13 bytes of payload */
+  unsigned char frame[21] = { 1, 0, 1, 0, 0, 0, 13, 0, 60, 0, 80 };
+  amqp_confirm_event_t event;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    frame[11 + i] = (unsigned char)(delivery_tag >> (56 - 8 * i));
+  }
+  frame[19] = 0;
+  frame[20] = AMQP_FRAME_END;
+
+  /* The frame is read in two parts and has to be put together */
+  if (10 != write(broker_fd, frame, 10)) {
+    die("write failed");
+  }
+  if (AMQP_STATUS_TIMEOUT != amqp_confirm_poll(conn, &event)) {
+    die("event from half a frame");
+  }
+  if (11 != write(broker_fd, frame + 10, 11)) {
+    die("write failed");
+  }
+}
+
+static void test_confirm_memory(amqp_connection_state_t conn,
+                                amqp_connection_state_t broker, int broker_fd)
+{
+  amqp_memory_stats_t before;
+  amqp_memory_stats_t after;
+  uint64_t seqno = amqp_confirm_next_seqno(conn, 1);
+  int i;
+
+  /* The library consumes the confirms, so the caller never releases
+     anything for them: they must not hold on to memory */
+  amqp_get_memory_stats(conn, &before);
+  for (i = 0; i < 1000; i++, seqno++) {
+    publish(conn, 1, 1);
+    if (i % 2) {
+      send_split_ack(broker_fd, seqno, conn);
+    } else {
+      send_confirm(broker, seqno, 0, 0);
+    }
+    expect_event(conn, seqno, seqno, 0);
+  }
+  amqp_get_memory_stats(conn, &after);
+
+  if (0 != after.pinned_buffer_bytes) {
+    die("confirms pinned %u bytes of receive buffers",
+        (unsigned)after.pinned_buffer_bytes);
+  }
+  if (after.bytes_in_use > before.bytes_in_use + 256) {
+    die("confirms took %u bytes of pool memory",
+        (unsigned)(after.bytes_in_use - before.bytes_in_use));
+  }
+}
+
+int main(void)
+{
+  int sv[2];
+  int buffer_size = 4 * 1024 * 1024;
+  amqp_connection_state_t conn;
+  amqp_connection_state_t broker;
+
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair failed");
+  }
+  /* room for every publish, nothing reads them */
+  setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+  setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+  conn = new_connection(sv[0]);
+  broker = new_connection(sv[1]);
+
+  if (AMQP_STATUS_OK != amqp_confirm_track(conn, 1)) {
+    die("tracking confirms failed");
+  }
+  expect_counts(conn, 1, 0);
+
+  /* Publishes span several bitmap words, channel 2 isn't tracked */
+  publish(conn, 1, 200);
+  publish(conn, 2, 10);
+  expect_counts(conn, 201, 200);
+
+  test_failed_publish(conn);
+  expect_counts(conn, 201, 200);
+
+  send_confirm(broker, 5, 0, 0);
+  expect_event(conn, 5, 5, 0);
+  expect_counts(conn, 201, 199);
+
+  /* A multiple ack skips what has already been confirmed */
+  send_confirm(broker, 70, 1, 0);
+  expect_event(conn, 1, 4, 0);
+  expect_event(conn, 6, 70, 0);
+  expect_counts(conn, 201, 130);
+
+  send_confirm(broker, 130, 1, 1);
+  expect_event(conn, 71, 130, 1);
+  expect_counts(conn, 201, 70);
+
+  /* Confirms for sequence numbers that are no longer outstanding are
+     ignored */
+  send_confirm(broker, 5, 0, 0);
+  send_confirm(broker, 100, 0, 1);
+  expect_no_event(conn);
+
+  /* Delivery tag 0 with multiple covers everything */
+  send_confirm(broker, 0, 1, 0);
+  expect_event(conn, 131, 200, 0);
+  expect_counts(conn, 201, 0);
+
+  /* The bitmap grows past its initial 1024 bits, with the window wrapping
+     around the end of the ring */
+  publish(conn, 1, 1500);
+  expect_counts(conn, 1701, 1500);
+
+  send_confirm(broker, 1000, 0, 1);
+  send_confirm(broker, 1700, 1, 0);
+  expect_event(conn, 1000, 1000, 1);
+  expect_event(conn, 201, 999, 0);
+  expect_event(conn, 1001, 1700, 0);
+  expect_counts(conn, 1701, 0);
+
+  /* Adjacent single acks are merged into one event */
+  publish(conn, 1, 3);
+  send_confirm(broker, 1701, 0, 0);
+  send_confirm(broker, 1702, 0, 0);
+  send_confirm(broker, 1703, 0, 0);
+  usleep(10000);
+  expect_event(conn, 1701, 1703, 0);
+  expect_counts(conn, 1704, 0);
+
+  test_confirm_memory(conn, broker, sv[1]);
+  expect_counts(conn, 2704, 0);
+
+  /* A failed publish just before the ring wraps around, with the confirms
+     around it coming in multiples */
+  test_failed_publish_at_wrap(conn, broker);
+
+  amqp_destroy_connection(broker);
+  amqp_destroy_connection(conn);
+
+  test_out_of_memory();
+  return 0;
+}
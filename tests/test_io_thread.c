@@ -0,0 +1,268 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_io_thread.h>
+#include <amqp_tcp_socket.h>
+
+/* The broker end is an ordinary blocking connection driven by the test */
+
+#define BODY_SIZE (8 * 1024)
+
+static void die(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  abort();
+}
+
+static amqp_connection_state_t new_connection(int sockfd)
+{
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *socket;
+
+  if (NULL == conn) {
+    die("out of memory");
+  }
+  socket = amqp_tcp_socket_new(conn);
+  if (NULL == socket) {
+    die("out of memory");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sockfd);
+  return conn;
+}
+
+static void check(int res, const char *what)
+{
+  if (AMQP_STATUS_OK != res) {
+    die("%s failed: %s", what, amqp_error_string2(res));
+  }
+}
+
+/* Only looked at once the I/O thread has been joined */
+typedef struct result_t_ {
+  int calls;
+  int status;
+  amqp_boolean_t nacked;
+} result_t;
+
+static void publish_done(void *user_data, int status, amqp_boolean_t nacked)
+{
+  result_t *result = user_data;
+
+  result->calls++;
+  result->status = status;
+  result->nacked = nacked;
+}
+
+static void publish(amqp_io_thread_t *thread, result_t *result)
+{
+  check(amqp_io_thread_publish(thread, amqp_cstring_bytes("exchange"),
+                               amqp_cstring_bytes("key"), 0, 0, NULL,
+                               amqp_cstring_bytes("body"), publish_done,
+                               result),
+        "publishing");
+}
+
+/* Reads the method, header and body frames of one publish */
+static void receive_publish(amqp_connection_state_t broker)
+{
+  amqp_frame_t frame;
+
+  check(amqp_simple_wait_frame(broker, &frame), "receiving the method");
+  if (AMQP_FRAME_METHOD != frame.frame_type ||
+      AMQP_BASIC_PUBLISH_METHOD != frame.payload.method.id) {
+    die("expected basic.publish");
+  }
+  check(amqp_simple_wait_frame(broker, &frame), "receiving the header");
+  check(amqp_simple_wait_frame(broker, &frame), "receiving the body");
+  amqp_maybe_release_buffers(broker);
+}
+
+static void test_confirmed(amqp_connection_state_t conn,
+                           amqp_connection_state_t broker)
+{
+  amqp_io_thread_t *thread;
+  amqp_basic_ack_t ack;
+  amqp_memory_stats_t stats;
+  struct timeval timeout = { 10, 0 };
+  result_t result = { 0, 0, 0 };
+
+  thread = amqp_io_thread_start(conn, 1, NULL, NULL);
+  if (NULL == thread) {
+    die("starting the I/O thread failed");
+  }
+
+  publish(thread, &result);
+  receive_publish(broker);
+  ack.delivery_tag = 1;
+  ack.multiple = 0;
+  check(amqp_send_method(broker, 1, AMQP_BASIC_ACK_METHOD, &ack),
+        "sending the ack");
+
+  /* Waits for the ack */
+  check(amqp_io_thread_stop(thread, &timeout), "stopping");
+  if (1 != result.calls || AMQP_STATUS_OK != result.status || result.nacked) {
+    die("expected the publish to be confirmed, got %d calls, status %d",
+        result.calls, result.status);
+  }
+
+  /* Nothing is held on to for the confirm */
+  amqp_get_memory_stats(conn, &stats);
+  if (0 != stats.pinned_buffer_bytes) {
+    die("%d bytes still pinned after the confirm",
+        (int)stats.pinned_buffer_bytes);
+  }
+}
+
+static void test_stop_timeout(amqp_connection_state_t conn,
+                              amqp_connection_state_t broker)
+{
+  amqp_io_thread_t *thread;
+  struct timeval timeout = { 0, 100 * 1000 };
+  result_t result = { 0, 0, 0 };
+  int res;
+
+  thread = amqp_io_thread_start(conn, 1, NULL, NULL);
+  if (NULL == thread) {
+    die("starting the I/O thread failed");
+  }
+
+  /* The broker never confirms */
+  publish(thread, &result);
+  receive_publish(broker);
+
+  res = amqp_io_thread_stop(thread, &timeout);
+  if (AMQP_STATUS_TIMEOUT != res) {
+    die("expected stopping to time out, got %s", amqp_error_string2(res));
+  }
+  if (1 != result.calls || AMQP_STATUS_TIMEOUT != result.status) {
+    die("expected the publish to time out, got %d calls, status %d",
+        result.calls, result.status);
+  }
+  if (1 != amqp_confirm_outstanding(conn, 1)) {
+    die("expected the publish to still be outstanding");
+  }
+}
+
+static void *drain(void *arg)
+{
+  int fd = *(int *)arg;
+  char buf[4096];
+
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+  return NULL;
+}
+
+static void test_queue_limit(void)
+{
+  static char body[BODY_SIZE];
+  int sv[2];
+  int buffer_size = 16 * 1024;
+  amqp_connection_state_t conn;
+  amqp_io_thread_t *thread;
+  pthread_t drainer;
+  amqp_bytes_t body_bytes;
+  int res = AMQP_STATUS_OK;
+  int i;
+
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair failed");
+  }
+  setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+  setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+  conn = new_connection(sv[0]);
+  amqp_set_memory_limit(conn, 64 * 1024);
+
+  /* Nothing reads what is published, on a channel without confirms */
+  thread = amqp_io_thread_start(conn, 2, NULL, NULL);
+  if (NULL == thread) {
+    die("starting the I/O thread failed");
+  }
+
+  body_bytes.len = BODY_SIZE;
+  body_bytes.bytes = body;
+  for (i = 0; i < 1000 && AMQP_STATUS_OK == res; i++) {
+    res = amqp_io_thread_publish(thread, amqp_cstring_bytes("exchange"),
+                                 amqp_cstring_bytes("key"), 0, 0, NULL,
+                                 body_bytes, NULL, NULL);
+  }
+  if (AMQP_STATUS_MEMORY_LIMIT != res) {
+    die("expected publishing to be refused, got %s after %d messages",
+        amqp_error_string2(res), i);
+  }
+
+  /* Everything accepted is still sent on stopping */
+  if (pthread_create(&drainer, NULL, drain, &sv[1])) {
+    die("starting the drain thread failed");
+  }
+  check(amqp_io_thread_stop(thread, NULL), "stopping");
+  amqp_destroy_connection(conn);
+  pthread_join(drainer, NULL);
+  close(sv[1]);
+}
+
+int main(void)
+{
+  int sv[2];
+  amqp_connection_state_t conn;
+  amqp_connection_state_t broker;
+  amqp_frame_t frame;
+
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair failed");
+  }
+  conn = new_connection(sv[0]);
+  broker = new_connection(sv[1]);
+
+  check(amqp_send_header(broker), "sending the header");
+  check(amqp_simple_wait_frame(conn, &frame), "receiving the header");
+  check(amqp_confirm_track(conn, 1), "tracking confirms");
+
+  test_confirmed(conn, broker);
+  test_stop_timeout(conn, broker);
+  test_queue_limit();
+
+  amqp_destroy_connection(broker);
+  amqp_destroy_connection(conn);
+  return 0;
+}
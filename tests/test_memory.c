@@ -0,0 +1,543 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+static void die(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  abort();
+}
+
+static amqp_connection_state_t new_connection(int sockfd)
+{
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *socket;
+
+  if (NULL == conn) {
+    die("out of memory");
+  }
+  socket = amqp_tcp_socket_new(conn);
+  if (NULL == socket) {
+    die("out of memory");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sockfd);
+  return conn;
+}
+
+static amqp_memory_stats_t get_stats(amqp_connection_state_t conn)
+{
+  amqp_memory_stats_t stats;
+  amqp_get_memory_stats(conn, &stats);
+  return stats;
+}
+
+/* The broker sends a method, which the connection receives in a read of its
+   own */
+static int send_and_wait(amqp_connection_state_t broker,
+                         amqp_connection_state_t conn, uint64_t delivery_tag)
+{
+  amqp_basic_ack_t ack;
+  amqp_frame_t frame;
+  int res;
+
+  ack.delivery_tag = delivery_tag;
+  ack.multiple = 0;
+  res = amqp_send_method(broker, 1, AMQP_BASIC_ACK_METHOD, &ack);
+  if (AMQP_STATUS_OK != res) {
+    die("sending failed: %s", amqp_error_string2(res));
+  }
+
+  res = amqp_simple_wait_frame(conn, &frame);
+  if (AMQP_STATUS_OK == res &&
+      (AMQP_FRAME_METHOD != frame.frame_type ||
+       AMQP_BASIC_ACK_METHOD != frame.payload.method.id ||
+       delivery_tag !=
+         ((amqp_basic_ack_t *)frame.payload.method.decoded)->delivery_tag)) {
+    die("received the wrong frame");
+  }
+  return res;
+}
+
+static void test_pinned_buffer_limit(amqp_connection_state_t conn,
+                                     amqp_connection_state_t broker)
+{
+  amqp_memory_stats_t stats;
+  size_t buffer_size;
+  int res;
+  int i;
+
+  /* Each read goes into a receive buffer of its own while the frames
+     decoded in place in the earlier ones are held */
+  if (AMQP_STATUS_OK != send_and_wait(broker, conn, 1)) {
+    die("receiving failed");
+  }
+  buffer_size = get_stats(conn).pinned_buffer_bytes;
+  if (AMQP_STATUS_OK != send_and_wait(broker, conn, 2)) {
+    die("receiving failed");
+  }
+  stats = get_stats(conn);
+  if (0 == buffer_size || 2 * buffer_size != stats.pinned_buffer_bytes) {
+    die("expected 2 pinned receive buffers, got %u bytes",
+        (unsigned)stats.pinned_buffer_bytes);
+  }
+
+  /* Pinned buffers count towards the limit */
+  amqp_set_memory_limit(conn, buffer_size + buffer_size / 2);
+  res = send_and_wait(broker, conn, 3);
+  if (AMQP_STATUS_MEMORY_LIMIT != res) {
+    die("expected the memory limit, got %s", amqp_error_string2(res));
+  }
+
+  /* One of the released buffers is kept as a spare */
+  amqp_maybe_release_buffers(conn);
+  stats = get_stats(conn);
+  if (0 != stats.pinned_buffer_bytes || buffer_size != stats.retained_bytes) {
+    die("expected a spare buffer after releasing, got %u pinned %u retained",
+        (unsigned)stats.pinned_buffer_bytes, (unsigned)stats.retained_bytes);
+  }
+
+  /* The spare is given up rather than refusing to read, and with no room
+     to pin a buffer frames are copied out of it */
+  amqp_set_memory_limit(conn, buffer_size / 2);
+  for (i = 0; i < 10; i++) {
+    amqp_frame_t frame;
+
+    res = (0 == i ? amqp_simple_wait_frame(conn, &frame) :
+           send_and_wait(broker, conn, 3 + i));
+    if (AMQP_STATUS_OK != res) {
+      die("receiving under the limit failed: %s", amqp_error_string2(res));
+    }
+    stats = get_stats(conn);
+    if (0 != stats.pinned_buffer_bytes || 0 != stats.retained_bytes) {
+      die("%u bytes pinned and %u retained under the limit",
+          (unsigned)stats.pinned_buffer_bytes, (unsigned)stats.retained_bytes);
+    }
+  }
+  amqp_maybe_release_buffers(conn);
+
+  /* With room for some, no more buffers are pinned than fit */
+  amqp_set_memory_limit(conn, 3 * buffer_size);
+  for (i = 0; i < 10; i++) {
+    if (AMQP_STATUS_OK != send_and_wait(broker, conn, 100 + i)) {
+      die("receiving under the limit failed");
+    }
+    stats = get_stats(conn);
+    if (stats.pinned_buffer_bytes + stats.bytes_in_use > 3 * buffer_size) {
+      die("%u bytes pinned past the limit",
+          (unsigned)stats.pinned_buffer_bytes);
+    }
+  }
+  if (0 == stats.pinned_buffer_bytes) {
+    die("nothing decoded in place under the limit");
+  }
+  amqp_maybe_release_buffers(conn);
+  amqp_set_memory_limit(conn, 0);
+}
+
+static void expect_pool(amqp_pool_t const *pool, size_t reserved,
+                        size_t in_use, size_t retained, const char *when)
+{
+  if (reserved != pool->stats.bytes_reserved ||
+      in_use != pool->stats.bytes_in_use ||
+      retained != pool->stats.retained_bytes) {
+    die("%s: %u reserved, %u in use, %u retained; expected %u, %u, %u", when,
+        (unsigned)pool->stats.bytes_reserved,
+        (unsigned)pool->stats.bytes_in_use,
+        (unsigned)pool->stats.retained_bytes, (unsigned)reserved,
+        (unsigned)in_use, (unsigned)retained);
+  }
+}
+
+static void *pool_alloc(amqp_pool_t *pool, size_t amount)
+{
+  void *result = amqp_pool_alloc(pool, amount);
+  if (NULL == result) {
+    die("out of memory");
+  }
+  return result;
+}
+
+static void test_large_block_reuse(void)
+{
+  amqp_pool_t pool;
+  unsigned char *blocks[100];
+  size_t total = 450000;
+  int i;
+
+  init_amqp_pool(&pool, 4096);
+  pool_alloc(&pool, 300000);
+  pool_alloc(&pool, 100000);
+  pool_alloc(&pool, 50000);
+  expect_pool(&pool, total, total, 0, "after allocating");
+  recycle_amqp_pool(&pool);
+  expect_pool(&pool, total, 0, total, "after recycling");
+
+  /* Each request takes the smallest block it fits in, a larger one would
+     leave the next request without */
+  pool_alloc(&pool, 90000);
+  expect_pool(&pool, total, 100000, 350000, "reusing for 90000");
+  pool_alloc(&pool, 250000);
+  expect_pool(&pool, total, 400000, 50000, "reusing for 250000");
+  pool_alloc(&pool, 40000);
+  expect_pool(&pool, total, total, 0, "reusing for 40000");
+  pool_alloc(&pool, 60000);
+  expect_pool(&pool, total + 60000, total + 60000, 0, "with nothing to reuse");
+
+  /* Only a bounded number of blocks is kept */
+  empty_amqp_pool(&pool);
+  expect_pool(&pool, 0, 0, 0, "after emptying");
+  for (i = 0; i < 100; i++) {
+    blocks[i] = pool_alloc(&pool, 5000);
+    memset(blocks[i], i, 5000);
+  }
+  for (i = 0; i < 100; i++) {
+    if (blocks[i][0] != i || blocks[i][4999] != i) {
+      die("large block %d was overwritten", i);
+    }
+  }
+  recycle_amqp_pool(&pool);
+  expect_pool(&pool, 8 * 5000, 0, 8 * 5000, "after recycling 100 blocks");
+  empty_amqp_pool(&pool);
+  expect_pool(&pool, 0, 0, 0, "after emptying");
+}
+
+static void test_page_reuse(void)
+{
+  amqp_pool_t pool;
+  unsigned char *chunks[100];
+  int i;
+
+  /* Past the first few pages the page list grows, pages are kept across
+     recycling */
+  init_amqp_pool(&pool, 4096);
+  for (i = 0; i < 100; i++) {
+    chunks[i] = pool_alloc(&pool, 3000);
+    memset(chunks[i], i, 3000);
+  }
+  for (i = 0; i < 100; i++) {
+    if (chunks[i][0] != i || chunks[i][2999] != i) {
+      die("chunk %d was overwritten", i);
+    }
+  }
+  expect_pool(&pool, 100 * 4096, 100 * 3000, 0, "after allocating");
+
+  recycle_amqp_pool(&pool);
+  for (i = 0; i < 100; i++) {
+    pool_alloc(&pool, 3000);
+  }
+  expect_pool(&pool, 100 * 4096, 100 * 3000, 0, "after reusing the pages");
+  empty_amqp_pool(&pool);
+}
+
+static void *poisoning_malloc(void *user_data, size_t size)
+{
+  void *result = malloc(size);
+  (void)user_data;
+  if (NULL != result) {
+    memset(result, 0xa5, size);
+  }
+  return result;
+}
+
+static void *plain_realloc(void *user_data, void *ptr, size_t size)
+{
+  (void)user_data;
+  return realloc(ptr, size);
+}
+
+static void plain_free(void *user_data, void *ptr)
+{
+  (void)user_data;
+  free(ptr);
+}
+
+static void expect_zeroed(const unsigned char *p, size_t len, const char *what)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (0 != p[i]) {
+      die("%s isn't zeroed at %u", what, (unsigned)i);
+    }
+  }
+}
+
+/* Sends a delivery whose properties have a nested headers table, with
+   strings of the given length */
+static void send_delivery(amqp_connection_state_t broker, uint64_t delivery_tag,
+                          size_t text_len, const unsigned char *body,
+                          size_t body_len)
+{
+  static char text[256];
+  amqp_basic_deliver_t deliver;
+  amqp_basic_properties_t properties;
+  amqp_table_entry_t entries[3];
+  amqp_table_entry_t inner;
+  amqp_bytes_t text_bytes;
+  amqp_frame_t frame;
+
+  memset(text, 'a' + (int)delivery_tag, sizeof(text));
+  text_bytes.bytes = text;
+  text_bytes.len = text_len;
+
+  deliver.consumer_tag = text_bytes;
+  deliver.delivery_tag = delivery_tag;
+  deliver.redelivered = 0;
+  deliver.exchange = text_bytes;
+  deliver.routing_key = text_bytes;
+  if (AMQP_STATUS_OK !=
+      amqp_send_method(broker, 1, AMQP_BASIC_DELIVER_METHOD, &deliver)) {
+    die("sending basic.deliver failed");
+  }
+
+  inner.key = amqp_cstring_bytes("flag");
+  inner.value.kind = AMQP_FIELD_KIND_BOOLEAN;
+  inner.value.value.boolean = 1;
+  entries[0].key = amqp_cstring_bytes("text");
+  entries[0].value.kind = AMQP_FIELD_KIND_UTF8;
+  entries[0].value.value.bytes = text_bytes;
+  entries[1].key = amqp_cstring_bytes("count");
+  entries[1].value.kind = AMQP_FIELD_KIND_I32;
+  entries[1].value.value.i32 = (int32_t)delivery_tag;
+  entries[2].key = amqp_cstring_bytes("inner");
+  entries[2].value.kind = AMQP_FIELD_KIND_TABLE;
+  entries[2].value.value.table.num_entries = 1;
+  entries[2].value.value.table.entries = &inner;
+
+  properties._flags = AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_HEADERS_FLAG;
+  properties.content_type = text_bytes;
+  properties.headers.num_entries = 3;
+  properties.headers.entries = entries;
+
+  frame.frame_type = AMQP_FRAME_HEADER;
+  frame.channel = 1;
+  frame.payload.properties.class_id = AMQP_BASIC_CLASS;
+  frame.payload.properties.body_size = body_len;
+  frame.payload.properties.decoded = &properties;
+  if (AMQP_STATUS_OK != amqp_send_frame(broker, &frame)) {
+    die("sending the content header failed");
+  }
+
+  frame.frame_type = AMQP_FRAME_BODY;
+  frame.payload.body_fragment.bytes = (void *)body;
+  frame.payload.body_fragment.len = body_len;
+  if (AMQP_STATUS_OK != amqp_send_frame(broker, &frame)) {
+    die("sending the body failed");
+  }
+}
+
+static void expect_text(amqp_bytes_t bytes, uint64_t delivery_tag,
+                        size_t text_len, const char *what)
+{
+  size_t i;
+
+  if (text_len != bytes.len) {
+    die("%s of message %u is %u bytes", what, (unsigned)delivery_tag,
+        (unsigned)bytes.len);
+  }
+  for (i = 0; i < text_len; i++) {
+    if (((char *)bytes.bytes)[i] != 'a' + (int)delivery_tag) {
+      die("%s of message %u is wrong", what, (unsigned)delivery_tag);
+    }
+  }
+}
+
+static void expect_message(amqp_message_t const *message, uint64_t delivery_tag,
+                           size_t text_len, const unsigned char *body,
+                           size_t body_len)
+{
+  amqp_basic_properties_t const *p = &message->properties;
+  amqp_table_entry_t const *e = p->headers.entries;
+
+  if ((AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_HEADERS_FLAG) != p->_flags) {
+    die("message %u has flags %x", (unsigned)delivery_tag,
+        (unsigned)p->_flags);
+  }
+  expect_text(p->content_type, delivery_tag, text_len, "the content type");
+  if (3 != p->headers.num_entries ||
+      AMQP_FIELD_KIND_UTF8 != e[0].value.kind ||
+      AMQP_FIELD_KIND_I32 != e[1].value.kind ||
+      (int32_t)delivery_tag != e[1].value.value.i32 ||
+      AMQP_FIELD_KIND_TABLE != e[2].value.kind ||
+      1 != e[2].value.value.table.num_entries ||
+      AMQP_FIELD_KIND_BOOLEAN != e[2].value.value.table.entries[0].value.kind ||
+      1 != e[2].value.value.table.entries[0].value.value.boolean) {
+    die("the headers of message %u are wrong", (unsigned)delivery_tag);
+  }
+  expect_text(e[0].value.value.bytes, delivery_tag, text_len, "a header");
+  if (body_len != message->body.len ||
+      0 != memcmp(message->body.bytes, body, body_len)) {
+    die("the body of message %u is wrong", (unsigned)delivery_tag);
+  }
+}
+
+/* Frames cut into pieces of this size are decoded through the frame buffer
+   rather than in place */
+#define PIECE_SIZE 13
+
+static void test_uninitialised_memory(void)
+{
+  static unsigned char body[3000];
+  static unsigned char raw[8192];
+  amqp_allocator_t allocator;
+  amqp_pool_t pool;
+  amqp_connection_state_t conn;
+  amqp_connection_state_t broker;
+  amqp_message_t message;
+  amqp_frame_t frame;
+  int relay[2];
+  int sv[2];
+  int i;
+
+  /* Everything the library allocates starts out as garbage */
+  memset(&allocator, 0, sizeof(allocator));
+  allocator.malloc_func = poisoning_malloc;
+  allocator.realloc_func = plain_realloc;
+  allocator.free_func = plain_free;
+  if (AMQP_STATUS_OK != amqp_set_default_allocator(&allocator)) {
+    die("setting the allocator failed");
+  }
+
+  /* Recycled pages and blocks are dirty, amqp_pool_alloc() still zeroes */
+  init_amqp_pool(&pool, 4096);
+  memset(pool_alloc(&pool, 1000), 0xff, 1000);
+  memset(pool_alloc(&pool, 10000), 0xff, 10000);
+  recycle_amqp_pool(&pool);
+  expect_zeroed(pool_alloc(&pool, 1000), 1000, "a recycled page");
+  expect_zeroed(pool_alloc(&pool, 10000), 10000, "a recycled block");
+  expect_zeroed(pool_alloc(&pool, 2000), 2000, "a new page");
+  empty_amqp_pool(&pool);
+
+  /* The broker's output is passed on in small pieces, read one at a time */
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, relay) ||
+      0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair failed");
+  }
+  broker = new_connection(relay[0]);
+  conn = new_connection(sv[0]);
+  if (AMQP_STATUS_OK != amqp_send_header(broker) ||
+      8 != recv(relay[1], raw, sizeof(raw), 0) || 8 != write(sv[1], raw, 8) ||
+      AMQP_STATUS_OK != amqp_simple_wait_frame(conn, &frame)) {
+    die("opening the connection failed");
+  }
+
+  for (i = 0; i < (int)sizeof(body); i++) {
+    body[i] = (unsigned char)(i * 7);
+  }
+  memset(&message, 0, sizeof(message));
+
+  /* Long strings first, then short ones into the same recycled memory */
+  for (i = 1; i <= 4; i++) {
+    size_t text_len = (i % 2) ? 200 : 5;
+    ssize_t len;
+    ssize_t offset;
+
+    send_delivery(broker, i, text_len, body, sizeof(body));
+    len = recv(relay[1], raw, sizeof(raw), MSG_DONTWAIT);
+    if (len <= 0) {
+      die("nothing to relay");
+    }
+
+    if (AMQP_STATUS_OK != amqp_set_nonblocking(conn, 1)) {
+      die("switching to non-blocking failed");
+    }
+    for (offset = 0; offset < len; offset += PIECE_SIZE) {
+      size_t piece = len - offset < PIECE_SIZE ? len - offset : PIECE_SIZE;
+      if ((ssize_t)piece != write(sv[1], raw + offset, piece) ||
+          AMQP_STATUS_OK != amqp_handle_io(conn, AMQP_IO_READABLE)) {
+        die("relaying failed");
+      }
+    }
+    if (AMQP_STATUS_OK != amqp_set_nonblocking(conn, 0)) {
+      die("switching to blocking failed");
+    }
+
+    if (AMQP_STATUS_OK != amqp_simple_wait_frame(conn, &frame) ||
+        AMQP_BASIC_DELIVER_METHOD != frame.payload.method.id) {
+      die("expected basic.deliver");
+    }
+    expect_text(((amqp_basic_deliver_t *)frame.payload.method.decoded)->exchange,
+                i, text_len, "the exchange");
+    if (AMQP_RESPONSE_NORMAL !=
+        amqp_read_message(conn, 1, &message, AMQP_MESSAGE_POOLED).reply_type) {
+      die("reading message %d failed", i);
+    }
+    expect_message(&message, i, text_len, body, sizeof(body));
+    amqp_maybe_release_buffers(conn);
+  }
+  amqp_destroy_message(&message);
+
+  amqp_destroy_connection(broker);
+  amqp_destroy_connection(conn);
+  close(relay[1]);
+  close(sv[1]);
+  amqp_set_default_allocator(NULL);
+}
+
+int main(void)
+{
+  int sv[2];
+  amqp_connection_state_t conn;
+  amqp_connection_state_t broker;
+  amqp_frame_t frame;
+
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair failed");
+  }
+  conn = new_connection(sv[0]);
+  broker = new_connection(sv[1]);
+
+  /* Frames are only decoded in place once the protocol header is in */
+  if (AMQP_STATUS_OK != amqp_send_header(broker) ||
+      AMQP_STATUS_OK != amqp_simple_wait_frame(conn, &frame)) {
+    die("opening the connection failed");
+  }
+
+  test_pinned_buffer_limit(conn, broker);
+  test_large_block_reuse();
+  test_page_reuse();
+  test_uninitialised_memory();
+
+  amqp_destroy_connection(broker);
+  amqp_destroy_connection(conn);
+  return 0;
+}
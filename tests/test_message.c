@@ -0,0 +1,475 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+/* Bodies are sent in frames of this size, so larger ones arrive in
+   several */
+#define FRAGMENT_SIZE 4000
+#define BODY_SIZE 20000
+
+static void die(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  abort();
+}
+
+static void check(int res, const char *what)
+{
+  if (AMQP_STATUS_OK != res) {
+    die("%s failed: %s", what, amqp_error_string2(res));
+  }
+}
+
+static void check_reply(amqp_rpc_reply_t reply, const char *what)
+{
+  if (AMQP_RESPONSE_NORMAL != reply.reply_type) {
+    die("%s failed: %s", what,
+        AMQP_RESPONSE_LIBRARY_EXCEPTION == reply.reply_type ?
+        amqp_error_string2(reply.library_error) : "server exception");
+  }
+}
+
+static amqp_connection_state_t new_connection(int sockfd,
+                                              amqp_allocator_t const *allocator)
+{
+  amqp_connection_state_t conn = (allocator ?
+                                  amqp_new_connection_with_allocator(allocator) :
+                                  amqp_new_connection());
+  amqp_socket_t *socket;
+
+  if (NULL == conn) {
+    die("out of memory");
+  }
+  socket = amqp_tcp_socket_new(conn);
+  if (NULL == socket) {
+    die("out of memory");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sockfd);
+  return conn;
+}
+
+static void fill_body(unsigned char *body, size_t len, int seed)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    body[i] = (unsigned char)(i * 13 + seed);
+  }
+}
+
+/* Sends a delivery the way a broker would, the body cut into frames of
+   FRAGMENT_SIZE */
+static void send_message(amqp_connection_state_t broker, amqp_channel_t channel,
+                         uint64_t delivery_tag, const unsigned char *body,
+                         size_t len)
+{
+  amqp_basic_deliver_t deliver;
+  amqp_basic_properties_t properties;
+  amqp_frame_t frame;
+  size_t sent;
+
+  deliver.consumer_tag = amqp_cstring_bytes("consumer");
+  deliver.delivery_tag = delivery_tag;
+  deliver.redelivered = 0;
+  deliver.exchange = amqp_cstring_bytes("exchange");
+  deliver.routing_key = amqp_cstring_bytes("key");
+  check(amqp_send_method(broker, channel, AMQP_BASIC_DELIVER_METHOD, &deliver),
+        "sending basic.deliver");
+
+  properties._flags = AMQP_BASIC_CONTENT_TYPE_FLAG;
+  properties.content_type = amqp_cstring_bytes("text/plain");
+  frame.frame_type = AMQP_FRAME_HEADER;
+  frame.channel = channel;
+  frame.payload.properties.class_id = AMQP_BASIC_CLASS;
+  frame.payload.properties.body_size = len;
+  frame.payload.properties.decoded = &properties;
+  check(amqp_send_frame(broker, &frame), "sending the content header");
+
+  for (sent = 0; sent < len; sent += FRAGMENT_SIZE) {
+    frame.frame_type = AMQP_FRAME_BODY;
+    frame.channel = channel;
+    frame.payload.body_fragment.bytes = (void *)(body + sent);
+    frame.payload.body_fragment.len =
+      len - sent < FRAGMENT_SIZE ? len - sent : FRAGMENT_SIZE;
+    check(amqp_send_frame(broker, &frame), "sending a body frame");
+  }
+}
+
+static void expect_deliver(amqp_connection_state_t conn, uint64_t delivery_tag)
+{
+  amqp_frame_t frame;
+
+  check(amqp_simple_wait_frame(conn, &frame), "receiving basic.deliver");
+  if (AMQP_FRAME_METHOD != frame.frame_type ||
+      AMQP_BASIC_DELIVER_METHOD != frame.payload.method.id ||
+      delivery_tag !=
+        ((amqp_basic_deliver_t *)frame.payload.method.decoded)->delivery_tag) {
+    die("expected basic.deliver %u", (unsigned)delivery_tag);
+  }
+}
+
+static void expect_content_type(amqp_basic_properties_t const *properties)
+{
+  if (!(properties->_flags & AMQP_BASIC_CONTENT_TYPE_FLAG) ||
+      properties->content_type.len != strlen("text/plain") ||
+      0 != memcmp(properties->content_type.bytes, "text/plain",
+                  properties->content_type.len)) {
+    die("the properties weren't received");
+  }
+}
+
+static void expect_nothing_held(amqp_connection_state_t conn)
+{
+  amqp_memory_stats_t stats;
+
+  amqp_get_memory_stats(conn, &stats);
+  if (0 != stats.bytes_in_use || 0 != stats.pinned_buffer_bytes) {
+    die("%u bytes in use and %u pinned after releasing",
+        (unsigned)stats.bytes_in_use, (unsigned)stats.pinned_buffer_bytes);
+  }
+}
+
+static void read_ref(amqp_connection_state_t conn,
+                     amqp_connection_state_t broker, const unsigned char *body,
+                     size_t len)
+{
+  amqp_message_ref_t ref;
+  size_t offset = 0;
+  int expected_fragments = (int)((len + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE);
+  int i;
+
+  send_message(broker, 1, 1, body, len);
+  expect_deliver(conn, 1);
+  check_reply(amqp_read_message_ref(conn, 1, &ref, 0), "reading a message");
+
+  expect_content_type(ref.properties);
+  if (1 != ref.channel || len != ref.body.len ||
+      expected_fragments != ref.num_fragments) {
+    die("a %u byte body came back as %u bytes in %d fragments",
+        (unsigned)len, (unsigned)ref.body.len, ref.num_fragments);
+  }
+  /* Only a body in one piece is returned as such */
+  if ((1 == expected_fragments) != (NULL != ref.body.bytes) ||
+      (ref.body.bytes && 0 != memcmp(ref.body.bytes, body, len))) {
+    die("the body of a %u byte message is wrong", (unsigned)len);
+  }
+
+  for (i = 0; i < ref.num_fragments; i++) {
+    if (offset + ref.fragments[i].len > len ||
+        0 != memcmp(ref.fragments[i].bytes, body + offset,
+                    ref.fragments[i].len)) {
+      die("fragment %d of a %u byte message is wrong", i, (unsigned)len);
+    }
+    offset += ref.fragments[i].len;
+  }
+  if (offset != len) {
+    die("the fragments of a %u byte message add up to %u", (unsigned)len,
+        (unsigned)offset);
+  }
+
+  amqp_release_message_ref(conn, &ref);
+  expect_nothing_held(conn);
+}
+
+static void test_read_ref(amqp_connection_state_t conn,
+                          amqp_connection_state_t broker)
+{
+  static unsigned char body[BODY_SIZE];
+
+  fill_body(body, sizeof(body), 1);
+  read_ref(conn, broker, body, 1000);
+  read_ref(conn, broker, body, FRAGMENT_SIZE);
+  read_ref(conn, broker, body, BODY_SIZE);
+  read_ref(conn, broker, body, 0);
+}
+
+typedef struct stream_t_ {
+  unsigned char body[BODY_SIZE];
+  size_t received;
+  uint64_t body_size;
+  int fragments;
+  int ends;
+  /* the fragment to fail on, -1 for none */
+  int fail_at;
+} stream_t;
+
+static int stream_properties(void *user_data, amqp_channel_t channel,
+                             amqp_basic_properties_t const *properties,
+                             uint64_t body_size)
+{
+  stream_t *stream = user_data;
+
+  if (1 != channel || 0 != stream->fragments || 0 != stream->ends) {
+    die("properties out of order");
+  }
+  expect_content_type(properties);
+  stream->body_size = body_size;
+  return AMQP_STATUS_OK;
+}
+
+static int stream_fragment(void *user_data, amqp_channel_t channel,
+                           amqp_bytes_t fragment)
+{
+  stream_t *stream = user_data;
+
+  if (1 != channel || 0 != stream->ends ||
+      stream->received + fragment.len > sizeof(stream->body)) {
+    die("fragment out of order");
+  }
+  if (stream->fragments == stream->fail_at) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+  memcpy(stream->body + stream->received, fragment.bytes, fragment.len);
+  stream->received += fragment.len;
+  stream->fragments++;
+  return AMQP_STATUS_OK;
+}
+
+static int stream_end(void *user_data, amqp_channel_t channel)
+{
+  stream_t *stream = user_data;
+
+  if (1 != channel) {
+    die("end on the wrong channel");
+  }
+  stream->ends++;
+  return AMQP_STATUS_OK;
+}
+
+static const amqp_message_handler_t stream_handler = {
+  stream_properties, stream_fragment, stream_end
+};
+
+static void test_read_stream(amqp_connection_state_t conn,
+                             amqp_connection_state_t broker)
+{
+  static unsigned char body[BODY_SIZE];
+  static stream_t stream;
+  amqp_rpc_reply_t reply;
+  amqp_frame_t frame;
+  amqp_memory_stats_t stats;
+
+  /* Every fragment comes through in order, then the end */
+  fill_body(body, sizeof(body), 2);
+  memset(&stream, 0, sizeof(stream));
+  stream.fail_at = -1;
+  send_message(broker, 1, 1, body, BODY_SIZE);
+  expect_deliver(conn, 1);
+  check_reply(amqp_read_message_stream(conn, 1, &stream_handler, &stream, 0),
+              "streaming a message");
+  if (BODY_SIZE != stream.body_size || BODY_SIZE != stream.received ||
+      (BODY_SIZE + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE != stream.fragments ||
+      1 != stream.ends || 0 != memcmp(stream.body, body, BODY_SIZE)) {
+    die("streamed %u of %u bytes in %d fragments, %d ends",
+        (unsigned)stream.received, (unsigned)stream.body_size,
+        stream.fragments, stream.ends);
+  }
+  /* Fragments aren't kept after their callback */
+  amqp_get_memory_stats(conn, &stats);
+  if (stats.peak_bytes_in_use > 2 * FRAGMENT_SIZE + 1024) {
+    die("streaming held on to %u bytes", (unsigned)stats.peak_bytes_in_use);
+  }
+
+  /* A callback's error stops the read, the rest is left on the channel */
+  memset(&stream, 0, sizeof(stream));
+  stream.fail_at = 2;
+  send_message(broker, 1, 2, body, BODY_SIZE);
+  expect_deliver(conn, 2);
+  reply = amqp_read_message_stream(conn, 1, &stream_handler, &stream, 0);
+  if (AMQP_RESPONSE_LIBRARY_EXCEPTION != reply.reply_type ||
+      AMQP_STATUS_BAD_AMQP_DATA != reply.library_error) {
+    die("the callback's error wasn't returned");
+  }
+  if (2 != stream.fragments || 0 != stream.ends) {
+    die("reading went on after the callback failed");
+  }
+
+  check(amqp_simple_wait_frame(conn, &frame), "receiving");
+  if (AMQP_FRAME_BODY != frame.frame_type ||
+      0 != memcmp(frame.payload.body_fragment.bytes, body + 3 * FRAGMENT_SIZE,
+                  frame.payload.body_fragment.len)) {
+    die("expected the fragment after the one that failed");
+  }
+  check(amqp_simple_wait_frame(conn, &frame), "receiving");
+  if (AMQP_FRAME_BODY != frame.frame_type) {
+    die("expected the last fragment");
+  }
+  amqp_maybe_release_buffers(conn);
+  expect_nothing_held(conn);
+}
+
+static int allocations;
+
+static void *counting_malloc(void *user_data, size_t size)
+{
+  (void)user_data;
+  allocations++;
+  return malloc(size);
+}
+
+static void *counting_realloc(void *user_data, void *ptr, size_t size)
+{
+  (void)user_data;
+  allocations++;
+  return realloc(ptr, size);
+}
+
+static void counting_free(void *user_data, void *ptr)
+{
+  (void)user_data;
+  free(ptr);
+}
+
+static void expect_bytes(amqp_bytes_t bytes, const char *expected)
+{
+  if (bytes.len != strlen(expected) ||
+      0 != memcmp(bytes.bytes, expected, bytes.len)) {
+    die("expected \"%s\" in the envelope", expected);
+  }
+}
+
+static void expect_envelope(amqp_envelope_t const *envelope,
+                            uint64_t delivery_tag, const unsigned char *body,
+                            size_t len)
+{
+  if (1 != envelope->channel || delivery_tag != envelope->delivery_tag ||
+      len != envelope->message.body.len ||
+      0 != memcmp(envelope->message.body.bytes, body, len)) {
+    die("envelope %u is wrong", (unsigned)delivery_tag);
+  }
+  expect_bytes(envelope->consumer_tag, "consumer");
+  expect_bytes(envelope->exchange, "exchange");
+  expect_bytes(envelope->routing_key, "key");
+  expect_content_type(&envelope->message.properties);
+}
+
+static void test_pooled_envelope(void)
+{
+  static unsigned char body[BODY_SIZE];
+  amqp_allocator_t allocator;
+  amqp_connection_state_t conn;
+  amqp_connection_state_t broker;
+  amqp_envelope_t envelope;
+  amqp_frame_t frame;
+  int sv[2];
+  int i;
+
+  memset(&allocator, 0, sizeof(allocator));
+  allocator.malloc_func = counting_malloc;
+  allocator.realloc_func = counting_realloc;
+  allocator.free_func = counting_free;
+
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair failed");
+  }
+  conn = new_connection(sv[0], &allocator);
+  broker = new_connection(sv[1], NULL);
+  check(amqp_send_header(broker), "sending the header");
+  check(amqp_simple_wait_frame(conn, &frame), "receiving the header");
+
+  fill_body(body, sizeof(body), 3);
+  memset(&envelope, 0, sizeof(envelope));
+  for (i = 1; i <= 20; i++) {
+    size_t len = (i % 2) ? 1000 : BODY_SIZE;
+    int before;
+
+    send_message(broker, 1, i, body, len);
+    amqp_maybe_release_buffers(conn);
+
+    /* Once warmed up, reading into the same envelope allocates nothing */
+    before = allocations;
+    check_reply(amqp_consume_message(conn, &envelope, NULL,
+                                     AMQP_MESSAGE_POOLED),
+                "consuming");
+    if (i > 2 && allocations != before) {
+      die("consuming message %d allocated %d times", i, allocations - before);
+    }
+
+    /* The envelope's memory is its own, not the connection's */
+    amqp_maybe_release_buffers(conn);
+    expect_envelope(&envelope, i, body, len);
+  }
+
+  /* Released, the envelope can be reused either way */
+  amqp_destroy_envelope(&envelope);
+  memset(&envelope, 0, sizeof(envelope));
+  send_message(broker, 1, 21, body, BODY_SIZE);
+  check_reply(amqp_consume_message(conn, &envelope, NULL, AMQP_MESSAGE_POOLED),
+              "consuming");
+  expect_envelope(&envelope, 21, body, BODY_SIZE);
+  amqp_destroy_envelope(&envelope);
+
+  send_message(broker, 1, 22, body, 1000);
+  check_reply(amqp_consume_message(conn, &envelope, NULL, 0), "consuming");
+  expect_envelope(&envelope, 22, body, 1000);
+  amqp_destroy_envelope(&envelope);
+
+  amqp_destroy_connection(broker);
+  amqp_destroy_connection(conn);
+}
+
+int main(void)
+{
+  int sv[2];
+  amqp_connection_state_t conn;
+  amqp_connection_state_t broker;
+  amqp_frame_t frame;
+
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair failed");
+  }
+  conn = new_connection(sv[0], NULL);
+  broker = new_connection(sv[1], NULL);
+
+  check(amqp_send_header(broker), "sending the header");
+  check(amqp_simple_wait_frame(conn, &frame), "receiving the header");
+
+  test_read_ref(conn, broker);
+  test_read_stream(conn, broker);
+  test_pooled_envelope();
+
+  amqp_destroy_connection(broker);
+  amqp_destroy_connection(conn);
+  return 0;
+}
@@ -0,0 +1,314 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+/* The connection under test runs non-blocking, driven by poll() as an
+   application's event loop would. The broker end is an ordinary blocking
+   connection, read only once poll() says there is something. */
+
+#define BODY_SIZE (1024 * 1024)
+
+static void die(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  abort();
+}
+
+static amqp_connection_state_t new_connection(int sockfd)
+{
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *socket;
+
+  if (NULL == conn) {
+    die("out of memory");
+  }
+  socket = amqp_tcp_socket_new(conn);
+  if (NULL == socket) {
+    die("out of memory");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sockfd);
+  return conn;
+}
+
+static void check(int res, const char *what)
+{
+  if (AMQP_STATUS_OK != res) {
+    die("%s failed: %s", what, amqp_error_string2(res));
+  }
+}
+
+/* Gets the next frame from the non-blocking connection, handling socket
+   events until there is one */
+static void next_frame(amqp_connection_state_t conn, amqp_frame_t *frame)
+{
+  struct pollfd pfd;
+
+  for (;;) {
+    check(amqp_poll_frame(conn, frame), "polling a frame");
+    if (0 != frame->frame_type) {
+      return;
+    }
+
+    pfd.fd = amqp_get_sockfd(conn);
+    pfd.events = (amqp_get_io_events(conn) & AMQP_IO_READABLE) ? POLLIN : 0;
+    pfd.revents = 0;
+    if (1 != poll(&pfd, 1, 1000)) {
+      die("no frame arrived");
+    }
+    check(amqp_handle_io(conn, AMQP_IO_READABLE), "reading");
+  }
+}
+
+static void test_publish(amqp_connection_state_t conn,
+                         amqp_connection_state_t broker)
+{
+  static char body[BODY_SIZE];
+  amqp_bytes_t body_bytes;
+  struct timeval no_wait = { 0, 0 };
+  size_t received = 0;
+  int buffer_size = 16 * 1024;
+  int state = 0;
+  int i;
+
+  for (i = 0; i < BODY_SIZE; i++) {
+    body[i] = (char)(i * 7);
+  }
+
+  /* Small socket buffers, so the socket only takes a bit of the message at
+     a time */
+  setsockopt(amqp_get_sockfd(conn), SOL_SOCKET, SO_SNDBUF, &buffer_size,
+             sizeof(buffer_size));
+  setsockopt(amqp_get_sockfd(broker), SOL_SOCKET, SO_RCVBUF, &buffer_size,
+             sizeof(buffer_size));
+
+  /* Doesn't block, what the socket doesn't take is kept */
+  body_bytes.len = BODY_SIZE;
+  body_bytes.bytes = body;
+  check(amqp_basic_publish(conn, 1, amqp_cstring_bytes("exchange"),
+                           amqp_cstring_bytes("key"), 0, 0, NULL, body_bytes),
+        "publishing");
+  if (!(amqp_get_io_events(conn) & AMQP_IO_WRITABLE)) {
+    die("no output pending after publishing a large message");
+  }
+
+  while (received < BODY_SIZE) {
+    struct pollfd pfd[2];
+    amqp_frame_t frame;
+    int res;
+
+    pfd[0].fd = amqp_get_sockfd(conn);
+    pfd[0].events = (amqp_get_io_events(conn) & AMQP_IO_WRITABLE) ? POLLOUT : 0;
+    pfd[1].fd = amqp_get_sockfd(broker);
+    pfd[1].events = POLLIN;
+    pfd[0].revents = pfd[1].revents = 0;
+    if (poll(pfd, 2, 1000) <= 0) {
+      die("stalled after %u bytes", (unsigned)received);
+    }
+
+    if (pfd[0].revents & POLLOUT) {
+      check(amqp_handle_io(conn, AMQP_IO_WRITABLE), "writing");
+    }
+    if (!(pfd[1].revents & POLLIN)) {
+      continue;
+    }
+
+    while (AMQP_STATUS_OK ==
+           (res = amqp_simple_wait_frame_noblock(broker, &frame, &no_wait))) {
+      if (0 == state) {
+        if (AMQP_FRAME_METHOD != frame.frame_type ||
+            AMQP_BASIC_PUBLISH_METHOD != frame.payload.method.id) {
+          die("expected basic.publish");
+        }
+      } else if (1 == state) {
+        if (AMQP_FRAME_HEADER != frame.frame_type ||
+            BODY_SIZE != frame.payload.properties.body_size) {
+          die("expected a content header");
+        }
+      } else {
+        if (AMQP_FRAME_BODY != frame.frame_type ||
+            received + frame.payload.body_fragment.len > BODY_SIZE ||
+            0 != memcmp(body + received, frame.payload.body_fragment.bytes,
+                        frame.payload.body_fragment.len)) {
+          die("body differs at %u", (unsigned)received);
+        }
+        received += frame.payload.body_fragment.len;
+      }
+      state++;
+      amqp_maybe_release_buffers(broker);
+    }
+    if (AMQP_STATUS_TIMEOUT != res) {
+      die("receiving failed: %s", amqp_error_string2(res));
+    }
+  }
+
+  if (amqp_get_io_events(conn) & AMQP_IO_WRITABLE) {
+    die("output still pending after it was all received");
+  }
+}
+
+static void send_ack(amqp_connection_state_t broker, uint64_t delivery_tag)
+{
+  amqp_basic_ack_t ack;
+  ack.delivery_tag = delivery_tag;
+  ack.multiple = 0;
+  check(amqp_send_method(broker, 1, AMQP_BASIC_ACK_METHOD, &ack), "sending");
+}
+
+static void expect_ack(amqp_connection_state_t conn, uint64_t delivery_tag)
+{
+  amqp_frame_t frame;
+
+  next_frame(conn, &frame);
+  if (AMQP_FRAME_METHOD != frame.frame_type ||
+      AMQP_BASIC_ACK_METHOD != frame.payload.method.id ||
+      delivery_tag !=
+        ((amqp_basic_ack_t *)frame.payload.method.decoded)->delivery_tag) {
+    die("expected basic.ack %u", (unsigned)delivery_tag);
+  }
+}
+
+static void test_receive(amqp_connection_state_t conn,
+                         amqp_connection_state_t broker)
+{
+  amqp_connection_close_t close;
+  amqp_frame_t frame;
+  amqp_frame_t heartbeat;
+  amqp_bytes_t reply_text;
+
+  memset(&close, 0, sizeof(close));
+  close.reply_code = AMQP_CONNECTION_FORCED;
+  close.reply_text = amqp_cstring_bytes("going away");
+  check(amqp_send_method(broker, 0, AMQP_CONNECTION_CLOSE_METHOD, &close),
+        "sending");
+
+  next_frame(conn, &frame);
+  if (AMQP_FRAME_METHOD != frame.frame_type ||
+      AMQP_CONNECTION_CLOSE_METHOD != frame.payload.method.id) {
+    die("expected connection.close");
+  }
+  reply_text = ((amqp_connection_close_t *)frame.payload.method.decoded)->reply_text;
+
+  /* A heartbeat is skipped without releasing what the caller still holds on
+     channel 0, the reads after it must not reuse that memory */
+  heartbeat.frame_type = AMQP_FRAME_HEARTBEAT;
+  heartbeat.channel = 0;
+  check(amqp_send_frame(broker, &heartbeat), "sending a heartbeat");
+  send_ack(broker, 1);
+  expect_ack(conn, 1);
+  send_ack(broker, 2);
+  expect_ack(conn, 2);
+  send_ack(broker, 3);
+  expect_ack(conn, 3);
+
+  if (reply_text.len != strlen("going away") ||
+      0 != memcmp(reply_text.bytes, "going away", reply_text.len)) {
+    die("a held frame was overwritten");
+  }
+
+  amqp_maybe_release_buffers(conn);
+  check(amqp_poll_frame(conn, &frame), "polling");
+  if (0 != frame.frame_type) {
+    die("unexpected frame");
+  }
+}
+
+static void test_heartbeat(amqp_connection_state_t conn,
+                           amqp_connection_state_t broker)
+{
+  struct timeval timeout;
+  unsigned char raw[8];
+  unsigned char expected[8] = { AMQP_FRAME_HEARTBEAT, 0, 0, 0, 0, 0, 0,
+                                AMQP_FRAME_END };
+  int waited = 0;
+
+  check(amqp_tune_connection(conn, 0, 131072, 1), "tuning");
+  if (!amqp_get_next_timeout(conn, &timeout) || timeout.tv_sec > 1) {
+    die("no heartbeat deadline");
+  }
+
+  /* Nothing to read, the deadline passes and handling it sends a
+     heartbeat */
+  while (!(amqp_get_next_timeout(conn, &timeout) &&
+           0 == timeout.tv_sec && 0 == timeout.tv_usec)) {
+    poll(NULL, 0, (int)(timeout.tv_sec * 1000 + timeout.tv_usec / 1000 + 1));
+    if (++waited > 3000) {
+      die("the heartbeat deadline never passed");
+    }
+  }
+  check(amqp_handle_io(conn, 0), "handling the deadline");
+
+  if (sizeof(raw) != read(amqp_get_sockfd(broker), raw, sizeof(raw)) ||
+      0 != memcmp(raw, expected, sizeof(raw))) {
+    die("expected a heartbeat");
+  }
+  if (!amqp_get_next_timeout(conn, &timeout) ||
+      (0 == timeout.tv_sec && 0 == timeout.tv_usec)) {
+    die("the deadline didn't move after sending a heartbeat");
+  }
+}
+
+int main(void)
+{
+  int sv[2];
+  amqp_connection_state_t conn;
+  amqp_connection_state_t broker;
+  amqp_frame_t frame;
+
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair failed");
+  }
+  conn = new_connection(sv[0]);
+  broker = new_connection(sv[1]);
+
+  check(amqp_send_header(broker), "sending the header");
+  check(amqp_simple_wait_frame(conn, &frame), "receiving the header");
+  check(amqp_set_nonblocking(conn, 1), "switching to non-blocking");
+
+  test_publish(conn, broker);
+  test_receive(conn, broker);
+  test_heartbeat(conn, broker);
+
+  amqp_destroy_connection(broker);
+  amqp_destroy_connection(conn);
+  return 0;
+}
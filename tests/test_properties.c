@@ -0,0 +1,334 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+static void die(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  abort();
+}
+
+static void check(int res, const char *what)
+{
+  if (AMQP_STATUS_OK != res) {
+    die("%s failed: %s", what, amqp_error_string2(res));
+  }
+}
+
+static amqp_connection_state_t new_connection(int sockfd)
+{
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *socket;
+
+  if (NULL == conn) {
+    die("out of memory");
+  }
+  socket = amqp_tcp_socket_new(conn);
+  if (NULL == socket) {
+    die("out of memory");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sockfd);
+  return conn;
+}
+
+/* Properties with a headers table between the fields, holding a nested
+   table and an array */
+static void make_properties(amqp_basic_properties_t *properties,
+                            amqp_table_t *headers)
+{
+  static amqp_table_entry_t inner_entries[1];
+  static amqp_field_value_t array_values[2];
+  static amqp_table_entry_t entries[4];
+
+  inner_entries[0].key = amqp_cstring_bytes("depth");
+  inner_entries[0].value.kind = AMQP_FIELD_KIND_I32;
+  inner_entries[0].value.value.i32 = 2;
+
+  array_values[0].kind = AMQP_FIELD_KIND_UTF8;
+  array_values[0].value.bytes = amqp_cstring_bytes("first");
+  array_values[1].kind = AMQP_FIELD_KIND_I64;
+  array_values[1].value.i64 = 1234567890123LL;
+
+  entries[0].key = amqp_cstring_bytes("x-origin");
+  entries[0].value.kind = AMQP_FIELD_KIND_UTF8;
+  entries[0].value.value.bytes = amqp_cstring_bytes("upstream");
+  entries[1].key = amqp_cstring_bytes("x-hops");
+  entries[1].value.kind = AMQP_FIELD_KIND_U8;
+  entries[1].value.value.u8 = 3;
+  entries[2].key = amqp_cstring_bytes("x-nested");
+  entries[2].value.kind = AMQP_FIELD_KIND_TABLE;
+  entries[2].value.value.table.num_entries = 1;
+  entries[2].value.value.table.entries = inner_entries;
+  entries[3].key = amqp_cstring_bytes("x-list");
+  entries[3].value.kind = AMQP_FIELD_KIND_ARRAY;
+  entries[3].value.value.array.num_entries = 2;
+  entries[3].value.value.array.entries = array_values;
+
+  headers->num_entries = 4;
+  headers->entries = entries;
+
+  memset(properties, 0, sizeof(*properties));
+  properties->_flags = AMQP_BASIC_CONTENT_TYPE_FLAG |
+                       AMQP_BASIC_HEADERS_FLAG |
+                       AMQP_BASIC_DELIVERY_MODE_FLAG |
+                       AMQP_BASIC_PRIORITY_FLAG |
+                       AMQP_BASIC_CORRELATION_ID_FLAG |
+                       AMQP_BASIC_TIMESTAMP_FLAG |
+                       AMQP_BASIC_APP_ID_FLAG;
+  properties->content_type = amqp_cstring_bytes("text/plain");
+  properties->headers = *headers;
+  properties->delivery_mode = 2;
+  properties->priority = 7;
+  properties->correlation_id = amqp_cstring_bytes("correlation");
+  properties->timestamp = 1700000000;
+  properties->app_id = amqp_cstring_bytes("test_properties");
+}
+
+static void send_header(amqp_connection_state_t from,
+                        amqp_basic_properties_t *properties)
+{
+  amqp_frame_t frame;
+
+  frame.frame_type = AMQP_FRAME_HEADER;
+  frame.channel = 1;
+  frame.payload.properties.class_id = AMQP_BASIC_CLASS;
+  frame.payload.properties.body_size = 0;
+  frame.payload.properties.decoded = properties;
+  check(amqp_send_frame(from, &frame), "sending the content header");
+}
+
+static void expect_header(amqp_connection_state_t conn, amqp_frame_t *frame)
+{
+  check(amqp_simple_wait_frame(conn, frame), "receiving the content header");
+  if (AMQP_FRAME_HEADER != frame->frame_type ||
+      AMQP_BASIC_CLASS != frame->payload.properties.class_id) {
+    die("expected a basic content header");
+  }
+}
+
+/* The properties must encode to exactly the bytes that were received */
+static void expect_encoding(amqp_basic_properties_t *properties,
+                            amqp_bytes_t raw, const char *what)
+{
+  static char buffer[4096];
+  amqp_bytes_t encoded;
+  int len;
+
+  encoded.len = sizeof(buffer);
+  encoded.bytes = buffer;
+  len = amqp_encode_properties(AMQP_BASIC_CLASS, properties, encoded);
+  if (len < 0) {
+    die("encoding %s failed: %s", what, amqp_error_string2(len));
+  }
+  if ((size_t)len != raw.len || 0 != memcmp(buffer, raw.bytes, raw.len)) {
+    die("%s differ from the properties received", what);
+  }
+}
+
+static void test_lazy_headers(amqp_connection_state_t conn,
+                              amqp_connection_state_t broker)
+{
+  amqp_basic_properties_t sent;
+  amqp_table_t headers;
+  amqp_frame_t eager_frame;
+  amqp_frame_t lazy_frame;
+  amqp_basic_properties_t *eager;
+  amqp_basic_properties_t *lazy;
+  amqp_basic_properties_t decoded;
+  amqp_pool_t pool;
+
+  make_properties(&sent, &headers);
+
+  /* The default decodes everything */
+  send_header(broker, &sent);
+  expect_header(conn, &eager_frame);
+  eager = eager_frame.payload.properties.decoded;
+  if (sent._flags != eager->_flags ||
+      headers.num_entries != eager->headers.num_entries) {
+    die("the headers weren't decoded");
+  }
+  expect_encoding(eager, eager_frame.payload.properties.raw,
+                  "eagerly decoded properties");
+
+  /* Lazily the flag is set but the table left empty, the rest is the same */
+  amqp_set_lazy_properties(conn, 1);
+  send_header(broker, &sent);
+  expect_header(conn, &lazy_frame);
+  lazy = lazy_frame.payload.properties.decoded;
+  if (sent._flags != lazy->_flags || 0 != lazy->headers.num_entries) {
+    die("the headers table was decoded");
+  }
+  if (eager->delivery_mode != lazy->delivery_mode ||
+      eager->priority != lazy->priority ||
+      eager->timestamp != lazy->timestamp ||
+      eager->content_type.len != lazy->content_type.len ||
+      0 != memcmp(eager->content_type.bytes, lazy->content_type.bytes,
+                  lazy->content_type.len) ||
+      eager->app_id.len != lazy->app_id.len ||
+      0 != memcmp(eager->app_id.bytes, lazy->app_id.bytes, lazy->app_id.len)) {
+    die("lazily decoded properties differ from eagerly decoded ones");
+  }
+
+  /* Decoding the headers on demand completes them */
+  init_amqp_pool(&pool, 4096);
+  check(amqp_decode_basic_properties(lazy_frame.payload.properties.raw,
+                                     AMQP_BASIC_HEADERS_FLAG, &pool, lazy),
+        "decoding the headers");
+  expect_encoding(lazy, lazy_frame.payload.properties.raw,
+                  "properties completed on demand");
+
+  /* Only the fields asked for are touched */
+  memset(&decoded, 0, sizeof(decoded));
+  decoded.priority = 99;
+  check(amqp_decode_basic_properties(lazy_frame.payload.properties.raw,
+                                     AMQP_BASIC_CORRELATION_ID_FLAG, NULL,
+                                     &decoded),
+        "decoding the correlation id");
+  if (sent._flags != decoded._flags || 99 != decoded.priority ||
+      0 != decoded.headers.num_entries || 0 != decoded.content_type.len ||
+      decoded.correlation_id.len != strlen("correlation") ||
+      0 != memcmp(decoded.correlation_id.bytes, "correlation",
+                  decoded.correlation_id.len)) {
+    die("decoding the correlation id decoded other fields");
+  }
+
+  /* The headers table can't be decoded without a pool */
+  if (AMQP_STATUS_INVALID_PARAMETER !=
+      amqp_decode_basic_properties(lazy_frame.payload.properties.raw,
+                                   AMQP_BASIC_HEADERS_FLAG, NULL, &decoded)) {
+    die("decoding the headers without a pool didn't fail");
+  }
+
+  /* Asking for everything gives what the eager decoder does */
+  memset(&decoded, 0, sizeof(decoded));
+  check(amqp_decode_basic_properties(lazy_frame.payload.properties.raw,
+                                     (amqp_flags_t)-1, &pool, &decoded),
+        "decoding all properties");
+  expect_encoding(&decoded, eager_frame.payload.properties.raw,
+                  "properties decoded on demand");
+
+  empty_amqp_pool(&pool);
+  amqp_set_lazy_properties(conn, 0);
+  amqp_maybe_release_buffers(conn);
+}
+
+static void test_publish_raw(amqp_connection_state_t conn,
+                             amqp_connection_state_t broker)
+{
+  amqp_basic_properties_t sent;
+  amqp_table_t headers;
+  amqp_frame_t received;
+  amqp_frame_t frame;
+  amqp_bytes_t raw;
+  amqp_bytes_t body = amqp_cstring_bytes("forwarded body");
+
+  make_properties(&sent, &headers);
+
+  amqp_set_lazy_properties(conn, 1);
+  send_header(broker, &sent);
+  expect_header(conn, &received);
+  raw = received.payload.properties.raw;
+
+  /* The header goes back out byte for byte */
+  check(amqp_basic_publish_raw(conn, 1, amqp_cstring_bytes("exchange"),
+                               amqp_cstring_bytes("key"), 0, 0, raw, body),
+        "publishing with raw properties");
+
+  check(amqp_simple_wait_frame(broker, &frame), "receiving basic.publish");
+  if (AMQP_FRAME_METHOD != frame.frame_type ||
+      AMQP_BASIC_PUBLISH_METHOD != frame.payload.method.id) {
+    die("expected basic.publish");
+  }
+  expect_header(broker, &frame);
+  if (body.len != frame.payload.properties.body_size ||
+      raw.len != frame.payload.properties.raw.len ||
+      0 != memcmp(raw.bytes, frame.payload.properties.raw.bytes, raw.len)) {
+    die("the raw properties weren't forwarded verbatim");
+  }
+  expect_encoding(frame.payload.properties.decoded,
+                  frame.payload.properties.raw, "forwarded properties");
+  check(amqp_simple_wait_frame(broker, &frame), "receiving the body");
+  if (AMQP_FRAME_BODY != frame.frame_type ||
+      body.len != frame.payload.body_fragment.len ||
+      0 != memcmp(body.bytes, frame.payload.body_fragment.bytes, body.len)) {
+    die("the body wasn't forwarded");
+  }
+
+  /* Too short to hold the property flags */
+  raw.len = 1;
+  if (AMQP_STATUS_INVALID_PARAMETER !=
+      amqp_basic_publish_raw(conn, 1, amqp_cstring_bytes("exchange"),
+                             amqp_cstring_bytes("key"), 0, 0, raw, body)) {
+    die("publishing truncated raw properties didn't fail");
+  }
+
+  amqp_set_lazy_properties(conn, 0);
+  amqp_maybe_release_buffers(conn);
+  amqp_maybe_release_buffers(broker);
+}
+
+int main(void)
+{
+  int sv[2];
+  amqp_connection_state_t conn;
+  amqp_connection_state_t broker;
+  amqp_frame_t frame;
+
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair failed");
+  }
+  conn = new_connection(sv[0]);
+  broker = new_connection(sv[1]);
+
+  check(amqp_send_header(broker), "sending the header");
+  check(amqp_simple_wait_frame(conn, &frame), "receiving the header");
+  check(amqp_send_header(conn), "sending the header");
+  check(amqp_simple_wait_frame(broker, &frame), "receiving the header");
+
+  test_lazy_headers(conn, broker);
+  test_publish_raw(conn, broker);
+
+  amqp_destroy_connection(broker);
+  amqp_destroy_connection(conn);
+  return 0;
+}
@@ -0,0 +1,301 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+/* Small frames, so that larger bodies are sent in several */
+#define FRAME_MAX 4096
+#define BODY_SIZE 10000
+
+static void die(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  abort();
+}
+
+static void check(int res, const char *what)
+{
+  if (AMQP_STATUS_OK != res) {
+    die("%s failed: %s", what, amqp_error_string2(res));
+  }
+}
+
+static amqp_connection_state_t new_connection(int sockfd)
+{
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *socket;
+
+  if (NULL == conn) {
+    die("out of memory");
+  }
+  socket = amqp_tcp_socket_new(conn);
+  if (NULL == socket) {
+    die("out of memory");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sockfd);
+  return conn;
+}
+
+static void fill_body(unsigned char *body, size_t len, int seed)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    body[i] = (unsigned char)(i * 7 + seed);
+  }
+}
+
+static void make_properties(amqp_basic_properties_t *properties,
+                            amqp_table_t *headers)
+{
+  static amqp_table_entry_t entries[1];
+
+  entries[0].key = amqp_cstring_bytes("x-source");
+  entries[0].value.kind = AMQP_FIELD_KIND_UTF8;
+  entries[0].value.value.bytes = amqp_cstring_bytes("test_publish");
+  headers->num_entries = 1;
+  headers->entries = entries;
+
+  memset(properties, 0, sizeof(*properties));
+  properties->_flags = AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_HEADERS_FLAG |
+                       AMQP_BASIC_DELIVERY_MODE_FLAG |
+                       AMQP_BASIC_TIMESTAMP_FLAG | AMQP_BASIC_APP_ID_FLAG;
+  properties->content_type = amqp_cstring_bytes("application/octet-stream");
+  properties->headers = *headers;
+  properties->delivery_mode = 2;
+  properties->timestamp = 1;
+  properties->app_id = amqp_cstring_bytes("publisher");
+}
+
+/* Receives a published message and checks it against what
+   amqp_basic_publish() sends for the same arguments */
+static void expect_publish(amqp_connection_state_t broker,
+                           amqp_channel_t channel,
+                           amqp_basic_properties_t const *properties,
+                           const unsigned char *body, size_t len)
+{
+  static char expected[FRAME_MAX];
+  amqp_basic_publish_t *publish;
+  amqp_basic_properties_t *received;
+  amqp_frame_t frame;
+  amqp_bytes_t encoded;
+  size_t offset;
+  int expected_len;
+
+  check(amqp_simple_wait_frame(broker, &frame), "receiving basic.publish");
+  if (AMQP_FRAME_METHOD != frame.frame_type || channel != frame.channel ||
+      AMQP_BASIC_PUBLISH_METHOD != frame.payload.method.id) {
+    die("expected basic.publish on channel %u", (unsigned)channel);
+  }
+  publish = frame.payload.method.decoded;
+  if (publish->exchange.len != strlen("exchange") ||
+      0 != memcmp(publish->exchange.bytes, "exchange", publish->exchange.len) ||
+      publish->routing_key.len != strlen("key") ||
+      0 != memcmp(publish->routing_key.bytes, "key",
+                  publish->routing_key.len) ||
+      !publish->mandatory || publish->immediate) {
+    die("basic.publish has the wrong arguments");
+  }
+
+  check(amqp_simple_wait_frame(broker, &frame), "receiving the content header");
+  if (AMQP_FRAME_HEADER != frame.frame_type || channel != frame.channel ||
+      AMQP_BASIC_CLASS != frame.payload.properties.class_id) {
+    die("expected a basic content header on channel %u", (unsigned)channel);
+  }
+  if (len != frame.payload.properties.body_size) {
+    die("body size %u sent as %u", (unsigned)len,
+        (unsigned)frame.payload.properties.body_size);
+  }
+  received = frame.payload.properties.decoded;
+  if (properties->timestamp != received->timestamp) {
+    die("timestamp %u sent as %u", (unsigned)properties->timestamp,
+        (unsigned)received->timestamp);
+  }
+  encoded.len = sizeof(expected);
+  encoded.bytes = expected;
+  expected_len = amqp_encode_properties(AMQP_BASIC_CLASS, (void *)properties,
+                                        encoded);
+  if (expected_len < 0 ||
+      (size_t)expected_len != frame.payload.properties.raw.len ||
+      0 != memcmp(expected, frame.payload.properties.raw.bytes,
+                  frame.payload.properties.raw.len)) {
+    die("the template's properties differ from amqp_basic_publish()'s");
+  }
+
+  for (offset = 0; offset < len; offset += frame.payload.body_fragment.len) {
+    check(amqp_simple_wait_frame(broker, &frame), "receiving the body");
+    if (AMQP_FRAME_BODY != frame.frame_type || channel != frame.channel ||
+        offset + frame.payload.body_fragment.len > len ||
+        0 != memcmp(body + offset, frame.payload.body_fragment.bytes,
+                    frame.payload.body_fragment.len)) {
+      die("the body of a %u byte message is wrong", (unsigned)len);
+    }
+  }
+  amqp_maybe_release_buffers(broker);
+}
+
+static void test_template_timestamp(amqp_connection_state_t conn,
+                                    amqp_connection_state_t broker)
+{
+  static unsigned char body[BODY_SIZE];
+  amqp_publish_template_t *publish_template;
+  amqp_basic_properties_t properties;
+  amqp_table_t headers;
+
+  fill_body(body, sizeof(body), 3);
+  make_properties(&properties, &headers);
+  check(amqp_publish_template_new(conn, amqp_cstring_bytes("exchange"),
+                                  amqp_cstring_bytes("key"), 1, 0, &properties,
+                                  &publish_template),
+        "making a template");
+
+  /* Each message gets its own timestamp, body size and channel */
+  properties.timestamp = 1700000000;
+  check(amqp_publish_template_set_timestamp(publish_template,
+                                            properties.timestamp),
+        "setting the timestamp");
+  check(amqp_basic_publish_template(conn, 1, publish_template,
+                                    amqp_cstring_bytes("short")),
+        "publishing");
+  expect_publish(broker, 1, &properties, (const unsigned char *)"short", 5);
+
+  properties.timestamp = UINT64_C(0x0123456789abcdef);
+  check(amqp_publish_template_set_timestamp(publish_template,
+                                            properties.timestamp),
+        "setting the timestamp");
+  {
+    amqp_bytes_t bytes;
+    bytes.len = BODY_SIZE;
+    bytes.bytes = body;
+    check(amqp_basic_publish_template(conn, 2, publish_template, bytes),
+          "publishing");
+  }
+  expect_publish(broker, 2, &properties, body, BODY_SIZE);
+
+  /* The timestamp stays until it is set again */
+  check(amqp_basic_publish_template(conn, 1, publish_template,
+                                    amqp_empty_bytes),
+        "publishing");
+  expect_publish(broker, 1, &properties, body, 0);
+
+  /* Batched messages are copied from the template as it was */
+  check(amqp_publish_batch_begin(conn, 0), "starting a batch");
+  properties.timestamp = 42;
+  check(amqp_publish_template_set_timestamp(publish_template,
+                                            properties.timestamp),
+        "setting the timestamp");
+  {
+    amqp_bytes_t bytes;
+    bytes.len = 100;
+    bytes.bytes = body;
+    check(amqp_basic_publish_template(conn, 1, publish_template, bytes),
+          "publishing in a batch");
+  }
+  check(amqp_publish_template_set_timestamp(publish_template, 43),
+        "setting the timestamp");
+  check(amqp_basic_publish_template(conn, 1, publish_template,
+                                    amqp_cstring_bytes("short")),
+        "publishing in a batch");
+  check(amqp_publish_batch_flush(conn), "flushing the batch");
+  expect_publish(broker, 1, &properties, body, 100);
+  properties.timestamp = 43;
+  expect_publish(broker, 1, &properties, (const unsigned char *)"short", 5);
+
+  amqp_publish_template_destroy(publish_template);
+}
+
+static void test_template_without_timestamp(amqp_connection_state_t conn)
+{
+  amqp_publish_template_t *publish_template;
+  amqp_basic_properties_t properties;
+  amqp_table_t headers;
+
+  make_properties(&properties, &headers);
+  properties._flags &= ~AMQP_BASIC_TIMESTAMP_FLAG;
+  check(amqp_publish_template_new(conn, amqp_cstring_bytes("exchange"),
+                                  amqp_cstring_bytes("key"), 1, 0, &properties,
+                                  &publish_template),
+        "making a template");
+  if (AMQP_STATUS_INVALID_PARAMETER !=
+      amqp_publish_template_set_timestamp(publish_template, 1700000000)) {
+    die("set a timestamp on a template without one");
+  }
+  amqp_publish_template_destroy(publish_template);
+
+  check(amqp_publish_template_new(conn, amqp_cstring_bytes("exchange"),
+                                  amqp_cstring_bytes("key"), 1, 0, NULL,
+                                  &publish_template),
+        "making a template without properties");
+  if (AMQP_STATUS_INVALID_PARAMETER !=
+      amqp_publish_template_set_timestamp(publish_template, 1700000000)) {
+    die("set a timestamp on a template without properties");
+  }
+  amqp_publish_template_destroy(publish_template);
+}
+
+int main(void)
+{
+  int sv[2];
+  amqp_connection_state_t conn;
+  amqp_connection_state_t broker;
+  amqp_frame_t frame;
+
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair failed");
+  }
+  conn = new_connection(sv[0]);
+  broker = new_connection(sv[1]);
+
+  check(amqp_send_header(broker), "sending the header");
+  check(amqp_simple_wait_frame(conn, &frame), "receiving the header");
+  check(amqp_send_header(conn), "sending the header");
+  check(amqp_simple_wait_frame(broker, &frame), "receiving the header");
+  check(amqp_tune_connection(conn, 0, FRAME_MAX, 0), "tuning");
+  check(amqp_tune_connection(broker, 0, FRAME_MAX, 0), "tuning");
+
+  test_template_timestamp(conn, broker);
+  test_template_without_timestamp(conn);
+
+  amqp_destroy_connection(broker);
+  amqp_destroy_connection(conn);
+  return 0;
+}
@@ -0,0 +1,362 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+/* The broker end is written to raw, so frames can be cut wherever the test
+   likes */
+
+#define BODY_SIZE 1000
+/* well past the size at which the rest of a frame is read into it directly */
+#define LARGE_BODY_SIZE (300 * 1024)
+
+static void die(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  abort();
+}
+
+static void check(int res, const char *what)
+{
+  if (AMQP_STATUS_OK != res) {
+    die("%s failed: %s", what, amqp_error_string2(res));
+  }
+}
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+
+  while (len > 0) {
+    ssize_t res = write(fd, p, len);
+    if (res <= 0) {
+      die("writing to the socket failed");
+    }
+    p += res;
+    len -= res;
+  }
+}
+
+static size_t put_frame(unsigned char *buf, int type, amqp_channel_t channel,
+                        const void *payload, size_t len)
+{
+  buf[0] = (unsigned char)type;
+  buf[1] = (unsigned char)(channel >> 8);
+  buf[2] = (unsigned char)channel;
+  buf[3] = (unsigned char)(len >> 24);
+  buf[4] = (unsigned char)(len >> 16);
+  buf[5] = (unsigned char)(len >> 8);
+  buf[6] = (unsigned char)len;
+  memcpy(buf + 7, payload, len);
+  buf[7 + len] = AMQP_FRAME_END;
+  return len + 8;
+}
+
+static size_t put_ack(unsigned char *buf, amqp_channel_t channel,
+                      uint64_t delivery_tag)
+{
+  unsigned char payload[13];
+  int i;
+
+  /* basic.ack: class 60, method 80, delivery tag and the multiple bit */
+  payload[0] = 0;
+  payload[1] = 60;
+  payload[2] = 0;
+  payload[3] = 80;
+  for (i = 0; i < 8; i++) {
+    payload[4 + i] = (unsigned char)(delivery_tag >> (56 - 8 * i));
+  }
+  payload[12] = 0;
+  return put_frame(buf, AMQP_FRAME_METHOD, channel, payload, sizeof(payload));
+}
+
+static void fill_body(unsigned char *body, size_t len, int seed)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    body[i] = (unsigned char)(i * 31 + seed);
+  }
+}
+
+static amqp_connection_state_t open_connection(int sockfd, int broker_fd)
+{
+  static const unsigned char header[8] = { 'A', 'M', 'Q', 'P', 0,
+                                           AMQP_PROTOCOL_VERSION_MAJOR,
+                                           AMQP_PROTOCOL_VERSION_MINOR,
+                                           AMQP_PROTOCOL_VERSION_REVISION };
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *socket;
+  amqp_frame_t frame;
+
+  if (NULL == conn) {
+    die("out of memory");
+  }
+  socket = amqp_tcp_socket_new(conn);
+  if (NULL == socket) {
+    die("out of memory");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sockfd);
+
+  /* Frames are only decoded in place once the first one has come in */
+  write_all(broker_fd, header, sizeof(header));
+  check(amqp_simple_wait_frame(conn, &frame), "receiving the header");
+  return conn;
+}
+
+/* Reads whatever the socket has and takes the next frame, if any */
+static amqp_boolean_t poll_one(amqp_connection_state_t conn,
+                               amqp_frame_t *frame)
+{
+  check(amqp_handle_io(conn, AMQP_IO_READABLE), "reading");
+  check(amqp_poll_frame(conn, frame), "polling a frame");
+  return 0 != frame->frame_type;
+}
+
+static void expect_ack(amqp_frame_t const *frame, uint64_t delivery_tag)
+{
+  if (AMQP_FRAME_METHOD != frame->frame_type ||
+      AMQP_BASIC_ACK_METHOD != frame->payload.method.id ||
+      delivery_tag !=
+        ((amqp_basic_ack_t *)frame->payload.method.decoded)->delivery_tag) {
+    die("expected basic.ack %u", (unsigned)delivery_tag);
+  }
+}
+
+static void expect_body(amqp_frame_t const *frame, const unsigned char *body,
+                        size_t len)
+{
+  if (AMQP_FRAME_BODY != frame->frame_type ||
+      len != frame->payload.body_fragment.len ||
+      0 != memcmp(body, frame->payload.body_fragment.bytes, len)) {
+    die("expected a body frame of %u bytes", (unsigned)len);
+  }
+}
+
+static void expect_nothing_pinned(amqp_connection_state_t conn)
+{
+  amqp_memory_stats_t stats;
+
+  amqp_get_memory_stats(conn, &stats);
+  if (0 != stats.pinned_buffer_bytes) {
+    die("%u bytes still pinned after releasing",
+        (unsigned)stats.pinned_buffer_bytes);
+  }
+}
+
+static void test_whole_frames(amqp_connection_state_t conn, int broker_fd)
+{
+  unsigned char body[BODY_SIZE];
+  unsigned char raw[3 * (BODY_SIZE + 64)];
+  amqp_frame_t frames[3];
+  amqp_memory_stats_t stats;
+  size_t len = 0;
+  int i;
+
+  fill_body(body, sizeof(body), 1);
+  len += put_ack(raw + len, 1, 1);
+  len += put_frame(raw + len, AMQP_FRAME_BODY, 1, body, sizeof(body));
+  len += put_ack(raw + len, 2, 2);
+  write_all(broker_fd, raw, len);
+
+  /* All three come out of the one read, and stay valid together */
+  for (i = 0; i < 3; i++) {
+    if (!poll_one(conn, &frames[i])) {
+      die("frame %d of a single write is missing", i);
+    }
+  }
+  amqp_get_memory_stats(conn, &stats);
+  if (0 == stats.pinned_buffer_bytes) {
+    die("whole frames weren't decoded in place");
+  }
+  expect_ack(&frames[0], 1);
+  expect_body(&frames[1], body, sizeof(body));
+  expect_ack(&frames[2], 2);
+
+  amqp_maybe_release_buffers(conn);
+  expect_nothing_pinned(conn);
+}
+
+static void test_partial_frames(amqp_connection_state_t conn, int broker_fd)
+{
+  /* in the frame header, at the start and middle of the payload, before
+     the end byte */
+  static const size_t splits[] = { 1, 4, 7, 8, BODY_SIZE / 2, BODY_SIZE + 7 };
+  unsigned char body[BODY_SIZE];
+  unsigned char raw[BODY_SIZE + 64];
+  size_t i;
+
+  for (i = 0; i < sizeof(splits) / sizeof(splits[0]); i++) {
+    amqp_frame_t frame;
+    size_t len;
+
+    fill_body(body, sizeof(body), (int)i);
+    len = put_frame(raw, AMQP_FRAME_BODY, 1, body, sizeof(body));
+    len += put_ack(raw + len, 1, i);
+
+    write_all(broker_fd, raw, splits[i]);
+    if (poll_one(conn, &frame)) {
+      die("a frame came out of the first %u bytes", (unsigned)splits[i]);
+    }
+
+    /* The rest of the frame, with a whole one behind it */
+    write_all(broker_fd, raw + splits[i], len - splits[i]);
+    if (!poll_one(conn, &frame)) {
+      die("the frame split at %u never completed", (unsigned)splits[i]);
+    }
+    expect_body(&frame, body, sizeof(body));
+    if (!poll_one(conn, &frame)) {
+      die("the frame after the one split at %u is missing",
+          (unsigned)splits[i]);
+    }
+    expect_ack(&frame, i);
+
+    amqp_maybe_release_buffers(conn);
+    expect_nothing_pinned(conn);
+  }
+}
+
+/* Writes data in the pieces given, pausing in between so each arrives in a
+   read of its own, from a child process */
+static pid_t write_in_pieces(int fd, const unsigned char *data,
+                             const size_t *ends, int count)
+{
+  pid_t pid = fork();
+  size_t start = 0;
+  int i;
+
+  if (pid < 0) {
+    die("fork failed");
+  }
+  if (pid > 0) {
+    return pid;
+  }
+
+  for (i = 0; i < count; i++) {
+    write_all(fd, data + start, ends[i] - start);
+    start = ends[i];
+    usleep(20000);
+  }
+  _exit(0);
+}
+
+static void test_large_frames(void)
+{
+  static unsigned char body[2][LARGE_BODY_SIZE];
+  static unsigned char raw[2 * LARGE_BODY_SIZE + 256];
+  size_t ends[5];
+  size_t large_start;
+  size_t len = 0;
+  int sv[2];
+  int status;
+  pid_t pid;
+  amqp_connection_state_t conn;
+  amqp_frame_t frame;
+
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair failed");
+  }
+  conn = open_connection(sv[0], sv[1]);
+  check(amqp_tune_connection(conn, 0, 1024 * 1024, 0), "tuning");
+
+  fill_body(body[0], LARGE_BODY_SIZE, 3);
+  fill_body(body[1], LARGE_BODY_SIZE, 4);
+  len += put_ack(raw + len, 1, 1);
+  large_start = len;
+  len += put_frame(raw + len, AMQP_FRAME_BODY, 1, body[0], LARGE_BODY_SIZE);
+  len += put_ack(raw + len, 1, 2);
+  len += put_frame(raw + len, AMQP_FRAME_BODY, 2, body[1], LARGE_BODY_SIZE);
+  len += put_ack(raw + len, 1, 3);
+
+  /* The first large frame starts in the socket buffer behind another frame
+     and is finished off in separate reads. Its end byte comes in with the
+     frames after it. */
+  ends[0] = large_start + 7 + 100;
+  ends[1] = large_start + 7 + LARGE_BODY_SIZE / 2;
+  ends[2] = large_start + 7 + LARGE_BODY_SIZE;
+  ends[3] = len - 1;
+  ends[4] = len;
+  pid = write_in_pieces(sv[1], raw, ends, 5);
+
+  check(amqp_simple_wait_frame(conn, &frame), "receiving");
+  expect_ack(&frame, 1);
+  check(amqp_simple_wait_frame(conn, &frame), "receiving");
+  expect_body(&frame, body[0], LARGE_BODY_SIZE);
+  check(amqp_simple_wait_frame(conn, &frame), "receiving");
+  expect_ack(&frame, 2);
+  check(amqp_simple_wait_frame(conn, &frame), "receiving");
+  if (2 != frame.channel) {
+    die("the second large frame is on the wrong channel");
+  }
+  expect_body(&frame, body[1], LARGE_BODY_SIZE);
+  check(amqp_simple_wait_frame(conn, &frame), "receiving");
+  expect_ack(&frame, 3);
+
+  if (pid != waitpid(pid, &status, 0) || !WIFEXITED(status) ||
+      0 != WEXITSTATUS(status)) {
+    die("the writer failed");
+  }
+  amqp_destroy_connection(conn);
+  close(sv[1]);
+}
+
+int main(void)
+{
+  int sv[2];
+  amqp_connection_state_t conn;
+
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair failed");
+  }
+  conn = open_connection(sv[0], sv[1]);
+  check(amqp_set_nonblocking(conn, 1), "switching to non-blocking");
+
+  test_whole_frames(conn, sv[1]);
+  test_partial_frames(conn, sv[1]);
+  test_large_frames();
+
+  amqp_destroy_connection(conn);
+  close(sv[1]);
+  return 0;
+}
@@ -410,6 +410,200 @@ static void test_table_codec(FILE *out)
   empty_amqp_pool(&pool);
 }
 
+static int allocator_calls;
+
+static void *counting_malloc(void *user_data, size_t size)
+{
+  (void)user_data;
+  allocator_calls++;
+  return malloc(size);
+}
+
+static void *counting_calloc(void *user_data, size_t count, size_t size)
+{
+  (void)user_data;
+  allocator_calls++;
+  return calloc(count, size);
+}
+
+static void *counting_realloc(void *user_data, void *ptr, size_t size)
+{
+  (void)user_data;
+  allocator_calls++;
+  return realloc(ptr, size);
+}
+
+static void counting_free(void *user_data, void *ptr)
+{
+  (void)user_data;
+  if (NULL != ptr) {
+    allocator_calls++;
+  }
+  free(ptr);
+}
+
+static void test_table_decode_allocations(void)
+{
+  amqp_allocator_t counting = {counting_malloc, counting_calloc,
+                               counting_realloc, counting_free, NULL};
+  amqp_pool_t pool;
+  amqp_table_t decoded;
+  amqp_bytes_t encoded;
+  size_t offset;
+  size_t len;
+  int result;
+
+  amqp_set_default_allocator(&counting);
+
+  encoded.bytes = pre_encoded_table;
+  init_amqp_pool(&pool, 4096);
+
+  /* The first decode takes a page for the pool */
+  encoded.len = sizeof(pre_encoded_table);
+  offset = 0;
+  result = amqp_decode_table(encoded, &pool, &decoded, &offset);
+  if (result < 0) {
+    die("Table decoding failed: %s", amqp_error_string2(result));
+  }
+
+  /* Decoding again into the recycled page uses nothing else */
+  recycle_amqp_pool(&pool);
+  allocator_calls = 0;
+  offset = 0;
+  result = amqp_decode_table(encoded, &pool, &decoded, &offset);
+  if (result < 0) {
+    die("Table decoding failed: %s", amqp_error_string2(result));
+  }
+  if (0 != allocator_calls) {
+    die("Table decoding made %d allocator calls", allocator_calls);
+  }
+  if (sizeof(pre_encoded_table) != offset) {
+    die("Decoding offset should be %ld, was %ld",
+        (long)sizeof(pre_encoded_table), (long)offset);
+  }
+
+  {
+    uint8_t encoding_buffer[4096];
+    amqp_bytes_t reencoded;
+
+    reencoded.len = sizeof(encoding_buffer);
+    reencoded.bytes = encoding_buffer;
+    offset = 0;
+    result = amqp_encode_table(reencoded, &decoded, &offset);
+    if (result < 0) {
+      die("Table encoding failed: %s", amqp_error_string2(result));
+    }
+    if (sizeof(pre_encoded_table) != offset ||
+        0 != memcmp(pre_encoded_table, encoding_buffer, offset)) {
+      die("Decoded table differs from the original");
+    }
+  }
+
+  empty_amqp_pool(&pool);
+
+  /* Truncated tables are rejected before anything is allocated */
+  for (len = 0; len < sizeof(pre_encoded_table); len++) {
+    init_amqp_pool(&pool, 4096);
+    allocator_calls = 0;
+    encoded.len = len;
+    offset = 0;
+    result = amqp_decode_table(encoded, &pool, &decoded, &offset);
+    if (AMQP_STATUS_BAD_AMQP_DATA != result) {
+      die("Decoding %ld of %ld bytes returned %d", (long)len,
+          (long)sizeof(pre_encoded_table), result);
+    }
+    if (0 != allocator_calls) {
+      die("Decoding %ld bytes made %d allocator calls", (long)len,
+          allocator_calls);
+    }
+    empty_amqp_pool(&pool);
+  }
+
+  amqp_set_default_allocator(NULL);
+}
+
+static void test_table_index_size(int num_entries)
+{
+  amqp_pool_t pool;
+  amqp_table_t table;
+  amqp_table_index_t *index;
+  amqp_table_key_t key;
+  char names[100][16];
+  char missing[16];
+  int i;
+
+  init_amqp_pool(&pool, 4096);
+
+  table.num_entries = num_entries;
+  table.entries = amqp_pool_alloc(&pool, 100 * sizeof(amqp_table_entry_t));
+  if (NULL == table.entries) {
+    die("out of memory");
+  }
+  for (i = 0; i < num_entries; i++) {
+    sprintf(names[i], "key-%d", i);
+    table.entries[i].key = amqp_cstring_bytes(names[i]);
+    table.entries[i].value.kind = AMQP_FIELD_KIND_I32;
+    table.entries[i].value.value.i32 = i;
+  }
+  /* Of duplicate keys the first is found */
+  if (num_entries > 2) {
+    table.entries[num_entries - 1].key = amqp_cstring_bytes(names[1]);
+  }
+
+  index = amqp_table_index_new(&table, &pool);
+  if (NULL == index) {
+    die("out of memory");
+  }
+
+  for (i = 0; i < num_entries; i++) {
+    int expected = (num_entries > 2 && i == num_entries - 1 ? -1 : i);
+    amqp_table_entry_t *entry;
+
+    key = amqp_table_key(amqp_cstring_bytes(names[i]));
+    entry = amqp_table_index_lookup(index, &key);
+    if (-1 == expected) {
+      if (NULL != entry) {
+        die("%d entries: %s was replaced, but found", num_entries, names[i]);
+      }
+    } else if (entry != &table.entries[expected]) {
+      die("%d entries: %s not found", num_entries, names[i]);
+    }
+  }
+
+  /* Keys that aren't there, including ones that are a prefix of a key or
+     have one as a prefix */
+  sprintf(missing, "key-%d", num_entries);
+  key = amqp_table_key(amqp_cstring_bytes(missing));
+  if (NULL != amqp_table_index_lookup(index, &key)) {
+    die("%d entries: %s found", num_entries, missing);
+  }
+  key = amqp_table_key(amqp_cstring_bytes("key-"));
+  if (NULL != amqp_table_index_lookup(index, &key)) {
+    die("%d entries: key- found", num_entries);
+  }
+  key = amqp_table_key(amqp_cstring_bytes("key-00"));
+  if (NULL != amqp_table_index_lookup(index, &key)) {
+    die("%d entries: key-00 found", num_entries);
+  }
+  key = amqp_table_key(amqp_empty_bytes);
+  if (NULL != amqp_table_index_lookup(index, &key)) {
+    die("%d entries: empty key found", num_entries);
+  }
+
+  empty_amqp_pool(&pool);
+}
+
+static void test_table_index(void)
+{
+  /* Small tables are scanned, from 9 entries on they are hashed */
+  test_table_index_size(0);
+  test_table_index_size(1);
+  test_table_index_size(8);
+  test_table_index_size(9);
+  test_table_index_size(17);
+  test_table_index_size(100);
+}
+
 #define CHUNK_SIZE 4096
 
 static int compare_files(FILE *f1_in, FILE *f2_in)
@@ -457,6 +651,8 @@ int main(void)
   test_table_codec(out);
   fprintf(out, "----------\n");
   test_dump_value(out);
+  test_table_index();
+  test_table_decode_allocations();
 
   if (srcdir == NULL) {
     srcdir = ".";
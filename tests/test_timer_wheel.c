@@ -0,0 +1,303 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_tcp_socket.h>
+
+typedef struct {
+  amqp_wheel_timer_t timer;
+  struct timeval delay;
+  uint64_t due;
+  int fired;
+  int order;
+} test_timer_t;
+
+static amqp_timer_wheel_t *wheel;
+static int fired_count;
+
+static void die(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  abort();
+}
+
+static uint64_t now_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void schedule(test_timer_t *t, long delay_ms, amqp_timer_fn fn)
+{
+  int res;
+
+  t->delay.tv_sec = delay_ms / 1000;
+  t->delay.tv_usec = (delay_ms % 1000) * 1000;
+  t->due = now_us() + delay_ms * 1000;
+  res = amqp_timer_wheel_schedule(wheel, &t->timer, &t->delay, fn, t);
+  if (AMQP_STATUS_OK != res) {
+    die("scheduling failed: %s", amqp_error_string2(res));
+  }
+}
+
+static void timer_expired(void *user_data)
+{
+  test_timer_t *t = user_data;
+
+  if (now_us() < t->due) {
+    die("timer of %u ms expired %u us early",
+        (unsigned)(t->delay.tv_sec * 1000 + t->delay.tv_usec / 1000),
+        (unsigned)(t->due - now_us()));
+  }
+  t->fired++;
+  t->order = ++fired_count;
+}
+
+static void run(void)
+{
+  int res = amqp_timer_wheel_run(wheel);
+  if (AMQP_STATUS_OK != res) {
+    die("running the wheel failed: %s", amqp_error_string2(res));
+  }
+}
+
+static void run_until_empty(void)
+{
+  struct timeval timeout;
+
+  while (amqp_timer_wheel_next_timeout(wheel, &timeout)) {
+    usleep(timeout.tv_sec * 1000000 + timeout.tv_usec);
+    run();
+  }
+}
+
+static void expect_fired(test_timer_t *t, int fired, int order)
+{
+  if (fired != t->fired || (order != 0 && order != t->order)) {
+    die("timer of %u ms fired %d times as number %d, expected %d times as "
+        "number %d",
+        (unsigned)(t->delay.tv_sec * 1000 + t->delay.tv_usec / 1000),
+        t->fired, t->order, fired, order);
+  }
+}
+
+static void test_cascade(void)
+{
+  test_timer_t t[4];
+
+  /* Past 64 ticks a timer goes on a higher level and is moved down as time
+     gets closer */
+  memset(t, 0, sizeof(t));
+  fired_count = 0;
+  schedule(&t[0], 300, timer_expired);
+  schedule(&t[1], 0, timer_expired);
+  schedule(&t[2], 100, timer_expired);
+  schedule(&t[3], 30, timer_expired);
+
+  run_until_empty();
+  expect_fired(&t[1], 1, 1);
+  expect_fired(&t[3], 1, 2);
+  expect_fired(&t[2], 1, 3);
+  expect_fired(&t[0], 1, 4);
+}
+
+static void test_late_cascade(void)
+{
+  test_timer_t t[3];
+  uint64_t late;
+
+  /* Run only long after timers on the higher levels were due, they all go
+     out on that run, in order */
+  memset(t, 0, sizeof(t));
+  fired_count = 0;
+  schedule(&t[0], 200, timer_expired);
+  schedule(&t[1], 70, timer_expired);
+  schedule(&t[2], 130, timer_expired);
+  usleep(300000);
+  run();
+  expect_fired(&t[1], 1, 1);
+  expect_fired(&t[2], 1, 2);
+  expect_fired(&t[0], 1, 3);
+
+  /* Scheduled while the wheel is still behind the clock, a timer more than
+     64 ticks away from the wheel's last tick doesn't wait a revolution
+     longer than it should */
+  usleep(200000);
+  schedule(&t[0], 80, timer_expired);
+  run_until_empty();
+  expect_fired(&t[0], 2, 4);
+  late = now_us() - t[0].due;
+  if (late > 50000) {
+    die("timer of 80 ms expired %u ms late", (unsigned)(late / 1000));
+  }
+}
+
+static test_timer_t cancel_timers[4];
+
+static void cancel_expired(void *user_data)
+{
+  timer_expired(user_data);
+  /* Cancelling from a callback, including a timer due on the same tick */
+  amqp_timer_wheel_cancel(wheel, &cancel_timers[1].timer);
+  amqp_timer_wheel_cancel(wheel, &cancel_timers[2].timer);
+}
+
+static void test_cancel(void)
+{
+  test_timer_t *t = cancel_timers;
+
+  memset(cancel_timers, 0, sizeof(cancel_timers));
+  fired_count = 0;
+  /* scheduled last, so first in its slot */
+  schedule(&t[1], 20, timer_expired);
+  schedule(&t[0], 20, cancel_expired);
+  schedule(&t[2], 150, timer_expired);
+  schedule(&t[3], 100, timer_expired);
+
+  /* Cancelling twice, or a timer that was never scheduled, does nothing */
+  amqp_timer_wheel_cancel(wheel, &t[3].timer);
+  amqp_timer_wheel_cancel(wheel, &t[3].timer);
+  schedule(&t[3], 100, timer_expired);
+
+  run_until_empty();
+  expect_fired(&t[0], 1, 1);
+  expect_fired(&t[1], 0, 0);
+  expect_fired(&t[2], 0, 0);
+  expect_fired(&t[3], 1, 2);
+}
+
+static amqp_connection_state_t new_connection(int sockfd)
+{
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *socket;
+
+  if (NULL == conn) {
+    die("out of memory");
+  }
+  socket = amqp_tcp_socket_new(conn);
+  if (NULL == socket) {
+    die("out of memory");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sockfd);
+  return conn;
+}
+
+static void heartbeat_due(void *user_data)
+{
+  (*(int *)user_data)++;
+}
+
+static void test_late_run(void)
+{
+  amqp_connection_state_t conn;
+  amqp_connection_state_t broker;
+  amqp_frame_t frame;
+  struct timeval timeout;
+  int sv[2];
+  int calls = 0;
+  int res;
+
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair failed");
+  }
+  conn = new_connection(sv[0]);
+  broker = new_connection(sv[1]);
+
+  /* The connection can only be tuned once the first frame has come in */
+  res = amqp_send_header(broker);
+  if (AMQP_STATUS_OK == res) {
+    res = amqp_simple_wait_frame(conn, &frame);
+  }
+  if (AMQP_STATUS_OK != res) {
+    die("opening the connection failed: %s", amqp_error_string2(res));
+  }
+
+  res = amqp_tune_connection(conn, 0, 131072, 1);
+  if (AMQP_STATUS_OK != res) {
+    die("tuning failed: %s", amqp_error_string2(res));
+  }
+  res = amqp_timer_wheel_add_connection(wheel, conn, heartbeat_due, &calls);
+  if (AMQP_STATUS_OK != res) {
+    die("adding the connection failed: %s", amqp_error_string2(res));
+  }
+
+  /* Run long after the heartbeat was due, with nothing done about it the
+     caller hears about it once per run rather than once per missed tick */
+  usleep(1500000);
+  run();
+  if (1 != calls) {
+    die("expected 1 call after a late run, got %d", calls);
+  }
+
+  if (!amqp_timer_wheel_next_timeout(wheel, &timeout) ||
+      timeout.tv_sec != 0 || timeout.tv_usec > 10000) {
+    die("an overdue heartbeat isn't looked at again soon");
+  }
+  /* the wheel runs off a coarse clock, which can lag a few ms */
+  usleep(timeout.tv_usec + 20000);
+  run();
+  if (2 != calls) {
+    die("expected 2 calls after the next run, got %d", calls);
+  }
+
+  amqp_timer_wheel_remove_connection(wheel, conn);
+  if (amqp_timer_wheel_next_timeout(wheel, &timeout)) {
+    die("timer left behind by a removed connection");
+  }
+  amqp_destroy_connection(broker);
+  amqp_destroy_connection(conn);
+}
+
+int main(void)
+{
+  wheel = amqp_timer_wheel_new();
+  if (NULL == wheel) {
+    die("creating the wheel failed");
+  }
+
+  test_cascade();
+  test_late_cascade();
+  test_cancel();
+  test_late_run();
+
+  amqp_timer_wheel_destroy(wheel);
+  return 0;
+}